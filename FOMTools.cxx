@@ -183,7 +183,7 @@ static PyObject* PyGetAllocationTraces(PyObject *self, PyObject * args)
     for(size_t i=0; i<result.size(); i++){
       snprintf(buffer, 300, "\nFrom 0x%lx to 0x%lx Size %lu kB at 0x%lx (%lu Bytes)\t",  result[i].getFirstPage(), result[i].getLastPage(), ((result[i].getLastPage()-result[i].getFirstPage())>>10), result[i].getAddr(), result[i].getSize());
       outputFile << buffer;
-      auto t = result[i].getStacks();
+      auto t = result[i].stacks();
       for(size_t l=0; l < t.size(); l++ ){
 	for(int k=0; k < stackIDs.size(); k++){
 	  if (t[l] == stackIDs[k]){
@@ -301,12 +301,17 @@ static PyObject* PyGetNextFromSteam(PyObject *self, PyObject * args){
     Py_INCREF(Py_None);
     return Py_None;
   }
+  int corrected=0;
+  if(!PyArg_ParseTuple(args,"|i",&corrected)){
+    return NULL;
+  }
   FOMPython::sIRdrCurrOffset++;
   auto r = FOMPython::s_InReader->at(FOMPython::sIRdrCurrOffset);
   if(!r.getHeader()){
     Py_INCREF(Py_None);
     return Py_None;  
   }
+  uint64_t overhead=(corrected?FOMPython::s_InReader->overheadBefore(FOMPython::sIRdrCurrOffset):0);
   size_t count=0;
   auto stackArray=r.getStacks(&count);
   PyObject* stackList=PyTuple_New(count);
@@ -314,9 +319,9 @@ static PyObject* PyGetNextFromSteam(PyObject *self, PyObject * args){
     PyTuple_SetItem(stackList,i,PyInt_FromLong(stackArray[i]));
   }
   PyObject* resultList=PyList_New(7);
-  PyList_SetItem(resultList,0,Py_BuildValue("K",r.getTStart()));
-  PyList_SetItem(resultList,1,Py_BuildValue("K",r.getTReturn()));
-  PyList_SetItem(resultList,2,Py_BuildValue("K",r.getTEnd()));
+  PyList_SetItem(resultList,0,Py_BuildValue("K",r.getTStart()-overhead));
+  PyList_SetItem(resultList,1,Py_BuildValue("K",r.getTReturn()-overhead));
+  PyList_SetItem(resultList,2,Py_BuildValue("K",r.getTEnd()-overhead));
   PyList_SetItem(resultList,3,Py_BuildValue("B",r.getAllocType()));
   PyList_SetItem(resultList,4,Py_BuildValue("K",r.getAddr()));
   PyList_SetItem(resultList,5,Py_BuildValue("K",r.getSize()));
@@ -338,7 +343,8 @@ static PyObject* PyRecordAt(PyObject *self, PyObject * args){
     return NULL;
   }
   size_t pos=0;
-  if(!PyArg_ParseTuple(args,"K",&pos)){
+  int corrected=0;
+  if(!PyArg_ParseTuple(args,"K|i",&pos,&corrected)){
     return NULL;
   }
   if(pos>=FOMPython::s_InReader->size()){
@@ -350,6 +356,7 @@ static PyObject* PyRecordAt(PyObject *self, PyObject * args){
     Py_INCREF(Py_None);
     return Py_None;  
   }
+  uint64_t overhead=(corrected?FOMPython::s_InReader->overheadBefore(pos):0);
   size_t count=0;
   auto stackArray=r.getStacks(&count);
   PyObject* stackList=PyTuple_New(count);
@@ -357,9 +364,9 @@ static PyObject* PyRecordAt(PyObject *self, PyObject * args){
     PyTuple_SetItem(stackList,i,PyInt_FromLong(stackArray[i]));
   }
   PyObject* resultList=PyList_New(7);
-  PyList_SetItem(resultList,0,Py_BuildValue("K",r.getTStart()));
-  PyList_SetItem(resultList,1,Py_BuildValue("K",r.getTReturn()));
-  PyList_SetItem(resultList,2,Py_BuildValue("K",r.getTEnd()));
+  PyList_SetItem(resultList,0,Py_BuildValue("K",r.getTStart()-overhead));
+  PyList_SetItem(resultList,1,Py_BuildValue("K",r.getTReturn()-overhead));
+  PyList_SetItem(resultList,2,Py_BuildValue("K",r.getTEnd()-overhead));
   PyList_SetItem(resultList,3,Py_BuildValue("B",r.getAllocType()));
   PyList_SetItem(resultList,4,Py_BuildValue("K",r.getAddr()));
   PyList_SetItem(resultList,5,Py_BuildValue("K",r.getSize()));
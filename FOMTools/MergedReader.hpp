@@ -0,0 +1,97 @@
+/*
+ *  Copyright (c) CERN 2015
+ *
+ *  Authors:
+ *      Nathalie Rauschmayr <nathalie.rauschmayr_ at _ cern _dot_ ch>
+ *      Sami Kama <sami.kama_ at _ cern _dot_ ch>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef __MERGED_READER_H
+#define __MERGED_READER_H
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include "Streamers.hpp"
+#include "SymbolTable.hpp"
+
+namespace FOM_mallocHook{
+  //
+  // MergedReader. Presents the traces of several processes, e.g. the
+  // mallocOutput_<pid>.fom files of a forking application, as one stream
+  // ordered by start time. The order is found once, with a k-way heap merge
+  // over the sources, and the records are read from the sources in place:
+  // the reader keeps the source of each merged record (2 bytes) and the
+  // position in every source each CheckpointPeriod records. Records out of
+  // order within a source (other threads) keep their order. Zlib traces
+  // have their compression time taken out of their record times, which
+  // shifts each file by its own amount, so they are merged by the times as
+  // stored in the file and at() may then return them out of order by tstart.
+  //
+  // at() returns records as stored, with the frame ids of their own trace.
+  // Those diverge between processes after a fork. getFrame() maps them to
+  // ids shared by all sources, unified by instruction pointer and symbol
+  // name from the symbol chunks, and At() returns copies with the frames
+  // already mapped. Frames without a symbol get ids of their own. Without
+  // symbol chunks in any source, the ids are left as they are.
+  //
+  class MergedReader:public FOM_mallocHook::ReaderBase{
+  public:
+    static const size_t CheckpointPeriod=1024;
+    MergedReader(const std::vector<std::string>& fileNames,unsigned int access=AccessNormal);
+    MergedReader()=delete;
+    MergedReader(const FOM_mallocHook::MergedReader&)=delete;
+    ~MergedReader();
+    const RecordIndex at(size_t) final;
+    FOM_mallocHook::FullRecord At(size_t)final;
+    size_t size() final;
+    std::unique_ptr<FOM_mallocHook::Cursor> newCursor()const final;
+    void setAccessPattern(unsigned int access) final;
+    bool writerFinished() final;//all sources closed
+    std::string traceFile()const final{return std::string();};
+    size_t numSources()const{return m_sources.size();};
+    size_t getSource(size_t t)const{return m_order.at(t);};
+    uint32_t getPid(size_t t)const{return m_sources[m_order.at(t)].pid;};
+    uint32_t getSourcePid(size_t s)const{return m_sources.at(s).pid;};
+    const std::string& getSourceName(size_t s)const{return m_sources.at(s).fileName;};
+    // merged id of frame in source s
+    FOM_mallocHook::index_t getFrame(size_t s,FOM_mallocHook::index_t frame)const{
+      const auto& m=m_sources[s].frames;
+      return (frame<m.size()?m[frame]:frame);
+    };
+    void mapFrames(size_t s,FOM_mallocHook::index_t* frames,size_t count)const;
+    size_t numFrames()const{return m_frames.size();};//0 if ids are not mapped
+    uint64_t getFrameIP(FOM_mallocHook::index_t f)const;//0 if unknown
+    const char* getFrameName(FOM_mallocHook::index_t f)const;//0 if unknown
+  private:
+    class CursorImpl;
+    struct Source{
+      std::string fileName;
+      uint32_t pid;
+      std::unique_ptr<FOM_mallocHook::ReaderBase> reader;
+      std::unique_ptr<FOM_mallocHook::SymbolTable> symbols;
+      std::vector<FOM_mallocHook::index_t> frames;//merged id by own id
+    };
+    void merge();
+    void mapFrames(const std::vector<FOM_mallocHook::index_t>& maxFrame);
+    std::vector<Source> m_sources;
+    std::vector<uint16_t> m_order;//source of each merged record
+    std::vector<size_t> m_checkpoints;//source positions at every CheckpointPeriod records
+    std::vector<std::pair<uint32_t,FOM_mallocHook::index_t> > m_frames;//source and own id by merged id
+    std::unique_ptr<FOM_mallocHook::Cursor> m_cursor;//for at()
+  };
+}//end namespace
+#endif
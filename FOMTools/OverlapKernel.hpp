@@ -0,0 +1,70 @@
+/*
+ *  Copyright (c) CERN 2015
+ *
+ *  Authors:
+ *      Nathalie Rauschmayr <nathalie.rauschmayr_ at _ cern _dot_ ch>
+ *      Sami Kama <sami.kama_ at _ cern _dot_ ch>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef __OVERLAP_KERNEL_H
+#define __OVERLAP_KERNEL_H
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include "RegionInfo.hpp"
+#include "RegionFinder.hpp"
+
+namespace FOM_mallocHook{
+  // All bits set if a<b, else 0, from the borrow of a-b, which ends up in
+  // the top bit: SSE2 has no 64 bit compare to vectorize a<b with. Holds
+  // for a and b under 2^63, as user space addresses are
+  inline uint64_t pageBelow(uint64_t a,uint64_t b){return 0-((a-b)>>63);}
+
+  // region pages as overlapOf() takes them, clamped so that pageBelow()
+  // stays exact for any region
+  inline uint64_t regionPage(uintptr_t p){return std::min((uint64_t)p,(uint64_t)INT64_MAX);}
+
+  //
+  // MemRecord::OVERLAP_TYPE of the allocation pages [ms,me] against the
+  // region [rs,re], Undefined when they do not overlap. Branch free, so
+  // that loops over it vectorize. With rs,re from regionPage():
+  //   rs<me, ms<=rs, re<=me          Superset
+  //   rs<me, ms<=rs, re>me           Underflow
+  //   rs<me, rs<ms,  re>=me          Subset
+  //   rs<me, rs<ms,  ms<=re<me       Overflow
+  //
+  inline uint8_t overlapOf(uint64_t rs,uint64_t re,uint64_t ms,uint64_t me){
+    const uint64_t hit=pageBelow(rs,me);
+    const uint64_t inside=~pageBelow(rs,ms);
+    const uint64_t c=~pageBelow(me,re);
+    const uint64_t d=~pageBelow(re,me);
+    const uint64_t e=~pageBelow(re,ms);
+    const uint64_t oIn=(c&MemRecord::Superset)|(~c&MemRecord::Underflow);
+    const uint64_t oOut=(d&MemRecord::Subset)|(~d&e&MemRecord::Overflow);
+    return (uint8_t)(hit&((inside&oIn)|(~inside&oOut)));
+  }
+
+  // whether an allocation made at tAlloc, ending at tFree, is wanted by a
+  // region at alloc_time t
+  template<int Mode> inline bool inTime(uint64_t tAlloc,uint64_t tFree,uint64_t t){
+    if(Mode==FOM_mallocHook::RegionFinder::BEFORE)return tAlloc<=t;
+    if(Mode==FOM_mallocHook::RegionFinder::AFTER)return tAlloc>=t;
+    if(Mode==FOM_mallocHook::RegionFinder::LIVE)return tAlloc<=t && t<tFree;
+    return true;
+  }
+
+}//end namespace
+#endif
@@ -23,19 +23,55 @@
 #define __REGION_FINDER_H
 #include <string>
 #include <vector>
+#include <memory>
+#include <mutex>
 #include "RegionInfo.hpp"
 #include "Streamers.hpp"
 namespace FOM_mallocHook{
-  class Reader;
+  class RegionIndex;
+  //
+  // RegionFinder. Records whose pages overlap a region, optionally only
+  // those made before or after the region's alloc_time, or the allocations
+  // live at that time. Queries go through a RegionIndex, built on first use
+  // and return records in file order. For readers of a single trace file,
+  // see ReaderBase::traceFile(), the index is kept next to it, others only
+  // build it in memory.
+  // Any reader can be searched. Building the index and collecting the
+  // records is split over nThreads threads (0: one per core), each on its
+  // own cursor. For readers that do not map the whole trace, see
+  // ReaderBase::recordsPersist(), the records returned are copies which
+  // stay valid until the next query, from any thread. Queries share the
+  // finder's cursors and copies and run one at a time.
+  //
   class RegionFinder{
   public:
-    enum ALLOCTIME{BEFORE=-1,ANYTIME=0,AFTER=1};
-    RegionFinder(const std::string & mallocFile);
+    enum ALLOCTIME{BEFORE=-1,ANYTIME=0,AFTER=1,LIVE=2};
+    // opens the trace with openReader(), compressed and segmented ones too
+    RegionFinder(const std::string & mallocFile,bool useIndexFile=true,unsigned int nThreads=0);
+    // searches an open reader, which has to outlive the finder
+    RegionFinder(FOM_mallocHook::ReaderBase* reader,bool useIndexFile=true,unsigned int nThreads=0);
     ~RegionFinder();
     std::vector<FOM_mallocHook::MemRecord> getAllocations(const RegionInfo&,ALLOCTIME t=ANYTIME)const;
     std::vector<std::vector<FOM_mallocHook::MemRecord> > getAllocationSets(const std::vector<RegionInfo> &,ALLOCTIME t=ANYTIME)const;
+    const FOM_mallocHook::RegionIndex& getIndex()const;
   private:
-    FOM_mallocHook::Reader *m_rdr;
+    static const size_t ParallelMin=4096;//records per thread at least
+    typedef uint64_t Hit;//record<<3 | overlap type
+    const FOM_mallocHook::RegionIndex& index()const;//getIndex() with m_mutex held
+    unsigned int prepare(size_t nRecords)const;
+    // appends the records of hits[first,last) with their overlap types to
+    // out, through the cursor and copies of thread k
+    void collect(const std::vector<Hit>& hits,size_t first,size_t last,
+		 std::vector<FOM_mallocHook::MemRecord>& out,unsigned int k)const;
+    FOM_mallocHook::ReaderBase *m_rdr;
+    bool m_ownReader;
+    std::string m_fileName;
+    bool m_useIndexFile;
+    unsigned int m_nThreads;
+    mutable std::unique_ptr<FOM_mallocHook::RegionIndex> m_index;
+    mutable std::vector<std::unique_ptr<FOM_mallocHook::Cursor>> m_cursors;//one per thread
+    mutable std::vector<FOM_mallocHook::RecordBatch> m_copies;//one per thread, unless recordsPersist()
+    mutable std::mutex m_mutex;//serializes queries
   };
   
 }//end namespace
@@ -0,0 +1,120 @@
+/*
+ *  Copyright (c) CERN 2015
+ *
+ *  Authors:
+ *      Nathalie Rauschmayr <nathalie.rauschmayr_ at _ cern _dot_ ch>
+ *      Sami Kama <sami.kama_ at _ cern _dot_ ch>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef __REGION_INDEX_H
+#define __REGION_INDEX_H
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include "Streamers.hpp"
+
+namespace FOM_mallocHook{
+  //
+  // RegionIndex. Page range and lifetime of every record of a trace, kept
+  // as an implicit interval tree: the entries are sorted by first page and
+  // entry i is a node at the level of its lowest unset bit. The largest
+  // last page under each inner (odd) node is kept aside, leaves use their
+  // own. The records touching a page range are then found in O(log n + k)
+  // instead of a scan of the trace.
+  //
+  // An allocation lives from its tstart until the tstart of the next free,
+  // or allocation, of the same address. Frees live for no time at all. A
+  // realloc record carries only the new address, its old block ends at the
+  // free of the old address the hook writes just before it. Traces without
+  // those frees keep the old blocks live.
+  //
+  // The index costs 40 bytes per record, on disk and in memory, plus 4 in
+  // memory for the subtree maxima. That is about five times the offset
+  // table of the SidecarIndex, so it is only built for region queries.
+  // It can be kept next to the trace as <file>.fomrgn, written and checked
+  // against the trace's size and mtime like the SidecarIndex, and against
+  // the record count of the reader loading it.
+  //
+  class RegionIndex{
+  public:
+    struct Entry{
+      uintptr_t firstPage;
+      uintptr_t lastPage;
+      uint64_t tAlloc;//tstart of the record
+      uint64_t tFree;//tstart of the record ending its lifetime, UINT64_MAX if none does
+      uint64_t record;
+      bool liveAt(uint64_t t)const{return tAlloc<=t && t<tFree;};
+    };
+    RegionIndex();
+    RegionIndex(const FOM_mallocHook::RegionIndex&)=delete;
+    ~RegionIndex();
+    // reads all records, on nThreads cursors of r (0: one per core)
+    void build(const FOM_mallocHook::ReaderBase& r,unsigned int nThreads=0);
+    // maps <traceName>.fomrgn, false if it is missing, stale or does not
+    // match the records of r
+    bool load(const std::string& traceName,FOM_mallocHook::ReaderBase& r);
+    bool store(const std::string& traceName)const;
+    size_t size()const{return m_nEntries;};
+    const Entry* entries()const{return m_entries;};//sorted by first page
+    size_t memoryBytes()const{return sizeof(Entry)*m_nEntries+sizeof(uintptr_t)*m_maxLast.size();};
+    // calls f(const Entry&) for each entry with firstPage<=pEnd and
+    // lastPage>pBegin, the records RegionFinder counts as overlapping
+    // [pBegin,pEnd], in order of their first page
+    template<class F> void overlapping(uintptr_t pBegin,uintptr_t pEnd,F f)const{
+      if(m_nEntries==0)return;
+      struct Node{
+	size_t x;
+	int k;
+	bool leftDone;
+      };
+      Node stack[64];
+      int top=0;
+      stack[top++]={((size_t)1<<m_rootLevel)-1,m_rootLevel,false};
+      while(top){
+	Node z=stack[--top];
+	if(z.k<=3){//small subtree, check all of it
+	  size_t i0=z.x>>z.k<<z.k;
+	  size_t i1=std::min(i0+((size_t)1<<(z.k+1))-1,m_nEntries);
+	  for(size_t i=i0;i<i1 && m_entries[i].firstPage<=pEnd;i++){
+	    if(pBegin<m_entries[i].lastPage)f(m_entries[i]);
+	  }
+	}else if(!z.leftDone){
+	  size_t y=z.x-((size_t)1<<(z.k-1));//left child, may be past the end
+	  stack[top++]={z.x,z.k,true};
+	  if(y>=m_nEntries || m_maxLast[y>>1]>pBegin){
+	    stack[top++]={y,z.k-1,false};
+	  }
+	}else if(z.x<m_nEntries && m_entries[z.x].firstPage<=pEnd){
+	  if(pBegin<m_entries[z.x].lastPage)f(m_entries[z.x]);
+	  stack[top++]={z.x+((size_t)1<<(z.k-1)),z.k-1,false};
+	}
+      }
+    };
+  private:
+    void unmap();
+    void link();//fills m_maxLast and m_rootLevel
+    std::vector<Entry> m_built;
+    const Entry* m_entries;//m_built or the mapped file
+    std::vector<uintptr_t> m_maxLast;//largest last page under inner node 2*i+1
+    size_t m_nEntries;
+    int m_rootLevel;
+    void* m_map;
+    size_t m_mapLength;
+  };
+
+}//end namespace
+#endif
@@ -26,8 +26,21 @@
 #ifndef __NO_FORK_SUPPORT__
 #include <pthread.h>
 #endif
+#include <sys/stat.h>
 #include <string>
 #include <vector>
+#include <map>
+#include <list>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+#include <utility>
+#include <iterator>
 #include <cstdint>
 #include <iostream>
 #include <ctime>
@@ -36,6 +49,9 @@
 #include "zlib.h"
 #define _USE_ZLIB_COMPRESSION_ 1
 #endif
+#ifdef IO_URING_FOUND
+#include <linux/io_uring.h>
+#endif
 #ifdef BZip2_FOUND
 #include "bzlib.h"
 #define _USE_BZLIB_COMPRESSION_ 2
@@ -58,6 +74,77 @@ namespace FOM_mallocHook{
     int count; // # of stacks in record
   }__attribute__((packed));
   //
+  // Entries with an allocType at or above SpecialRecord are not allocations.
+  // They keep the record layout (header followed by count index_t words) so
+  // that walkers stepping over h->count stay aligned, and readers skip them.
+  //
+  enum SPECIAL_RECORD{SpecialRecord=0x40,
+		      SyncMarker=0x40, // treturn=SyncMagic, addr=own file offset, size=#records before, stacks[0]=max depth
+		      SymbolChunk=0x41,// treturn=ChunkMagic, addr=index of first symbol, size=payload bytes, see SymbolTable.hpp
+		      MapsChunk=0x42,  // treturn=ChunkMagic, addr=0, size=payload bytes, see SymbolTable.hpp
+		      DictionaryChunk=0x43 // treturn=ChunkMagic, addr=adler32 of the deflate dictionary, size=dictionary bytes
+  };
+  const uint64_t SyncMagic=0x434e5953204d4f46ull;// "FOM SYNC"
+  const uint64_t ChunkMagic=0x4b4e4843204d4f46ull;// "FOM CHNK"
+  inline bool isSpecialRecord(const FOM_mallocHook::header* h){return ((unsigned char)h->allocType)>=SpecialRecord;}
+  inline const FOM_mallocHook::header* skipRecord(const FOM_mallocHook::header* h){
+    return (const FOM_mallocHook::header*)(((const FOM_mallocHook::index_t*)(h+1))+h->count);
+  }
+  // step to the next allocation record. Caller must know that one exists
+  inline const FOM_mallocHook::header* nextRecord(const FOM_mallocHook::header* h){
+    do{ h=skipRecord(h);}while(isSpecialRecord(h));
+    return h;
+  }
+  // returns the first sync marker in [from,end) or 0. fileBegin is the start of the mapped file
+  const FOM_mallocHook::header* findSyncMarker(const void* fileBegin,const void* from,const void* end);
+  // returns the last sync marker in [from,end) or 0. Scans backwards in windows
+  const FOM_mallocHook::header* findLastSyncMarker(const void* fileBegin,const void* from,const void* end);
+  // recovers NumRecords and MaxStacks of an unfinished plain file starting from
+  // its last sync marker. Drops a trailing partial record and rewrites the header if fix is true
+  size_t recoverFile(const std::string& fileName,bool fix=true);
+  //
+  // EliasFano. Compressed, increasing sequence such as record offsets. The
+  // low log2(universe/n) bits of each value are stored verbatim, the rest as
+  // a unary coded bit vector, about 2+log2(universe/n) bits per value. Every
+  // SampleRate-th set bit is sampled so at() is constant time. set() may be
+  // called from several threads, finalize() once all values are in.
+  //
+  class EliasFano{
+  public:
+    EliasFano();
+    void reset(size_t n,uint64_t universe);
+    void set(size_t i,uint64_t v);
+    void finalize();
+    uint64_t at(size_t i)const;
+    void decode(size_t first,size_t n,uint64_t* out)const;//values first..first+n-1
+    size_t size()const{return m_size;};
+    size_t memoryBytes()const;
+    void adviseHugePages()const;
+  private:
+    static const size_t SampleRate=64;
+    size_t m_size;
+    unsigned int m_lowBits;
+    uint64_t m_lowMask;
+    std::vector<uint64_t> m_low;
+    std::vector<uint64_t> m_high;
+    std::vector<uint64_t> m_samples;//position of every SampleRate-th one in m_high
+  };
+  // indexes the uncompressed records in [hdrOff,fileLength) of a mapped file
+  // on nThreads threads (0 uses all cores). Ranges are resynchronized on sync
+  // markers or chains of plausible records and only kept if they chain up
+  // with their predecessor. Offsets of every period-th record are stored.
+  // Returns the number of records
+  size_t indexRecords(const void* fileBegin,size_t hdrOff,size_t fileLength,unsigned int period,
+		      std::vector<uint64_t>& offsets,unsigned int nThreads=0);
+  // same, storing all offsets in compressed form
+  size_t indexRecords(const void* fileBegin,size_t hdrOff,size_t fileLength,
+		      FOM_mallocHook::EliasFano& offsets,unsigned int nThreads=0);
+  // madvise()s a mapped trace for the ReaderBase::ACCESS_PATTERN flags in access
+  void adviseMapping(void* addr,size_t length,unsigned int access);
+  // asks for transparent huge pages on the 2MB pages within [p,p+bytes),
+  // meant for large in-memory indices
+  void adviseHugePages(const void* p,size_t bytes);
+  //
   // Just keeps header information in local variables, indices are located in pre-allocated memory locations.
   //
   struct BucketStats{
@@ -79,6 +166,27 @@ namespace FOM_mallocHook{
   //   void push_front(T&&);
   //   T& swapAt(t,T&);//swap with t and return t;
   // }
+  //
+  //StackSpan. Non-owning view of the stack ids of a record, valid as long as
+  //the memory of the record it was taken from
+  //
+  class StackSpan{
+  public:
+    typedef const index_t* const_iterator;
+    StackSpan():m_stacks(0),m_count(0){};
+    StackSpan(const index_t* s,size_t count):m_stacks(s),m_count(count){};
+    const index_t* begin()const{return m_stacks;};
+    const index_t* end()const{return m_stacks+m_count;};
+    const index_t* data()const{return m_stacks;};
+    size_t size()const{return m_count;};
+    bool empty()const{return m_count==0;};
+    index_t operator[](size_t i)const{return m_stacks[i];};
+    std::vector<index_t> toVector()const{return std::vector<index_t>(m_stacks,m_stacks+m_count);};
+  private:
+    const index_t* m_stacks;
+    size_t m_count;
+  };
+
   class RecordIndex;
   class MemRecord{
   public:
@@ -90,8 +198,7 @@ namespace FOM_mallocHook{
 		      Exact=5 //malloc range matches the scanned region (rs=ms<me=re)
     };
     MemRecord(void*);
-    MemRecord(const RecordIndex&);
-    ~MemRecord();
+    MemRecord(const RecordIndex&,OVERLAP_TYPE o=Undefined);
     uintptr_t getFirstPage() const;
     uintptr_t getLastPage() const ;
     uint64_t getTStart()const;
@@ -102,6 +209,7 @@ namespace FOM_mallocHook{
     char getAllocType() const;
     const index_t* const getStacks(size_t *count) const;
     std::vector<index_t> getStacks() const;
+    StackSpan stacks() const{return StackSpan(m_stacks,m_h.count);};
     const FOM_mallocHook::header* const getHeader() const;
     OVERLAP_TYPE getOverlap() const;
     void setOverlap(OVERLAP_TYPE);
@@ -138,32 +246,39 @@ namespace FOM_mallocHook{
   //
   class RecordIndex{
   public:
-    RecordIndex(const FOM_mallocHook::header*);
+    RecordIndex(const FOM_mallocHook::header* h):m_h(h){};
     RecordIndex():m_h(0){};
-    ~RecordIndex();
     uintptr_t getFirstPage() const;
     uintptr_t getLastPage() const ;
-    uintptr_t getAddr() const;
-    uint64_t getTStart()const;
-    uint64_t getTReturn() const;
-    uint64_t getTEnd()const;
-    size_t getSize() const;
-    char getAllocType() const;
+    uintptr_t getAddr() const{return m_h->addr;};
+    uint64_t getTStart()const{return m_h->tstart;};
+    uint64_t getTReturn() const{return m_h->treturn;};
+    uint64_t getTEnd()const{return m_h->tend;};
+    size_t getSize() const{return m_h->size;};
+    char getAllocType() const{return m_h->allocType;};
     const index_t* const getStacks(size_t *count) const;
     std::vector<index_t> getStacks() const;
-    const FOM_mallocHook::header* const getHeader() const;
+    StackSpan stacks() const{return m_h?StackSpan((const index_t*)(m_h+1),m_h->count):StackSpan();};
+    const FOM_mallocHook::header* const getHeader() const{return m_h;};
   private:
     const FOM_mallocHook::header *m_h;
   };
 
   //
-  //FullRecord. Keeps a copy of full record in private memory
+  //FullRecord. Keeps a copy of full record in private memory. Records with up
+  //to InlineStacks stacks are kept in the object itself, deeper ones on the
+  //heap. Assigning reuses the heap buffer if it is large enough
   //
   class FullRecord{
   public:
+    static const size_t InlineStacks=32;
+    FullRecord();
     FullRecord(const void*);//takes a pointer to consecutive memory location containing a buffer + stacks
     FullRecord(const RecordIndex&);
     FullRecord(const FullRecord& );
+    FullRecord(FullRecord&& );
+    FullRecord& operator=(const FullRecord&);
+    FullRecord& operator=(FullRecord&&);
     ~FullRecord();
     uintptr_t getFirstPage() const;
     uintptr_t getLastPage() const ;
@@ -175,54 +290,404 @@ namespace FOM_mallocHook{
     char getAllocType() const;
     const index_t* const getStacks(size_t *count) const;
     std::vector<index_t> getStacks() const;
+    StackSpan stacks() const{return m_h?StackSpan((const index_t*)(m_h+1),m_h->count):StackSpan();};
     const FOM_mallocHook::header* const getHeader() const;
     void* getBuffer();
   private:
-    FOM_mallocHook::header *m_h;
+    void assign(const FOM_mallocHook::header*,const index_t* stacks);
+    bool onHeap()const{return m_buff!=m_inline;};
+    FOM_mallocHook::header *m_h;//0 or m_buff
+    char* m_buff;
+    size_t m_capacity;//stacks that fit in m_buff
+    char m_inline[sizeof(FOM_mallocHook::header)+InlineStacks*sizeof(index_t)];
+  };
+
+  //
+  //RecordBatch. Copies of records packed back to back in large chunks, so
+  //that keeping many records costs no allocation per record. Records are
+  //returned as RecordIndex and stay valid until the batch is cleared.
+  //clear() keeps the chunks for reuse
+  //
+  class RecordBatch{
+  public:
+    static const size_t ChunkBytes=1<<20;
+    RecordBatch();
+    RecordIndex push_back(const RecordIndex&);
+    RecordIndex operator[](size_t i)const{return RecordIndex(m_records[i]);};
+    size_t size()const{return m_records.size();};
+    bool empty()const{return m_records.empty();};
+    void reserve(size_t n){m_records.reserve(n);};
+    void clear();
+    size_t memoryBytes()const;
+  private:
+    struct Chunk{
+      std::unique_ptr<char[]> buff;
+      size_t size;
+    };
+    std::vector<Chunk> m_chunks;
+    size_t m_curr;//chunk being filled
+    size_t m_used;//bytes used in it
+    std::vector<const FOM_mallocHook::header*> m_records;
   };
 
   class FileStats;
-  
+
+  //
+  // Cursor. Read position of one thread in a reader. Readers do not change
+  // their index after construction and share their bucket cache, all state
+  // at() updates while walking the file is kept in the cursor. Threads
+  // splitting one file among them each take a cursor from the same reader
+  // instead of opening and indexing the file again. Records returned by
+  // at() stay valid until the cursor moves to another bucket or segment,
+  // use At() for copies. The reader must outlive its cursors.
+  //
+  class Cursor{
+  public:
+    static const size_t BatchSize=256;
+    virtual ~Cursor(){};
+    virtual const FOM_mallocHook::RecordIndex at(size_t)=0;
+    FOM_mallocHook::FullRecord At(size_t t){return FOM_mallocHook::FullRecord(at(t));};
+    virtual size_t size()const=0;
+    // Records from first on as one array, at most maxCount. Compressed
+    // files hand out the rest of the bucket in place, the others a batch of
+    // up to BatchSize. Valid until the next call. Returns the count
+    virtual size_t span(size_t first,size_t maxCount,const FOM_mallocHook::RecordIndex** recs)=0;
+    // calls f(const RecordIndex&) on records [first,last) in order, a span
+    // at a time, so that f can be inlined into the loop
+    template<class F> void forEach(F f,size_t first=0,size_t last=SIZE_MAX){
+      last=std::min(last,size());
+      const FOM_mallocHook::RecordIndex* recs=0;
+      while(first<last){
+	size_t n=span(first,last-first,&recs);
+	for(size_t i=0;i<n;i++)f(recs[i]);
+	first+=n;
+      }
+    };
+  };
+
+  class ReaderBase;
+
+  //
+  // RecordIterator. Forward iterator over records, walking the spans of a
+  // cursor of its own. Copies open another cursor.
+  //
+  class RecordIterator{
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef FOM_mallocHook::RecordIndex value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const FOM_mallocHook::RecordIndex* pointer;
+    typedef const FOM_mallocHook::RecordIndex& reference;
+    RecordIterator():m_r(0),m_pos(0),m_last(0),m_p(0),m_end(0){};
+    RecordIterator(const FOM_mallocHook::ReaderBase* r,size_t pos,size_t last);
+    RecordIterator(const FOM_mallocHook::RecordIterator& o);
+    RecordIterator(FOM_mallocHook::RecordIterator&& o)=default;
+    RecordIterator& operator=(const FOM_mallocHook::RecordIterator& o);
+    RecordIterator& operator=(FOM_mallocHook::RecordIterator&& o)=default;
+    reference operator*()const{return *m_p;};
+    pointer operator->()const{return m_p;};
+    RecordIterator& operator++(){
+      m_pos++;
+      if(++m_p==m_end)fill();
+      return *this;
+    };
+    RecordIterator operator++(int){
+      RecordIterator t(*this);
+      ++(*this);
+      return t;
+    };
+    bool operator==(const FOM_mallocHook::RecordIterator& o)const{return m_pos==o.m_pos;};
+    bool operator!=(const FOM_mallocHook::RecordIterator& o)const{return m_pos!=o.m_pos;};
+    size_t index()const{return m_pos;};
+  private:
+    void fill();
+    const FOM_mallocHook::ReaderBase* m_r;
+    std::unique_ptr<FOM_mallocHook::Cursor> m_c;
+    size_t m_pos,m_last;
+    const FOM_mallocHook::RecordIndex *m_p,*m_end;
+  };
+
+  class RecordRange{
+  public:
+    RecordRange(const FOM_mallocHook::ReaderBase* r,size_t first,size_t last):m_r(r),m_first(first),m_last(last){};
+    FOM_mallocHook::RecordIterator begin()const{return FOM_mallocHook::RecordIterator(m_r,m_first,m_last);};
+    FOM_mallocHook::RecordIterator end()const{return FOM_mallocHook::RecordIterator(m_r,m_last,m_last);};
+    size_t size()const{return m_last-m_first;};
+  private:
+    const FOM_mallocHook::ReaderBase* m_r;
+    size_t m_first,m_last;
+  };
+
+  //
+  // TimeIndex. tstart range of every BlockSize records, kept as the running
+  // maximum of the block maxima from the front and the running minimum of
+  // the block minima from the back. Both are sorted even though records of
+  // different threads are not strictly in time order, so the block holding
+  // a time bound is found by binary search and only that block is read.
+  //
+  class TimeIndex{
+  public:
+    static const size_t BlockSize=1024;
+    TimeIndex();
+    // reads all records, on nThreads cursors of r (0: one per core)
+    void build(const FOM_mallocHook::ReaderBase& r,unsigned int nThreads=0);
+    size_t size()const{return m_nRecords;};
+    size_t numBlocks()const{return m_maxBefore.size();};
+    size_t memoryBytes()const{return 2*sizeof(uint64_t)*m_maxBefore.size();};
+    // first record with tstart>=t, size() if there is none. s is the reader
+    // the index was built from or one of its cursors
+    template<class Source> size_t lowerBound(Source& s,uint64_t t)const{
+      size_t b=std::lower_bound(m_maxBefore.begin(),m_maxBefore.end(),t)-m_maxBefore.begin();
+      if(b==m_maxBefore.size())return m_nRecords;
+      size_t i=b*BlockSize;
+      size_t e=std::min(i+BlockSize,m_nRecords);
+      for(;i<e;i++){
+	if(s.at(i).getTStart()>=t)break;
+      }
+      return i;
+    };
+    // one past the last record with tstart<=t, 0 if there is none
+    template<class Source> size_t upperBound(Source& s,uint64_t t)const{
+      size_t b=std::upper_bound(m_minAfter.begin(),m_minAfter.end(),t)-m_minAfter.begin();
+      if(b==0)return 0;
+      size_t i=std::min(b*BlockSize,m_nRecords);
+      size_t e=(b-1)*BlockSize;
+      for(;i>e;i--){
+	if(s.at(i-1).getTStart()<=t)break;
+      }
+      return i;
+    };
+  private:
+    size_t m_nRecords;
+    std::vector<uint64_t> m_maxBefore;//max tstart in blocks 0..b
+    std::vector<uint64_t> m_minAfter;//min tstart in blocks b..end
+  };
+
+  //
+  // OverheadIndex. Prefix sums of the hook overhead, the tend-tstart of a
+  // record as record2TTree counts it, for every BlockSize-th record. The
+  // overhead of all records before any record is then one lookup plus at
+  // most BlockSize-1 record reads, which gives a clock as if the hook were
+  // absent: subtract offset(t) from the times of record t.
+  //
+  class OverheadIndex{
+  public:
+    static const size_t BlockSize=64;
+    OverheadIndex();
+    // reads all records, on nThreads cursors of r (0: one per core)
+    void build(const FOM_mallocHook::ReaderBase& r,unsigned int nThreads=0);
+    size_t size()const{return m_nRecords;};
+    size_t memoryBytes()const{return sizeof(uint64_t)*m_prefix.size();};
+    static uint64_t overhead(const FOM_mallocHook::RecordIndex& r){return r.getTEnd()-r.getTStart();};
+    // overhead of records [0,t). s is the reader the index was built from
+    // or one of its cursors
+    template<class Source> uint64_t offset(Source& s,size_t t)const{
+      t=std::min(t,m_nRecords);
+      size_t b=t/BlockSize;
+      uint64_t o=m_prefix[b];
+      for(size_t i=b*BlockSize;i<t;i++)o+=overhead(s.at(i));
+      return o;
+    };
+    uint64_t total()const{return m_prefix.back();};
+  private:
+    size_t m_nRecords;
+    std::vector<uint64_t> m_prefix;//overhead of records [0,b*BlockSize), last one of all
+  };
+
   class ReaderBase{
   public:
-    ReaderBase(const std::string& fileName);
+    // How the trace is going to be read: one of AccessNormal,
+    // AccessSequential (full scans) or AccessRandom (queries), optionally
+    // or'ed with AccessPopulate to fault the whole file in up front and
+    // AccessHugePages to back large record indices with huge pages
+    enum ACCESS_PATTERN{AccessNormal=0,AccessSequential=1,AccessRandom=2,
+			AccessPopulate=4,AccessHugePages=8};
+    ReaderBase(const std::string& fileName,unsigned int access=AccessNormal);
     virtual ~ReaderBase();
     virtual const FOM_mallocHook::FileStats* getFileStats()const{return m_fileStats;};
     virtual const FOM_mallocHook::RecordIndex at(size_t)=0;
     virtual FOM_mallocHook::FullRecord At(size_t)=0;
     virtual size_t size()=0;
+    // independent read position for another thread, see Cursor
+    virtual std::unique_ptr<FOM_mallocHook::Cursor> newCursor()const=0;
+    // true when records from at() stay valid as long as the reader does
+    // (until a refresh()), because the whole trace is mapped
+    virtual bool recordsPersist()const{return false;};
+    // Faster ways through many records than at(): records() for range-for
+    // loops, forEach() to visit them a span at a time. Both use a cursor
+    FOM_mallocHook::RecordRange records(size_t first=0,size_t last=SIZE_MAX){
+      last=std::min(last,size());
+      return FOM_mallocHook::RecordRange(this,std::min(first,last),last);
+    };
+    template<class F> void forEach(F f,size_t first=0,size_t last=SIZE_MAX)const{
+      newCursor()->forEach(f,first,last);
+    };
     const std::string& getFileName(){return m_fileName;}
+    // the one trace file the records are read from, which indices of them
+    // can be kept next to. Empty for readers over several files or a
+    // stream, their indices are only built in memory
+    virtual std::string traceFile()const{return m_fileName;};
+    // Record positions by start time, through the time index which is built
+    // on first use. Cursors use getTimeIndex() directly, it has to be
+    // built before they are handed out to other threads.
+    size_t lowerBoundTime(uint64_t t);//first record starting at or after t
+    size_t upperBoundTime(uint64_t t);//one past the last record starting at or before t
+    // records [first,second) hold all records starting within [t0,t1].
+    // Out of order records of other threads may be among them
+    std::pair<size_t,size_t> timeRange(uint64_t t0,uint64_t t1);
+    const FOM_mallocHook::TimeIndex& getTimeIndex(unsigned int nThreads=0);
+    // Overhead corrected clock, the times records would have had without
+    // the hook. Every time of record t is taken down by the hook overhead
+    // of all records before it, see OverheadIndex, which is built on first
+    // use. forEachCorrected() hands each record with that overhead to
+    // f(record,overhead) and keeps the sum running instead of looking it up
+    uint64_t overheadBefore(size_t t);
+    uint64_t correctedTStart(size_t t){return at(t).getTStart()-overheadBefore(t);};
+    FOM_mallocHook::FullRecord AtCorrected(size_t t);
+    template<class F> void forEachCorrected(F f,size_t first=0,size_t last=SIZE_MAX){
+      last=std::min(last,size());
+      if(first>=last)return;
+      uint64_t o=overheadBefore(first);
+      forEach([&f,&o](const FOM_mallocHook::RecordIndex& ri){
+	  f(ri,o);
+	  o+=FOM_mallocHook::OverheadIndex::overhead(ri);
+	},first,last);
+    };
+    const FOM_mallocHook::OverheadIndex& getOverheadIndex(unsigned int nThreads=0);
+    // changes the access pattern of an open reader, e.g. to random after a scan
+    virtual void setAccessPattern(unsigned int access){m_access=access;};
+    unsigned int getAccessPattern()const{return m_access;};
+    // Follow mode, for traces that are still being written. refresh() picks
+    // up the records appended since the reader was opened or last
+    // refreshed and returns their number. The trace may be remapped,
+    // records and cursors obtained before are invalid afterwards and it
+    // must not run while other threads read. Reader and ZlibReader can
+    // follow (canFollow()), the others return 0. See Follower
+    size_t refresh();
+    virtual bool canFollow()const{return false;};
+    // true once the writer has closed the trace, see FileStats::isClosed().
+    // Check before the last refresh(). Readers over several files answer
+    // for all of them, StreamReader once the stream has ended
+    virtual bool writerFinished();
   protected:
+    virtual size_t appendRecords(){return 0;};//indexes new records for refresh()
     void readFileStats(void*);
     FOM_mallocHook::FileStats* m_fileStats;
+    unsigned int m_access;
   private:
     std::string m_fileName;
+    std::unique_ptr<FOM_mallocHook::TimeIndex> m_timeIndex;
+    std::unique_ptr<FOM_mallocHook::OverheadIndex> m_overheadIndex;
+  };
+
+  //
+  // SidecarIndex. Record offsets and bucket table of a trace, kept next to
+  // it as <file>.fomidx so that later opens map it instead of walking the
+  // trace again. The index records the size and mtime of the trace it was
+  // built from and is ignored (and rebuilt) when they no longer match, or
+  // when its offsets are not increasing or point past the end of the trace.
+  //
+  class SidecarIndex{
+  public:
+    struct Bucket{
+      uint64_t offset;//from the start of the trace
+      uint64_t rStart;
+      uint64_t rEnd;
+      uint64_t tOffset;
+    }__attribute__((packed));
+    SidecarIndex(const std::string& traceName);
+    SidecarIndex()=delete;
+    SidecarIndex(const FOM_mallocHook::SidecarIndex&)=delete;
+    ~SidecarIndex();
+    bool load(const struct stat& traceStat);
+    bool store(const struct stat& traceStat,
+	       const uint64_t* records,size_t nRecords,
+	       const Bucket* buckets,size_t nBuckets,
+	       const uint64_t* chunks,size_t nChunks);
+    const uint64_t* records()const{return m_records;};
+    size_t numRecords()const{return m_nRecords;};
+    const Bucket* buckets()const{return m_buckets;};
+    size_t numBuckets()const{return m_nBuckets;};
+    const uint64_t* chunks()const{return m_chunks;};//offsets of special records, e.g. dictionaries
+    size_t numChunks()const{return m_nChunks;};
+    const std::string& getIndexName()const{return m_indexName;};
+    void advise(unsigned int access)const;//see ReaderBase::ACCESS_PATTERN
+  private:
+    void unmap();
+    std::string m_indexName;
+    void* m_map;
+    size_t m_mapLength;
+    const uint64_t* m_records;
+    size_t m_nRecords;
+    const Bucket* m_buckets;
+    size_t m_nBuckets;
+    const uint64_t* m_chunks;
+    size_t m_nChunks;
   };
 
   class Reader:public FOM_mallocHook::ReaderBase{
   public:
-    Reader(std::string fileName);
+    Reader(std::string fileName,bool useIndexFile=true,unsigned int access=AccessNormal);
     Reader()=delete;
     ~Reader();
     //const MemRecord&  readNext();
     const RecordIndex at(size_t) final;
     FOM_mallocHook::FullRecord At(size_t)final;    
     size_t size() final;
+    std::unique_ptr<FOM_mallocHook::Cursor> newCursor()const final;
+    bool recordsPersist()const final{return true;};
+    void setAccessPattern(unsigned int access) final;
+    bool canFollow()const final{return true;};
     //const FOM_mallocHook::FileStats* getFileStats() const;
+  protected:
+    size_t appendRecords() final;
   private:
+    class CursorImpl;
+    const RecordIndex record(size_t)const;
     int m_fileHandle;
     size_t m_fileLength;
     std::string m_fileName;
     void *m_fileBegin;
     //MemRecord m_curr;
-    std::vector<RecordIndex> m_records;
-    FOM_mallocHook::FileStats* m_fileStats;
+    std::vector<uint64_t> m_offsets;//record offsets when not mapped from the index file
+    const uint64_t* m_records;
+    size_t m_numRecords;
+    FOM_mallocHook::SidecarIndex* m_index;
     bool m_fileOpened; 
+    size_t m_scanEnd;//end of the last complete record indexed
+  };
+
+  //
+  // CompactReader. Random access like Reader, with record offsets kept in an
+  // Elias-Fano sequence (about a byte per record instead of eight) for
+  // traces whose index would not fit in memory otherwise.
+  //
+  class CompactReader:public FOM_mallocHook::ReaderBase{
+  public:
+    CompactReader(std::string fileName,unsigned int access=AccessNormal);
+    CompactReader()=delete;
+    CompactReader(const FOM_mallocHook::CompactReader&)=delete;
+    ~CompactReader();
+    const RecordIndex at(size_t) final;
+    FOM_mallocHook::FullRecord At(size_t)final;
+    size_t size() final;
+    std::unique_ptr<FOM_mallocHook::Cursor> newCursor()const final;
+    bool recordsPersist()const final{return true;};
+    void setAccessPattern(unsigned int access) final;
+    size_t indexBytes()const{return m_offsets.memoryBytes();};
+  private:
+    class CursorImpl;
+    const RecordIndex record(size_t)const;
+    int m_fileHandle;
+    size_t m_fileLength;
+    void *m_fileBegin;
+    FOM_mallocHook::EliasFano m_offsets;
+    bool m_fileOpened;
   };
 
   class IndexingReader:public FOM_mallocHook::ReaderBase{
   public:
-    IndexingReader(std::string fileName,unsigned int indexPeriod=100);
+    IndexingReader(std::string fileName,unsigned int indexPeriod=100,unsigned int access=AccessNormal);
     IndexingReader()=delete;
     IndexingReader(const FOM_mallocHook::IndexingReader&)=delete;
     ~IndexingReader();
@@ -230,9 +695,14 @@ namespace FOM_mallocHook{
     const RecordIndex at(size_t) final;
     size_t size() final;
     FOM_mallocHook::FullRecord At(size_t)final;
+    std::unique_ptr<FOM_mallocHook::Cursor> newCursor()const final;
+    bool recordsPersist()const final{return true;};
+    void setAccessPattern(unsigned int access) final;
     size_t indexedSize();
     //const FOM_mallocHook::FileStats* getFileStats() const;
   private:
+    class CursorImpl;
+    const FOM_mallocHook::header* locate(size_t t,size_t* lastIndex,const FOM_mallocHook::header** lastHdr)const;
     RecordIndex& seek(const RecordIndex& start, uint offset);
     int m_fileHandle;
     size_t m_fileLength;
@@ -247,19 +717,147 @@ namespace FOM_mallocHook{
     const FOM_mallocHook::header* m_lastHdr;    
   };
 
+  //
+  // SegmentedReader. Presents the segments listed in a .manifest file as a
+  // single stream. Segments are opened on first access and at most
+  // maxOpenSegments are kept open, so RecordIndex objects returned by at()
+  // are only valid until other segments are visited. Use At() for copies.
+  // A trailing segment missing from the manifest (crashed writer) is picked
+  // up and scanned at construction. Cursors share the open segments, a
+  // segment closed while a cursor is still in it is released when the
+  // cursor leaves it.
+  //
+  class SegmentedReader:public FOM_mallocHook::ReaderBase{
+  public:
+    SegmentedReader(std::string manifestName,unsigned int maxOpenSegments=2,unsigned int access=AccessNormal);
+    SegmentedReader()=delete;
+    SegmentedReader(const FOM_mallocHook::SegmentedReader&)=delete;
+    ~SegmentedReader();
+    const RecordIndex at(size_t) final;
+    FOM_mallocHook::FullRecord At(size_t)final;
+    size_t size() final;
+    std::unique_ptr<FOM_mallocHook::Cursor> newCursor()const final;
+    void setAccessPattern(unsigned int access) final;//also applies to segments opened later
+    bool writerFinished() final;//all segments closed
+    std::string traceFile()const final{return std::string();};
+    size_t numSegments()const{return m_segments.size();};
+    const std::string& segmentName(size_t s)const{return m_segments.at(s).fileName;};
+  private:
+    class CursorImpl;
+    size_t findSegment(size_t t)const;
+    struct Segment{
+      std::string fileName;
+      size_t firstRecord;
+      size_t nRecords;
+      uint64_t tFirst,tLast;
+      mutable std::shared_ptr<FOM_mallocHook::ReaderBase> reader;
+      mutable uint64_t lastUse;
+    };
+    std::shared_ptr<FOM_mallocHook::ReaderBase> openSegment(size_t s)const;
+    std::vector<Segment> m_segments;
+    size_t m_numRecords;
+    unsigned int m_maxOpen;
+    mutable unsigned int m_nOpen;
+    mutable uint64_t m_useCount;
+    mutable std::mutex m_mutex;//guards opening and closing segments
+    size_t m_currSegment;
+    std::shared_ptr<FOM_mallocHook::ReaderBase> m_currReader;
+  };
+
+  // opens fileName with the reader for its format: SegmentedReader for a
+  // .manifest, Reader or ZlibReader by the compression in its header. The
+  // caller owns the reader
+  FOM_mallocHook::ReaderBase* openReader(const std::string& fileName,unsigned int access=ReaderBase::AccessNormal);
+
+  //
+  // BucketCache. Inflated buckets with their record index, kept in LRU order
+  // within a byte budget. Lookups and evictions are O(1) through a hash map.
+  // Entries are keyed by owner (reader) and bucket, so one cache can be
+  // shared by several readers. Blocks are reference counted, an evicted
+  // block stays valid for whoever still holds it. Thread safe.
+  //
+  class BucketCache{
+  public:
+    struct Block{
+      std::vector<uint8_t> data;
+      std::vector<RecordIndex> records;
+      size_t bytes()const{return data.capacity()+records.capacity()*sizeof(RecordIndex);};
+    };
+    typedef std::shared_ptr<Block> BlockPtr;
+    struct Stats{
+      uint64_t hits;
+      uint64_t misses;
+      uint64_t evictions;
+      size_t entries;
+      size_t bytes;
+    };
+    BucketCache(size_t budgetBytes);
+    BucketCache()=delete;
+    BucketCache(const FOM_mallocHook::BucketCache&)=delete;
+    BlockPtr find(const void* owner,size_t bucket);//counts a hit or a miss
+    bool contains(const void* owner,size_t bucket)const;
+    void insert(const void* owner,size_t bucket,const BlockPtr& b);
+    void erase(const void* owner);
+    BlockPtr acquire();//empty block, recycled if possible
+    void release(BlockPtr& b);//hands an unused block back for recycling
+    Stats getStats()const;
+    void resetStats();
+    size_t getBudget()const{return m_budget;};
+  private:
+    struct Key{
+      const void* owner;
+      size_t bucket;
+      bool operator==(const Key& o)const{return (owner==o.owner)&&(bucket==o.bucket);};
+    };
+    struct KeyHash{
+      size_t operator()(const Key& k)const{return std::hash<const void*>()(k.owner)^(k.bucket*0x9e3779b97f4a7c15ull);};
+    };
+    typedef std::list<std::pair<Key,BlockPtr> > LRUList;
+    void evict();
+    mutable std::mutex m_mutex;
+    size_t m_budget;
+    size_t m_bytes;
+    LRUList m_lru;//most recently used first
+    std::unordered_map<Key,LRUList::iterator,KeyHash> m_map;
+    std::vector<BlockPtr> m_spare;
+    uint64_t m_hits,m_misses,m_evictions;
+  };
 
  #ifdef ZLIB_FOUND
   class ZlibReader:public FOM_mallocHook::ReaderBase{
   public:
-    ZlibReader(std::string fileName,unsigned int nUncompBuckets=3);
+    // nUncompBuckets sets the budget of the reader's own cache, see setCache()
+    ZlibReader(std::string fileName,unsigned int nUncompBuckets=3,bool useIndexFile=true,unsigned int access=AccessNormal);
     ZlibReader()=delete;
     ZlibReader(const FOM_mallocHook::ZlibReader&)=delete;
     ~ZlibReader();
     const RecordIndex at(size_t) final;
     FOM_mallocHook::FullRecord At(size_t)final;
     size_t size() final;
+    // cursors share the bucket cache and the read-ahead workers, but inflate
+    // their misses with their own stream and follow their own sequence
+    std::unique_ptr<FOM_mallocHook::Cursor> newCursor()const final;
+    void setAccessPattern(unsigned int access) final;
+    bool canFollow()const final{return true;};
     size_t indexedSize();
+    // Sequential misses start inflating the following buckets on nThreads
+    // worker threads (0: one per core), at most depth buckets and
+    // memoryBudget bytes ahead. depth 0 disables read-ahead. Not to be
+    // called while cursors of the reader are in use
+    void setReadAhead(unsigned int depth,size_t memoryBudget=256<<20,unsigned int nThreads=0);
+    // replaces the reader's own bucket cache, e.g. with one shared by other readers
+    void setCache(const std::shared_ptr<FOM_mallocHook::BucketCache>& cache);
+    const std::shared_ptr<FOM_mallocHook::BucketCache>& getCache()const{return m_cache;};
+    // compression time subtracted from the times of record t, the same for
+    // every record up to *last
+    uint64_t getTimeOffset(size_t t,size_t* last=0)const{
+      const auto& b=m_bucketIndices.at(findBucket(t));
+      if(last)*last=b.rEnd;
+      return b.tOffset;
+    };
     //const FOM_mallocHook::FileStats* getFileStats() const;
+  protected:
+    size_t appendRecords() final;
   private:
     class BucketIndex{
     public:
@@ -268,26 +866,14 @@ namespace FOM_mallocHook{
       size_t rEnd;//record end
       uint64_t tOffset;// tOffset at the start of the bucket
     };
-    class BuffRec{
-    public:
-      BuffRec(size_t bi,uint8_t* b,size_t avgNrecords):bucketIndex(bi),bucketBuff(b),lastUse(0){records=new std::vector<RecordIndex>(avgNrecords);};
-      size_t bucketIndex;
-      uint8_t *bucketBuff;
-      uint64_t lastUse;
-      std::vector<RecordIndex> *records;
-      
-      friend void swap( BuffRec&a, BuffRec&b){
-	std::swap(a.bucketIndex,b.bucketIndex);
-	std::swap(a.bucketBuff,b.bucketBuff);
-	std::swap(a.records,b.records);
-      }
-    };
+    class CursorImpl;
     std::vector<BucketIndex> m_bucketIndices;
     RecordIndex& seek(const RecordIndex& start, uint offset);
+    size_t findBucket(size_t t)const;
     int m_fileHandle;
     size_t m_fileLength;
     void *m_fileBegin;
-    std::vector<RecordIndex> *m_recordsInCurrBuffer;
+    FOM_mallocHook::BucketCache::BlockPtr m_curr;//pins the current bucket
     bool m_fileOpened;
     size_t m_lastIndex;
     size_t m_numRecords;
@@ -296,14 +882,151 @@ namespace FOM_mallocHook{
     //size_t m_currTimeSkew;
     size_t m_bucketSize;
     double m_avgRecordsPerBucket;
-    std::vector<BuffRec>  m_buffers;
+    size_t m_scanEnd;//end of the last complete bucket indexed
+    uint64_t m_tOffsetEnd;//compression time of all indexed buckets
+    size_t scanBuckets();
+    std::shared_ptr<FOM_mallocHook::BucketCache> m_cache;
     size_t m_inflateCount;
+    size_t m_prefetchCount;
+    std::vector<std::pair<uint32_t,const FOM_mallocHook::header*> > m_dictionaries;//by adler32
+    z_stream m_zs;
+    void inflateBucket(z_stream* zs,uint8_t* dst,size_t* dstLen,const BucketStats* bs)const;
+    void loadBucket(z_stream* zs,size_t bucket,FOM_mallocHook::BucketCache::Block& b)const;
+    struct Prefetch{
+      FOM_mallocHook::BucketCache::BlockPtr block;
+      bool done;
+      std::string error;
+    };
+    // const and guarded by m_raMutex, so that cursors read ahead too
+    void scheduleReadAhead(size_t bucket)const;
+    FOM_mallocHook::BucketCache::BlockPtr takePrefetched(size_t bucket)const;
+    void readAheadWorker()const;
+    void stopReadAhead();
+    unsigned int m_readAheadDepth;
+    size_t m_readAheadBudget;
+    unsigned int m_readAheadThreads;
+    size_t m_lastMiss;
+    mutable std::vector<std::thread> m_workers;
+    mutable std::mutex m_raMutex;
+    mutable std::condition_variable m_raWork,m_raDone;
+    mutable std::deque<size_t> m_raQueue;
+    mutable std::map<size_t,Prefetch> m_prefetched;//by bucket, queued or inflated
+    bool m_raStop;
     //const FOM_mallocHook::header* m_lastHdr;
     //uint8_t *m_uncomressedBucket,*m_prevBucket;
     
   };
 #endif
 
+  //
+  // StreamReader. Forward-only reader for inputs that can not be mapped:
+  // pipes, FIFOs, sockets or stdin ("-"). Holds one bucket of a compressed
+  // trace, or about bufferSize bytes of an uncompressed one, at a time, so
+  // memory stays bounded however long the trace is. next() returns the
+  // records in order and an empty RecordIndex at the end of the stream.
+  // at() moves forward to the requested record, records before the current
+  // window are gone (std::out_of_range). size() counts the records read so
+  // far. Cursors, and everything built on them, are not available.
+  //
+  class StreamReader:public FOM_mallocHook::ReaderBase{
+  public:
+    StreamReader(std::string fileName,size_t bufferSize=1<<20);
+    StreamReader(int fd,size_t bufferSize=1<<20);//fd stays open
+    StreamReader()=delete;
+    StreamReader(const FOM_mallocHook::StreamReader&)=delete;
+    ~StreamReader();
+    const RecordIndex next();
+    const RecordIndex at(size_t) final;
+    FOM_mallocHook::FullRecord At(size_t)final;
+    size_t size() final;
+    std::unique_ptr<FOM_mallocHook::Cursor> newCursor()const final;//throws std::logic_error
+    bool writerFinished() final{return m_eof;};//the writer has closed the stream
+    std::string traceFile()const final{return std::string();};
+    bool eof()const{return m_eof && m_pos>=m_first+m_window.size();};
+    // visits the remaining records a window at a time
+    template<class F> void forEach(F f){
+      do{
+	for(size_t i=m_pos-m_first;i<m_window.size();i++)f(m_window[i]);
+	m_pos=m_first+m_window.size();
+      }while(fill());
+    };
+  private:
+    void open();
+    bool fill();//replaces the window with the next records, false at the end
+    bool fillPlain();
+    bool fillZlib();
+    int m_fd;
+    bool m_ownFd;
+    bool m_eof;
+    int m_compression;
+    size_t m_bufferSize;
+    std::vector<char> m_buff;//current window
+    size_t m_used;//valid bytes in m_buff
+    size_t m_consumed;//bytes of m_buff in m_window
+    std::vector<RecordIndex> m_window;
+    size_t m_first;//number of the first record in m_window
+    size_t m_pos;//next record for next()
+#ifdef ZLIB_FOUND
+    std::vector<char> m_cBuff;
+    uint64_t m_tOffset;
+    std::vector<std::pair<uint32_t,std::vector<char> > > m_dictionaries;//by adler32
+    z_stream m_zs;
+    bool m_zsInit;
+#endif
+  };
+
+  //
+  // Follower. tail -f for a trace that is still being written. follow()
+  // refreshes the reader and hands every new record to f, in order, until
+  // the writer has closed the trace, f returns false or nothing arrived for
+  // idleMs (0: wait for the writer). It returns the number of records
+  // handed out, a later call resumes after the last one. In between it
+  // waits on inotify, and polls every pollMs for writes through a mapping
+  // (MmapWriter) that inotify does not report. Readers that can not follow
+  // are only accepted once their writer has finished, the constructor
+  // throws std::ios_base::failure otherwise.
+  //
+  class Follower{
+  public:
+    Follower(FOM_mallocHook::ReaderBase* reader,unsigned int pollMs=200);
+    Follower()=delete;
+    Follower(const FOM_mallocHook::Follower&)=delete;
+    ~Follower();
+    // blocks until the trace changes or timeoutMs pass, false on timeout
+    bool wait(unsigned int timeoutMs);
+    size_t position()const{return m_next;};//next record to hand out
+    template<class F> size_t follow(F f,unsigned int idleMs=0){
+      size_t handed=0;
+      auto lastData=std::chrono::steady_clock::now();
+      while(true){
+	bool finished=m_reader->writerFinished();//before the refresh, which then sees every record
+	m_reader->refresh();
+	size_t end=m_reader->size();
+	if(m_next<end){
+	  auto c=m_reader->newCursor();
+	  while(m_next<end){
+	    const FOM_mallocHook::RecordIndex* recs=0;
+	    size_t n=c->span(m_next,end-m_next,&recs);
+	    for(size_t i=0;i<n;i++){
+	      m_next++;
+	      handed++;
+	      if(!f(recs[i]))return handed;
+	    }
+	  }
+	  lastData=std::chrono::steady_clock::now();
+	}
+	if(finished)return handed;
+	if(idleMs && (std::chrono::steady_clock::now()-lastData)>=std::chrono::milliseconds(idleMs))return handed;
+	wait(m_pollMs);
+      }
+    };
+  private:
+    FOM_mallocHook::ReaderBase* m_reader;
+    unsigned int m_pollMs;
+    int m_inotify;//-1 if not available
+    size_t m_next;
+  };
+
   //  Writers;
   
   class WriterBase{
@@ -318,15 +1041,57 @@ namespace FOM_mallocHook{
     virtual bool reopenFile(bool seekEnd=true)=0;
     virtual FOM_mallocHook::FileStats* getFileStats(){return m_stats;};
     virtual bool updateStats();
+    void setSyncPeriod(size_t nRecords){m_syncPeriod=nRecords;};//0 disables sync markers
+    // Splits the output into numbered segments <fileName>.NNNN, starting a
+    // new one after segmentSize bytes of records or segmentTime ns of trace
+    // time, whichever comes first (0 disables either). Each closed segment
+    // is listed in <fileName>.manifest. Must be called before any record is
+    // written.
+    bool setSegmentation(size_t segmentSize,uint64_t segmentTime);
+    bool rotate();
+    // Stores a binary chunk (symbols, module maps) as a special record. In
+    // compressed files it goes into an uncompressed bucket with no records.
+    virtual void writeChunk(char type,uint64_t addr,const void* payload,size_t len);
   protected:
     std::string m_fileName;
     size_t m_nRecords;
     size_t m_maxDepth;
     int m_fileHandle;
     bool m_fileOpened;
+    bool m_seekable;//false for pipes and sockets, their header is written once and never updated
     int m_compress;
     size_t m_bucketSize;
+    size_t m_syncPeriod;
+    uint64_t m_lastTStart,m_lastTEnd;
+    std::string m_baseName;
+    unsigned int m_segment;
+    size_t m_segmentSize;
+    uint64_t m_segmentTime;
+    size_t m_segmentBytes;
+    uint64_t m_segmentT0;
     FileStats* m_stats;
+    struct SyncRecord{
+      FOM_mallocHook::header h;
+      FOM_mallocHook::index_t maxDepth;
+    }__attribute__((packed));
+    void fillSyncMarker(SyncRecord& m,uint64_t fileOffset)const;
+    virtual void writeSyncMarker();
+    //bookkeeping after each record, emits sync markers and rotates segments
+    inline void recordWritten(const FOM_mallocHook::header* hdr){
+      if(m_nRecords==1)m_segmentT0=hdr->tstart;
+      m_lastTStart=hdr->tstart;
+      m_lastTEnd=hdr->tend;
+      if(m_syncPeriod && (m_nRecords%m_syncPeriod)==0)writeSyncMarker();
+      if(m_segmentSize||m_segmentTime){
+	m_segmentBytes+=sizeof(*hdr)+sizeof(FOM_mallocHook::index_t)*hdr->count;
+	if((m_segmentSize && m_segmentBytes>=m_segmentSize)||
+	   (m_segmentTime && (m_lastTStart-m_segmentT0)>=m_segmentTime))rotate();
+      }
+    }
+    virtual void segmentStarted(){};//resets writer specific per file state
+    void appendManifest();
+    std::string segmentName(unsigned int segment)const;
+    int createFile(uint64_t startTime,uint64_t startTimeUTC);
     time_t getProcessStartTime();
     bool parseCmdline(char* buff,size_t *len);
   };
@@ -343,6 +1108,85 @@ namespace FOM_mallocHook{
     bool reopenFile(bool seekEnd=true);
   };
 
+  //
+  // MmapWriter. Same output as PlainWriter but records are copied into a
+  // shared mapping of the output file which is grown in large windows, so
+  // there are no syscalls per record. The file is unmapped before fork and
+  // remapped by reopenFile() in the parent, at the end of the file, or
+  // with seekEnd=false truncated back to its header to start over.
+  //
+  class MmapWriter:public WriterBase{
+  public:
+    MmapWriter(std::string fileName,int compress,size_t bucketSize);
+    MmapWriter() = delete;
+    ~MmapWriter();
+    void writeRecord(const MemRecord& r);
+    void writeRecord(const RecordIndex& r);
+    void writeRecord(const void* hdr);
+    bool closeFile(bool flush=false);
+    bool reopenFile(bool seekEnd=true);
+    void writeChunk(char type,uint64_t addr,const void* payload,size_t len);
+  private:
+    void writeSyncMarker();
+    void append(const void* hdr,size_t hdrLen,const void* stacks,size_t stacksLen);
+    void mapWindow(size_t minLen);
+    void unmapWindow();
+    size_t m_windowSize;
+    size_t m_mapOffset;// file offset of the mapped window
+    size_t m_mapLen;
+    size_t m_writeOffset;// file offset of the next record
+    char* m_map;
+  };
+
+#ifdef IO_URING_FOUND
+  //
+  // UringWriter. Uncompressed output assembled in chunks that are written
+  // through io_uring, keeping up to queueDepth writes in flight. If the
+  // kernel refuses io_uring the same chunks are written with pwrite().
+  //
+  class UringWriter:public WriterBase{
+  public:
+    UringWriter(std::string fileName,int compress,size_t bucketSize,unsigned int queueDepth=8);
+    UringWriter() = delete;
+    ~UringWriter();
+    void writeRecord(const MemRecord& r);
+    void writeRecord(const RecordIndex& r);
+    void writeRecord(const void* hdr);
+    bool closeFile(bool flush=false);
+    bool reopenFile(bool seekEnd=true);
+    void writeChunk(char type,uint64_t addr,const void* payload,size_t len);
+    bool usingUring()const{return m_ringFd>=0;};
+  private:
+    struct Chunk{
+      char* buff;
+      size_t used;
+      uint64_t offset;//file offset once submitted
+      bool inFlight;
+    };
+    void writeSyncMarker();
+    void append(const void* hdr,size_t hdrLen,const void* stacks,size_t stacksLen);
+    void copyBytes(const char* src,size_t len);
+    void submitChunk();
+    void reapCompletions(unsigned int minComplete);
+    void writeChunkSync(Chunk& c,size_t done);
+    bool setupRing();
+    void teardownRing();
+    std::vector<Chunk> m_chunks;
+    size_t m_chunkSize;
+    size_t m_currChunk;
+    uint64_t m_fileOffset;// file offset of the current chunk
+    unsigned int m_depth;
+    unsigned int m_inFlight;
+    int m_ringFd;
+    void *m_sqRing,*m_cqRing;
+    size_t m_sqRingLen,m_cqRingLen,m_sqesLen;
+    struct io_uring_sqe *m_sqes;
+    struct io_uring_cqe *m_cqes;
+    unsigned *m_sqTail,*m_sqMask,*m_sqArray,*m_cqHead,*m_cqTail,*m_cqMask;
+    bool m_ringUnsupported;//the kernel rejected IORING_OP_WRITE, write directly
+  };
+#endif
+
 #ifdef ZLIB_FOUND
   class ZlibWriter:public WriterBase{
   public:
@@ -354,8 +1198,16 @@ namespace FOM_mallocHook{
     void writeRecord(const void* hdr);
     bool closeFile(bool flush=false);
     bool reopenFile(bool seekEnd=true);
+    void writeChunk(char type,uint64_t addr,const void* payload,size_t len);
+    // Trains a deflate dictionary of up to dictSize bytes (at most 32k) from
+    // the most frequent stacks of the first trainingBuckets buckets. It is
+    // stored once per file and preset for all later buckets. 0 disables
+    void setDictionary(size_t dictSize,unsigned int trainingBuckets=4);
   private:
     void compressBuffer();
+    void trainDictionary();
+    void writeSyncMarker(){};//buckets are the sync points of compressed files
+    void segmentStarted(){m_numBuckets=0;m_dictWritten=false;};
     size_t m_nRecordsInBuffer;
     size_t m_bucketOffset;
     size_t m_compBuffLen;
@@ -364,6 +1216,14 @@ namespace FOM_mallocHook{
     BucketStats m_bs;
     uint8_t *m_buff;
     uint8_t *m_cBuff;    
+    size_t m_dictSize;
+    unsigned int m_trainingBuckets;
+    std::vector<uint8_t> m_samples;
+    std::vector<uint8_t> m_dict;
+    uint32_t m_dictId;
+    bool m_dictWritten;
+    z_stream m_zs;
+    bool m_zsInit;
   };
 #endif
 
@@ -409,8 +1269,16 @@ namespace FOM_mallocHook{
   };
 #endif
     
+  //
+  // FileStats. Trace file header. Version 30000 and later use a fixed, packed
+  // layout followed by the command line, padded to a multiple of
+  // FileStats::HeaderAlign so that records start page aligned. The whole
+  // header is read and written with a single pread()/pwrite(). Older
+  // (20000, 20001) headers are still read and written in their own layout.
+  //
   class FileStats{
   public:
+    static const size_t HeaderAlign=4096;
     FileStats();
     ~FileStats();
     //getters
@@ -425,6 +1293,12 @@ namespace FOM_mallocHook{
     size_t   getBucketSize()const;
     size_t   getNumBuckets()const;
     size_t   getCompressionHeaderSize() const;
+    size_t   getHeaderSize()const;//offset of the first record
+    // true once the writer has closed the trace with closeFile(true) and
+    // written the final counts, also when it holds no records. Writers
+    // leave the record count at 0 until then, so traces without the flag
+    // (version 2000x, or written before it) count as closed by their count
+    bool     isClosed()const;
    
     //setters
     void setVersion(int);
@@ -438,9 +1312,16 @@ namespace FOM_mallocHook{
     void setBucketSize(size_t bsize);
     void setNumBuckets(size_t bsize);
     void setCompressionHeaderSize(size_t hdrSize);
+    void setClosed(bool closed);
 
+    //without keepOffset the file offset is left at the end of the header
     int read(int fd,bool keepOffset=true);
     int write(int fd,bool keepOffset=true)const;
+    // parses a header from memory, e.g. a mapped file. Returns the header size
+    size_t parse(const void* buff,size_t len);
+    // reads the header from a pipe or socket, consuming exactly its bytes.
+    // Returns the header size
+    size_t readStream(int fd);
     int read(std::istream &in);
     int write(std::ostream &out)const;
     std::ostream& print(std::ostream &out=std::cout)const;
@@ -460,7 +1341,12 @@ namespace FOM_mallocHook{
       uint64_t CompressionHeaderSize;
       size_t CmdLength; //length of command-line
       char* CmdLine;// commandline string
+      size_t HeaderSize;// size on disk, 0 until read from a file
+      uint32_t Flags;// FlagClosed
     } *m_hdr;
+    static const uint32_t FlagClosed=1;
+    size_t serialize(std::vector<char>& buff)const;
+    size_t requiredSize(const char* buff,size_t len)const;
   };
 }
 
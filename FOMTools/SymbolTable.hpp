@@ -0,0 +1,103 @@
+/*
+ *  Copyright (c) CERN 2015
+ *
+ *  Authors:
+ *      Nathalie Rauschmayr <nathalie.rauschmayr_ at _ cern _dot_ ch>
+ *      Sami Kama <sami.kama_ at _ cern _dot_ ch>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef __SYMBOL_TABLE_H
+#define __SYMBOL_TABLE_H
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "Streamers.hpp"
+
+namespace FOM_mallocHook{
+  //
+  // Payload of SymbolChunk and MapsChunk records. A ChunkTable is followed
+  // by nEntries entries and a pool of poolSize bytes with the NUL terminated
+  // names the entries point into.
+  //
+  struct ChunkTable{
+    uint32_t nEntries;
+    uint32_t poolSize;
+  }__attribute__((packed));
+
+  struct SymbolEntry{
+    uint64_t ip;
+    uint32_t nameOffset;
+    uint32_t nameLength;
+  }__attribute__((packed));
+
+  struct ModuleEntry{
+    uint64_t begin;
+    uint64_t end;
+    uint64_t offset;// file offset of the mapping
+    char perms[4];
+    uint32_t nameOffset;
+    uint32_t nameLength;
+  }__attribute__((packed));
+
+  //
+  // SymbolTable. Collects the symbol and module map chunks of a trace (plain,
+  // zlib or a segment manifest). The files stay mapped and all returned
+  // names point into the mapping, nothing is copied.
+  //
+  class SymbolTable{
+  public:
+    SymbolTable(const std::string& fileName);
+    SymbolTable()=delete;
+    SymbolTable(const SymbolTable&)=delete;
+    ~SymbolTable();
+    size_t size()const{return m_symbols.size();};
+    bool hasSymbol(index_t i)const{return i<m_symbols.size() && m_symbols[i].entry;};
+    uint64_t getIP(index_t i)const;
+    const char* getName(index_t i)const;//0 if symbol is unknown
+    size_t numMapSnapshots()const{return m_snapshots.size();};
+    uint64_t getSnapshotTime(size_t s)const{return m_snapshots.at(s).time;};
+    size_t numModules(size_t s)const{return m_snapshots.at(s).nEntries;};
+    const ModuleEntry& getModule(size_t s,size_t m)const;
+    const char* getModuleName(size_t s,size_t m)const;
+    // module containing ip, searching the newest snapshot first. 0 if none
+    const ModuleEntry* findModule(uint64_t ip,const char** name=0)const;
+
+    // payload builders used by the hook
+    static void encodeSymbols(std::vector<char>& out,const uint64_t* ips,const std::string* names,size_t n);
+    static void encodeMaps(std::vector<char>& out,const char* maps,size_t len);
+  private:
+    struct SymbolRef{
+      const SymbolEntry* entry;
+      const char* pool;
+    };
+    struct Snapshot{
+      const ModuleEntry* entries;
+      uint32_t nEntries;
+      const char* pool;
+      uint64_t time;
+    };
+    struct Mapping{
+      void* begin;
+      size_t length;
+    };
+    void addFile(const std::string& fileName);
+    void addChunk(const FOM_mallocHook::header* h,const char* fileEnd);
+    std::vector<Mapping> m_maps;
+    std::vector<SymbolRef> m_symbols;
+    std::vector<Snapshot> m_snapshots;
+  };
+}//end namespace
+#endif
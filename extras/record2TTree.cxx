@@ -124,7 +124,8 @@ size_t convert(const std::string inpName,const std::string output,
     addr   =r.getAddr();
     size   =r.getSize();
     alloc_type=r.getAllocType();
-    stacks =r.getStacks();
+    auto st=r.stacks();
+    stacks.assign(st.begin(),st.end());
     auto rmin=rdr->at(windowMin);
     int64_t tmin=TCorr-DHalf;
     uint64_t wlT0=rmin.getTStart();
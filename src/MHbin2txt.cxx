@@ -45,14 +45,20 @@ static double msecRes=1.0/1000000;
 
 void printUsage(char* name){
   std::cout<<"Usage:  "<<name<<" -i <input> -o <output> "<<std::endl;
-  std::cout<<"     --input  (-i)  name of a file that is created by mallochook"<<std::endl;
+  std::cout<<"     --input  (-i)  name of a file that is created by mallochook, or the .manifest of a segmented output."<<std::endl;
+  std::cout<<"                    FIFOs, sockets and - (stdin) are read as a stream while they are written"<<std::endl;
   std::cout<<"     --output (-o)  output file name"<<std::endl;
+  std::cout<<"     --follow (-f)  keep converting records appended to a trace that is still being written"<<std::endl;
+  std::cout<<"                    until its writer closes it"<<std::endl;
+  std::cout<<"     --corrected (-c) write times with the hook overhead of all earlier records taken off"<<std::endl;
 }
 
 int main(int argc,char* argv[]){
   std::string inpName("");
   std::string outName("");
   struct stat sinp;
+  bool follow=false;
+  bool corrected=false;
   int c;
   while (1) {
     int option_index = 0;
@@ -60,9 +66,11 @@ int main(int argc,char* argv[]){
       {"help", 0, 0, 'h'},
       {"input", 1, 0, 'i'},
       {"output", 1, 0, 'o'},
+      {"follow", 0, 0, 'f'},
+      {"corrected", 0, 0, 'c'},
       {0, 0, 0, 0}
     };
-    c = getopt_long(argc, argv, "hi:o:",
+    c = getopt_long(argc, argv, "hi:o:fc",
 		    long_options, &option_index);
     if (c == -1)
       break;
@@ -79,6 +87,14 @@ int main(int argc,char* argv[]){
       outName=std::string(optarg);
       break;
     }
+    case 'f':  {
+      follow=true;
+      break;
+    }
+    case 'c':  {
+      corrected=true;
+      break;
+    }
     default:
       printf("unknown parameter! getopt returned character code 0%o ??\n", c);
     }
@@ -106,7 +122,7 @@ int main(int argc,char* argv[]){
     // std::cout<<"Output file name is needed"<<std::endl;
     // printUsage(argv[0]);
     // exit(EXIT_FAILURE);
-    outName=inpName+".txt";
+    outName=(inpName=="-"?std::string("stdin"):inpName)+".txt";
     std::cout<<"Using outputfile "<<outName<<std::endl;
   }
 
@@ -123,98 +139,125 @@ int main(int argc,char* argv[]){
   size_t totBytes=0;
   struct timespec tstart,tend;
   struct stat st;
-  if(lstat(inpName.c_str(),&st)){
-    std::cerr<<"Can't stat input file \""<<inpName<<"\". Check that file exists and readeable"<<std::endl;
+  bool streaming=(inpName=="-");
+  if(!streaming){
+    if(stat(inpName.c_str(),&st)){
+      std::cerr<<"Can't stat input file \""<<inpName<<"\". Check that file exists and readeable"<<std::endl;
+    }else if(S_ISFIFO(st.st_mode)||S_ISSOCK(st.st_mode)){
+      streaming=true;
+    }
   }
-  int inpFile=open(inpName.c_str(),O_RDONLY);
-  auto fs=new FOM_mallocHook::FileStats();
-  fs->read(inpFile,false);
-  close(inpFile);
   FOM_mallocHook::ReaderBase* r=0;
-  int compressionMode=((fs->getCompression())/10000000); //higher 8 bits for compression mode
-  switch(compressionMode){
-  case(0):
-    {
-      if(fs->getNumRecords()>500000000){//4G
-	unsigned int indexSize=(fs->getNumRecords()+499999999)/500000000;
+  FOM_mallocHook::StreamReader* sr=0;
+  const std::string manifestSuffix(".manifest");
+  if(streaming){
+    try{
+      sr=new FOM_mallocHook::StreamReader(inpName);
+      r=sr;
+    }catch(const std::exception &ex){
+      fprintf(stderr,"Caught exception %s\n",ex.what());
+      exit(EXIT_FAILURE);
+    }
+  }else if(inpName.size()>manifestSuffix.size() &&
+     inpName.compare(inpName.size()-manifestSuffix.size(),manifestSuffix.size(),manifestSuffix)==0){
+    try{
+      r=new FOM_mallocHook::SegmentedReader(inpName);
+    }catch(const std::exception &ex){
+      fprintf(stderr,"Caught exception %s\n",ex.what());
+      exit(EXIT_FAILURE);
+    }
+  }else{
+    int inpFile=open(inpName.c_str(),O_RDONLY);
+    auto fs=new FOM_mallocHook::FileStats();
+    fs->read(inpFile,false);
+    close(inpFile);
+    int compressionMode=((fs->getCompression())/10000000); //higher 8 bits for compression mode
+    switch(compressionMode){
+    case(0):
+      {
+	//a full index costs 8 bytes/record, switch to the compressed one when
+	//that would take more than a quarter of the physical memory
+	uint64_t physMem=(uint64_t)sysconf(_SC_PHYS_PAGES)*sysconf(_SC_PAGESIZE);
+	if(fs->getNumRecords()*sizeof(uint64_t)>physMem/4){
+	  try{
+	    r=new FOM_mallocHook::CompactReader(inpName);
+	  }catch(const std::exception &ex){
+	    fprintf(stderr,"Caught exception %s\n",ex.what());
+	    exit(EXIT_FAILURE);
+	  }
+	}else{
+	  try{
+	    r=new FOM_mallocHook::Reader(inpName);
+	  }catch(const std::exception &ex){
+	    fprintf(stderr,"Caught exception %s\n",ex.what());
+	    exit(EXIT_FAILURE);
+	  }
+	}
+	break;
+      }
+#ifdef ZLIB_FOUND
+    case(_USE_ZLIB_COMPRESSION_):
+      {
 	try{
-	  r=new FOM_mallocHook::IndexingReader(inpName,indexSize);
+	  r=new FOM_mallocHook::ZlibReader(inpName);
 	}catch(const std::exception &ex){
 	  fprintf(stderr,"Caught exception %s\n",ex.what());
 	  exit(EXIT_FAILURE);
 	}
-      }else{
+	break;
+      }
+#endif
+#ifdef BZip2_FOUND    
+    case(_USE_BZLIB_COMPRESSION_):
+      {
 	try{
-	  r=new FOM_mallocHook::Reader(inpName);
+	  r=new FOM_mallocHook::BZip2Writer(inpName);
 	}catch(const std::exception &ex){
 	  fprintf(stderr,"Caught exception %s\n",ex.what());
 	  exit(EXIT_FAILURE);
 	}
+	break;
       }
-      break;
-    }
-#ifdef ZLIB_FOUND
-  case(_USE_ZLIB_COMPRESSION_):
-    {
-      try{
-	r=new FOM_mallocHook::ZlibReader(inpName);
-      }catch(const std::exception &ex){
-	fprintf(stderr,"Caught exception %s\n",ex.what());
-	exit(EXIT_FAILURE);
-      }
-      break;
-    }
-#endif
-#ifdef BZip2_FOUND    
-  case(_USE_BZLIB_COMPRESSION_):
-    {
-      try{
-	r=new FOM_mallocHook::BZip2Writer(inpName);
-      }catch(const std::exception &ex){
-	fprintf(stderr,"Caught exception %s\n",ex.what());
-	exit(EXIT_FAILURE);
-      }
-      break;
-    }
 #endif
 
 #ifdef LibLZMA_FOUND    
-  case(_USE_LZMA_COMPRESSION_):
-    {
-      try{
-	r=new FOM_mallocHook::LZMAWriter(inpName);
-      }catch(const std::exception &ex){
-	fprintf(stderr,"Caught exception %s\n",ex.what());
-	exit(EXIT_FAILURE);
+    case(_USE_LZMA_COMPRESSION_):
+      {
+	try{
+	  r=new FOM_mallocHook::LZMAWriter(inpName);
+	}catch(const std::exception &ex){
+	  fprintf(stderr,"Caught exception %s\n",ex.what());
+	  exit(EXIT_FAILURE);
+	}
+	break;
       }
-      break;
-    }
 #endif
- default:
-   {
-     try{
-       r=new FOM_mallocHook::Reader(inpName);   
-     }catch(const std::exception &ex){
-       fprintf(stderr,"Caught exception %s\n",ex.what());
-       exit(EXIT_FAILURE);
+   default:
+     {
+       try{
+	 r=new FOM_mallocHook::Reader(inpName);   
+       }catch(const std::exception &ex){
+	 fprintf(stderr,"Caught exception %s\n",ex.what());
+	 exit(EXIT_FAILURE);
+       }
+       break;
      }
-     break;
-   }
+    }
+
   }
-  
-  size_t nRecords=r->size();
-  printf("Starting conversion of %ld records\n",nRecords);
-  for(size_t t=0;t<nRecords;t++){
-    auto memRec=r->at(t);
+
+  uint64_t overhead=0;//of the records converted so far, records come in order
+  auto convert=[&](const FOM_mallocHook::RecordIndex& memRec){
     auto hdr=memRec.getHeader();
     buffPos+=snprintf(buff+buffPos,maxBuf-buffPos,
 		      "%lu %u 0x%lx %lu %lu %lu",
-		      hdr->tstart,
+		      hdr->tstart-overhead,
 		      hdr->allocType,
 		      hdr->addr, 
 		      hdr->size, 
-		      hdr->treturn,
-		      hdr->tend);
+		      hdr->treturn-overhead,
+		      hdr->tend-overhead);
+    if(corrected)overhead+=FOM_mallocHook::OverheadIndex::overhead(memRec);
     size_t nStacks=0;
     auto stIds=memRec.getStacks(&nStacks);
     for(int i=0;i<nStacks;i++){
@@ -232,6 +275,25 @@ int main(int argc,char* argv[]){
     totBytes+=writtenBytes;
     buffPos=0;
     nrecords++;
+  };
+  if(sr){
+    printf("Starting conversion of %s\n",inpName.c_str());
+    sr->forEach(convert);
+  }else if(follow){
+    printf("Following %s\n",inpName.c_str());
+    try{
+      FOM_mallocHook::Follower fl(r);
+      fl.follow([&convert](const FOM_mallocHook::RecordIndex& ri)->bool{convert(ri);return true;});
+    }catch(const std::exception &ex){
+      fprintf(stderr,"Caught exception %s\n",ex.what());
+      exit(EXIT_FAILURE);
+    }
+  }else{
+    size_t nRecords=r->size();
+    printf("Starting conversion of %ld records\n",nRecords);
+    for(size_t t=0;t<nRecords;t++){
+      convert(r->at(t));
+    }
   }
   clock_gettime(CLOCK_MONOTONIC,&tend);
   delete r;
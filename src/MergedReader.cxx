@@ -0,0 +1,304 @@
+/*
+ *  Copyright (c) CERN 2015
+ *
+ *  Authors:
+ *      Nathalie Rauschmayr <nathalie.rauschmayr_ at _ cern _dot_ ch>
+ *      Sami Kama <sami.kama_ at _ cern _dot_ ch>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "FOMTools/MergedReader.hpp"
+#include <cstring>
+#include <cstdio>
+#include <ios>
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+#include <map>
+#include <limits>
+
+FOM_mallocHook::MergedReader::MergedReader(const std::vector<std::string>& fileNames,uint access):ReaderBase(fileNames.empty()?std::string():fileNames.front(),access){
+  if(fileNames.empty())throw std::ios_base::failure("No files to merge");
+  if(fileNames.size()>std::numeric_limits<uint16_t>::max()){
+    throw std::length_error("Too many files to merge");
+  }
+  m_sources.resize(fileNames.size());
+  for(size_t s=0;s<fileNames.size();s++){
+    auto& src=m_sources[s];
+    src.fileName=fileNames[s];
+    src.reader.reset(FOM_mallocHook::openReader(src.fileName,access));
+    auto fs=src.reader->getFileStats();
+    src.pid=(fs?fs->getPid():0);
+    try{
+      src.symbols.reset(new FOM_mallocHook::SymbolTable(src.fileName));
+      if(src.symbols->size()==0)src.symbols.reset();
+    }catch(const std::exception& ex){
+      std::cerr<<"No symbols from \""<<src.fileName<<"\": "<<ex.what()<<std::endl;
+    }
+  }
+  merge();
+  m_fileStats=new FOM_mallocHook::FileStats();
+  uint64_t startTime=std::numeric_limits<uint64_t>::max();
+  for(const auto& src:m_sources){
+    auto fs=src.reader->getFileStats();
+    if(fs)startTime=std::min(startTime,fs->getStartTime());
+  }
+  m_fileStats->setNumRecords(m_order.size());
+  m_fileStats->setStartTime(startTime);
+  m_fileStats->setPid(m_sources.front().pid);
+  m_cursor=newCursor();
+  std::cout<<"Merged "<<m_order.size()<<" records from "<<m_sources.size()<<" files, "
+	   <<m_frames.size()<<" distinct frames"<<std::endl;
+}
+
+FOM_mallocHook::MergedReader::~MergedReader(){
+  m_cursor.reset();
+  delete m_fileStats;
+  m_fileStats=0;
+}
+
+namespace{
+  struct Head{
+    uint64_t t;
+    uint32_t s;
+  };
+  // heap order, earliest on top. Ties go to the lower source
+  inline bool later(const Head& a,const Head& b){
+    return (a.t>b.t)||((a.t==b.t)&&(a.s>b.s));
+  }
+}
+
+// k-way merge by start time. A source keeps going without touching the
+// heap as long as its next record is not later than the top of the heap,
+// so sources that do not overlap in time cost no heap operations. Zlib
+// sources get their compression time added back, a bucket at a time, so
+// that all sources are compared on the clock they were recorded with
+void FOM_mallocHook::MergedReader::merge(){
+  size_t k=m_sources.size();
+  std::vector<std::unique_ptr<FOM_mallocHook::Cursor> > cursors(k);
+  std::vector<const FOM_mallocHook::RecordIndex*> recs(k,0);
+  std::vector<size_t> wFirst(k,0),wN(k,0),pos(k,0),nRec(k,0);
+  std::vector<FOM_mallocHook::index_t> nFrames(k,0);
+  std::vector<uint64_t> tOffset(k,0);
+  std::vector<size_t> tOffsetLast(k,std::numeric_limits<size_t>::max());
+#ifdef ZLIB_FOUND
+  std::vector<const FOM_mallocHook::ZlibReader*> zlib(k,0);
+#endif
+  auto recordedStart=[&](size_t s)->uint64_t{
+#ifdef ZLIB_FOUND
+    if(zlib[s] && (pos[s]>tOffsetLast[s] || pos[s]==0)){
+      tOffset[s]=zlib[s]->getTimeOffset(pos[s],&tOffsetLast[s]);
+    }
+#endif
+    return recs[s][pos[s]-wFirst[s]].getTStart()+tOffset[s];
+  };
+  std::vector<Head> heap;
+  size_t total=0;
+  for(size_t s=0;s<k;s++){
+    nRec[s]=m_sources[s].reader->size();
+    total+=nRec[s];
+    if(nRec[s]==0)continue;
+#ifdef ZLIB_FOUND
+    zlib[s]=dynamic_cast<const FOM_mallocHook::ZlibReader*>(m_sources[s].reader.get());
+#endif
+    cursors[s]=m_sources[s].reader->newCursor();
+    wN[s]=cursors[s]->span(0,nRec[s],&recs[s]);
+    heap.push_back(Head{recordedStart(s),(uint32_t)s});
+  }
+  m_order.reserve(total);
+  m_checkpoints.reserve((total/CheckpointPeriod+1)*k);
+  std::make_heap(heap.begin(),heap.end(),later);
+  while(!heap.empty()){
+    std::pop_heap(heap.begin(),heap.end(),later);
+    size_t s=heap.back().s;
+    heap.pop_back();
+    while(true){
+      if((m_order.size()%CheckpointPeriod)==0)m_checkpoints.insert(m_checkpoints.end(),pos.begin(),pos.end());
+      for(auto f:recs[s][pos[s]-wFirst[s]].stacks()){
+	if(f>=nFrames[s])nFrames[s]=f+1;
+      }
+      m_order.push_back(s);
+      pos[s]++;
+      if(pos[s]==nRec[s])break;
+      if(pos[s]==wFirst[s]+wN[s]){
+	wFirst[s]=pos[s];
+	wN[s]=cursors[s]->span(pos[s],nRec[s]-pos[s],&recs[s]);
+      }
+      Head n{recordedStart(s),(uint32_t)s};
+      if(!heap.empty() && later(n,heap.front())){
+	heap.push_back(n);
+	std::push_heap(heap.begin(),heap.end(),later);
+	break;
+      }
+    }
+  }
+  mapFrames(nFrames);
+}
+
+// frames with the same instruction pointer and name get the same merged
+// id, in the order they are first seen going through the sources
+void FOM_mallocHook::MergedReader::mapFrames(const std::vector<FOM_mallocHook::index_t>& nFrames){
+  bool haveSymbols=false;
+  for(const auto& src:m_sources)haveSymbols|=(bool)src.symbols;
+  if(!haveSymbols)return;
+  std::map<std::pair<uint64_t,std::string>,FOM_mallocHook::index_t> known;
+  for(size_t s=0;s<m_sources.size();s++){
+    auto& src=m_sources[s];
+    const FOM_mallocHook::SymbolTable* sym=src.symbols.get();
+    size_t n=std::max((size_t)nFrames[s],(sym?sym->size():0));
+    src.frames.resize(n);
+    for(size_t id=0;id<n;id++){
+      if(m_frames.size()>=std::numeric_limits<FOM_mallocHook::index_t>::max()){
+	throw std::length_error("Too many distinct frames to merge");
+      }
+      if(sym && sym->hasSymbol(id)){
+	const char* name=sym->getName(id);
+	auto it=known.emplace(std::make_pair(sym->getIP(id),std::string(name?name:"")),m_frames.size());
+	if(it.second)m_frames.emplace_back(s,id);
+	src.frames[id]=it.first->second;
+      }else{
+	src.frames[id]=m_frames.size();
+	m_frames.emplace_back(s,id);
+      }
+    }
+  }
+}
+
+void FOM_mallocHook::MergedReader::mapFrames(size_t s,FOM_mallocHook::index_t* frames,size_t count)const{
+  const auto& m=m_sources.at(s).frames;
+  if(m.empty())return;
+  for(size_t i=0;i<count;i++){
+    if(frames[i]<m.size())frames[i]=m[frames[i]];
+  }
+}
+
+uint64_t FOM_mallocHook::MergedReader::getFrameIP(FOM_mallocHook::index_t f)const{
+  if(f>=m_frames.size())return 0;
+  const auto& sym=m_sources[m_frames[f].first].symbols;
+  return (sym && sym->hasSymbol(m_frames[f].second))?sym->getIP(m_frames[f].second):0;
+}
+
+const char* FOM_mallocHook::MergedReader::getFrameName(FOM_mallocHook::index_t f)const{
+  if(f>=m_frames.size())return 0;
+  const auto& sym=m_sources[m_frames[f].first].symbols;
+  return (sym && sym->hasSymbol(m_frames[f].second))?sym->getName(m_frames[f].second):0;
+}
+
+const FOM_mallocHook::RecordIndex FOM_mallocHook::MergedReader::at(size_t t){
+  return m_cursor->at(t);
+}
+
+FOM_mallocHook::FullRecord FOM_mallocHook::MergedReader::At(size_t t){
+  FOM_mallocHook::FullRecord r(m_cursor->at(t));
+  auto h=(FOM_mallocHook::header*)r.getBuffer();
+  mapFrames(m_order[t],(FOM_mallocHook::index_t*)(h+1),h->count);
+  return r;
+}
+
+size_t FOM_mallocHook::MergedReader::size(){
+  return m_order.size();
+}
+
+void FOM_mallocHook::MergedReader::setAccessPattern(uint access){
+  ReaderBase::setAccessPattern(access);
+  for(auto& src:m_sources)src.reader->setAccessPattern(access);
+}
+
+bool FOM_mallocHook::MergedReader::writerFinished(){
+  for(auto& src:m_sources){
+    if(!src.reader->writerFinished())return false;
+  }
+  return true;
+}
+
+// One cursor per source. Positions are found from the nearest checkpoint
+// and then followed along, so walking the records in order is constant
+// time per record. A span takes records from the current span of each
+// source and ends before it would have to move a source that already
+// contributed, its records would not stay valid otherwise
+class FOM_mallocHook::MergedReader::CursorImpl:public FOM_mallocHook::Cursor{
+public:
+  CursorImpl(const FOM_mallocHook::MergedReader* r):m_r(r),m_next(SIZE_MAX){
+    size_t k=r->m_sources.size();
+    for(const auto& src:r->m_sources)m_cursors.push_back(src.reader->newCursor());
+    m_pos.assign(k,0);
+    m_wRecs.assign(k,0);
+    m_wFirst.assign(k,0);
+    m_wN.assign(k,0);
+    m_used.assign(k,0);
+  };
+  const FOM_mallocHook::RecordIndex at(size_t t) override{
+    locate(t);
+    size_t s=m_r->m_order[t];
+    m_wN[s]=0;//the source cursor moves, its span is gone
+    auto rec=m_cursors[s]->at(m_pos[s]);
+    m_pos[s]++;
+    m_next=t+1;
+    return rec;
+  };
+  size_t size()const override{return m_r->m_order.size();};
+  size_t span(size_t first,size_t maxCount,const FOM_mallocHook::RecordIndex** recs) override{
+    *recs=m_batch;
+    if(maxCount==0)return 0;
+    locate(first);
+    size_t limit=std::min(std::min(maxCount,BatchSize),m_r->m_order.size()-first);
+    std::fill(m_used.begin(),m_used.end(),0);
+    size_t n=0;
+    while(n<limit){
+      size_t s=m_r->m_order[first+n];
+      size_t p=m_pos[s];
+      if((p<m_wFirst[s])||(p>=m_wFirst[s]+m_wN[s])){
+	if(m_used[s])break;
+	m_wFirst[s]=p;
+	m_wN[s]=m_cursors[s]->span(p,m_cursors[s]->size()-p,&m_wRecs[s]);
+      }
+      m_batch[n]=m_wRecs[s][p-m_wFirst[s]];
+      m_used[s]=1;
+      m_pos[s]++;
+      n++;
+    }
+    m_next=first+n;
+    return n;
+  };
+private:
+  // m_pos becomes the position in every source of merged record t
+  void locate(size_t t){
+    if(t==m_next)return;
+    if(t>=m_r->m_order.size()){
+      char bu[500];
+      snprintf(bu,500,"Asked for an index larger than number of records! t=%ld size=%ld",t,m_r->m_order.size());
+      throw std::out_of_range(bu);
+    }
+    size_t k=m_pos.size();
+    size_t c=t/CheckpointPeriod;
+    std::copy(m_r->m_checkpoints.begin()+c*k,m_r->m_checkpoints.begin()+(c+1)*k,m_pos.begin());
+    const uint16_t* o=m_r->m_order.data();
+    for(size_t i=c*CheckpointPeriod;i<t;i++)m_pos[o[i]]++;
+    m_next=t;
+  };
+  const FOM_mallocHook::MergedReader* m_r;
+  std::vector<std::unique_ptr<FOM_mallocHook::Cursor> > m_cursors;
+  std::vector<size_t> m_pos;//next record of each source
+  std::vector<const FOM_mallocHook::RecordIndex*> m_wRecs;//current span of each source
+  std::vector<size_t> m_wFirst;
+  std::vector<size_t> m_wN;
+  std::vector<char> m_used;//sources in the span being built
+  size_t m_next;//merged record m_pos is for
+  FOM_mallocHook::RecordIndex m_batch[BatchSize];
+};
+
+std::unique_ptr<FOM_mallocHook::Cursor> FOM_mallocHook::MergedReader::newCursor()const{
+  return std::unique_ptr<FOM_mallocHook::Cursor>(new CursorImpl(this));
+}
@@ -0,0 +1,54 @@
+/*
+ *  Copyright (c) CERN 2015
+ *
+ *  Authors:
+ *      Nathalie Rauschmayr <nathalie.rauschmayr_ at _ cern _dot_ ch>
+ *      Sami Kama <sami.kama_ at _ cern _dot_ ch>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef __ON_THREADS_H
+#define __ON_THREADS_H
+#include <string>
+#include <vector>
+#include <thread>
+#include <stdexcept>
+#include <ios>
+
+// Internal to FOMUtils, shared by the region index and finder and the
+// time and overhead indices of the readers.
+namespace FOM_mallocHook{
+  // runs f(k) for k in [0,n), on n-1 threads and the caller. Exceptions of
+  // f are collected and rethrown as one std::ios_base::failure after all
+  // threads are done, prefixed with what, also when n is 1
+  template<class F> void onThreads(unsigned int n,const char* what,F f){
+    std::vector<std::string> errors(n);
+    auto run=[&f,&errors](unsigned int k){
+      try{
+	f(k);
+      }catch(const std::exception& ex){
+	errors[k]=ex.what();
+      }
+    };
+    std::vector<std::thread> threads;
+    for(unsigned int k=1;k<n;k++)threads.emplace_back(run,k);
+    run(0);
+    for(auto &t:threads)t.join();
+    for(const auto &e:errors){
+      if(!e.empty())throw std::ios_base::failure(std::string(what)+": "+e);
+    }
+  }
+}//end namespace
+#endif
@@ -20,205 +20,231 @@
  */
 
 #include "FOMTools/RegionFinder.hpp"
+#include "FOMTools/RegionIndex.hpp"
+#include "FOMTools/OverlapKernel.hpp"
+#include "OnThreads.hpp"
+#include <algorithm>
+#include <queue>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <stdexcept>
+#include <ios>
 
-FOM_mallocHook::RegionFinder::RegionFinder(const std::string& fileName):m_rdr(0){
-  m_rdr=new FOM_mallocHook::Reader(fileName);
+namespace{
+  // overlap type of an index entry for ri, Undefined if the entry's time
+  // does not fit Mode. The index has done the page search already, so
+  // entries are classified one at a time as it hands them out
+  template<int Mode> inline uint8_t classify(const RegionInfo& ri,const FOM_mallocHook::RegionIndex::Entry& e){
+    if(!FOM_mallocHook::inTime<Mode>(e.tAlloc,e.tFree,ri.alloc_time))return FOM_mallocHook::MemRecord::Undefined;
+    return FOM_mallocHook::overlapOf(FOM_mallocHook::regionPage(ri.pBegin),FOM_mallocHook::regionPage(ri.pEnd),
+				     e.firstPage,e.lastPage);
+  }
+
+  // a record and its overlap type in one word, which sorts in record order
+  inline uint64_t hit(uint64_t record,uint8_t o){return (record<<3)|o;}
+
+  // Elements the sweep has passed the start but not the end of. Expired
+  // ones are dropped through a min-heap on their end and swapped out of
+  // the list, so that everything listed overlaps the sweep position
+  class ActiveSet{
+  public:
+    ActiveSet(size_t nIds):m_slot(nIds){};
+    void add(size_t id,uintptr_t end){
+      m_slot[id]=m_ids.size();
+      m_ids.push_back(id);
+      m_ends.push(std::make_pair(end,id));
+    };
+    void expire(uintptr_t p){//drops all ending before p
+      while(!m_ends.empty() && m_ends.top().first<p){
+	size_t id=m_ends.top().second;
+	m_ends.pop();
+	size_t s=m_slot[id];
+	m_ids[s]=m_ids.back();
+	m_slot[m_ids[s]]=s;
+	m_ids.pop_back();
+      }
+    };
+    bool empty()const{return m_ids.empty();};
+    const std::vector<size_t>& ids()const{return m_ids;};
+  private:
+    typedef std::pair<uintptr_t,size_t> End;
+    std::vector<size_t> m_slot;//position of each id in m_ids
+    std::vector<size_t> m_ids;
+    std::priority_queue<End,std::vector<End>,std::greater<End>> m_ends;
+  };
+
+  // The query bodies, one instance per ALLOCTIME so that the mode is
+  // picked once per query rather than for every entry.
+
+  // hits of the entries overlapping ri, unsorted
+  template<int Mode> void findHits(const FOM_mallocHook::RegionIndex& idx,const RegionInfo& ri,std::vector<uint64_t>& hits){
+    //overlapOf() also counts the records a region starts in when pEnd<pBegin
+    idx.overlapping(ri.pBegin,std::max(ri.pBegin,ri.pEnd),[&hits,&ri](const FOM_mallocHook::RegionIndex::Entry& e){
+	uint8_t o=classify<Mode>(ri,e);
+	if(o)hits.push_back(hit(e.record,o));
+      });
+  }
+
+  // Sweep over the page axis, with the index entries already sorted by
+  // first page and the regions sorted by pBegin. Entries and regions stay
+  // active until the sweep passes their end, and every entry or region that
+  // starts pairs with everything active on the other side. Regions go first
+  // at equal starts, so each overlapping pair is seen exactly once. Fills
+  // the unsorted hits of every region.
+  template<int Mode> void sweepHits(const FOM_mallocHook::RegionIndex& idx,const std::vector<RegionInfo>& rVec,
+				    std::vector<std::vector<uint64_t>>& hits){
+    const FOM_mallocHook::RegionIndex::Entry* e=idx.entries();
+    size_t nEntries=idx.size();
+    size_t nSets=rVec.size();
+    std::vector<size_t> order(nSets);
+    for(size_t k=0;k<nSets;k++)order[k]=k;
+    std::sort(order.begin(),order.end(),[&rVec](size_t a,size_t b)->bool{return rVec[a].pBegin<rVec[b].pBegin;});
+    ActiveSet entries(nEntries),regions(nSets);
+    size_t i=0,j=0;
+    while(j<nSets || (i<nEntries && !regions.empty())){
+      if(j<nSets && (i==nEntries || rVec[order[j]].pBegin<=e[i].firstPage)){
+	size_t k=order[j++];
+	const auto& ri=rVec[k];
+	entries.expire(ri.pBegin);
+	for(auto id:entries.ids()){
+	  uint8_t o=classify<Mode>(ri,e[id]);
+	  if(o)hits[k].push_back(hit(e[id].record,o));
+	}
+	regions.add(k,std::max(ri.pBegin,ri.pEnd));//see findHits()
+      }else{
+	const auto& en=e[i];
+	uintptr_t last=en.lastPage-1;//active while lastPage>pBegin
+	regions.expire(en.firstPage);
+	if(regions.empty() && (j==nSets || last<rVec[order[j]].pBegin)){
+	  i++;//over before the next region starts
+	  continue;
+	}
+	for(auto k:regions.ids()){
+	  uint8_t o=classify<Mode>(rVec[k],en);
+	  if(o)hits[k].push_back(hit(en.record,o));
+	}
+	entries.add(i++,last);
+      }
+    }
+  }
+}
+
+FOM_mallocHook::RegionFinder::RegionFinder(const std::string& fileName,bool useIndexFile,uint nThreads):m_rdr(0),m_ownReader(true),
+												     m_useIndexFile(useIndexFile),
+												     m_nThreads(nThreads){
+  m_rdr=FOM_mallocHook::openReader(fileName);
+  m_fileName=m_rdr->traceFile();
+  if(m_fileName.empty())m_useIndexFile=false;
+  if(m_nThreads==0)m_nThreads=std::max(1u,std::thread::hardware_concurrency());
 }
+
+FOM_mallocHook::RegionFinder::RegionFinder(FOM_mallocHook::ReaderBase* reader,bool useIndexFile,uint nThreads):m_rdr(reader),m_ownReader(false),
+													      m_useIndexFile(useIndexFile),
+													      m_nThreads(nThreads){
+  if(!m_rdr)throw std::ios_base::failure("RegionFinder needs a reader");
+  m_fileName=m_rdr->traceFile();
+  if(m_fileName.empty())m_useIndexFile=false;
+  if(m_nThreads==0)m_nThreads=std::max(1u,std::thread::hardware_concurrency());
+}
+
 FOM_mallocHook::RegionFinder::~RegionFinder(){
-  delete m_rdr;
+  m_cursors.clear();
+  if(m_ownReader)delete m_rdr;
+}
+
+const FOM_mallocHook::RegionIndex& FOM_mallocHook::RegionFinder::getIndex()const{
+  std::lock_guard<std::mutex> lk(m_mutex);
+  return index();
+}
+
+const FOM_mallocHook::RegionIndex& FOM_mallocHook::RegionFinder::index()const{
+  if(!m_index){
+    std::unique_ptr<FOM_mallocHook::RegionIndex> idx(new FOM_mallocHook::RegionIndex());
+    if(!m_useIndexFile || !idx->load(m_fileName,*m_rdr)){
+      idx->build(*m_rdr,m_nThreads);
+      if(m_useIndexFile)idx->store(m_fileName);
+    }
+    m_index.swap(idx);
+  }
+  return *m_index;
+}
+
+void FOM_mallocHook::RegionFinder::collect(const std::vector<Hit>& hits,size_t first,size_t last,
+					   std::vector<FOM_mallocHook::MemRecord>& out,uint k)const{
+  auto& cur=*m_cursors[k];
+  bool copy=!m_rdr->recordsPersist();
+  out.reserve(out.size()+last-first);
+  for(size_t i=first;i<last;i++){
+    auto mr=cur.at(hits[i]>>3);
+    if(copy)mr=m_copies[k].push_back(mr);
+    out.emplace_back(mr,(FOM_mallocHook::MemRecord::OVERLAP_TYPE)(hits[i]&7));
+  }
+}
+
+// Cursors are kept between queries, copies of the last query are dropped.
+// Returns how many threads to use for nRecords records.
+uint FOM_mallocHook::RegionFinder::prepare(size_t nRecords)const{
+  if(m_cursors.empty()){
+    m_copies.resize(m_nThreads);
+    for(uint k=0;k<m_nThreads;k++)m_cursors.push_back(m_rdr->newCursor());
+  }
+  for(auto& b:m_copies)b.clear();
+  return std::max((size_t)1,std::min((size_t)m_nThreads,nRecords/ParallelMin));
 }
 
 std::vector<FOM_mallocHook::MemRecord> FOM_mallocHook::RegionFinder::getAllocations(const RegionInfo &ri, FOM_mallocHook::RegionFinder::ALLOCTIME t)const{
   std::vector<FOM_mallocHook::MemRecord> regions;
-  regions.reserve(100);
-  size_t nRecords=m_rdr->size();
-  if(t==FOM_mallocHook::RegionFinder::ANYTIME){
-    for(size_t t=0;t<nRecords;t++){
-      const auto &mr=m_rdr->at(t);
-      auto ms=mr.getFirstPage();
-      auto me=mr.getLastPage();
-      if(ri.pBegin<me){ // rs<me
-	if(ri.pBegin>=ms){//rs>=ms there is overlap
-	  if(ri.pEnd<=me){//re<=me -> ms<=rs<re<=me ->superset Overlap
-	    regions.push_back(mr);
-	    regions.back().setOverlap(FOM_mallocHook::MemRecord::Superset);
-	  }else{// re>me -> ms<=rs<me<re ->underflow
-	    regions.push_back(mr);
-	    regions.back().setOverlap(FOM_mallocHook::MemRecord::Underflow); //isnt it Overflow?!
-	  }
-	}else{//rs<ms
-	  if(ri.pEnd>=me){ //re>me ->rs<ms<me<re -> subset overlap
-	    regions.push_back(mr);
-	    regions.back().setOverlap(FOM_mallocHook::MemRecord::Subset);  
-	  }else if(ri.pEnd>=ms){//re>ms -> rs<ms<re<me ->overflow overlap
-	    regions.push_back(mr);
-	    regions.back().setOverlap(FOM_mallocHook::MemRecord::Overflow); //underflow?!
-	  }//re<ms -> rs<re<ms<me -> no overlap
-	}
-      }//rs>me -> ms<me<rs<re ->no overlap
-      
-    }
-  } else if(t==FOM_mallocHook::RegionFinder::AFTER){
-    for(size_t t=0;t<nRecords;t++){
-      const auto &mr=m_rdr->at(t);
-      if(mr.getTStart()<ri.alloc_time){
-	continue;
-      }
-      auto ms=mr.getFirstPage();
-      auto me=mr.getLastPage();
-      if(ri.pBegin<me){ // rs<me
-	if(ri.pBegin>=ms){//rs>=ms there is overlap
-	  if(ri.pEnd<=me){//re<=me -> ms<=rs<re<=me ->superset Overlap
-	    regions.push_back(mr);
-	    regions.back().setOverlap(FOM_mallocHook::MemRecord::Superset);
-	  }else{// re>me -> ms<=rs<me<re ->underflow
-	    regions.push_back(mr);
-	    regions.back().setOverlap(FOM_mallocHook::MemRecord::Underflow); //isnt it Overflow?!
-	  }
-	}else{//rs<ms
-	  if(ri.pEnd>=me){ //re>me ->rs<ms<me<re -> subset overlap
-	    regions.push_back(mr);
-	    regions.back().setOverlap(FOM_mallocHook::MemRecord::Subset);  
-	  }else if(ri.pEnd>=ms){//re>ms -> rs<ms<re<me ->overflow overlap
-	    regions.push_back(mr);
-	    regions.back().setOverlap(FOM_mallocHook::MemRecord::Overflow); //underflow?!
-	  }//re<ms -> rs<re<ms<me -> no overlap
-	}
-      }//rs>me -> ms<me<rs<re ->no overlap
-      
-    }
-  }else{
-    for(size_t t=0;t<nRecords;t++){
-      const auto &mr=m_rdr->at(t);
-      if(mr.getTStart()>ri.alloc_time ){
-	continue;
-      }
-      auto ms=mr.getFirstPage();
-      auto me=mr.getLastPage();
-      if(ri.pBegin<me){ // rs<me
-	if(ri.pBegin>=ms){//rs>=ms there is overlap
-	  if(ri.pEnd<=me){//re<=me -> ms<=rs<re<=me ->superset Overlap
-	    regions.push_back(mr);
-	    regions.back().setOverlap(FOM_mallocHook::MemRecord::Superset);
-	  }else{// re>me -> ms<=rs<me<re ->underflow
-	    regions.push_back(mr);
-	    regions.back().setOverlap(FOM_mallocHook::MemRecord::Underflow); //isnt it Overflow?!
-	  }
-	}else{//rs<ms
-	  if(ri.pEnd>=me){ //re>me ->rs<ms<me<re -> subset overlap
-	    regions.push_back(mr);
-	    regions.back().setOverlap(FOM_mallocHook::MemRecord::Subset);  
-	  }else if(ri.pEnd>=ms){//re>ms -> rs<ms<re<me ->overflow overlap
-	    regions.push_back(mr);
-	    regions.back().setOverlap(FOM_mallocHook::MemRecord::Overflow); //underflow?!
-	  }//re<ms -> rs<re<ms<me -> no overlap
-	}
-      }//rs>me -> ms<me<rs<re ->no overlap
-    }
+  std::lock_guard<std::mutex> lk(m_mutex);
+  const auto& idx=index();
+  std::vector<Hit> hits;
+  switch(t){
+  case BEFORE:findHits<BEFORE>(idx,ri,hits);break;
+  case AFTER:findHits<AFTER>(idx,ri,hits);break;
+  case LIVE:findHits<LIVE>(idx,ri,hits);break;
+  default:findHits<ANYTIME>(idx,ri,hits);break;
+  }
+  std::sort(hits.begin(),hits.end());
+  size_t n=hits.size();
+  uint nThreads=prepare(n);
+  if(nThreads==1){
+    collect(hits,0,n,regions,0);
+    return regions;
   }
+  std::vector<std::vector<FOM_mallocHook::MemRecord>> parts(nThreads);
+  FOM_mallocHook::onThreads(nThreads,"Reading regions failed",[&](uint k){
+      collect(hits,n*k/nThreads,n*(k+1)/nThreads,parts[k],k);
+    });
+  regions.reserve(n);
+  for(const auto& p:parts)regions.insert(regions.end(),p.begin(),p.end());
   return regions;
 }
 
+// Hits are found by sweepHits(), then read by the threads
 std::vector<std::vector<FOM_mallocHook::MemRecord> > FOM_mallocHook::RegionFinder::getAllocationSets(const std::vector<RegionInfo> &rVec, FOM_mallocHook::RegionFinder::ALLOCTIME t)const{
   if(rVec.size()==0)return std::vector<std::vector<FOM_mallocHook::MemRecord>>();
-  std::vector<std::vector<FOM_mallocHook::MemRecord>> sregions(rVec.size());
-  for(auto &i:sregions)i.reserve(100); 
-  size_t nRecords=m_rdr->size();
+  std::lock_guard<std::mutex> lk(m_mutex);
+  const auto& idx=index();
   size_t nSets=rVec.size();
-  if(t==FOM_mallocHook::RegionFinder::ANYTIME){
-    for(size_t t=0;t<nRecords;t++){
-      const auto &mr=m_rdr->at(t);
-      auto ms=mr.getFirstPage();
-      auto me=mr.getLastPage();
-      for(size_t k=0;k<nSets;k++){
-	const auto &ri=rVec[k];
-	auto &regions=sregions[k];
-	if(ri.pBegin<me){ // rs<me
-	  if(ri.pBegin>=ms){//rs>=ms there is overlap
-	    if(ri.pEnd<=me){//re<=me -> ms<=rs<re<=me ->superset Overlap
-	      regions.push_back(mr);
-	      regions.back().setOverlap(FOM_mallocHook::MemRecord::Superset);
-	    }else{// re>me -> ms<=rs<me<re ->underflow
-	      regions.push_back(mr);
-	      regions.back().setOverlap(FOM_mallocHook::MemRecord::Underflow); //isnt it Overflow?!
-	    }
-	  }else{//rs<ms
-	    if(ri.pEnd>=me){ //re>me ->rs<ms<me<re -> subset overlap
-	      regions.push_back(mr);
-	      regions.back().setOverlap(FOM_mallocHook::MemRecord::Subset);  
-	    }else if(ri.pEnd>=ms){//re>ms -> rs<ms<re<me ->overflow overlap
-	      regions.push_back(mr);
-	      regions.back().setOverlap(FOM_mallocHook::MemRecord::Overflow); //underflow?!
-	    }//re<ms -> rs<re<ms<me -> no overlap
-	  }
-	}//rs>me -> ms<me<rs<re ->no overlap
-      }
-    }
-  } else if(t==FOM_mallocHook::RegionFinder::AFTER){
-    for(size_t t=0;t<nRecords;t++){
-      const auto &mr=m_rdr->at(t);
-      auto ms=mr.getFirstPage();
-      auto me=mr.getLastPage();
-      for(size_t k=0;k<nSets;k++){
-	const auto &ri=rVec[k];
-	auto &regions=sregions[k];
-	
-	if(mr.getTStart()<ri.alloc_time){
-	  continue;
-	}
-	if(ri.pBegin<me){ // rs<me
-	  if(ri.pBegin>=ms){//rs>=ms there is overlap
-	    if(ri.pEnd<=me){//re<=me -> ms<=rs<re<=me ->superset Overlap
-	      regions.push_back(mr);
-	      regions.back().setOverlap(FOM_mallocHook::MemRecord::Superset);
-	    }else{// re>me -> ms<=rs<me<re ->underflow
-	      regions.push_back(mr);
-	      regions.back().setOverlap(FOM_mallocHook::MemRecord::Underflow); //isnt it Overflow?!
-	    }
-	  }else{//rs<ms
-	    if(ri.pEnd>=me){ //re>me ->rs<ms<me<re -> subset overlap
-	      regions.push_back(mr);
-	      regions.back().setOverlap(FOM_mallocHook::MemRecord::Subset);  
-	    }else if(ri.pEnd>=ms){//re>ms -> rs<ms<re<me ->overflow overlap
-	      regions.push_back(mr);
-	      regions.back().setOverlap(FOM_mallocHook::MemRecord::Overflow); //underflow?!
-	    }//re<ms -> rs<re<ms<me -> no overlap
-	  }
-	}//rs>me -> ms<me<rs<re ->no overlap
-      }
-    }
-  }else{
-    for(size_t t=0;t<nRecords;t++){
-      const auto &mr=m_rdr->at(t);
-      auto ms=mr.getFirstPage();
-      auto me=mr.getLastPage();
-      for(size_t k=0;k<nSets;k++){
-	const auto &ri=rVec[k];
-	auto &regions=sregions[k];
-	if(mr.getTStart()>ri.alloc_time){
-	  continue;
-	}
-	if(ri.pBegin<me){ // rs<me
-	  if(ri.pBegin>=ms){//rs>=ms there is overlap
-	    if(ri.pEnd<=me){//re<=me -> ms<=rs<re<=me ->superset Overlap
-	      regions.push_back(mr);
-	      regions.back().setOverlap(FOM_mallocHook::MemRecord::Superset);
-	    }else{// re>me -> ms<=rs<me<re ->underflow
-	      regions.push_back(mr);
-	      regions.back().setOverlap(FOM_mallocHook::MemRecord::Underflow); //isnt it Overflow?!
-	    }
-	  }else{//rs<ms
-	    if(ri.pEnd>=me){ //re>me ->rs<ms<me<re -> subset overlap
-	      regions.push_back(mr);
-	      regions.back().setOverlap(FOM_mallocHook::MemRecord::Subset);  
-	    }else if(ri.pEnd>=ms){//re>ms -> rs<ms<re<me ->overflow overlap
-	      regions.push_back(mr);
-	      regions.back().setOverlap(FOM_mallocHook::MemRecord::Overflow); //underflow?!
-	    }//re<ms -> rs<re<ms<me -> no overlap
-	  }
-	}//rs>me -> ms<me<rs<re ->no overlap
-      }
-    }
+  std::vector<std::vector<Hit>> hits(nSets);
+  switch(t){
+  case BEFORE:sweepHits<BEFORE>(idx,rVec,hits);break;
+  case AFTER:sweepHits<AFTER>(idx,rVec,hits);break;
+  case LIVE:sweepHits<LIVE>(idx,rVec,hits);break;
+  default:sweepHits<ANYTIME>(idx,rVec,hits);break;
   }
-  return sregions;   
+  //regions are handed out to the threads one at a time
+  size_t total=0;
+  for(const auto& hs:hits)total+=hs.size();
+  uint nThreads=std::min((size_t)prepare(total),nSets);
+  std::vector<std::vector<FOM_mallocHook::MemRecord>> sregions(nSets);
+  std::atomic<size_t> next(0);
+  FOM_mallocHook::onThreads(nThreads,"Reading regions failed",[&](uint th){
+      for(size_t k=next++;k<nSets;k=next++){
+	auto& hs=hits[k];
+	std::sort(hs.begin(),hs.end());
+	collect(hs,0,hs.size(),sregions[k],th);
+      }
+    });
+  return sregions;
 }
@@ -0,0 +1,269 @@
+/*
+ *  Copyright (c) CERN 2015
+ *
+ *  Authors:
+ *      Nathalie Rauschmayr <nathalie.rauschmayr_ at _ cern _dot_ ch>
+ *      Sami Kama <sami.kama_ at _ cern _dot_ ch>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "FOMTools/RegionIndex.hpp"
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include "OnThreads.hpp"
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <iostream>
+#include <unordered_map>
+#include <thread>
+#include <functional>
+#include <stdexcept>
+#include <ios>
+
+namespace{
+  const char RegionKey[8]={'F','O','M','R','G','N','\0','\3'};
+  struct RegionHdr{
+    char key[8];
+    uint64_t traceSize;
+    int64_t traceMtimeSec;
+    int64_t traceMtimeNsec;
+    uint64_t nRecords;//of the reader it was built from
+    uint64_t nEntries;
+  }__attribute__((packed));
+}
+
+FOM_mallocHook::RegionIndex::RegionIndex():m_entries(0),m_nEntries(0),m_rootLevel(0),
+					   m_map(0),m_mapLength(0){
+}
+
+FOM_mallocHook::RegionIndex::~RegionIndex(){
+  unmap();
+}
+
+void FOM_mallocHook::RegionIndex::unmap(){
+  if(m_map)munmap(m_map,m_mapLength);
+  m_map=0;
+  m_mapLength=0;
+  m_entries=m_built.empty()?0:m_built.data();
+  m_nEntries=m_built.size();
+}
+
+namespace{
+  inline bool firstPageOrder(const FOM_mallocHook::RegionIndex::Entry& a,const FOM_mallocHook::RegionIndex::Entry& b){
+    return (a.firstPage<b.firstPage)||((a.firstPage==b.firstPage)&&(a.record<b.record));
+  }
+}
+
+// Each thread reads a range of records into the entries and sorts their
+// ids into one list per pairing thread, by hash of the address. Lifetimes
+// are then paired per address, each thread walking its lists of all
+// ranges in record order. Last the ranges are sorted by their threads and
+// merged pairwise.
+void FOM_mallocHook::RegionIndex::build(const FOM_mallocHook::ReaderBase& r,uint nThreads){
+  unmap();
+  auto c=r.newCursor();
+  size_t n=c->size();
+  m_built.clear();
+  m_built.resize(n);
+  if(nThreads==0)nThreads=std::max(1u,std::thread::hardware_concurrency());
+  nThreads=std::max((size_t)1,std::min((size_t)nThreads,n/1024));
+  std::vector<size_t> bounds(nThreads+1);
+  for(uint k=0;k<=nThreads;k++)bounds[k]=n*k/nThreads;
+  Entry* es=m_built.data();
+  typedef std::pair<uintptr_t,size_t> Use;//address and entry
+  std::vector<std::vector<std::vector<Use> > > uses(nThreads,std::vector<std::vector<Use> >(nThreads));//by range, then pairing thread
+  FOM_mallocHook::onThreads(nThreads,"Building region index failed",[&](uint k){
+      std::unique_ptr<FOM_mallocHook::Cursor> cur;
+      if(k==0){
+	cur.swap(c);
+      }else{
+	cur=r.newCursor();
+      }
+      auto& mine=uses[k];
+      std::hash<uintptr_t> h;
+      size_t i=bounds[k];
+      cur->forEach([&](const FOM_mallocHook::RecordIndex& ri){
+	  Entry& e=es[i];
+	  e.firstPage=ri.getFirstPage();
+	  e.lastPage=ri.getLastPage();
+	  e.tAlloc=ri.getTStart();
+	  e.tFree=(ri.getAllocType()==0)?e.tAlloc:UINT64_MAX;//frees never live
+	  e.record=i;
+	  uintptr_t a=ri.getAddr();
+	  if(a)mine[h(a>>4)%nThreads].emplace_back(a,i);
+	  i++;
+	},bounds[k],bounds[k+1]);
+    });
+  FOM_mallocHook::onThreads(nThreads,"Building region index failed",[&](uint p){
+      std::unordered_map<uintptr_t,size_t> live;//address -> entry of the allocation living there
+      for(uint k=0;k<nThreads;k++){
+	for(const auto& u:uses[k][p]){
+	  auto it=live.find(u.first);
+	  if(it!=live.end()){
+	    es[it->second].tFree=es[u.second].tAlloc;
+	    live.erase(it);
+	  }
+	  if(es[u.second].tFree==UINT64_MAX)live.emplace(u.first,u.second);
+	}
+	std::vector<Use>().swap(uses[k][p]);
+      }
+    });
+  FOM_mallocHook::onThreads(nThreads,"Building region index failed",[&](uint k){
+      std::sort(es+bounds[k],es+bounds[k+1],firstPageOrder);
+    });
+  for(uint w=1;w<nThreads;w*=2){
+    uint nMerges=(nThreads+2*w-1)/(2*w);
+    FOM_mallocHook::onThreads(nMerges,"Building region index failed",[&](uint m){
+	uint l=2*w*m;
+	uint mid=std::min(l+w,nThreads);
+	uint e=std::min(l+2*w,nThreads);
+	std::inplace_merge(es+bounds[l],es+bounds[mid],es+bounds[e],firstPageOrder);
+      });
+  }
+  m_entries=m_built.data();
+  m_nEntries=m_built.size();
+  link();
+}
+
+// Implicit interval tree over the sorted entries. Leaves are the even
+// entries, the node at level k is the entry whose lowest k bits are set
+// and the root is at 2^rootLevel-1. Nodes past the end of the array are
+// represented by the maximum of the last complete subtree. Only the inner
+// nodes get a maximum, recomputed after a load rather than stored.
+void FOM_mallocHook::RegionIndex::link(){
+  m_rootLevel=0;
+  m_maxLast.clear();
+  size_t n=m_nEntries;
+  if(n==0)return;
+  while(((size_t)2<<m_rootLevel)<=n)m_rootLevel++;
+  const Entry* a=m_entries;
+  m_maxLast.resize(n/2);
+  uintptr_t* m=m_maxLast.data();
+  auto maxLast=[a,m](size_t i)->uintptr_t{return (i&1)?m[i>>1]:a[i].lastPage;};
+  size_t lastI=0;
+  uintptr_t last=0;
+  for(size_t i=0;i<n;i+=2){
+    lastI=i;
+    last=a[i].lastPage;
+  }
+  for(int k=1;((size_t)1<<k)<=n;k++){
+    size_t x=(size_t)1<<(k-1);
+    size_t i0=(x<<1)-1;
+    size_t step=x<<2;
+    for(size_t i=i0;i<n;i+=step){
+      uintptr_t el=maxLast(i-x);
+      uintptr_t er=(i+x<n)?maxLast(i+x):last;
+      m[i>>1]=std::max(a[i].lastPage,std::max(el,er));
+    }
+    lastI=((lastI>>k)&1)?lastI-x:lastI+x;
+    if(lastI<n && maxLast(lastI)>last)last=maxLast(lastI);
+  }
+}
+
+// A missing, stale, truncated or corrupt index is not an error, the
+// caller just builds it again. Every record has an entry, so the index
+// has to have as many as the reader has records, all of them in range and
+// in first page order.
+bool FOM_mallocHook::RegionIndex::load(const std::string& traceName,FOM_mallocHook::ReaderBase& r){
+  struct stat st;
+  if(stat(traceName.c_str(),&st)==-1)return false;
+  std::string idxName=traceName+".fomrgn";
+  int fd=open(idxName.c_str(),O_RDONLY);
+  if(fd==-1)return false;
+  struct stat sidx;
+  if(fstat(fd,&sidx)==-1 || (size_t)sidx.st_size<sizeof(RegionHdr)){
+    close(fd);
+    return false;
+  }
+  void* m=mmap64(0,sidx.st_size,PROT_READ,MAP_SHARED,fd,0);
+  close(fd);
+  if(m==MAP_FAILED)return false;
+  auto rh=(const RegionHdr*)m;
+  if(::memcmp(rh->key,RegionKey,sizeof(RegionKey))!=0 ||
+     rh->traceSize!=(uint64_t)st.st_size ||
+     rh->traceMtimeSec!=(int64_t)st.st_mtim.tv_sec ||
+     rh->traceMtimeNsec!=(int64_t)st.st_mtim.tv_nsec ||
+     rh->nRecords!=r.size() || rh->nEntries!=rh->nRecords ||
+     sizeof(RegionHdr)+sizeof(Entry)*rh->nEntries!=(size_t)sidx.st_size){
+    munmap(m,sidx.st_size);
+    return false;
+  }
+  auto es=(const Entry*)(rh+1);
+  for(size_t i=0;i<rh->nEntries;i++){
+    if(es[i].record>=rh->nRecords || es[i].firstPage>es[i].lastPage ||
+       (i && es[i].firstPage<es[i-1].firstPage)){
+      std::cerr<<"Ignoring corrupt region index "<<idxName<<std::endl;
+      munmap(m,sidx.st_size);
+      return false;
+    }
+  }
+  m_built.clear();
+  m_built.shrink_to_fit();
+  unmap();
+  m_map=m;
+  m_mapLength=sidx.st_size;
+  m_entries=es;
+  m_nEntries=rh->nEntries;
+  link();
+  return true;
+}
+
+// Written under a temporary name and renamed, as the SidecarIndex
+bool FOM_mallocHook::RegionIndex::store(const std::string& traceName)const{
+  struct stat st;
+  if(stat(traceName.c_str(),&st)==-1)return false;
+  std::string idxName=traceName+".fomrgn";
+  char tmpName[20];
+  snprintf(tmpName,20,".%u",getpid());
+  std::string tmp=idxName+tmpName;
+  int fd=open(tmp.c_str(),O_WRONLY|O_CREAT|O_TRUNC,(S_IRWXU^S_IXUSR)|(S_IRWXG^S_IXGRP)|(S_IROTH));
+  if(fd==-1)return false;
+  RegionHdr rh;
+  ::memcpy(rh.key,RegionKey,sizeof(RegionKey));
+  rh.traceSize=st.st_size;
+  rh.traceMtimeSec=st.st_mtim.tv_sec;
+  rh.traceMtimeNsec=st.st_mtim.tv_nsec;
+  rh.nRecords=m_nEntries;//one entry per record
+  rh.nEntries=m_nEntries;
+  const struct iovec parts[2]={{&rh,sizeof(rh)},
+			       {(void*)m_entries,sizeof(Entry)*m_nEntries}};
+  bool ok=true;
+  for(const auto& p:parts){
+    const char* b=(const char*)p.iov_base;
+    size_t left=p.iov_len;
+    while(ok && left){
+      ssize_t w=::write(fd,b,left);
+      if(w<0){
+	if(errno==EINTR)continue;
+	ok=false;
+	break;
+      }
+      b+=w;
+      left-=w;
+    }
+  }
+  if(close(fd)!=0)ok=false;
+  if(ok && rename(tmp.c_str(),idxName.c_str())!=0)ok=false;
+  if(!ok){
+    unlink(tmp.c_str());
+    std::cerr<<"Could not write region index "<<idxName<<std::endl;
+  }
+  return ok;
+}
@@ -20,10 +20,12 @@
  */
 
 #include "FOMTools/Streamers.hpp"
+#include "OnThreads.hpp"
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <cstring>
 #include <ios>
@@ -34,27 +36,33 @@
 #include <chrono> //to get utc
 #include <ctime>
 #include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+#include <thread>
+#include <sys/inotify.h>
+#include <poll.h>
+#ifdef IO_URING_FOUND
+#include <sys/syscall.h>
+#endif
 
 #define handle_error(msg)				\
   do { perror(msg); exit(EXIT_FAILURE); } while (0)
 static const uintptr_t pageMask=(sysconf(_SC_PAGE_SIZE) - 1);
+// newer than some libc headers, older kernels reject them with EINVAL
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE 25
+#endif
 
-#define WRITES(F,X) if(::write(F,X,sizeof(X))!=sizeof(X)){char buff[2048]; \
-    throw std::ios_base::failure(std::string("Writing header failed with ")+ \
-				 std::string(strerror_r(errno,buff,2048)));} \
-  //std::cerr<<"Write "<<#X<<" = "<<X<<" sizeof="<<sizeof(X)<<" pid="<<getpid()<<" fd="<<fd<<" offs="<<::lseek64(fd,0,SEEK_CUR)<<std::endl;
 #define WRITE(F,X) if(::write(F,&(X),sizeof(X))!=sizeof(X)){char buff[2048]; \
   throw std::ios_base::failure(std::string("writing "#X)+std::string(" failed")+	\
 				 std::string(strerror_r(errno,buff,2048)));} \
   //std::cerr<<"Write "<<#X<<" = "<<X<<" sizeof="<<sizeof(X)<<" pid="<<getpid()<<" fd="<<fd<<" offs="<<::lseek64(fd,0,SEEK_CUR)<<std::endl;
-#define READS(F,X) if(::read(F, (X) , sizeof(X))<0){char buff[2048];	\
-    throw std::ios_base::failure(std::string("Parsing header failed ")+	\
-				 std::string(strerror_r(errno,buff,2048)));} \
-  //std::cerr<<"Read "<<#X<<" = "<<X<<" sizeof="<<sizeof(X)<<" pid="<<getpid()<<" fd="<<fd<<" offs="<<::lseek64(fd,0,SEEK_CUR)<<std::endl;
-#define READ(F,X) if(::read(F, &(X) , sizeof(X))<0){char buff[2048];	\
-    throw std::ios_base::failure(std::string("Parsing header failed ")+	\
-				 std::string(strerror_r(errno,buff,2048)));} \
-  //std::cerr<<"Read "<<#X<<" = "<<X<<" sizeof="<<sizeof(X)<<" pid="<<getpid()<<" fd="<<fd<<" offs="<<::lseek64(fd,0,SEEK_CUR)<<std::endl;
 
 
 FOM_mallocHook::MemRecord::MemRecord(void* r){
@@ -74,7 +82,7 @@ FOM_mallocHook::MemRecord::MemRecord(void* r){
   }
 }
 
-FOM_mallocHook::MemRecord::MemRecord(const RecordIndex& r){
+FOM_mallocHook::MemRecord::MemRecord(const RecordIndex& r,OVERLAP_TYPE o):m_overlap(o){
   auto hh=r.getHeader();
   m_h=*hh;
   m_stacks=(FOM_mallocHook::index_t*)(hh+1);
@@ -86,8 +94,6 @@ FOM_mallocHook::MemRecord::OVERLAP_TYPE FOM_mallocHook::MemRecord::getOverlap()c
 
 void FOM_mallocHook::MemRecord::setOverlap(FOM_mallocHook::MemRecord::OVERLAP_TYPE o){m_overlap=o;}
 
-FOM_mallocHook::MemRecord::~MemRecord(){};
-
 const FOM_mallocHook::header* const FOM_mallocHook::MemRecord::getHeader() const{
   return &m_h;
 }
@@ -132,18 +138,56 @@ size_t FOM_mallocHook::MemRecord::getSize() const{
 }
 
 std::vector<FOM_mallocHook::index_t> FOM_mallocHook::MemRecord::getStacks() const{
-  if((m_h.count==0)||(m_stacks==0)){
-    return std::vector<FOM_mallocHook::index_t>();
+  return stacks().toVector();
+}
+
+/*
+  ACCESS PATTERNS
+*/
+
+void FOM_mallocHook::adviseMapping(void* addr,size_t length,uint access){
+  if(!addr||!length)return;
+  if(access&FOM_mallocHook::ReaderBase::AccessRandom){//no read-around on faults
+    madvise(addr,length,MADV_RANDOM);
+  }else if(access&FOM_mallocHook::ReaderBase::AccessSequential){//aggressive read-ahead, start it now
+    madvise(addr,length,MADV_SEQUENTIAL);
+    madvise(addr,length,MADV_WILLNEED);
+  }else{
+    madvise(addr,length,MADV_NORMAL);
+  }
+  if(access&FOM_mallocHook::ReaderBase::AccessPopulate){
+    if(madvise(addr,length,MADV_POPULATE_READ)!=0){//before Linux 5.14, touch every page
+      volatile char sum=0;
+      for(size_t o=0;o<length;o+=pageMask+1)sum+=((const char*)addr)[o];
+    }
   }
-  return std::vector<FOM_mallocHook::index_t> (m_stacks,m_stacks+m_h.count);
+}
+
+void FOM_mallocHook::adviseHugePages(const void* p,size_t bytes){
+  const uintptr_t hugeMask=(2ul<<20)-1;
+  uintptr_t b=((uintptr_t)p+hugeMask)&(~hugeMask);
+  uintptr_t e=((uintptr_t)p+bytes)&(~hugeMask);
+  if(e<=b)return;
+  madvise((void*)b,e-b,MADV_HUGEPAGE);
+  madvise((void*)b,e-b,MADV_COLLAPSE);//already filled, collapse now rather than when khugepaged gets to it
+}
+
+// maps a trace read only. MAP_POPULATE saves the separate populate pass
+static void* mapTrace(int fd,size_t length,uint access){
+  int flags=MAP_PRIVATE;
+  if(access&FOM_mallocHook::ReaderBase::AccessPopulate)flags|=MAP_POPULATE;
+  void* m=mmap64(0,length,PROT_READ,flags,fd,0);
+  if(m!=MAP_FAILED)FOM_mallocHook::adviseMapping(m,length,access&(~FOM_mallocHook::ReaderBase::AccessPopulate));
+  return m;
 }
 
 /* READER CLASS
  */
 
-FOM_mallocHook::Reader::Reader(std::string fileName):ReaderBase(fileName),m_fileHandle(-1),
-						     m_fileLength(0),m_fileName(fileName),
-						     m_fileBegin(0),m_fileStats(0),m_fileOpened(false)
+FOM_mallocHook::Reader::Reader(std::string fileName,bool useIndexFile,uint access):ReaderBase(fileName,access),m_fileHandle(-1),
+								      m_fileLength(0),m_fileName(fileName),
+								      m_fileBegin(0),m_records(0),m_numRecords(0),
+								      m_index(0),m_fileOpened(false),m_scanEnd(0)
 {
   if(m_fileName.empty())throw std::ios_base::failure("File name is empty");
   int inpFile=open(m_fileName.c_str(),O_RDONLY);
@@ -165,27 +209,44 @@ FOM_mallocHook::Reader::Reader(std::string fileName):ReaderBase(fileName),m_file
   m_fileOpened=true;
   //size_t nrecords=0;
   char buff[2050];
-  m_fileStats=new FOM_mallocHook::FileStats();
-  //std::cout << m_fileStats << " " << m_fileHandle << std::endl;
-  m_fileStats->read(m_fileHandle,false);
-  off_t hdrOff=::lseek64(m_fileHandle,0,SEEK_CUR);
-  ::lseek64(m_fileHandle,0,SEEK_SET);
-  m_fileBegin=mmap64(0,sinp.st_size,PROT_READ,MAP_PRIVATE,inpFile,0);
+  m_fileBegin=mapTrace(inpFile,sinp.st_size,m_access);
   if(m_fileBegin==MAP_FAILED){
     throw std::ios_base::failure(std::string(strerror_r(errno,buff,2048))+"failed to mmap "+m_fileName);        
   }
+  m_fileStats=new FOM_mallocHook::FileStats();
+  off_t hdrOff=m_fileStats->parse(m_fileBegin,sinp.st_size);
   std::cout<<"Starting to scan the file. File should contain "<<
     m_fileStats->getNumRecords()<<" entries"<<std::endl;
-
-  void* fileEnd=(char*)m_fileBegin+sinp.st_size;
-  FOM_mallocHook::header *h=(FOM_mallocHook::header*)(((uintptr_t)m_fileBegin)+hdrOff);
-  m_records.reserve(m_fileStats->getNumRecords());
-  while ((void*)h<fileEnd){
-    m_records.emplace_back(h);
-    //const auto hdr=m_records.back().getHeader();
-    h=(FOM_mallocHook::header*)(((FOM_mallocHook::index_t*)(h+1))+h->count);
+  m_scanEnd=sinp.st_size;
+  if(m_fileStats->getNumRecords()==0){
+    //still being written (or the writer died), the tail may hold a partial
+    //record. Index up to the last sync marker in parallel, walk the rest
+    auto sm=FOM_mallocHook::findLastSyncMarker(m_fileBegin,(const char*)m_fileBegin+hdrOff,
+						(const char*)m_fileBegin+sinp.st_size);
+    m_scanEnd=(sm?(const char*)sm-(const char*)m_fileBegin:hdrOff);
+    FOM_mallocHook::indexRecords(m_fileBegin,hdrOff,m_scanEnd,1,m_offsets);
+    m_records=m_offsets.data();
+    m_numRecords=m_offsets.size();
+    appendRecords();
+    std::cout<<"Found "<<m_numRecords<<" records in an unfinished file"<<std::endl;
+    return;
+  }
+  if(useIndexFile){
+    m_index=new FOM_mallocHook::SidecarIndex(m_fileName);
+    if(m_index->load(sinp)){
+      m_index->advise(m_access);
+      m_records=m_index->records();
+      m_numRecords=m_index->numRecords();
+      std::cout<<"Found "<<m_numRecords<<" records in "<<m_index->getIndexName()<<std::endl;
+      return;
+    }
   }
-  std::cout<<"Found "<<m_records.size()<<" records"<<std::endl;
+  FOM_mallocHook::indexRecords(m_fileBegin,hdrOff,sinp.st_size,1,m_offsets);
+  if(m_access&AccessHugePages)FOM_mallocHook::adviseHugePages(m_offsets.data(),m_offsets.size()*sizeof(uint64_t));
+  m_records=m_offsets.data();
+  m_numRecords=m_offsets.size();
+  std::cout<<"Found "<<m_numRecords<<" records"<<std::endl;
+  if(m_index)m_index->store(sinp,m_records,m_numRecords,0,0,0,0);
 }
 
 // const FOM_mallocHook::FileStats* FOM_mallocHook::Reader::getFileStats()const{
@@ -196,17 +257,219 @@ FOM_mallocHook::Reader::~Reader(){
   if(m_fileOpened){
     munmap(m_fileBegin,m_fileLength);
     close(m_fileHandle);
-    m_records.clear();
   }
+  delete m_index;
+  delete m_fileStats;
+}
+
+void FOM_mallocHook::Reader::setAccessPattern(uint access){
+  ReaderBase::setAccessPattern(access);
+  FOM_mallocHook::adviseMapping(m_fileBegin,m_fileLength,access);
+  if(m_index)m_index->advise(access);
+  if(access&AccessHugePages)FOM_mallocHook::adviseHugePages(m_offsets.data(),m_offsets.size()*sizeof(uint64_t));
 }
 
 FOM_mallocHook::FullRecord FOM_mallocHook::Reader::At(size_t t){
   return FOM_mallocHook::FullRecord(at(t));
 }
 
-const FOM_mallocHook::RecordIndex FOM_mallocHook::Reader::at(size_t t){return m_records.at(t);}
+const FOM_mallocHook::RecordIndex FOM_mallocHook::Reader::at(size_t t){
+  return record(t);
+}
+
+const FOM_mallocHook::RecordIndex FOM_mallocHook::Reader::record(size_t t)const{
+  if(t>=m_numRecords){
+    char bu[500];
+    snprintf(bu,500,"Asked for an index larger than number of records! t=%ld size=%ld",t,m_numRecords);
+    throw std::out_of_range(bu);
+  }
+  return FOM_mallocHook::RecordIndex((const FOM_mallocHook::header*)((const char*)m_fileBegin+m_records[t]));
+}
  
-size_t FOM_mallocHook::Reader::size(){return m_records.size();}
+size_t FOM_mallocHook::Reader::size(){return m_numRecords;}
+
+// records are located from the offsets alone, nothing to keep per thread
+class FOM_mallocHook::Reader::CursorImpl:public FOM_mallocHook::Cursor{
+public:
+  CursorImpl(const FOM_mallocHook::Reader* r):m_r(r){};
+  const FOM_mallocHook::RecordIndex at(size_t t) override{return m_r->record(t);};
+  size_t size()const override{return m_r->m_numRecords;};
+  size_t span(size_t first,size_t maxCount,const FOM_mallocHook::RecordIndex** recs) override{
+    *recs=m_batch;
+    if(maxCount==0)return 0;
+    m_batch[0]=m_r->record(first);
+    size_t n=std::min(std::min(maxCount,BatchSize),m_r->m_numRecords-first);
+    const char* b=(const char*)m_r->m_fileBegin;
+    const uint64_t* o=m_r->m_records+first;
+    for(size_t i=1;i<n;i++)m_batch[i]=FOM_mallocHook::RecordIndex((const FOM_mallocHook::header*)(b+o[i]));
+    return n;
+  };
+private:
+  const FOM_mallocHook::Reader* m_r;
+  FOM_mallocHook::RecordIndex m_batch[BatchSize];
+};
+
+std::unique_ptr<FOM_mallocHook::Cursor> FOM_mallocHook::Reader::newCursor()const{
+  return std::unique_ptr<FOM_mallocHook::Cursor>(new CursorImpl(this));
+}
+
+/* SIDECAR INDEX
+ */
+
+namespace{
+  const char IndexKey[8]={'F','O','M','I','D','X','\0','\1'};
+  struct IndexHdr{
+    char key[8];
+    uint64_t traceSize;
+    int64_t traceMtimeSec;
+    int64_t traceMtimeNsec;
+    uint64_t nRecords;
+    uint64_t nBuckets;
+    uint64_t nChunks;
+  }__attribute__((packed));
+
+  size_t indexFileSize(uint64_t nRecords,uint64_t nBuckets,uint64_t nChunks){
+    return sizeof(IndexHdr)+sizeof(uint64_t)*(nRecords+nChunks)+sizeof(FOM_mallocHook::SidecarIndex::Bucket)*nBuckets;
+  }
+
+  // offsets must each be past the previous one and leave room for an
+  // item of itemSize bytes before the end of the trace
+  bool increasingWithin(const uint64_t* v,size_t n,uint64_t traceSize,size_t itemSize){
+    for(size_t i=0;i<n;i++){
+      if(v[i]>traceSize || traceSize-v[i]<itemSize || (i && v[i]<=v[i-1]))return false;
+    }
+    return true;
+  }
+
+  // buckets also have to number their records contiguously from 0
+  bool validBuckets(const FOM_mallocHook::SidecarIndex::Bucket* b,size_t n,uint64_t traceSize){
+    for(size_t i=0;i<n;i++){
+      if(b[i].offset>traceSize || traceSize-b[i].offset<sizeof(FOM_mallocHook::BucketStats))return false;
+      if(b[i].rEnd<b[i].rStart || b[i].rStart!=(i?b[i-1].rEnd+1:0))return false;
+      if(i && b[i].offset<=b[i-1].offset)return false;
+    }
+    return true;
+  }
+}
+
+FOM_mallocHook::SidecarIndex::SidecarIndex(const std::string& traceName):m_indexName(traceName+".fomidx"),
+									  m_map(0),m_mapLength(0),
+									  m_records(0),m_nRecords(0),
+									  m_buckets(0),m_nBuckets(0),
+									  m_chunks(0),m_nChunks(0){
+}
+
+FOM_mallocHook::SidecarIndex::~SidecarIndex(){
+  unmap();
+}
+
+void FOM_mallocHook::SidecarIndex::unmap(){
+  if(m_map)munmap(m_map,m_mapLength);
+  m_map=0;
+  m_mapLength=0;
+  m_records=0;
+  m_buckets=0;
+  m_chunks=0;
+  m_nRecords=m_nBuckets=m_nChunks=0;
+}
+
+// A missing, stale or truncated index is not an error, the caller just
+// scans the trace.
+bool FOM_mallocHook::SidecarIndex::load(const struct stat& traceStat){
+  unmap();
+  int fd=open(m_indexName.c_str(),O_RDONLY);
+  if(fd==-1)return false;
+  struct stat sidx;
+  if(fstat(fd,&sidx)==-1 || (size_t)sidx.st_size<sizeof(IndexHdr)){
+    close(fd);
+    return false;
+  }
+  void* m=mmap64(0,sidx.st_size,PROT_READ,MAP_SHARED,fd,0);
+  close(fd);
+  if(m==MAP_FAILED)return false;
+  auto ih=(const IndexHdr*)m;
+  if(::memcmp(ih->key,IndexKey,sizeof(IndexKey))!=0 ||
+     ih->traceSize!=(uint64_t)traceStat.st_size ||
+     ih->traceMtimeSec!=(int64_t)traceStat.st_mtim.tv_sec ||
+     ih->traceMtimeNsec!=(int64_t)traceStat.st_mtim.tv_nsec ||
+     indexFileSize(ih->nRecords,ih->nBuckets,ih->nChunks)!=(size_t)sidx.st_size){
+    munmap(m,sidx.st_size);
+    return false;
+  }
+  m_map=m;
+  m_mapLength=sidx.st_size;
+  m_nRecords=ih->nRecords;
+  m_nBuckets=ih->nBuckets;
+  m_nChunks=ih->nChunks;
+  m_records=(const uint64_t*)(ih+1);
+  m_buckets=(const Bucket*)(m_records+m_nRecords);
+  m_chunks=(const uint64_t*)(m_buckets+m_nBuckets);
+  madvise(m_map,m_mapLength,MADV_WILLNEED);
+  //a matching stat does not make the contents right, never hand out offsets past the trace
+  uint64_t traceSize=traceStat.st_size;
+  if(!increasingWithin(m_records,m_nRecords,traceSize,sizeof(FOM_mallocHook::header)) ||
+     !validBuckets(m_buckets,m_nBuckets,traceSize) ||
+     !increasingWithin(m_chunks,m_nChunks,traceSize,sizeof(FOM_mallocHook::header))){
+    std::cerr<<"Ignoring corrupt index file "<<m_indexName<<std::endl;
+    unmap();
+    return false;
+  }
+  return true;
+}
+
+void FOM_mallocHook::SidecarIndex::advise(uint access)const{
+  //the index is small next to the trace, populate it whenever anything asks for it
+  if(access!=FOM_mallocHook::ReaderBase::AccessNormal)access|=FOM_mallocHook::ReaderBase::AccessPopulate;
+  FOM_mallocHook::adviseMapping(m_map,m_mapLength,access);
+}
+
+// Written under a temporary name and renamed so that concurrent readers
+// never see a partial index. Failing to write (e.g. read-only directory)
+// only costs the next open a scan.
+bool FOM_mallocHook::SidecarIndex::store(const struct stat& traceStat,
+					 const uint64_t* records,size_t nRecords,
+					 const Bucket* buckets,size_t nBuckets,
+					 const uint64_t* chunks,size_t nChunks){
+  char tmpName[20];
+  snprintf(tmpName,20,".%u",getpid());
+  std::string tmp=m_indexName+tmpName;
+  int fd=open(tmp.c_str(),O_WRONLY|O_CREAT|O_TRUNC,(S_IRWXU^S_IXUSR)|(S_IRWXG^S_IXGRP)|(S_IROTH));
+  if(fd==-1)return false;
+  IndexHdr ih;
+  ::memcpy(ih.key,IndexKey,sizeof(IndexKey));
+  ih.traceSize=traceStat.st_size;
+  ih.traceMtimeSec=traceStat.st_mtim.tv_sec;
+  ih.traceMtimeNsec=traceStat.st_mtim.tv_nsec;
+  ih.nRecords=nRecords;
+  ih.nBuckets=nBuckets;
+  ih.nChunks=nChunks;
+  const struct iovec parts[4]={{&ih,sizeof(ih)},
+			       {(void*)records,sizeof(uint64_t)*nRecords},
+			       {(void*)buckets,sizeof(Bucket)*nBuckets},
+			       {(void*)chunks,sizeof(uint64_t)*nChunks}};
+  bool ok=true;
+  for(const auto& p:parts){
+    const char* b=(const char*)p.iov_base;
+    size_t left=p.iov_len;
+    while(ok && left){
+      ssize_t w=::write(fd,b,left);
+      if(w<0){
+	if(errno==EINTR)continue;
+	ok=false;
+	break;
+      }
+      b+=w;
+      left-=w;
+    }
+  }
+  if(close(fd)!=0)ok=false;
+  if(ok && rename(tmp.c_str(),m_indexName.c_str())!=0)ok=false;
+  if(!ok){
+    unlink(tmp.c_str());
+    std::cerr<<"Could not write index file "<<m_indexName<<std::endl;
+  }
+  return ok;
+}
 
 /* WRITER CLASS
  */
@@ -216,9 +479,28 @@ FOM_mallocHook::WriterBase::WriterBase(std::string fileName,int comp,size_t bsiz
 										   m_maxDepth(0),
 										   m_fileHandle(-1),
 										   m_fileOpened(false),
+										   m_seekable(true),
 										   m_compress(comp),
 										   m_bucketSize(bsize),
+										   m_syncPeriod(65536),
+										   m_lastTStart(0),
+										   m_lastTEnd(0),
+										   m_segment(0),
+										   m_segmentSize(0),
+										   m_segmentTime(0),
+										   m_segmentBytes(0),
+										   m_segmentT0(0),
 										   m_stats(0){
+  struct timespec tp;
+  clock_gettime(CLOCK_MONOTONIC,&tp);
+  m_fileHandle=createFile(tp.tv_sec*1000000000l+tp.tv_nsec,
+			  std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+  m_fileOpened=true;
+  m_nRecords=0;
+  m_maxDepth=0;
+}
+
+int FOM_mallocHook::WriterBase::createFile(uint64_t startTime,uint64_t startTimeUTC){
   if(m_fileName.empty())throw std::ios_base::failure("File name is empty");
   int outFile=open(m_fileName.c_str(),O_RDWR|O_CREAT|O_TRUNC,(S_IRWXU^S_IXUSR)|(S_IRWXG^S_IXGRP)|(S_IROTH));
   //std::cerr<<__PRETTY_FUNCTION__<<m_fileName<<" @fd="<<outFile<<" pid= "<<getpid()<<std::endl;
@@ -227,59 +509,193 @@ FOM_mallocHook::WriterBase::WriterBase(std::string fileName,int comp,size_t bsiz
     char buff[2048];
     throw std::ios_base::failure(std::string(strerror_r(errno,buff,2048)));
   }
-  m_fileHandle=outFile;
+  m_seekable=(::lseek64(outFile,0,SEEK_CUR)!=-1);
   m_stats=new FileStats();
-  m_stats->setVersion(20000);
+  m_stats->setVersion(30000);
   m_stats->setPid(getpid());
-  struct timespec tp;
-  clock_gettime(CLOCK_MONOTONIC,&tp);
-  m_stats->setStartTime(tp.tv_sec*1000000000l+tp.tv_nsec);
-  m_stats->setStartTimeUTC(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+  m_stats->setStartTime(startTime);
+  m_stats->setStartTimeUTC(startTimeUTC);
   size_t len=2048;
   char *buff=new char[len];
   if(!parseCmdline(buff,&len)){
     throw std::ios_base::failure(std::string("Parsing process commandline failed! ")+
 				 std::string(strerror_r(errno,buff,2048)));
   }
-  m_stats->setCompression(comp);
-  m_stats->setBucketSize(bsize);
+  m_stats->setCompression(m_compress);
+  m_stats->setBucketSize(m_bucketSize);
   m_stats->setCmdLine(buff,len);
   //for(auto &cl:m_stats->getCmdLine()){std::cerr<<cl<<" ";}std::cerr<<std::endl;
-  m_stats->write(m_fileHandle,false);
-  m_fileOpened=true;
+  m_stats->write(outFile,false);
+  delete[] buff;
+  return outFile;
+}
+
+std::string FOM_mallocHook::WriterBase::segmentName(unsigned int segment)const{
+  char buff[32];
+  snprintf(buff,32,".%04u",segment);
+  return m_baseName+buff;
+}
+
+bool FOM_mallocHook::WriterBase::setSegmentation(size_t segmentSize,uint64_t segmentTime){
+  if((segmentSize==0 && segmentTime==0)||m_nRecords!=0||!m_baseName.empty()||!m_fileOpened||!m_seekable)return false;
+  m_baseName=m_fileName;
+  std::string seg=segmentName(0);
+  //the open descriptor follows the rename, so no writer state has to change
+  if(::rename(m_fileName.c_str(),seg.c_str())==-1){
+    char buff[2048];
+    m_baseName.clear();
+    throw std::ios_base::failure(std::string("Renaming output to first segment failed ")+
+				 std::string(strerror_r(errno,buff,2048)));
+  }
+  m_fileName=seg;
+  std::string manifest=m_baseName+".manifest";
+  int mf=open(manifest.c_str(),O_WRONLY|O_CREAT|O_TRUNC,(S_IRWXU^S_IXUSR)|(S_IRWXG^S_IXGRP)|(S_IROTH));
+  if(mf==-1){
+    char buff[2048];
+    throw std::ios_base::failure(std::string("Creating manifest failed ")+
+				 std::string(strerror_r(errno,buff,2048)));
+  }
+  const char hdr[]="#FOM manifest 1\n#segment\trecords\tfirstTStart\tlastTEnd\n";
+  if(::write(mf,hdr,sizeof(hdr)-1)!=sizeof(hdr)-1){
+    char buff[2048];
+    close(mf);
+    throw std::ios_base::failure(std::string("Writing manifest failed ")+
+				 std::string(strerror_r(errno,buff,2048)));
+  }
+  close(mf);
+  m_segment=0;
+  m_segmentSize=segmentSize;
+  m_segmentTime=segmentTime;
+  m_segmentBytes=0;
+  return true;
+}
+
+//called from closeFile(true) of the writers, lists the segment once it is complete
+void FOM_mallocHook::WriterBase::appendManifest(){
+  if(m_baseName.empty())return;
+  std::string manifest=m_baseName+".manifest";
+  int mf=open(manifest.c_str(),O_WRONLY|O_APPEND);
+  if(mf==-1){
+    std::cerr<<"Can't open manifest \""<<manifest<<"\""<<std::endl;
+    return;
+  }
+  auto slash=m_fileName.rfind('/');
+  char line[4096];
+  int len=snprintf(line,4096,"%s\t%lu\t%lu\t%lu\n",
+		   m_fileName.c_str()+(slash==std::string::npos?0:slash+1),
+		   m_nRecords,(m_nRecords?m_segmentT0:0ul),(m_nRecords?m_lastTEnd:0ul));
+  if(len>0 && ::write(mf,line,len)!=len){
+    std::cerr<<"Writing manifest entry for \""<<m_fileName<<"\" failed"<<std::endl;
+  }
+  close(mf);
+}
+
+bool FOM_mallocHook::WriterBase::rotate(){
+  if(m_baseName.empty()||!m_fileOpened)return false;
+  uint64_t startTime=m_stats->getStartTime();
+  uint64_t startTimeUTC=m_stats->getStartUTC();
+  closeFile(true);
+  m_segment++;
+  m_fileName=segmentName(m_segment);
+  int fd=createFile(startTime,startTimeUTC);
+  fsync(fd);
+  close(fd);
+  delete m_stats;
+  m_stats=0;
   m_nRecords=0;
   m_maxDepth=0;
-  delete[] buff;
+  m_segmentBytes=0;
+  segmentStarted();
+  return reopenFile(true);
 }
 
 bool FOM_mallocHook::WriterBase::updateStats(){
-  if(m_nRecords==0 && m_stats && m_fileHandle>=0){
-    ::lseek64(m_fileHandle,0,SEEK_SET);
+  if(m_nRecords==0 && m_stats && m_fileHandle>=0 && m_seekable){
     m_stats->write(m_fileHandle,false);
     return true;
   }
   return false;
 }
 
+void FOM_mallocHook::WriterBase::fillSyncMarker(SyncRecord& m,uint64_t pos)const{
+  m.h.tstart=m_lastTStart;
+  m.h.treturn=FOM_mallocHook::SyncMagic;
+  m.h.tend=m_lastTEnd;
+  m.h.allocType=FOM_mallocHook::SyncMarker;
+  m.h.addr=pos;
+  m.h.size=m_nRecords;
+  m.h.count=1;
+  m.maxDepth=m_maxDepth;
+}
+
+void FOM_mallocHook::WriterBase::writeSyncMarker(){
+  if(!m_seekable)return;//no file offsets to recover from in a pipe
+  auto pos=::lseek64(m_fileHandle,0,SEEK_CUR);
+  if(pos==-1){
+    char buff[2048];
+    throw std::ios_base::failure(std::string("Finding file offset failed ")+
+				 std::string(strerror_r(errno,buff,2048)));
+  }
+  SyncRecord m;
+  fillSyncMarker(m,pos);
+  WRITE(m_fileHandle,m);
+}
+
+// chunks keep the record layout, payload is padded to whole index_t words
+static FOM_mallocHook::header makeChunkHeader(char type,uint64_t addr,size_t len,uint64_t tStart,uint64_t tEnd){
+  FOM_mallocHook::header h;
+  h.tstart=tStart;
+  h.treturn=FOM_mallocHook::ChunkMagic;
+  h.tend=tEnd;
+  h.allocType=type;
+  h.addr=addr;
+  h.size=len;
+  h.count=(len+sizeof(FOM_mallocHook::index_t)-1)/sizeof(FOM_mallocHook::index_t);
+  return h;
+}
+
+static const char chunkPadding[sizeof(FOM_mallocHook::index_t)]={0};
+
+void FOM_mallocHook::WriterBase::writeChunk(char type,uint64_t addr,const void* payload,size_t len){
+  auto h=makeChunkHeader(type,addr,len,m_lastTStart,m_lastTEnd);
+  size_t pad=h.count*sizeof(FOM_mallocHook::index_t)-len;
+  WRITE(m_fileHandle,h);
+  if(len && ::write(m_fileHandle,payload,len)!=(ssize_t)len){
+    char buff[2048];
+    throw std::ios_base::failure(std::string(" writeChunk ")+std::string(strerror_r(errno,buff,2048)));
+  }
+  if(pad && ::write(m_fileHandle,chunkPadding,pad)!=(ssize_t)pad){
+    char buff[2048];
+    throw std::ios_base::failure(std::string(" writeChunk ")+std::string(strerror_r(errno,buff,2048)));
+  }
+}
+
 FOM_mallocHook::PlainWriter::PlainWriter(std::string fileName,int comp,size_t bsize):WriterBase(fileName,comp,bsize){
 }
 
 
 bool FOM_mallocHook::PlainWriter::closeFile(bool flush){
   if(m_fileOpened){
+    if(!flush && !m_seekable){//closing a pipe ends the stream for its reader, keep it open over forks
+      m_fileOpened=false;
+      return true;
+    }
     //std::cerr<<__PRETTY_FUNCTION__<<fsync(m_fileHandle)<<" "<<m_fileName<<" @fd= "<<m_fileHandle<<" currOffset="<<::lseek64(m_fileHandle,0,SEEK_CUR)<<" pid= "<<getpid()<<std::endl;    
     if(flush){
-      if(m_stats){
+      if(m_stats && m_seekable){
 	//std::cerr<<"Nrecords= "<<m_nRecords<<" max depth="<<m_maxDepth<<std::endl;
 	m_stats->setNumRecords(m_nRecords);
 	m_stats->setStackDepthLimit(m_maxDepth);
+	m_stats->setClosed(true);
 	m_stats->write(m_fileHandle,false);
       }
+      appendManifest();
     }
     fsync(m_fileHandle);
     //std::cerr<<__PRETTY_FUNCTION__<<fsync(m_fileHandle)<<" "<<m_fileName<<" @fd= "<<m_fileHandle<<" pid= "<<getpid()<<std::endl;
     close(m_fileHandle);
     //std::cerr<<__PRETTY_FUNCTION__<<close(m_fileHandle)<<" "<<m_fileName<<" @fd= "<<m_fileHandle<<" pid= "<<getpid()<<std::endl;
+    m_fileHandle=-1;
     delete m_stats;
     m_stats=0;
     m_fileOpened=false;
@@ -293,47 +709,35 @@ bool FOM_mallocHook::PlainWriter::reopenFile(bool seekEnd){
   if(m_fileOpened){
     return false;
   }
+  if(!m_seekable && m_fileHandle>=0){//pipe kept open by closeFile()
+    m_fileOpened=true;
+    return true;
+  }
   if(m_fileName.empty())throw std::ios_base::failure("File name is empty");
-  int outFile=open(m_fileName.c_str(),O_RDONLY,(S_IRWXU^S_IXUSR)|(S_IRWXG^S_IXGRP)|(S_IROTH));
+  int outFile=open(m_fileName.c_str(),O_RDWR,(S_IRWXU^S_IXUSR)|(S_IRWXG^S_IXGRP)|(S_IROTH));
   if(outFile==-1){
     std::cerr<<"Can't open out file \""<<m_fileName<<"\""<<std::endl;
     char buff[2048];
     throw std::ios_base::failure(std::string("Openning file failed ")+std::string(strerror_r(errno,buff,2048)));
   }
   m_stats=new FOM_mallocHook::FileStats();
-  m_stats->read(outFile,false);
-  fsync(outFile);
-  close(outFile);
-  outFile=open(m_fileName.c_str(),O_WRONLY,(S_IRWXU^S_IXUSR)|(S_IRWXG^S_IXGRP)|(S_IROTH));
-  if(outFile==-1){
-    std::cerr<<"Can't open out file \""<<m_fileName<<"\""<<std::endl;
-    char buff[2048];
-    throw std::ios_base::failure(std::string("Openning file failed ")+std::string(strerror_r(errno,buff,2048)));
-  }
-  fsync(outFile);
+  m_stats->read(outFile);
   m_fileHandle=outFile;
   m_fileOpened=true;
   if(seekEnd){
     ::lseek64(outFile,0,SEEK_END);
+  }else{
+    ::lseek64(outFile,m_stats->getHeaderSize(),SEEK_SET);
   }
   return true;
 }
 
 FOM_mallocHook::WriterBase::~WriterBase(){
+  if(!m_seekable && m_fileHandle>=0)close(m_fileHandle);//pipe inherited over a fork
 }
 
 FOM_mallocHook::PlainWriter::~PlainWriter(){
-  if(m_fileOpened){
-    if(m_stats){
-      //std::cerr<<__PRETTY_FUNCTION__<<" Nrecords= "<<m_nRecords<<" max depth="<<m_maxDepth<<" @pid="<<getpid()<<std::endl;
-      m_stats->setNumRecords(m_nRecords);
-      m_stats->setStackDepthLimit(m_maxDepth);
-      //m_stats->print();
-      m_stats->write(m_fileHandle,false);
-    }
-    fsync(m_fileHandle);
-    close(m_fileHandle);
-  }
+  closeFile(true);
   delete m_stats;
   m_stats=0;
 }
@@ -411,6 +815,7 @@ void FOM_mallocHook::PlainWriter::writeRecord(const MemRecord&r){
     char buff[2048];
     throw std::ios_base::failure(std::string(" WriteRecord1 ")+std::string(strerror_r(errno,buff,2048)));
   }
+  recordWritten(hdr);
 }
 
 void FOM_mallocHook::PlainWriter::writeRecord(const RecordIndex&r){
@@ -427,6 +832,7 @@ void FOM_mallocHook::PlainWriter::writeRecord(const RecordIndex&r){
     char buff[2048];
     throw std::ios_base::failure(std::string(" WriteRecord2 ")+std::string(strerror_r(errno,buff,2048)));
   }
+  recordWritten(hdr);
 }
 
 void FOM_mallocHook::PlainWriter::writeRecord(const void *r){
@@ -443,398 +849,2055 @@ void FOM_mallocHook::PlainWriter::writeRecord(const void *r){
     char buff[2048];
     throw std::ios_base::failure(std::string(" WriteRecord3 ")+std::string(strerror_r(errno,buff,2048)));
   }
+  recordWritten(hdr);
 }
 
-FOM_mallocHook::FileStats::FileStats(){
-  m_hdr=new FileStats::fileHdr();
-  strncpy(m_hdr->key,"FOM",4);
-  m_hdr->ToolVersion=-1;
-  m_hdr->Compression=0;  
-  m_hdr->NumRecords=0;
-  m_hdr->MaxStacks=0;
-  m_hdr->BucketSize=0;
-  m_hdr->NumBuckets=0;
-  m_hdr->Pid=0;
-  m_hdr->CmdLength=0;
-  m_hdr->CmdLine=0;
-  m_hdr->CompressionHeaderSize=0;
-}
-
-FOM_mallocHook::FileStats::~FileStats(){
-  delete[] m_hdr->CmdLine;
-  delete m_hdr;
-}
-
-int FOM_mallocHook::FileStats::getVersion()const{
-  return m_hdr->ToolVersion;
-}
+/* MMAP WRITER
+ */
 
-size_t FOM_mallocHook::FileStats::getNumRecords()const{
-  return m_hdr->NumRecords;
+FOM_mallocHook::MmapWriter::MmapWriter(std::string fileName,int comp,size_t bsize):WriterBase(fileName,comp,bsize),
+										    m_windowSize(32ul<<20),
+										    m_mapOffset(0),m_mapLen(0),
+										    m_writeOffset(0),m_map(0){
+  auto pos=::lseek64(m_fileHandle,0,SEEK_CUR);//end of file header
+  if(pos==-1){
+    char buff[2048];
+    throw std::ios_base::failure(std::string("Finding file offset failed ")+
+				 std::string(strerror_r(errno,buff,2048)));
+  }
+  m_writeOffset=pos;
+  mapWindow(0);
 }
 
-size_t FOM_mallocHook::FileStats::getMaxStackLen()const{
-  return m_hdr->MaxStacks;
+FOM_mallocHook::MmapWriter::~MmapWriter(){
+  closeFile(true);
+  delete m_stats;
+  m_stats=0;
 }
 
-
-std::vector<std::string> FOM_mallocHook::FileStats::getCmdLine()const{
-  std::vector<std::string> cmds;
-  if(m_hdr->CmdLength){
-    char* c=m_hdr->CmdLine;
-    char *cmdEnd=m_hdr->CmdLine+m_hdr->CmdLength;
-    while(c<cmdEnd){
-      std::string s(c);
-      c+=s.length()+1;
-      cmds.push_back(s);
+void FOM_mallocHook::MmapWriter::mapWindow(size_t minLen){
+  unmapWindow();
+  m_mapOffset=m_writeOffset&(~pageMask);
+  m_mapLen=std::max(m_windowSize,((m_writeOffset-m_mapOffset+minLen)|pageMask)+1);
+  //reserve the blocks so that stores into the mapping can't fail with SIGBUS
+  if(fallocate64(m_fileHandle,0,m_mapOffset,m_mapLen)==-1){
+    if(ftruncate64(m_fileHandle,m_mapOffset+m_mapLen)==-1){
+      char buff[2048];
+      throw std::ios_base::failure(std::string(" MmapWriter growing file failed ")+std::string(strerror_r(errno,buff,2048)));
     }
   }
-  return cmds;
-}
-
-uint64_t FOM_mallocHook::FileStats::getStartTime()const{
-  return m_hdr->StartTime;
-}
-uint64_t FOM_mallocHook::FileStats::getStartUTC()const{
-  return m_hdr->StartTimeUtc;
+  void* m=mmap64(0,m_mapLen,PROT_READ|PROT_WRITE,MAP_SHARED,m_fileHandle,m_mapOffset);
+  if(m==MAP_FAILED){
+    char buff[2048];
+    throw std::ios_base::failure(std::string(strerror_r(errno,buff,2048))+" failed to mmap "+m_fileName);
+  }
+  madvise(m,m_mapLen,MADV_SEQUENTIAL);
+  m_map=(char*)m;
 }
 
-uint32_t FOM_mallocHook::FileStats::getPid()const{
-  return m_hdr->Pid;
+void FOM_mallocHook::MmapWriter::unmapWindow(){
+  if(m_map){
+    msync(m_map,m_mapLen,MS_ASYNC);
+    munmap(m_map,m_mapLen);
+    m_map=0;
+  }
 }
 
-int FOM_mallocHook::FileStats::getCompression()const{
-  return m_hdr->Compression;
+inline void FOM_mallocHook::MmapWriter::append(const void* hdr,size_t hdrLen,const void* stacks,size_t stacksLen){
+  size_t len=hdrLen+stacksLen;
+  if(m_writeOffset+len>m_mapOffset+m_mapLen)mapWindow(len);
+  char* dst=m_map+(m_writeOffset-m_mapOffset);
+  ::memcpy(dst,hdr,hdrLen);
+  if(stacksLen)::memcpy(dst+hdrLen,stacks,stacksLen);
+  m_writeOffset+=len;
 }
 
-size_t   FOM_mallocHook::FileStats::getBucketSize()const{
-  return m_hdr->BucketSize;
-}
-size_t   FOM_mallocHook::FileStats::getNumBuckets()const{
-  return m_hdr->NumBuckets;
+void FOM_mallocHook::MmapWriter::writeSyncMarker(){
+  SyncRecord m;
+  fillSyncMarker(m,m_writeOffset);
+  append(&m,sizeof(m),0,0);
 }
 
-size_t FOM_mallocHook::FileStats::getCompressionHeaderSize()const{
-  return m_hdr->CompressionHeaderSize;
+void FOM_mallocHook::MmapWriter::writeChunk(char type,uint64_t addr,const void* payload,size_t len){
+  auto h=makeChunkHeader(type,addr,len,m_lastTStart,m_lastTEnd);
+  size_t pad=h.count*sizeof(FOM_mallocHook::index_t)-len;
+  append(&h,sizeof(h),payload,len);
+  if(pad)append(chunkPadding,pad,0,0);
 }
 
-void FOM_mallocHook::FileStats::setCompressionHeaderSize(size_t t){
-  m_hdr->CompressionHeaderSize=t;
+void FOM_mallocHook::MmapWriter::writeRecord(const MemRecord&r){
+  const auto  hdr=r.getHeader();
+  size_t nStacks=0;
+  auto stIds=r.getStacks(&nStacks);
+  m_nRecords++;
+  if(m_maxDepth<nStacks)m_maxDepth=nStacks;
+  append(hdr,sizeof(*hdr),stIds,sizeof(*stIds)*nStacks);
+  recordWritten(hdr);
 }
 
-void FOM_mallocHook::FileStats::setVersion(int ver){
-  m_hdr->ToolVersion=ver;
+void FOM_mallocHook::MmapWriter::writeRecord(const RecordIndex&r){
+  return writeRecord((const void*)r.getHeader());
 }
 
-void FOM_mallocHook::FileStats::setNumRecords(size_t n){
-  m_hdr->NumRecords=n;
+void FOM_mallocHook::MmapWriter::writeRecord(const void *r){
+  const auto  hdr=(const FOM_mallocHook::header*)r;
+  size_t nStacks=hdr->count;
+  m_nRecords++;
+  if(m_maxDepth<nStacks)m_maxDepth=nStacks;
+  append(hdr,sizeof(*hdr)+sizeof(FOM_mallocHook::index_t)*nStacks,0,0);
+  recordWritten(hdr);
 }
 
-void FOM_mallocHook::FileStats::setStackDepthLimit(size_t l){
-  m_hdr->MaxStacks=l;
+bool FOM_mallocHook::MmapWriter::closeFile(bool flush){
+  if(m_fileOpened){
+    unmapWindow();
+    //drop the unused tail of the last window
+    if(ftruncate64(m_fileHandle,m_writeOffset)==-1){
+      char buff[2048];
+      throw std::ios_base::failure(std::string(" MmapWriter truncating file failed ")+std::string(strerror_r(errno,buff,2048)));
+    }
+    if(flush){
+      if(m_stats){
+	m_stats->setNumRecords(m_nRecords);
+	m_stats->setStackDepthLimit(m_maxDepth);
+	m_stats->setClosed(true);
+	m_stats->write(m_fileHandle,false);
+      }
+      appendManifest();
+    }
+    fsync(m_fileHandle);
+    close(m_fileHandle);
+    delete m_stats;
+    m_stats=0;
+    m_fileOpened=false;
+    return true;
+  }else{
+    return false;
+  }
 }
 
-
-void FOM_mallocHook::FileStats::setCmdLine(char* cmd,size_t len){
-  delete m_hdr->CmdLine;
-  m_hdr->CmdLength=len;
-  if(len){
-    m_hdr->CmdLine=new char[len+1];
-    ::memcpy(m_hdr->CmdLine,cmd,len);
-    m_hdr->CmdLine[len]='\0';
-    //std::cout<<"len ="<<len<<" cmd="<<cmd<<std::endl;
+bool FOM_mallocHook::MmapWriter::reopenFile(bool seekEnd){
+  if(m_fileOpened){
+    return false;
+  }
+  if(m_fileName.empty())throw std::ios_base::failure("File name is empty");
+  int outFile=open(m_fileName.c_str(),O_RDWR,(S_IRWXU^S_IXUSR)|(S_IRWXG^S_IXGRP)|(S_IROTH));
+  if(outFile==-1){
+    std::cerr<<"Can't open out file \""<<m_fileName<<"\""<<std::endl;
+    char buff[2048];
+    throw std::ios_base::failure(std::string("Openning file failed ")+std::string(strerror_r(errno,buff,2048)));
+  }
+  m_stats=new FOM_mallocHook::FileStats();
+  m_stats->read(outFile,false);
+  m_fileHandle=outFile;
+  m_fileOpened=true;
+  if(seekEnd){
+    m_writeOffset=::lseek64(outFile,0,SEEK_END);
+  }else{//start over, dropping the records already in the file
+    m_writeOffset=m_stats->getHeaderSize();
+    if(ftruncate64(outFile,m_writeOffset)==-1){
+      char buff[2048];
+      throw std::ios_base::failure(std::string(" MmapWriter truncating file failed ")+std::string(strerror_r(errno,buff,2048)));
+    }
+    m_nRecords=0;
+    m_maxDepth=0;
+  }
+  mapWindow(0);
+  return true;
+}
+
+#ifdef IO_URING_FOUND
+/* IO_URING WRITER
+ */
+
+FOM_mallocHook::UringWriter::UringWriter(std::string fileName,int comp,size_t bsize,uint queueDepth):WriterBase(fileName,comp,bsize),
+												     m_chunkSize(1ul<<20),
+												     m_currChunk(0),m_fileOffset(0),
+												     m_depth(queueDepth),m_inFlight(0),
+												     m_ringFd(-1),m_sqRing(0),m_cqRing(0),
+												     m_sqRingLen(0),m_cqRingLen(0),m_sqesLen(0),
+												     m_sqes(0),m_cqes(0),m_ringUnsupported(false){
+  if(m_depth<2)m_depth=2;
+  auto pos=::lseek64(m_fileHandle,0,SEEK_CUR);//end of file header
+  if(pos==-1){
+    char buff[2048];
+    throw std::ios_base::failure(std::string("Finding file offset failed ")+
+				 std::string(strerror_r(errno,buff,2048)));
+  }
+  m_fileOffset=pos;
+  m_chunks.resize(m_depth);
+  for(auto &c:m_chunks){
+    c.buff=new char[m_chunkSize];
+    c.used=0;
+    c.offset=0;
+    c.inFlight=false;
+  }
+  if(!setupRing()){
+    std::cerr<<"io_uring is not available, falling back to buffered writes"<<std::endl;
+  }
+}
+
+FOM_mallocHook::UringWriter::~UringWriter(){
+  closeFile(true);
+  for(auto &c:m_chunks){
+    delete[] c.buff;
+  }
+  delete m_stats;
+  m_stats=0;
+}
+
+bool FOM_mallocHook::UringWriter::setupRing(){
+  struct io_uring_params p;
+  ::memset(&p,0,sizeof(p));
+  int fd=syscall(__NR_io_uring_setup,m_depth,&p);
+  if(fd<0){
+    errno=0;
+    return false;
+  }
+  m_sqRingLen=p.sq_off.array+p.sq_entries*sizeof(unsigned);
+  m_cqRingLen=p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+  if(p.features&IORING_FEAT_SINGLE_MMAP){
+    m_sqRingLen=m_cqRingLen=std::max(m_sqRingLen,m_cqRingLen);
+  }
+  m_sqRing=mmap64(0,m_sqRingLen,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+  if(m_sqRing==MAP_FAILED){
+    m_sqRing=0;
+    close(fd);
+    return false;
+  }
+  if(p.features&IORING_FEAT_SINGLE_MMAP){
+    m_cqRing=m_sqRing;
+  }else{
+    m_cqRing=mmap64(0,m_cqRingLen,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_CQ_RING);
+    if(m_cqRing==MAP_FAILED){
+      m_cqRing=0;
+      munmap(m_sqRing,m_sqRingLen);
+      m_sqRing=0;
+      close(fd);
+      return false;
+    }
+  }
+  m_sqesLen=p.sq_entries*sizeof(struct io_uring_sqe);
+  void* sqes=mmap64(0,m_sqesLen,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQES);
+  if(sqes==MAP_FAILED){
+    if(m_cqRing!=m_sqRing)munmap(m_cqRing,m_cqRingLen);
+    munmap(m_sqRing,m_sqRingLen);
+    m_sqRing=m_cqRing=0;
+    close(fd);
+    return false;
+  }
+  m_sqes=(struct io_uring_sqe*)sqes;
+  char* sq=(char*)m_sqRing;
+  char* cq=(char*)m_cqRing;
+  m_sqTail=(unsigned*)(sq+p.sq_off.tail);
+  m_sqMask=(unsigned*)(sq+p.sq_off.ring_mask);
+  m_sqArray=(unsigned*)(sq+p.sq_off.array);
+  m_cqHead=(unsigned*)(cq+p.cq_off.head);
+  m_cqTail=(unsigned*)(cq+p.cq_off.tail);
+  m_cqMask=(unsigned*)(cq+p.cq_off.ring_mask);
+  m_cqes=(struct io_uring_cqe*)(cq+p.cq_off.cqes);
+  m_ringFd=fd;
+  return true;
+}
+
+void FOM_mallocHook::UringWriter::teardownRing(){
+  if(m_ringFd<0)return;
+  munmap(m_sqes,m_sqesLen);
+  if(m_cqRing!=m_sqRing)munmap(m_cqRing,m_cqRingLen);
+  munmap(m_sqRing,m_sqRingLen);
+  m_sqes=0;
+  m_sqRing=m_cqRing=0;
+  close(m_ringFd);
+  m_ringFd=-1;
+}
+
+void FOM_mallocHook::UringWriter::writeChunkSync(Chunk& c,size_t done){
+  while(done<c.used){
+    ssize_t n=pwrite64(m_fileHandle,c.buff+done,c.used-done,c.offset+done);
+    if(n<0){
+      if(errno==EINTR)continue;
+      char buff[2048];
+      throw std::ios_base::failure(std::string(" UringWriter FileWriter ")+std::string(strerror_r(errno,buff,2048)));
+    }
+    done+=n;
+  }
+  c.used=0;
+  c.inFlight=false;
+}
+
+void FOM_mallocHook::UringWriter::reapCompletions(uint minComplete){
+  if(m_ringFd<0)return;
+  if(minComplete){
+    while(syscall(__NR_io_uring_enter,m_ringFd,0,minComplete,IORING_ENTER_GETEVENTS,0,0)<0){
+      if(errno!=EINTR){
+	char buff[2048];
+	throw std::ios_base::failure(std::string(" UringWriter io_uring_enter ")+std::string(strerror_r(errno,buff,2048)));
+      }
+    }
+  }
+  unsigned head=*m_cqHead;
+  unsigned tail=__atomic_load_n(m_cqTail,__ATOMIC_ACQUIRE);
+  while(head!=tail){
+    const struct io_uring_cqe &cqe=m_cqes[head&(*m_cqMask)];
+    Chunk &c=m_chunks.at(cqe.user_data);
+    m_inFlight--;
+    if(cqe.res<0){
+      if(cqe.res==-EINVAL||cqe.res==-EOPNOTSUPP){//kernel without IORING_OP_WRITE
+	if(!m_ringUnsupported){
+	  std::cerr<<"io_uring write is not supported, falling back to buffered writes"<<std::endl;
+	  m_ringUnsupported=true;
+	}
+	writeChunkSync(c,0);
+      }else{
+	char buff[2048];
+	throw std::ios_base::failure(std::string(" UringWriter FileWriter ")+std::string(strerror_r(-cqe.res,buff,2048)));
+      }
+    }else{
+      writeChunkSync(c,cqe.res);//completes short writes
+    }
+    head++;
+  }
+  __atomic_store_n(m_cqHead,head,__ATOMIC_RELEASE);
+  if(m_ringUnsupported && m_inFlight==0)teardownRing();//later chunks are written directly
+}
+
+void FOM_mallocHook::UringWriter::submitChunk(){
+  Chunk &c=m_chunks[m_currChunk];
+  if(c.used){
+    c.offset=m_fileOffset;
+    m_fileOffset+=c.used;
+    if(m_ringFd>=0 && !m_ringUnsupported){
+      unsigned tail=*m_sqTail;
+      unsigned idx=tail&(*m_sqMask);
+      struct io_uring_sqe *sqe=&m_sqes[idx];
+      ::memset(sqe,0,sizeof(*sqe));
+      sqe->opcode=IORING_OP_WRITE;
+      sqe->fd=m_fileHandle;
+      sqe->addr=(uint64_t)c.buff;
+      sqe->len=c.used;
+      sqe->off=c.offset;
+      sqe->user_data=m_currChunk;
+      m_sqArray[idx]=idx;
+      __atomic_store_n(m_sqTail,tail+1,__ATOMIC_RELEASE);
+      c.inFlight=true;
+      m_inFlight++;
+      while(syscall(__NR_io_uring_enter,m_ringFd,1,0,0,0,0)<0){
+	if(errno!=EINTR){
+	  char buff[2048];
+	  throw std::ios_base::failure(std::string(" UringWriter io_uring_enter ")+std::string(strerror_r(errno,buff,2048)));
+	}
+      }
+    }else{
+      writeChunkSync(c,0);
+    }
+  }
+  //pick the next free chunk, waiting for a completion if all are in flight
+  m_currChunk=(m_currChunk+1)%m_chunks.size();
+  reapCompletions(0);
+  while(m_chunks[m_currChunk].inFlight){
+    reapCompletions(1);
+  }
+}
+
+//for data that does not fit into a single chunk, chunks are contiguous in the file
+void FOM_mallocHook::UringWriter::copyBytes(const char* src,size_t len){
+  while(len){
+    Chunk &c=m_chunks[m_currChunk];
+    size_t n=std::min(len,m_chunkSize-c.used);
+    ::memcpy(c.buff+c.used,src,n);
+    c.used+=n;
+    src+=n;
+    len-=n;
+    if(c.used==m_chunkSize)submitChunk();
+  }
+}
+
+inline void FOM_mallocHook::UringWriter::append(const void* hdr,size_t hdrLen,const void* stacks,size_t stacksLen){
+  size_t len=hdrLen+stacksLen;
+  if(len>m_chunkSize){
+    copyBytes((const char*)hdr,hdrLen);
+    copyBytes((const char*)stacks,stacksLen);
+    return;
+  }
+  if(m_chunks[m_currChunk].used+len>m_chunkSize)submitChunk();
+  Chunk &c=m_chunks[m_currChunk];
+  ::memcpy(c.buff+c.used,hdr,hdrLen);
+  if(stacksLen)::memcpy(c.buff+c.used+hdrLen,stacks,stacksLen);
+  c.used+=len;
+}
+
+void FOM_mallocHook::UringWriter::writeSyncMarker(){
+  SyncRecord m;
+  if(m_chunks[m_currChunk].used+sizeof(m)>m_chunkSize)submitChunk();
+  fillSyncMarker(m,m_fileOffset+m_chunks[m_currChunk].used);
+  append(&m,sizeof(m),0,0);
+}
+
+void FOM_mallocHook::UringWriter::writeChunk(char type,uint64_t addr,const void* payload,size_t len){
+  auto h=makeChunkHeader(type,addr,len,m_lastTStart,m_lastTEnd);
+  size_t pad=h.count*sizeof(FOM_mallocHook::index_t)-len;
+  append(&h,sizeof(h),payload,len);
+  if(pad)append(chunkPadding,pad,0,0);
+}
+
+void FOM_mallocHook::UringWriter::writeRecord(const MemRecord&r){
+  const auto  hdr=r.getHeader();
+  size_t nStacks=0;
+  auto stIds=r.getStacks(&nStacks);
+  m_nRecords++;
+  if(m_maxDepth<nStacks)m_maxDepth=nStacks;
+  append(hdr,sizeof(*hdr),stIds,sizeof(*stIds)*nStacks);
+  recordWritten(hdr);
+}
+
+void FOM_mallocHook::UringWriter::writeRecord(const RecordIndex&r){
+  return writeRecord((const void*)r.getHeader());
+}
+
+void FOM_mallocHook::UringWriter::writeRecord(const void *r){
+  const auto  hdr=(const FOM_mallocHook::header*)r;
+  size_t nStacks=hdr->count;
+  m_nRecords++;
+  if(m_maxDepth<nStacks)m_maxDepth=nStacks;
+  append(hdr,sizeof(*hdr)+sizeof(FOM_mallocHook::index_t)*nStacks,0,0);
+  recordWritten(hdr);
+}
+
+bool FOM_mallocHook::UringWriter::closeFile(bool flush){
+  if(m_fileOpened){
+    submitChunk();
+    while(m_inFlight){
+      reapCompletions(1);
+    }
+    //the ring must not be shared with a forked child
+    teardownRing();
+    if(flush){
+      if(m_stats){
+	m_stats->setNumRecords(m_nRecords);
+	m_stats->setStackDepthLimit(m_maxDepth);
+	m_stats->setClosed(true);
+	m_stats->write(m_fileHandle,false);
+      }
+      appendManifest();
+    }
+    fsync(m_fileHandle);
+    close(m_fileHandle);
+    delete m_stats;
+    m_stats=0;
+    m_fileOpened=false;
+    return true;
+  }else{
+    return false;
+  }
+}
+
+bool FOM_mallocHook::UringWriter::reopenFile(bool seekEnd){
+  if(m_fileOpened){
+    return false;
+  }
+  if(m_fileName.empty())throw std::ios_base::failure("File name is empty");
+  int outFile=open(m_fileName.c_str(),O_RDWR,(S_IRWXU^S_IXUSR)|(S_IRWXG^S_IXGRP)|(S_IROTH));
+  if(outFile==-1){
+    std::cerr<<"Can't open out file \""<<m_fileName<<"\""<<std::endl;
+    char buff[2048];
+    throw std::ios_base::failure(std::string("Openning file failed ")+std::string(strerror_r(errno,buff,2048)));
+  }
+  m_stats=new FOM_mallocHook::FileStats();
+  m_stats->read(outFile,false);
+  m_fileHandle=outFile;
+  m_fileOpened=true;
+  if(seekEnd){
+    m_fileOffset=::lseek64(outFile,0,SEEK_END);
+  }else{//start over, dropping the records already in the file
+    m_fileOffset=m_stats->getHeaderSize();
+    if(ftruncate64(outFile,m_fileOffset)==-1){
+      char buff[2048];
+      throw std::ios_base::failure(std::string(" UringWriter truncating file failed ")+std::string(strerror_r(errno,buff,2048)));
+    }
+    m_nRecords=0;
+    m_maxDepth=0;
+  }
+  if(!m_ringUnsupported)setupRing();
+  return true;
+}
+#endif
+
+FOM_mallocHook::FileStats::FileStats(){
+  m_hdr=new FileStats::fileHdr();
+  strncpy(m_hdr->key,"FOM",4);
+  m_hdr->ToolVersion=-1;
+  m_hdr->Compression=0;  
+  m_hdr->NumRecords=0;
+  m_hdr->MaxStacks=0;
+  m_hdr->BucketSize=0;
+  m_hdr->NumBuckets=0;
+  m_hdr->Pid=0;
+  m_hdr->CmdLength=0;
+  m_hdr->CmdLine=0;
+  m_hdr->CompressionHeaderSize=0;
+  m_hdr->HeaderSize=0;
+  m_hdr->Flags=0;
+}
+
+FOM_mallocHook::FileStats::~FileStats(){
+  delete[] m_hdr->CmdLine;
+  delete m_hdr;
+}
+
+int FOM_mallocHook::FileStats::getVersion()const{
+  return m_hdr->ToolVersion;
+}
+
+size_t FOM_mallocHook::FileStats::getNumRecords()const{
+  return m_hdr->NumRecords;
+}
+
+size_t FOM_mallocHook::FileStats::getMaxStackLen()const{
+  return m_hdr->MaxStacks;
+}
+
+
+std::vector<std::string> FOM_mallocHook::FileStats::getCmdLine()const{
+  std::vector<std::string> cmds;
+  if(m_hdr->CmdLength){
+    char* c=m_hdr->CmdLine;
+    char *cmdEnd=m_hdr->CmdLine+m_hdr->CmdLength;
+    while(c<cmdEnd){
+      std::string s(c);
+      c+=s.length()+1;
+      cmds.push_back(s);
+    }
+  }
+  return cmds;
+}
+
+uint64_t FOM_mallocHook::FileStats::getStartTime()const{
+  return m_hdr->StartTime;
+}
+uint64_t FOM_mallocHook::FileStats::getStartUTC()const{
+  return m_hdr->StartTimeUtc;
+}
+
+uint32_t FOM_mallocHook::FileStats::getPid()const{
+  return m_hdr->Pid;
+}
+
+int FOM_mallocHook::FileStats::getCompression()const{
+  return m_hdr->Compression;
+}
+
+size_t   FOM_mallocHook::FileStats::getBucketSize()const{
+  return m_hdr->BucketSize;
+}
+size_t   FOM_mallocHook::FileStats::getNumBuckets()const{
+  return m_hdr->NumBuckets;
+}
+
+size_t FOM_mallocHook::FileStats::getHeaderSize()const{
+  if(m_hdr->HeaderSize)return m_hdr->HeaderSize;//as read from the file
+  std::vector<char> buff;
+  return serialize(buff);//as it will be written
+}
+
+bool FOM_mallocHook::FileStats::isClosed()const{
+  return (m_hdr->Flags&FlagClosed)!=0 || m_hdr->NumRecords!=0;
+}
+
+size_t FOM_mallocHook::FileStats::getCompressionHeaderSize()const{
+  return m_hdr->CompressionHeaderSize;
+}
+
+void FOM_mallocHook::FileStats::setCompressionHeaderSize(size_t t){
+  m_hdr->CompressionHeaderSize=t;
+}
+
+void FOM_mallocHook::FileStats::setClosed(bool closed){
+  if(closed){
+    m_hdr->Flags|=FlagClosed;
+  }else{
+    m_hdr->Flags&=~FlagClosed;
+  }
+}
+
+void FOM_mallocHook::FileStats::setVersion(int ver){
+  m_hdr->ToolVersion=ver;
+}
+
+void FOM_mallocHook::FileStats::setNumRecords(size_t n){
+  m_hdr->NumRecords=n;
+}
+
+void FOM_mallocHook::FileStats::setStackDepthLimit(size_t l){
+  m_hdr->MaxStacks=l;
+}
+
+
+void FOM_mallocHook::FileStats::setCmdLine(char* cmd,size_t len){
+  delete m_hdr->CmdLine;
+  m_hdr->CmdLength=len;
+  if(len){
+    m_hdr->CmdLine=new char[len+1];
+    ::memcpy(m_hdr->CmdLine,cmd,len);
+    m_hdr->CmdLine[len]='\0';
+    //std::cout<<"len ="<<len<<" cmd="<<cmd<<std::endl;
   }else{
     m_hdr->CmdLine=0; 
   }
 }
 
-void FOM_mallocHook::FileStats::setStartTime(uint64_t t){
-  m_hdr->StartTime=t;
+void FOM_mallocHook::FileStats::setStartTime(uint64_t t){
+  m_hdr->StartTime=t;
+}
+
+void FOM_mallocHook::FileStats::setStartTimeUTC(uint64_t t){
+  m_hdr->StartTimeUtc=t;
+}
+
+void FOM_mallocHook::FileStats::setPid(uint32_t p){
+  m_hdr->Pid=p;
+}
+
+void FOM_mallocHook::FileStats::setCompression(int comp){
+  m_hdr->Compression=comp;
+}
+
+void FOM_mallocHook::FileStats::setBucketSize(size_t n){
+  m_hdr->BucketSize=n;
+}
+
+void FOM_mallocHook::FileStats::setNumBuckets(size_t n){
+  m_hdr->NumBuckets=n;
+}
+
+namespace{
+  // on disk layout of version 30000 headers. The command line starts at
+  // CmdOffset and the first record at HeaderSize
+  struct FileHdrV3{
+    char key[4];
+    int32_t ToolVersion;
+    int32_t Compression;
+    uint32_t HeaderSize;
+    uint64_t NumRecords;
+    uint64_t MaxStacks;
+    uint64_t BucketSize;
+    uint64_t NumBuckets;
+    uint32_t Pid;
+    uint32_t Flags;
+    uint64_t StartTime;
+    uint64_t StartTimeUtc;
+    uint64_t CompressionHeaderSize;
+    uint64_t CmdOffset;
+    uint64_t CmdLength;
+  }__attribute__((packed));
+  // version 20000 and 20001 headers, fields written one after the other
+  const size_t legacyFixedSize=4+2*sizeof(int)+4*sizeof(size_t)+sizeof(uint32_t)+3*sizeof(uint64_t)+sizeof(size_t);
+  const size_t legacyCmdLengthOffset=legacyFixedSize-sizeof(size_t);
+  inline int headerVersion(const char* buff){
+    int v;
+    ::memcpy(&v,buff+4,sizeof(v));
+    return v;
+  }
+}
+
+// bytes needed to parse the header starting at buff, given len bytes of it
+size_t FOM_mallocHook::FileStats::requiredSize(const char* buff,size_t len)const{
+  if(len<legacyFixedSize)return std::max(legacyFixedSize,sizeof(FileHdrV3));
+  if(headerVersion(buff)>=30000){
+    if(len<sizeof(FileHdrV3))return sizeof(FileHdrV3);
+    const FileHdrV3* h=(const FileHdrV3*)buff;
+    return std::max((size_t)h->HeaderSize,(size_t)(h->CmdOffset+h->CmdLength));
+  }
+  size_t cmdLen;
+  ::memcpy(&cmdLen,buff+legacyCmdLengthOffset,sizeof(cmdLen));
+  return legacyFixedSize+cmdLen;
+}
+
+size_t FOM_mallocHook::FileStats::parse(const void* b,size_t len){
+  const char* buff=(const char*)b;
+  size_t req=requiredSize(buff,len);
+  if(len<req){
+    throw std::length_error("Corrupt file. Header is truncated");
+  }
+  if(::strncmp(buff,"FOM",4)!=0){
+    throw std::ios_base::failure("Not a FOM trace file, header key mismatch");
+  }
+  ::memcpy(m_hdr->key,buff,4);
+  delete[] m_hdr->CmdLine;
+  m_hdr->CmdLine=0;
+  const char* cmd=0;
+  if(headerVersion(buff)>=30000){
+    const FileHdrV3* h=(const FileHdrV3*)buff;
+    m_hdr->ToolVersion=h->ToolVersion;
+    m_hdr->Compression=h->Compression;
+    m_hdr->NumRecords=h->NumRecords;
+    m_hdr->MaxStacks=h->MaxStacks;
+    m_hdr->BucketSize=h->BucketSize;
+    m_hdr->NumBuckets=h->NumBuckets;
+    m_hdr->Pid=h->Pid;
+    m_hdr->Flags=h->Flags;
+    m_hdr->StartTime=h->StartTime;
+    m_hdr->StartTimeUtc=h->StartTimeUtc;
+    m_hdr->CompressionHeaderSize=h->CompressionHeaderSize;
+    m_hdr->CmdLength=h->CmdLength;
+    m_hdr->HeaderSize=h->HeaderSize;
+    cmd=buff+h->CmdOffset;
+  }else{
+    const char* p=buff+4;
+#define PARSE(X) ::memcpy(&(X),p,sizeof(X));p+=sizeof(X);
+    PARSE(m_hdr->ToolVersion);
+    PARSE(m_hdr->Compression);
+    PARSE(m_hdr->NumRecords);
+    PARSE(m_hdr->MaxStacks);
+    PARSE(m_hdr->BucketSize);
+    PARSE(m_hdr->NumBuckets);
+    PARSE(m_hdr->Pid);
+    PARSE(m_hdr->StartTime);
+    PARSE(m_hdr->StartTimeUtc);
+    PARSE(m_hdr->CompressionHeaderSize);
+    PARSE(m_hdr->CmdLength);
+#undef PARSE
+    m_hdr->Flags=0;
+    m_hdr->HeaderSize=req;
+    cmd=p;
+  }
+  if(m_hdr->CmdLength){
+    m_hdr->CmdLine=new char[m_hdr->CmdLength+1];
+    ::memcpy(m_hdr->CmdLine,cmd,m_hdr->CmdLength);
+    m_hdr->CmdLine[m_hdr->CmdLength]='\0';
+  }
+  return m_hdr->HeaderSize;
+}
+
+size_t FOM_mallocHook::FileStats::serialize(std::vector<char>& buff)const{
+  if(m_hdr->ToolVersion>=30000){
+    size_t len=((sizeof(FileHdrV3)+m_hdr->CmdLength+HeaderAlign-1)/HeaderAlign)*HeaderAlign;
+    buff.assign(len,0);
+    FileHdrV3* h=(FileHdrV3*)buff.data();
+    ::memcpy(h->key,m_hdr->key,4);
+    h->ToolVersion=m_hdr->ToolVersion;
+    h->Compression=m_hdr->Compression;
+    h->HeaderSize=len;
+    h->NumRecords=m_hdr->NumRecords;
+    h->MaxStacks=m_hdr->MaxStacks;
+    h->BucketSize=m_hdr->BucketSize;
+    h->NumBuckets=m_hdr->NumBuckets;
+    h->Pid=m_hdr->Pid;
+    h->Flags=m_hdr->Flags;
+    h->StartTime=m_hdr->StartTime;
+    h->StartTimeUtc=m_hdr->StartTimeUtc;
+    h->CompressionHeaderSize=m_hdr->CompressionHeaderSize;
+    h->CmdOffset=sizeof(FileHdrV3);
+    h->CmdLength=m_hdr->CmdLength;
+    if(m_hdr->CmdLength)::memcpy(buff.data()+h->CmdOffset,m_hdr->CmdLine,m_hdr->CmdLength);
+    return len;
+  }
+  size_t len=legacyFixedSize+m_hdr->CmdLength;
+  buff.assign(len,0);
+  char* p=buff.data();
+  ::memcpy(p,m_hdr->key,4);
+  p+=4;
+#define STORE(X) ::memcpy(p,&(X),sizeof(X));p+=sizeof(X);
+  STORE(m_hdr->ToolVersion);
+  STORE(m_hdr->Compression);
+  STORE(m_hdr->NumRecords);
+  STORE(m_hdr->MaxStacks);
+  STORE(m_hdr->BucketSize);
+  STORE(m_hdr->NumBuckets);
+  STORE(m_hdr->Pid);
+  STORE(m_hdr->StartTime);
+  STORE(m_hdr->StartTimeUtc);
+  STORE(m_hdr->CompressionHeaderSize);
+  STORE(m_hdr->CmdLength);
+#undef STORE
+  if(m_hdr->CmdLength)::memcpy(p,m_hdr->CmdLine,m_hdr->CmdLength);
+  return len;
+}
+
+int FOM_mallocHook::FileStats::read(int fd,bool keepOffset){
+  if(fd<0){
+    throw std::ios_base::failure("Invalid file descriptor in read()");
+  }
+  std::vector<char> buff(HeaderAlign);
+  ssize_t nread=::pread64(fd,buff.data(),buff.size(),0);
+  if(nread<0){
+    char ebuff[2048];
+    throw std::ios_base::failure(std::string("Parsing header failed ")+
+				 std::string(strerror_r(errno,ebuff,2048)));
+  }
+  size_t req=requiredSize(buff.data(),nread);
+  if(req>(size_t)nread && nread==(ssize_t)buff.size()){//long command line
+    buff.resize(req);
+    ssize_t more=::pread64(fd,buff.data()+nread,req-nread,nread);
+    if(more<0){
+      char ebuff[2048];
+      throw std::ios_base::failure(std::string("Parsing header failed ")+
+				   std::string(strerror_r(errno,ebuff,2048)));
+    }
+    nread+=more;
+  }
+  parse(buff.data(),nread);
+  if(!keepOffset){
+    if(::lseek64(fd,m_hdr->HeaderSize,SEEK_SET)==-1){
+      char ebuff[2048];
+      throw std::ios_base::failure(std::string("Seek failed ")+
+				   std::string(strerror_r(errno,ebuff,2048)));
+    }
+  }
+  return 0;
+}
+
+int FOM_mallocHook::FileStats::write(int fd,bool keepOffset)const{
+  if(fd<0){
+    throw std::ios_base::failure("Invalid file descriptor in write()");
+  }
+  std::vector<char> buff;
+  size_t len=serialize(buff);
+  ssize_t written=::pwrite64(fd,buff.data(),len,0);
+  if(written==-1 && errno==ESPIPE){//pipe or socket, only valid at the start of the stream
+    written=::write(fd,buff.data(),len);
+    if(written==(ssize_t)len)return 0;
+  }
+  if(written!=(ssize_t)len){
+    char ebuff[2048];
+    throw std::ios_base::failure(std::string("Writing header failed with ")+
+				 std::string(strerror_r(errno,ebuff,2048)));
+  }
+  if(!keepOffset){
+    if(::lseek64(fd,len,SEEK_SET)==-1){
+      char ebuff[2048];
+      throw std::ios_base::failure(std::string("Seek failed ")+
+				   std::string(strerror_r(errno,ebuff,2048)));
+    }
+  }
+  return 0;
+}
+
+int FOM_mallocHook::FileStats::read(std::istream &in){
+  return 0;
+}
+
+int FOM_mallocHook::FileStats::write(std::ostream &out)const{
+  return 0;
+}
+
+std::ostream& FOM_mallocHook::FileStats::print(std::ostream &out)const{
+  out<<"Key              = "<<m_hdr->key<<std::endl;
+  out<<"Tool Version     = "<<m_hdr->ToolVersion<<std::endl;
+  out<<"Compression      = "<<m_hdr->Compression<<std::endl;
+  out<<"Num Records      = "<<m_hdr->NumRecords<<std::endl;
+  out<<"Max Stack Depth  = "<<m_hdr->MaxStacks<<std::endl;
+  out<<"Bucket Size      = "<<m_hdr->BucketSize<<std::endl;
+  out<<"Num Buckets      = "<<m_hdr->NumBuckets<<std::endl;
+  out<<"PID              = "<<m_hdr->Pid<<std::endl;
+  out<<"Start time       = "<<m_hdr->StartTime<<std::endl;
+  out<<"Start time UTC   = "<<m_hdr->StartTimeUtc<<std::endl;
+  out<<"Header Size      = "<<m_hdr->HeaderSize<<std::endl;
+  out<<"Closed           = "<<(isClosed()?"yes":"no")<<std::endl;
+  out<<"Command Line     = "<<std::endl;
+  auto cmdline=getCmdLine();
+  for(size_t t=0;t<cmdline.size();t++){
+    out<<"  arg["<<t<<"]   = "<<cmdline.at(t)<<std::endl;
+  }
+  return out;
+}
+/* 
+   INDEXING READER
+*/
+
+FOM_mallocHook::ReaderBase::ReaderBase(const std::string& f,uint access):m_fileStats(0),m_access(access),m_fileName(f){
+
+}
+FOM_mallocHook::ReaderBase::~ReaderBase(){
+
+}
+
+const FOM_mallocHook::TimeIndex& FOM_mallocHook::ReaderBase::getTimeIndex(uint nThreads){
+  if(!m_timeIndex){
+    std::unique_ptr<FOM_mallocHook::TimeIndex> ti(new FOM_mallocHook::TimeIndex());
+    ti->build(*this,nThreads);
+    m_timeIndex.swap(ti);
+  }
+  return *m_timeIndex;
+}
+
+const FOM_mallocHook::OverheadIndex& FOM_mallocHook::ReaderBase::getOverheadIndex(uint nThreads){
+  if(!m_overheadIndex){
+    std::unique_ptr<FOM_mallocHook::OverheadIndex> oi(new FOM_mallocHook::OverheadIndex());
+    oi->build(*this,nThreads);
+    m_overheadIndex.swap(oi);
+  }
+  return *m_overheadIndex;
+}
+
+uint64_t FOM_mallocHook::ReaderBase::overheadBefore(size_t t){
+  return getOverheadIndex().offset(*this,t);
+}
+
+FOM_mallocHook::FullRecord FOM_mallocHook::ReaderBase::AtCorrected(size_t t){
+  FOM_mallocHook::FullRecord fr=At(t);
+  auto h=(FOM_mallocHook::header*)fr.getBuffer();
+  if(h){
+    uint64_t o=overheadBefore(t);
+    h->tstart-=o;
+    h->treturn-=o;
+    h->tend-=o;
+  }
+  return fr;
+}
+
+size_t FOM_mallocHook::ReaderBase::lowerBoundTime(uint64_t t){
+  return getTimeIndex().lowerBound(*this,t);
+}
+
+size_t FOM_mallocHook::ReaderBase::upperBoundTime(uint64_t t){
+  return getTimeIndex().upperBound(*this,t);
+}
+
+std::pair<size_t,size_t> FOM_mallocHook::ReaderBase::timeRange(uint64_t t0,uint64_t t1){
+  const auto& ti=getTimeIndex();
+  size_t first=ti.lowerBound(*this,t0);
+  size_t last=(t1<t0?first:ti.upperBound(*this,t1));
+  return std::make_pair(first,std::max(first,last));
+}
+
+size_t FOM_mallocHook::ReaderBase::refresh(){
+  size_t n=appendRecords();
+  if(n){//both rebuilt over all records on next use
+    m_timeIndex.reset();
+    m_overheadIndex.reset();
+  }
+  return n;
+}
+
+namespace{
+  // whether the header of trace fileName says its writer has closed it
+  bool traceClosed(const std::string& fileName,FOM_mallocHook::FileStats& fs){
+    int fd=open(fileName.c_str(),O_RDONLY);
+    if(fd==-1)return false;
+    bool closed=false;
+    try{
+      fs.read(fd);
+      closed=fs.isClosed();
+    }catch(const std::exception&){//header being rewritten, try again later
+    }
+    close(fd);
+    return closed;
+  }
+}
+
+bool FOM_mallocHook::ReaderBase::writerFinished(){
+  FOM_mallocHook::FileStats fs;
+  bool finished=traceClosed(m_fileName,fs);
+  if(finished && m_fileStats){
+    m_fileStats->setNumRecords(fs.getNumRecords());
+    m_fileStats->setStackDepthLimit(fs.getMaxStackLen());
+    m_fileStats->setNumBuckets(fs.getNumBuckets());
+  }
+  return finished;
+}
+
+/*
+  RECORD ITERATOR
+*/
+
+FOM_mallocHook::RecordIterator::RecordIterator(const FOM_mallocHook::ReaderBase* r,size_t pos,size_t last):m_r(r),m_pos(pos),m_last(last),
+													   m_p(0),m_end(0){
+  if(m_pos<m_last){
+    m_c=m_r->newCursor();
+    fill();
+  }
+}
+
+FOM_mallocHook::RecordIterator::RecordIterator(const FOM_mallocHook::RecordIterator& o):m_r(o.m_r),m_pos(o.m_pos),m_last(o.m_last),
+											m_p(0),m_end(0){
+  if(o.m_c && (m_pos<m_last)){
+    m_c=m_r->newCursor();
+    fill();
+  }
+}
+
+FOM_mallocHook::RecordIterator& FOM_mallocHook::RecordIterator::operator=(const FOM_mallocHook::RecordIterator& o){
+  if(this!=&o){
+    RecordIterator t(o);
+    *this=std::move(t);
+  }
+  return *this;
+}
+
+void FOM_mallocHook::RecordIterator::fill(){
+  if(m_pos<m_last){
+    size_t n=m_c->span(m_pos,m_last-m_pos,&m_p);
+    m_end=m_p+n;
+  }else{
+    m_p=m_end=0;
+  }
+}
+
+/*
+  TIME INDEX
+*/
+
+FOM_mallocHook::TimeIndex::TimeIndex():m_nRecords(0){
+}
+
+void FOM_mallocHook::TimeIndex::build(const FOM_mallocHook::ReaderBase& r,uint nThreads){
+  auto c=r.newCursor();
+  m_nRecords=c->size();
+  size_t nBlocks=(m_nRecords+BlockSize-1)/BlockSize;
+  std::vector<uint64_t> tMin(nBlocks),tMax(nBlocks);
+  if(nThreads==0)nThreads=std::max(1u,std::thread::hardware_concurrency());
+  nThreads=std::max((size_t)1,std::min((size_t)nThreads,nBlocks));
+  FOM_mallocHook::onThreads(nThreads,"Building time index failed",[&](uint k){
+      std::unique_ptr<FOM_mallocHook::Cursor> cur=(k==0?std::move(c):r.newCursor());
+      for(size_t b=nBlocks*k/nThreads;b<nBlocks*(k+1)/nThreads;b++){
+	size_t i=b*BlockSize;
+	size_t e=std::min(i+BlockSize,m_nRecords);
+	uint64_t lo=UINT64_MAX,hi=0;
+	cur->forEach([&lo,&hi](const FOM_mallocHook::RecordIndex& ri){
+	    uint64_t t=ri.getTStart();
+	    lo=std::min(lo,t);
+	    hi=std::max(hi,t);
+	  },i,e);
+	tMin[b]=lo;
+	tMax[b]=hi;
+      }
+    });
+  m_maxBefore.resize(nBlocks);
+  m_minAfter.resize(nBlocks);
+  uint64_t hi=0,lo=UINT64_MAX;
+  for(size_t b=0;b<nBlocks;b++){
+    hi=std::max(hi,tMax[b]);
+    m_maxBefore[b]=hi;
+  }
+  for(size_t b=nBlocks;b>0;b--){
+    lo=std::min(lo,tMin[b-1]);
+    m_minAfter[b-1]=lo;
+  }
+}
+
+/*
+  OVERHEAD INDEX
+*/
+
+FOM_mallocHook::OverheadIndex::OverheadIndex():m_nRecords(0),m_prefix(1,0){
+}
+
+void FOM_mallocHook::OverheadIndex::build(const FOM_mallocHook::ReaderBase& r,uint nThreads){
+  auto c=r.newCursor();
+  m_nRecords=c->size();
+  size_t nBlocks=(m_nRecords+BlockSize-1)/BlockSize;
+  std::vector<uint64_t> sums(nBlocks);
+  if(nThreads==0)nThreads=std::max(1u,std::thread::hardware_concurrency());
+  nThreads=std::max((size_t)1,std::min((size_t)nThreads,nBlocks));
+  FOM_mallocHook::onThreads(nThreads,"Building overhead index failed",[&](uint k){
+      std::unique_ptr<FOM_mallocHook::Cursor> cur=(k==0?std::move(c):r.newCursor());
+      size_t b=nBlocks*k/nThreads;
+      size_t first=b*BlockSize;
+      size_t last=std::min(nBlocks*(k+1)/nThreads*BlockSize,m_nRecords);
+      size_t i=first;
+      uint64_t s=0;
+      cur->forEach([&](const FOM_mallocHook::RecordIndex& ri){
+	  s+=overhead(ri);
+	  if(++i%BlockSize==0||i==last){
+	    sums[b++]=s;
+	    s=0;
+	  }
+	},first,last);
+    });
+  m_prefix.assign(nBlocks+1,0);
+  for(size_t b=0;b<nBlocks;b++){
+    m_prefix[b+1]=m_prefix[b]+sums[b];
+  }
+}
+
+FOM_mallocHook::IndexingReader::IndexingReader(std::string fileName,uint indexPeriod,uint access):ReaderBase(fileName,access),m_fileHandle(-1),
+										      m_fileLength(0),m_fileName(fileName),
+										      m_fileBegin(0),m_fileOpened(false),
+										      m_period(indexPeriod),m_remainder(0),
+										      m_lastIndex(0),m_numRecords(0),
+										      m_lastHdr(0)
+{
+  if(m_fileName.empty())throw std::ios_base::failure("File name is empty ");
+  int inpFile=open(m_fileName.c_str(),O_RDONLY);
+  if(inpFile==-1){
+    std::cerr<<"Input file \""<<m_fileName<<"\" does not exist"<<std::endl;
+    char buff[2048];
+    throw std::ios_base::failure(std::string(strerror_r(errno,buff,2048)));
+  }
+  m_fileHandle=inpFile;
+  struct stat sinp;
+  if(fstat(m_fileHandle,&sinp)==-1){
+    char buff[2048];
+    throw std::ios_base::failure(std::string(strerror_r(errno,buff,2048)));    
+  }
+  if(sinp.st_size<(ssize_t)sizeof(FOM_mallocHook::header)){
+    throw std::length_error("Corrupt file. File is too short");
+  }
+  m_fileLength=sinp.st_size;
+  m_fileOpened=true;
+  //size_t nrecords=0;
+  char buff[2050];
+  m_fileBegin=mapTrace(inpFile,sinp.st_size,m_access);
+  if(m_fileBegin==MAP_FAILED){
+    throw std::ios_base::failure(std::string(strerror_r(errno,buff,2048))+"failed to mmap "+m_fileName);        
+  }
+  m_fileStats=new FOM_mallocHook::FileStats();
+  off_t hdrOff=m_fileStats->parse(m_fileBegin,sinp.st_size);
+  
+  std::cout<<"Starting to scan the file. File should contain "<<
+    m_fileStats->getNumRecords()<<" entries"<<std::endl;
+  if(m_period<1)m_period=100;
+  std::vector<uint64_t> offsets;
+  size_t count=FOM_mallocHook::indexRecords(m_fileBegin,hdrOff,sinp.st_size,m_period,offsets);
+  m_records.reserve(offsets.size());
+  for(auto o:offsets){
+    m_records.emplace_back((const FOM_mallocHook::header*)((const char*)m_fileBegin+o));
+  }
+  if(!m_records.empty())m_lastHdr=m_records.front().getHeader();
+  if(m_access&AccessHugePages)FOM_mallocHook::adviseHugePages(m_records.data(),m_records.size()*sizeof(RecordIndex));
+  m_numRecords=count;
+  m_remainder=((count-1)%m_period);
+  std::cout<<"Counted "<<count<<" records. Created "<<m_records.size()<<" index points. Remaining "<< m_remainder<<" records"<<std::endl;
+}
+
+// const FOM_mallocHook::FileStats* FOM_mallocHook::IndexingReader::getFileStats()const{
+//   return m_fileStats;
+// }
+
+FOM_mallocHook::IndexingReader::~IndexingReader(){
+  if(m_fileOpened){
+    munmap(m_fileBegin,m_fileLength);
+    close(m_fileHandle);
+    m_records.clear();
+  }
+  delete m_fileStats;
+}
+
+const FOM_mallocHook::RecordIndex FOM_mallocHook::IndexingReader::at(size_t t){
+  return FOM_mallocHook::RecordIndex(locate(t,&m_lastIndex,&m_lastHdr));
+}
+
+// walks from the closest index point, or from the last record returned if
+// that is closer. lastIndex and lastHdr are the caller's position
+const FOM_mallocHook::header* FOM_mallocHook::IndexingReader::locate(size_t t,size_t* lastIndex,
+								     const FOM_mallocHook::header** lastHdr)const{
+  if(t>=m_numRecords){
+    char bu[500];
+    snprintf(bu,500,"Asked for an index larger than number of records! t=%ld size=%ld",t,m_numRecords);
+    throw std::length_error(bu);
+  }
+  size_t bucket=t/m_period;
+  size_t offset=t-(bucket*m_period);
+  if(offset==0){return m_records.at(bucket).getHeader();}
+  size_t d=t-*lastIndex;
+  if((d>0) &&(d<offset)){
+    auto h=*lastHdr;
+    for(size_t i=0;i<d;i++){
+      h=FOM_mallocHook::nextRecord(h);
+    }
+    *lastHdr=h;
+  }else{
+    auto h=m_records.at(bucket).getHeader();
+    for(size_t i=0;i<offset;i++){
+      h=FOM_mallocHook::nextRecord(h);
+    }
+    *lastHdr=h;
+  }
+  *lastIndex=t;
+  return *lastHdr;
+}
+
+class FOM_mallocHook::IndexingReader::CursorImpl:public FOM_mallocHook::Cursor{
+public:
+  CursorImpl(const FOM_mallocHook::IndexingReader* r):m_r(r),m_lastIndex(0),
+						     m_lastHdr(r->m_records.empty()?0:r->m_records.front().getHeader()){};
+  const FOM_mallocHook::RecordIndex at(size_t t) override{
+    return FOM_mallocHook::RecordIndex(m_r->locate(t,&m_lastIndex,&m_lastHdr));
+  };
+  size_t size()const override{return m_r->m_numRecords;};
+  // Each record is found from the one before it. The chains starting at
+  // first and at every index point in the batch are independent and
+  // walked side by side, so that their loads overlap
+  size_t span(size_t first,size_t maxCount,const FOM_mallocHook::RecordIndex** recs) override{
+    *recs=m_batch;
+    if(maxCount==0)return 0;
+    auto h=m_r->locate(first,&m_lastIndex,&m_lastHdr);
+    size_t n=std::min(std::min(maxCount,BatchSize),m_r->m_numRecords-first);
+    size_t p=m_r->m_period;
+    size_t nChains=1;
+    m_heads[0]=h;
+    m_starts[0]=0;
+    for(size_t q=(first/p+1)*p;q<first+n;q+=p){
+      m_heads[nChains]=m_r->m_records[q/p].getHeader();
+      m_starts[nChains]=q-first;
+      nChains++;
+    }
+    m_starts[nChains]=n;
+    size_t longest=0;
+    for(size_t c=0;c<nChains;c++){
+      m_batch[m_starts[c]]=FOM_mallocHook::RecordIndex(m_heads[c]);
+      longest=std::max(longest,m_starts[c+1]-m_starts[c]);
+    }
+    for(size_t j=1;j<longest;j++){
+      for(size_t c=0;c<nChains;c++){
+	if(m_starts[c]+j<m_starts[c+1]){
+	  m_heads[c]=FOM_mallocHook::nextRecord(m_heads[c]);
+	  m_batch[m_starts[c]+j]=FOM_mallocHook::RecordIndex(m_heads[c]);
+	}
+      }
+    }
+    m_lastIndex=first+n-1;
+    m_lastHdr=m_batch[n-1].getHeader();
+    return n;
+  };
+private:
+  const FOM_mallocHook::IndexingReader* m_r;
+  size_t m_lastIndex;
+  const FOM_mallocHook::header* m_lastHdr;
+  FOM_mallocHook::RecordIndex m_batch[BatchSize];
+  const FOM_mallocHook::header* m_heads[BatchSize+1];
+  size_t m_starts[BatchSize+2];
+};
+
+std::unique_ptr<FOM_mallocHook::Cursor> FOM_mallocHook::IndexingReader::newCursor()const{
+  return std::unique_ptr<FOM_mallocHook::Cursor>(new CursorImpl(this));
+}
+
+void FOM_mallocHook::IndexingReader::setAccessPattern(uint access){
+  ReaderBase::setAccessPattern(access);
+  FOM_mallocHook::adviseMapping(m_fileBegin,m_fileLength,access);
+  if(access&AccessHugePages)FOM_mallocHook::adviseHugePages(m_records.data(),m_records.size()*sizeof(RecordIndex));
+}
+
+FOM_mallocHook::FullRecord FOM_mallocHook::IndexingReader::At(size_t t){
+  return FOM_mallocHook::FullRecord(at(t));
+}
+
+size_t FOM_mallocHook::IndexingReader::size(){
+  return (((m_records.size()-1)*m_period)+m_remainder+1);
+}
+size_t FOM_mallocHook::IndexingReader::indexedSize(){
+  return m_records.size();
+}
+
+/* COMPACT READER
+ */
+
+FOM_mallocHook::CompactReader::CompactReader(std::string fileName,uint access):ReaderBase(fileName,access),m_fileHandle(-1),
+								    m_fileLength(0),m_fileBegin(0),
+								    m_fileOpened(false)
+{
+  if(fileName.empty())throw std::ios_base::failure("File name is empty");
+  int inpFile=open(fileName.c_str(),O_RDONLY);
+  if(inpFile==-1){
+    std::cerr<<"Input file \""<<fileName<<"\" does not exist"<<std::endl;
+    char buff[2048];
+    throw std::ios_base::failure(std::string(strerror_r(errno,buff,2048)));
+  }
+  m_fileHandle=inpFile;
+  struct stat sinp;
+  if(fstat(m_fileHandle,&sinp)==-1){
+    char buff[2048];
+    throw std::ios_base::failure(std::string(strerror_r(errno,buff,2048)));
+  }
+  if((size_t)sinp.st_size<sizeof(FOM_mallocHook::header)){
+    throw std::length_error("Corrupt file. File is too short");
+  }
+  m_fileLength=sinp.st_size;
+  m_fileOpened=true;
+  char buff[2050];
+  m_fileBegin=mapTrace(inpFile,sinp.st_size,m_access);
+  if(m_fileBegin==MAP_FAILED){
+    throw std::ios_base::failure(std::string(strerror_r(errno,buff,2048))+"failed to mmap "+fileName);
+  }
+  m_fileStats=new FOM_mallocHook::FileStats();
+  off_t hdrOff=m_fileStats->parse(m_fileBegin,sinp.st_size);
+  std::cout<<"Starting to scan the file. File should contain "<<
+    m_fileStats->getNumRecords()<<" entries"<<std::endl;
+  FOM_mallocHook::indexRecords(m_fileBegin,hdrOff,sinp.st_size,m_offsets);
+  if(m_access&AccessHugePages)m_offsets.adviseHugePages();
+  std::cout<<"Found "<<m_offsets.size()<<" records, index uses "
+	   <<(m_offsets.size()?(double)m_offsets.memoryBytes()/m_offsets.size():0.)<<" bytes/record"<<std::endl;
+}
+
+FOM_mallocHook::CompactReader::~CompactReader(){
+  if(m_fileOpened){
+    munmap(m_fileBegin,m_fileLength);
+    close(m_fileHandle);
+  }
+  delete m_fileStats;
+}
+
+const FOM_mallocHook::RecordIndex FOM_mallocHook::CompactReader::at(size_t t){
+  return record(t);
+}
+
+const FOM_mallocHook::RecordIndex FOM_mallocHook::CompactReader::record(size_t t)const{
+  if(t>=m_offsets.size()){
+    char bu[500];
+    snprintf(bu,500,"Asked for an index larger than number of records! t=%ld size=%ld",t,m_offsets.size());
+    throw std::out_of_range(bu);
+  }
+  return FOM_mallocHook::RecordIndex((const FOM_mallocHook::header*)((const char*)m_fileBegin+m_offsets.at(t)));
+}
+
+void FOM_mallocHook::CompactReader::setAccessPattern(uint access){
+  ReaderBase::setAccessPattern(access);
+  FOM_mallocHook::adviseMapping(m_fileBegin,m_fileLength,access);
+  if(access&AccessHugePages)m_offsets.adviseHugePages();
+}
+
+FOM_mallocHook::FullRecord FOM_mallocHook::CompactReader::At(size_t t){
+  return FOM_mallocHook::FullRecord(at(t));
+}
+
+size_t FOM_mallocHook::CompactReader::size(){return m_offsets.size();}
+
+class FOM_mallocHook::CompactReader::CursorImpl:public FOM_mallocHook::Cursor{
+public:
+  CursorImpl(const FOM_mallocHook::CompactReader* r):m_r(r){};
+  const FOM_mallocHook::RecordIndex at(size_t t) override{return m_r->record(t);};
+  size_t size()const override{return m_r->m_offsets.size();};
+  // offsets are decoded in one go, the records do not have to be walked
+  size_t span(size_t first,size_t maxCount,const FOM_mallocHook::RecordIndex** recs) override{
+    *recs=m_batch;
+    if(maxCount==0)return 0;
+    m_batch[0]=m_r->record(first);
+    size_t n=std::min(std::min(maxCount,BatchSize),m_r->m_offsets.size()-first);
+    m_r->m_offsets.decode(first,n,m_offs);
+    const char* b=(const char*)m_r->m_fileBegin;
+    for(size_t i=1;i<n;i++)m_batch[i]=FOM_mallocHook::RecordIndex((const FOM_mallocHook::header*)(b+m_offs[i]));
+    return n;
+  };
+private:
+  const FOM_mallocHook::CompactReader* m_r;
+  uint64_t m_offs[BatchSize];
+  FOM_mallocHook::RecordIndex m_batch[BatchSize];
+};
+
+std::unique_ptr<FOM_mallocHook::Cursor> FOM_mallocHook::CompactReader::newCursor()const{
+  return std::unique_ptr<FOM_mallocHook::Cursor>(new CursorImpl(this));
+}
+
+/*
+  SEGMENTED READER
+ */
+
+static FOM_mallocHook::ReaderBase* openSegmentReader(const std::string& fileName,uint access){
+  int inpFile=open(fileName.c_str(),O_RDONLY);
+  if(inpFile==-1){
+    std::cerr<<"Segment \""<<fileName<<"\" does not exist"<<std::endl;
+    char buff[2048];
+    throw std::ios_base::failure(std::string(strerror_r(errno,buff,2048)));
+  }
+  FOM_mallocHook::FileStats fs;
+  fs.read(inpFile,false);
+  close(inpFile);
+  int compressionMode=(fs.getCompression()/10000000);
+  switch(compressionMode){
+  case(0):
+    return new FOM_mallocHook::Reader(fileName,true,access);
+#ifdef ZLIB_FOUND
+  case(_USE_ZLIB_COMPRESSION_):
+    return new FOM_mallocHook::ZlibReader(fileName,3,true,access);
+#endif
+  default:
+    throw std::ios_base::failure(std::string("Unsupported compression in segment ")+fileName);
+  }
+  return 0;
+}
+
+FOM_mallocHook::ReaderBase* FOM_mallocHook::openReader(const std::string& fileName,uint access){
+  const std::string manifestSuffix(".manifest");
+  if(fileName.size()>manifestSuffix.size() &&
+     fileName.compare(fileName.size()-manifestSuffix.size(),manifestSuffix.size(),manifestSuffix)==0){
+    return new FOM_mallocHook::SegmentedReader(fileName,2,access);
+  }
+  return openSegmentReader(fileName,access);
+}
+
+FOM_mallocHook::SegmentedReader::SegmentedReader(std::string manifestName,uint maxOpenSegments,uint access):ReaderBase(manifestName,access),
+												m_numRecords(0),
+												m_maxOpen(maxOpenSegments),
+												m_nOpen(0),m_useCount(0),
+												m_currSegment(0){
+  if(manifestName.empty())throw std::ios_base::failure("File name is empty ");
+  if(m_maxOpen<1)m_maxOpen=1;
+  std::ifstream mf(manifestName);
+  if(!mf.good()){
+    std::cerr<<"Manifest \""<<manifestName<<"\" does not exist"<<std::endl;
+    throw std::ios_base::failure("Can't open manifest");
+  }
+  std::string dir;
+  auto slash=manifestName.rfind('/');
+  if(slash!=std::string::npos)dir=manifestName.substr(0,slash+1);
+  std::string line;
+  while(std::getline(mf,line)){
+    if(line.empty()||line[0]=='#')continue;
+    std::istringstream ls(line);
+    Segment s;
+    ls>>s.fileName>>s.nRecords>>s.tFirst>>s.tLast;
+    if(ls.fail()){
+      throw std::length_error(std::string("Corrupt manifest line \"")+line+"\"");
+    }
+    if(s.fileName[0]!='/')s.fileName=dir+s.fileName;
+    s.firstRecord=m_numRecords;
+    s.reader.reset();
+    s.lastUse=0;
+    m_numRecords+=s.nRecords;
+    m_segments.push_back(s);
+  }
+  //a writer that did not exit cleanly leaves its last segment out of the manifest
+  const std::string suffix(".manifest");
+  if(manifestName.size()>suffix.size() &&
+     manifestName.compare(manifestName.size()-suffix.size(),suffix.size(),suffix)==0){
+    char buff[32];
+    snprintf(buff,32,".%04lu",m_segments.size());
+    std::string trailing=manifestName.substr(0,manifestName.size()-suffix.size())+buff;
+    struct stat st;
+    if(::stat(trailing.c_str(),&st)==0){
+      try{
+	Segment s;
+	s.fileName=trailing;
+	s.lastUse=0;
+	s.reader.reset(openSegmentReader(trailing,m_access));
+	s.firstRecord=m_numRecords;
+	s.nRecords=s.reader->size();
+	s.tFirst=(s.nRecords?s.reader->at(0).getTStart():0);
+	s.tLast=(s.nRecords?s.reader->at(s.nRecords-1).getTEnd():0);
+	s.lastUse=++m_useCount;
+	m_numRecords+=s.nRecords;
+	m_segments.push_back(s);
+	m_nOpen++;
+	std::cerr<<"Segment \""<<trailing<<"\" is not in manifest, found "<<s.nRecords<<" records"<<std::endl;
+      }catch(const std::exception &ex){
+	std::cerr<<"Skipping unlisted segment \""<<trailing<<"\": "<<ex.what()<<std::endl;
+      }
+    }
+  }
+  if(m_segments.empty()){
+    throw std::length_error("Manifest does not list any segments");
+  }
+  //file stats of the first segment, with the totals of the whole set
+  int inpFile=open(m_segments.front().fileName.c_str(),O_RDONLY);
+  if(inpFile==-1){
+    std::cerr<<"Segment \""<<m_segments.front().fileName<<"\" does not exist"<<std::endl;
+    char buff[2048];
+    throw std::ios_base::failure(std::string(strerror_r(errno,buff,2048)));
+  }
+  m_fileStats=new FOM_mallocHook::FileStats();
+  m_fileStats->read(inpFile,false);
+  close(inpFile);
+  m_fileStats->setNumRecords(m_numRecords);
+}
+
+FOM_mallocHook::SegmentedReader::~SegmentedReader(){
+  m_currReader.reset();
+  for(auto &s:m_segments){
+    s.reader.reset();
+  }
+  delete m_fileStats;
+  m_fileStats=0;
+}
+
+// readers of closed segments live on as long as someone is still using them
+std::shared_ptr<FOM_mallocHook::ReaderBase> FOM_mallocHook::SegmentedReader::openSegment(size_t seg)const{
+  std::lock_guard<std::mutex> lk(m_mutex);
+  auto &s=m_segments[seg];
+  s.lastUse=++m_useCount;
+  if(s.reader)return s.reader;
+  if(m_nOpen>=m_maxOpen){//close least recently used segment
+    const Segment* lru=0;
+    for(auto &o:m_segments){
+      if(o.reader && (!lru || o.lastUse<lru->lastUse))lru=&o;
+    }
+    lru->reader.reset();
+    m_nOpen--;
+  }
+  s.reader.reset(openSegmentReader(s.fileName,m_access));
+  m_nOpen++;
+  if(s.reader->size()!=s.nRecords){
+    std::cerr<<"Segment \""<<s.fileName<<"\" has "<<s.reader->size()
+	     <<" records, manifest lists "<<s.nRecords<<std::endl;
+  }
+  return s.reader;
+}
+
+const FOM_mallocHook::RecordIndex FOM_mallocHook::SegmentedReader::at(size_t t){
+  if(t>=m_numRecords){
+    char bu[500];
+    snprintf(bu,500,"Asked for an index larger than number of records! t=%ld size=%ld",t,m_numRecords);
+    throw std::length_error(bu);
+  }
+  auto *cs=&m_segments[m_currSegment];
+  if(!m_currReader || t<cs->firstRecord || t>=(cs->firstRecord+cs->nRecords)){
+    m_currSegment=findSegment(t);
+    cs=&m_segments[m_currSegment];
+    m_currReader=openSegment(m_currSegment);
+  }
+  return m_currReader->at(t-cs->firstRecord);
 }
 
-void FOM_mallocHook::FileStats::setStartTimeUTC(uint64_t t){
-  m_hdr->StartTimeUtc=t;
+void FOM_mallocHook::SegmentedReader::setAccessPattern(uint access){
+  std::lock_guard<std::mutex> lk(m_mutex);
+  ReaderBase::setAccessPattern(access);
+  for(auto &s:m_segments){
+    if(s.reader)s.reader->setAccessPattern(access);
+  }
 }
 
-void FOM_mallocHook::FileStats::setPid(uint32_t p){
-  m_hdr->Pid=p;
+FOM_mallocHook::FullRecord FOM_mallocHook::SegmentedReader::At(size_t t){
+  return FOM_mallocHook::FullRecord(at(t));
 }
 
-void FOM_mallocHook::FileStats::setCompression(int comp){
-  m_hdr->Compression=comp;
+size_t FOM_mallocHook::SegmentedReader::size(){
+  return m_numRecords;
 }
 
-void FOM_mallocHook::FileStats::setBucketSize(size_t n){
-  m_hdr->BucketSize=n;
+bool FOM_mallocHook::SegmentedReader::writerFinished(){
+  for(const auto &s:m_segments){
+    FOM_mallocHook::FileStats fs;
+    if(!traceClosed(s.fileName,fs))return false;
+  }
+  return true;
 }
 
-void FOM_mallocHook::FileStats::setNumBuckets(size_t n){
-  m_hdr->NumBuckets=n;
+size_t FOM_mallocHook::SegmentedReader::findSegment(size_t t)const{
+  auto s=std::upper_bound(m_segments.begin(),m_segments.end(),t,
+			  [](const size_t a,const Segment &b)->bool{return a<b.firstRecord;});
+  return std::distance(m_segments.begin(),s)-1;
 }
 
-int FOM_mallocHook::FileStats::read(int fd,bool keepOffset){
-  if(fd<0){
-    throw std::ios_base::failure("Invalid file descriptor in read()");
-  }
-  auto currPos=::lseek64(fd,0,SEEK_CUR);
-  if(currPos==-1){
-    char buff[2048];
-    throw std::ios_base::failure(std::string("Finding file offset failed ")+
-				 std::string(strerror_r(errno,buff,2048)));
-  }
-  auto fBegin=::lseek64(fd,0,SEEK_SET);
-  if(fBegin==-1){
-    char buff[2048];
-    throw std::ios_base::failure(std::string("File seek failed ")+
-				 std::string(strerror_r(errno,buff,2048)));
-  }
-  
-  READS(fd,m_hdr->key);
-  READ(fd,m_hdr->ToolVersion);
-  READ(fd,m_hdr->Compression);
-  READ(fd,m_hdr->NumRecords);
-  READ(fd,m_hdr->MaxStacks);
-  READ(fd,m_hdr->BucketSize);
-  READ(fd,m_hdr->NumBuckets);
-  READ(fd,m_hdr->Pid);
-  READ(fd,m_hdr->StartTime);
-  READ(fd,m_hdr->StartTimeUtc);
-  //  if(m_hdr->Compression>0){
-  READ(fd,m_hdr->CompressionHeaderSize);
-    // }
-  READ(fd,m_hdr->CmdLength);
-  delete[] m_hdr->CmdLine;
-  m_hdr->CmdLine=0;
-  if(m_hdr->CmdLength){
-    m_hdr->CmdLine=new char[m_hdr->CmdLength+1];
-    if(::read(fd,m_hdr->CmdLine,m_hdr->CmdLength)<0){
-      char buff[2048];
-      throw std::ios_base::failure(std::string("Parsing header failed ")+
-				   std::string(strerror_r(errno,buff,2048)));
+class FOM_mallocHook::SegmentedReader::CursorImpl:public FOM_mallocHook::Cursor{
+public:
+  CursorImpl(const FOM_mallocHook::SegmentedReader* r):m_r(r),m_segment(0){};
+  const FOM_mallocHook::RecordIndex at(size_t t) override{
+    auto cs=seek(t);
+    return m_cursor->at(t-cs->firstRecord);
+  };
+  size_t size()const override{return m_r->m_numRecords;};
+  // spans end at the end of the segment
+  size_t span(size_t first,size_t maxCount,const FOM_mallocHook::RecordIndex** recs) override{
+    auto cs=seek(first);
+    size_t n=std::min(maxCount,cs->firstRecord+cs->nRecords-first);
+    return m_cursor->span(first-cs->firstRecord,n,recs);
+  };
+private:
+  const FOM_mallocHook::SegmentedReader::Segment* seek(size_t t){
+    if(t>=m_r->m_numRecords){
+      char bu[500];
+      snprintf(bu,500,"Asked for an index larger than number of records! t=%ld size=%ld",t,m_r->m_numRecords);
+      throw std::length_error(bu);
+    }
+    const auto* cs=&m_r->m_segments[m_segment];
+    if(!m_cursor || t<cs->firstRecord || t>=(cs->firstRecord+cs->nRecords)){
+      m_segment=m_r->findSegment(t);
+      cs=&m_r->m_segments[m_segment];
+      m_cursor.reset();
+      m_reader=m_r->openSegment(m_segment);
+      m_cursor=m_reader->newCursor();
+    }
+    return cs;
+  };
+  const FOM_mallocHook::SegmentedReader* m_r;
+  size_t m_segment;
+  std::shared_ptr<FOM_mallocHook::ReaderBase> m_reader;
+  std::unique_ptr<FOM_mallocHook::Cursor> m_cursor;
+};
+
+std::unique_ptr<FOM_mallocHook::Cursor> FOM_mallocHook::SegmentedReader::newCursor()const{
+  return std::unique_ptr<FOM_mallocHook::Cursor>(new CursorImpl(this));
+}
+
+/*
+  SYNC MARKERS
+*/
+
+const FOM_mallocHook::header* FOM_mallocHook::findSyncMarker(const void* fileBegin,const void* from,const void* end){
+  const char* p=(const char*)from;
+  const char* e=(const char*)end;
+  const size_t magicOffset=offsetof(FOM_mallocHook::header,treturn);
+  while(p<e){
+    const char* m=(const char*)::memmem(p,e-p,&FOM_mallocHook::SyncMagic,sizeof(FOM_mallocHook::SyncMagic));
+    if(!m)return 0;
+    auto h=(const FOM_mallocHook::header*)(m-magicOffset);
+    //a marker knows its own offset, which rules out records that happen to contain the magic
+    if(((const char*)h>=(const char*)from) && ((const char*)(h+1)<=e) &&
+       (h->allocType==FOM_mallocHook::SyncMarker) &&
+       (h->addr==(uintptr_t)((const char*)h-(const char*)fileBegin))){
+      return h;
     }
-    // std::cout<<"cmdLine="<<m_hdr->cmdLine<<std::endl;
+    p=m+1;
   }
-  if(keepOffset){
-    if(::lseek64(fd,currPos,SEEK_SET)==-1){
-      char buff[2048];
-      throw std::ios_base::failure(std::string("Seek failed ")+
-				   std::string(strerror_r(errno,buff,2048)));
+  return 0;
+}
+
+const FOM_mallocHook::header* FOM_mallocHook::findLastSyncMarker(const void* fileBegin,const void* from,const void* end){
+  const size_t window=1<<20;
+  const char* b=(const char*)from;
+  const char* e=(const char*)end;
+  const char* hi=e;
+  while(hi>b){
+    const char* lo=((size_t)(hi-b)>window)?hi-window:b;
+    const char* wend=std::min(e,hi+sizeof(FOM_mallocHook::header));//markers crossing hi
+    const FOM_mallocHook::header *last=0,*h=0;
+    const char* p=lo;
+    while((h=findSyncMarker(fileBegin,p,wend)) && ((const char*)h<hi)){
+      last=h;
+      p=((const char*)h)+1;
     }
-    // std::cout<<"File Offset "<<currPos<<std::endl;
+    if(last)return last;
+    hi=lo;
   }
   return 0;
 }
 
-int FOM_mallocHook::FileStats::write(int fd,bool keepOffset)const{
+namespace{
+  const int maxPlausibleDepth=4096;
+
+  // false for partial, zero filled or misaligned data. Special records are
+  // recognized by their magic, chunks may be longer than any stack
+  bool plausibleRecord(const FOM_mallocHook::header* h,const char* end){
+    if((const char*)(h+1)>end)return false;
+    if(h->count<0)return false;
+    if(FOM_mallocHook::isSpecialRecord(h)){
+      if((h->treturn!=FOM_mallocHook::SyncMagic)&&(h->treturn!=FOM_mallocHook::ChunkMagic))return false;
+    }else{
+      if(h->count>maxPlausibleDepth)return false;
+      if(((unsigned char)h->allocType>3)||(h->tstart==0)||(h->tend<h->tstart))return false;
+    }
+    return (const char*)FOM_mallocHook::skipRecord(h)<=end;
+  }
+}
 
-  if(fd<0){
-    throw std::ios_base::failure("Invalid file descriptor in write()");
+size_t FOM_mallocHook::recoverFile(const std::string& fileName,bool fix){
+  int fd=open(fileName.c_str(),fix?O_RDWR:O_RDONLY);
+  if(fd==-1){
+    std::cerr<<"Input file \""<<fileName<<"\" does not exist"<<std::endl;
+    char buff[2048];
+    throw std::ios_base::failure(std::string(strerror_r(errno,buff,2048)));
   }
-  auto currPos=::lseek64(fd,0,SEEK_CUR);
-  if(currPos==-1){
+  struct stat sinp;
+  if(fstat(fd,&sinp)==-1){
     char buff[2048];
-    throw std::ios_base::failure(std::string("Finding file offset failed ")+
-				 std::string(strerror_r(errno,buff,2048)));
+    close(fd);
+    throw std::ios_base::failure(std::string(strerror_r(errno,buff,2048)));
+  }
+  FOM_mallocHook::FileStats fs;
+  fs.read(fd);
+  off_t hdrOff=fs.getHeaderSize();
+  if(fs.getCompression()!=0){
+    close(fd);
+    throw std::invalid_argument("Recovery is only supported for uncompressed files");
   }
-  // std::cout<<"File Offset "<<currPos<<std::endl;
-  if(::lseek64(fd,0,SEEK_SET)==-1){
+  if(sinp.st_size<=hdrOff){
+    close(fd);
+    return 0;
+  }
+  void* fileBegin=mmap64(0,sinp.st_size,PROT_READ,MAP_SHARED,fd,0);
+  if(fileBegin==MAP_FAILED){
     char buff[2048];
-    throw std::ios_base::failure(std::string("File seek failed ")+
-				 std::string(strerror_r(errno,buff,2048)));
+    close(fd);
+    throw std::ios_base::failure(std::string(strerror_r(errno,buff,2048))+"failed to mmap "+fileName);
   }
+  const char* begin=(const char*)fileBegin;
+  const char* end=begin+sinp.st_size;
+  size_t nRecords=0;
+  size_t maxDepth=0;
+  const FOM_mallocHook::header *h=(const FOM_mallocHook::header*)(begin+hdrOff);
+  auto sm=findLastSyncMarker(begin,h,end);
+  if(sm){
+    nRecords=sm->size;
+    maxDepth=*((const FOM_mallocHook::index_t*)(sm+1));
+    h=skipRecord(sm);
+  }
+  //walk the tail and stop at the first partial or implausible (e.g. zero filled) record
+  while((const char*)(h+1)<=end){
+    if(!plausibleRecord(h,end))break;
+    if(!isSpecialRecord(h)){
+      nRecords++;
+      if((size_t)h->count>maxDepth)maxDepth=h->count;
+    }
+    h=skipRecord(h);
+  }
+  off_t validLen=(const char*)h-begin;
+  munmap(fileBegin,sinp.st_size);
+  if(fix){
+    if(validLen<sinp.st_size){
+      std::cerr<<"Dropping "<<sinp.st_size-validLen<<" trailing bytes from "<<fileName<<std::endl;
+      if(ftruncate64(fd,validLen)==-1){
+	char buff[2048];
+	close(fd);
+	throw std::ios_base::failure(std::string("Truncating file failed ")+std::string(strerror_r(errno,buff,2048)));
+      }
+    }
+    fs.setNumRecords(nRecords);
+    fs.setStackDepthLimit(maxDepth);
+    fs.setClosed(true);
+    fs.write(fd,false);
+    fsync(fd);
+  }
+  close(fd);
+  return nRecords;
+}
 
-  WRITES(fd,m_hdr->key);
-  WRITE(fd,m_hdr->ToolVersion);
-  WRITE(fd,m_hdr->Compression);
-  WRITE(fd,m_hdr->NumRecords);
-  WRITE(fd,m_hdr->MaxStacks);
-  WRITE(fd,m_hdr->BucketSize);
-  WRITE(fd,m_hdr->NumBuckets);
-  WRITE(fd,m_hdr->Pid);
-  WRITE(fd,m_hdr->StartTime);
-  WRITE(fd,m_hdr->StartTimeUtc);
-  //if(m_hdr->Compression!=0){
-  WRITE(fd,m_hdr->CompressionHeaderSize);
-    //}
-  WRITE(fd,m_hdr->CmdLength);
+/*
+  FOLLOW MODE
+*/
 
-  if(m_hdr->CmdLength){
-    if(::write(fd,m_hdr->CmdLine,m_hdr->CmdLength)<0){
-      char buff[2048];
-      throw std::ios_base::failure(std::string("Writing header failed with ")+
-				   std::string(strerror_r(errno,buff,2048)));
-    } 
-    // std::cout<<"cmdLine="<<m_hdr->cmdLine<<std::endl;
+// grows the mapping to the current file size and indexes the complete
+// records after m_scanEnd. A zero filled (MmapWriter) or partially written
+// tail stops the walk until the next call
+size_t FOM_mallocHook::Reader::appendRecords(){
+  struct stat sinp;
+  if(fstat(m_fileHandle,&sinp)==-1){
+    char buff[2048];
+    throw std::ios_base::failure(std::string(strerror_r(errno,buff,2048)));
   }
-  if(keepOffset){
-    if(::lseek64(fd,currPos,SEEK_SET)==-1){
+  if((size_t)sinp.st_size>m_fileLength){
+    void* m=mremap(m_fileBegin,m_fileLength,sinp.st_size,MREMAP_MAYMOVE);
+    if(m==MAP_FAILED){
       char buff[2048];
-      throw std::ios_base::failure(std::string("Seek failed ")+
-				   std::string(strerror_r(errno,buff,2048)));
+      throw std::ios_base::failure(std::string(strerror_r(errno,buff,2048))+"failed to grow the mapping of "+m_fileName);
     }
-    // std::cout<<"File Offset "<<currPos<<std::endl;
+    m_fileBegin=m;
+    m_fileLength=sinp.st_size;
+    FOM_mallocHook::adviseMapping(m_fileBegin,m_fileLength,m_access&(~AccessPopulate));
   }
-  return 0;
+  if(m_records!=m_offsets.data()){//offsets came from the index file, which is stale now
+    m_offsets.assign(m_records,m_records+m_numRecords);
+    delete m_index;
+    m_index=0;
+  }
+  const char* begin=(const char*)m_fileBegin;
+  const char* end=begin+std::min(m_fileLength,(size_t)sinp.st_size);//MmapWriter truncates its tail at close
+  auto h=(const FOM_mallocHook::header*)(begin+m_scanEnd);
+  size_t n0=m_offsets.size();
+  while(plausibleRecord(h,end)){
+    if(!isSpecialRecord(h))m_offsets.push_back((const char*)h-begin);
+    h=skipRecord(h);
+  }
+  m_scanEnd=(const char*)h-begin;
+  m_records=m_offsets.data();
+  m_numRecords=m_offsets.size();
+  return m_numRecords-n0;
 }
 
-int FOM_mallocHook::FileStats::read(std::istream &in){
-  return 0;
+FOM_mallocHook::Follower::Follower(FOM_mallocHook::ReaderBase* reader,uint pollMs):m_reader(reader),m_pollMs(std::max(1u,pollMs)),
+										 m_inotify(-1),m_next(0){
+  if(!m_reader->canFollow() && !m_reader->writerFinished()){//would wait forever
+    throw std::ios_base::failure("Can not follow "+m_reader->getFileName()+", its reader does not pick up new records");
+  }
+  m_inotify=inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+  if(m_inotify!=-1 && inotify_add_watch(m_inotify,m_reader->getFileName().c_str(),IN_MODIFY|IN_CLOSE_WRITE)==-1){
+    close(m_inotify);
+    m_inotify=-1;
+  }
 }
 
-int FOM_mallocHook::FileStats::write(std::ostream &out)const{
-  return 0;
+FOM_mallocHook::Follower::~Follower(){
+  if(m_inotify!=-1)close(m_inotify);
 }
 
-std::ostream& FOM_mallocHook::FileStats::print(std::ostream &out)const{
-  out<<"Key              = "<<m_hdr->key<<std::endl;
-  out<<"Tool Version     = "<<m_hdr->ToolVersion<<std::endl;
-  out<<"Compression      = "<<m_hdr->Compression<<std::endl;
-  out<<"Num Records      = "<<m_hdr->NumRecords<<std::endl;
-  out<<"Max Stack Depth  = "<<m_hdr->MaxStacks<<std::endl;
-  out<<"Bucket Size      = "<<m_hdr->BucketSize<<std::endl;
-  out<<"Num Buckets      = "<<m_hdr->NumBuckets<<std::endl;
-  out<<"PID              = "<<m_hdr->Pid<<std::endl;
-  out<<"Start time       = "<<m_hdr->StartTime<<std::endl;
-  out<<"Start time UTC   = "<<m_hdr->StartTimeUtc<<std::endl;
-  out<<"Command Line     = "<<std::endl;
-  auto cmdline=getCmdLine();
-  for(size_t t=0;t<cmdline.size();t++){
-    out<<"  arg["<<t<<"]   = "<<cmdline.at(t)<<std::endl;
+bool FOM_mallocHook::Follower::wait(uint timeoutMs){
+  if(m_inotify==-1){
+    std::this_thread::sleep_for(std::chrono::milliseconds(timeoutMs));
+    return false;
   }
-  return out;
+  struct pollfd pfd;
+  pfd.fd=m_inotify;
+  pfd.events=POLLIN;
+  pfd.revents=0;
+  int r=::poll(&pfd,1,timeoutMs);
+  if(r<=0)return false;
+  char buff[4096];
+  while(::read(m_inotify,buff,sizeof(buff))>0){}//coalesce the events
+  return true;
 }
-/* 
-   INDEXING READER
+
+/*
+  PARALLEL INDEXING
 */
 
-FOM_mallocHook::ReaderBase::ReaderBase(const std::string& f):m_fileStats(0),m_fileName(f){
+namespace{
+  const unsigned int resyncChain=16;//plausible records in a row to trust a boundary found without a marker
+  const size_t resyncWindow=32<<20;//bytes searched for a sync marker before falling back to plausibility
+  const size_t minRangeBytes=16<<20;
+
+  // first record boundary in [from,to): a sync marker if there is one close
+  // by, otherwise the first offset starting a chain of plausible records
+  const char* findBoundary(const char* fileBegin,const char* from,const char* to,const char* end){
+    const char* wEnd=std::min(end,std::min(to,from+resyncWindow)+sizeof(FOM_mallocHook::header));
+    auto sm=FOM_mallocHook::findSyncMarker(fileBegin,from,wEnd);
+    if(sm && ((const char*)sm<to))return (const char*)sm;
+    for(const char* p=from;p<to;p++){
+      auto h=(const FOM_mallocHook::header*)p;
+      unsigned int n=0;
+      while((n<resyncChain)&&((const char*)h<end)&&plausibleRecord(h,end)){
+	h=FOM_mallocHook::skipRecord(h);
+	n++;
+      }
+      if((n==resyncChain)||((n>0)&&((const char*)h==end)))return p;
+    }
+    return 0;
+  }
+
+  // counts regular records in [b,e). stop is the first record boundary at
+  // or after e, or the first implausible record, e.g. after a false resync,
+  // so that a garbage count never walks out of [b,end)
+  size_t countRange(const char* b,const char* e,const char* end,const char** stop){
+    auto h=(const FOM_mallocHook::header*)b;
+    size_t n=0;
+    while(((const char*)h<e)&&plausibleRecord(h,end)){
+      n+=!FOM_mallocHook::isSpecialRecord(h);
+      h=FOM_mallocHook::skipRecord(h);
+    }
+    *stop=(const char*)h;
+    return n;
+  }
+
+  // splits the records of [hdrOff,fileLength) in up to nThreads ranges that
+  // chain up. starts has one entry more than firsts, the end of the file.
+  // firsts are the global indices of the first record in each range.
+  // Returns the number of records
+  size_t splitRanges(const char* begin,size_t hdrOff,size_t fileLength,unsigned int nThreads,
+		     std::vector<const char*>& starts,std::vector<size_t>& firsts){
+    const char* end=begin+fileLength;
+    if(nThreads==0)nThreads=std::max(1u,std::thread::hardware_concurrency());
+    size_t len=(fileLength>hdrOff?fileLength-hdrOff:0);
+    nThreads=std::max((size_t)1,std::min((size_t)nThreads,len/minRangeBytes));
+    starts.assign(1,begin+hdrOff);
+    size_t rangeLen=len/nThreads;
+    for(unsigned int t=1;t<nThreads;t++){
+      const char* from=begin+hdrOff+t*rangeLen;
+      const char* to=(t+1<nThreads)?from+rangeLen:end;
+      const char* b=findBoundary(begin,from,to,end);
+      if(b)starts.push_back(b);
+    }
+    size_t nRanges=starts.size();
+    starts.push_back(end);
+    std::vector<size_t> counts(nRanges,0);
+    std::vector<const char*> stops(nRanges,0);
+    auto count=[&](size_t r){counts[r]=countRange(starts[r],starts[r+1],end,&stops[r]);};
+    {
+      std::vector<std::thread> workers;
+      for(size_t r=1;r<nRanges;r++)workers.emplace_back(count,r);
+      count(0);
+      for(auto &w:workers)w.join();
+    }
+    // a range is trusted only if its predecessor ends exactly where it starts.
+    // Otherwise its boundary was inside a record and it is folded back
+    for(size_t r=0;r+1<nRanges;){
+      if(stops[r]==starts[r+1]){
+	r++;
+	continue;
+      }
+      starts.erase(starts.begin()+r+1);
+      counts.erase(counts.begin()+r+1);
+      stops.erase(stops.begin()+r+1);
+      nRanges--;
+      counts[r]+=countRange(stops[r],starts[r+1],end,&stops[r]);
+    }
+    if(stops.back()<end){//fillRanges() must walk no further than the count
+      std::cerr<<"Indexing stopped at an implausible record "<<(end-stops.back())<<" bytes before the end of the file"<<std::endl;
+      starts.back()=stops.back();
+    }
+    firsts.assign(nRanges,0);
+    size_t total=0;
+    for(size_t r=0;r<nRanges;r++){
+      firsts[r]=total;
+      total+=counts[r];
+    }
+    return total;
+  }
+
+  // calls sink(index,offset) for every regular record, one thread per range
+  template<class Sink> void fillRanges(const char* begin,const std::vector<const char*>& starts,
+				       const std::vector<size_t>& firsts,Sink sink){
+    auto fill=[&](size_t r){
+      auto h=(const FOM_mallocHook::header*)starts[r];
+      size_t n=firsts[r];
+      while((const char*)h<starts[r+1]){
+	if(!FOM_mallocHook::isSpecialRecord(h)){
+	  sink(n,(uint64_t)((const char*)h-begin));
+	  n++;
+	}
+	h=FOM_mallocHook::skipRecord(h);
+      }
+    };
+    std::vector<std::thread> workers;
+    for(size_t r=1;r<firsts.size();r++)workers.emplace_back(fill,r);
+    fill(0);
+    for(auto &w:workers)w.join();
+  }
+}
 
+size_t FOM_mallocHook::indexRecords(const void* fileBegin,size_t hdrOff,size_t fileLength,
+				    unsigned int period,std::vector<uint64_t>& offsets,unsigned int nThreads){
+  const char* begin=(const char*)fileBegin;
+  if(period<1)period=1;
+  std::vector<const char*> starts;
+  std::vector<size_t> firsts;
+  size_t total=splitRanges(begin,hdrOff,fileLength,nThreads,starts,firsts);
+  offsets.resize((total+period-1)/period);
+  uint64_t* out=offsets.data();
+  if(period==1){
+    fillRanges(begin,starts,firsts,[out](size_t n,uint64_t o){out[n]=o;});
+  }else{
+    fillRanges(begin,starts,firsts,[out,period](size_t n,uint64_t o){if((n%period)==0)out[n/period]=o;});
+  }
+  return total;
 }
-FOM_mallocHook::ReaderBase::~ReaderBase(){
 
+size_t FOM_mallocHook::indexRecords(const void* fileBegin,size_t hdrOff,size_t fileLength,
+				    FOM_mallocHook::EliasFano& offsets,unsigned int nThreads){
+  const char* begin=(const char*)fileBegin;
+  std::vector<const char*> starts;
+  std::vector<size_t> firsts;
+  size_t total=splitRanges(begin,hdrOff,fileLength,nThreads,starts,firsts);
+  offsets.reset(total,fileLength);
+  FOM_mallocHook::EliasFano* ef=&offsets;
+  fillRanges(begin,starts,firsts,[ef](size_t n,uint64_t o){ef->set(n,o);});
+  offsets.finalize();
+  return total;
 }
 
-FOM_mallocHook::IndexingReader::IndexingReader(std::string fileName,uint indexPeriod):ReaderBase(fileName),m_fileHandle(-1),
-										      m_fileLength(0),m_fileName(fileName),
-										      m_fileBegin(0),m_fileOpened(false),
-										      m_period(indexPeriod),m_remainder(0),
-										      m_lastIndex(0),m_numRecords(0),
-										      m_lastHdr(0)
-{
-  if(m_fileName.empty())throw std::ios_base::failure("File name is empty ");
-  int inpFile=open(m_fileName.c_str(),O_RDONLY);
-  if(inpFile==-1){
-    std::cerr<<"Input file \""<<m_fileName<<"\" does not exist"<<std::endl;
-    char buff[2048];
-    throw std::ios_base::failure(std::string(strerror_r(errno,buff,2048)));
+/*
+  ELIAS-FANO OFFSETS
+*/
+
+namespace{
+  // bit counting without relying on -mpopcnt, the builtins become library calls otherwise
+  inline uint64_t bytePopcounts(uint64_t x){
+    x=x-((x>>1)&0x5555555555555555ull);
+    x=(x&0x3333333333333333ull)+((x>>2)&0x3333333333333333ull);
+    return (x+(x>>4))&0x0f0f0f0f0f0f0f0full;
   }
-  m_fileHandle=inpFile;
-  struct stat sinp;
-  if(fstat(m_fileHandle,&sinp)==-1){
-    char buff[2048];
-    throw std::ios_base::failure(std::string(strerror_r(errno,buff,2048)));    
+  inline unsigned int popcount64(uint64_t x){
+    return (bytePopcounts(x)*0x0101010101010101ull)>>56;
   }
-  if(sinp.st_size<(ssize_t)sizeof(FOM_mallocHook::header)){
-    throw std::length_error("Corrupt file. File is too short");
+  // position of the k-th (0 based) set bit of x, which must have more than k
+  inline unsigned int selectInWord(uint64_t x,unsigned int k){
+    uint64_t prefix=bytePopcounts(x)*0x0101010101010101ull;//byte i counts the ones in bytes 0..i
+    unsigned int base=0;
+    while(((prefix>>base)&0xff)<=k)base+=8;
+    if(base)k-=(prefix>>(base-8))&0xff;
+    uint64_t b=(x>>base)&0xff;
+    for(unsigned int i=0;i<k;i++)b&=b-1;
+    return base+__builtin_ctzll(b);
   }
-  m_fileLength=sinp.st_size;
-  m_fileOpened=true;
-  //size_t nrecords=0;
-  char buff[2050];
-  m_fileStats=new FOM_mallocHook::FileStats();
-  //std::cout << m_fileStats << " " << m_fileHandle << std::endl;
-  m_fileStats->read(m_fileHandle,false);
-  off_t hdrOff=::lseek64(m_fileHandle,0,SEEK_CUR);
-  ::lseek64(m_fileHandle,0,SEEK_SET);
-  m_fileBegin=mmap64(0,sinp.st_size,PROT_READ,MAP_PRIVATE,inpFile,0);
-  if(m_fileBegin==MAP_FAILED){
-    throw std::ios_base::failure(std::string(strerror_r(errno,buff,2048))+"failed to mmap "+m_fileName);        
+}
+
+FOM_mallocHook::EliasFano::EliasFano():m_size(0),m_lowBits(0){
+}
+
+void FOM_mallocHook::EliasFano::reset(size_t n,uint64_t universe){
+  m_size=n;
+  m_lowBits=0;
+  if(n && (universe/n)>1){
+    m_lowBits=63-__builtin_clzll(universe/n);
   }
-  
-  std::cout<<"Starting to scan the file. File should contain "<<
-    m_fileStats->getNumRecords()<<" entries"<<std::endl;
-  void* fileEnd=(char*)m_fileBegin+sinp.st_size;
-  FOM_mallocHook::header *h=(FOM_mallocHook::header*)(((uintptr_t)m_fileBegin)+hdrOff);
-  m_records.reserve(m_fileStats->getNumRecords());
-  if(m_period<1)m_period=100;
-  size_t count=0;
-  m_lastHdr=h;
-  while ((void*)h<fileEnd){
-    if((count%m_period)==0)m_records.emplace_back(h);
-    h=(FOM_mallocHook::header*)(((FOM_mallocHook::index_t*)(h+1))+h->count);
-    count++;
+  m_lowMask=(m_lowBits?((1ull<<m_lowBits)-1):0);
+  m_low.assign((n*m_lowBits+63)/64+1,0);
+  m_high.assign((n+(universe>>m_lowBits)+1+63)/64+1,0);
+  m_samples.clear();
+}
+
+// records of different threads may share words, hence the atomic or
+void FOM_mallocHook::EliasFano::set(size_t i,uint64_t v){
+  if(m_lowBits){
+    uint64_t lo=v&m_lowMask;
+    size_t bit=i*m_lowBits;
+    size_t w=bit>>6;
+    unsigned int sh=bit&63;
+    __atomic_fetch_or(&m_low[w],lo<<sh,__ATOMIC_RELAXED);
+    if(sh+m_lowBits>64)__atomic_fetch_or(&m_low[w+1],lo>>(64-sh),__ATOMIC_RELAXED);
   }
-  m_numRecords=count;
-  m_remainder=((count-1)%m_period);
-  std::cout<<"Counted "<<count<<" records. Created "<<m_records.size()<<" index points. Remaining "<< m_remainder<<" records"<<std::endl;
+  size_t hb=(v>>m_lowBits)+i;
+  __atomic_fetch_or(&m_high[hb>>6],1ull<<(hb&63),__ATOMIC_RELAXED);
 }
 
-// const FOM_mallocHook::FileStats* FOM_mallocHook::IndexingReader::getFileStats()const{
-//   return m_fileStats;
-// }
+void FOM_mallocHook::EliasFano::finalize(){
+  m_samples.clear();
+  m_samples.reserve(m_size/SampleRate+1);
+  size_t ones=0;
+  for(size_t w=0;w<m_high.size();w++){
+    uint64_t word=m_high[w];
+    size_t c=popcount64(word);
+    // positions of ones number ones, ones+1,... in this word
+    while((m_samples.size()*SampleRate<ones+c)&&(m_samples.size()*SampleRate<m_size)){
+      m_samples.push_back(w*64+selectInWord(word,m_samples.size()*SampleRate-ones));
+    }
+    ones+=c;
+  }
+}
 
-FOM_mallocHook::IndexingReader::~IndexingReader(){
-  if(m_fileOpened){
-    munmap(m_fileBegin,m_fileLength);
-    close(m_fileHandle);
-    m_records.clear();
+uint64_t FOM_mallocHook::EliasFano::at(size_t i)const{
+  size_t pos=m_samples[i/SampleRate];
+  size_t rem=i%SampleRate;
+  size_t w=pos>>6;
+  uint64_t word=m_high[w]&(~0ull<<(pos&63));
+  size_t c;
+  while(rem>=(c=popcount64(word))){
+    rem-=c;
+    word=m_high[++w];
   }
-  delete m_fileStats;
+  uint64_t high=(w*64+selectInWord(word,rem))-i;
+  uint64_t low=0;
+  if(m_lowBits){
+    size_t bit=i*m_lowBits;
+    size_t lw=bit>>6;
+    unsigned int sh=bit&63;
+    low=m_low[lw]>>sh;
+    if(sh+m_lowBits>64)low|=m_low[lw+1]<<(64-sh);
+    low&=m_lowMask;
+  }
+  return (high<<m_lowBits)|low;
 }
 
-const FOM_mallocHook::RecordIndex FOM_mallocHook::IndexingReader::at(size_t t){
-  if(t>=m_numRecords){
-    char bu[500];
-    snprintf(bu,500,"Asked for an index larger than number of records! t=%ld size=%ld",t,m_numRecords);
-    throw std::length_error(bu);
+// walks the high bits once from the first value instead of selecting each
+void FOM_mallocHook::EliasFano::decode(size_t first,size_t n,uint64_t* out)const{
+  if(n==0)return;
+  size_t pos=m_samples[first/SampleRate];
+  size_t rem=first%SampleRate;
+  size_t w=pos>>6;
+  uint64_t word=m_high[w]&(~0ull<<(pos&63));
+  size_t c;
+  while(rem>=(c=popcount64(word))){
+    rem-=c;
+    word=m_high[++w];
   }
-  size_t bucket=t/m_period;
-  size_t offset=t-(bucket*m_period);
-  if(offset==0){return m_records.at(bucket);}
-  size_t d=t-m_lastIndex;
-  if((d>0) &&(d<offset)){
-    auto h=m_lastHdr;
-    for(size_t i=0;i<d;i++){
-      h=(FOM_mallocHook::header*)(((FOM_mallocHook::index_t*)(h+1))+h->count);
+  for(;rem;rem--)word&=word-1;
+  size_t bit=first*m_lowBits;
+  for(size_t k=0;k<n;k++){
+    while(!word)word=m_high[++w];
+    uint64_t high=(w*64+__builtin_ctzll(word))-(first+k);
+    word&=word-1;
+    uint64_t low=0;
+    if(m_lowBits){
+      size_t lw=bit>>6;
+      unsigned int sh=bit&63;
+      low=m_low[lw]>>sh;
+      if(sh+m_lowBits>64)low|=m_low[lw+1]<<(64-sh);
+      low&=m_lowMask;
+      bit+=m_lowBits;
     }
-    m_lastHdr=h;
-  }else{
-    auto h=m_records.at(bucket).getHeader();
-    for(size_t i=0;i<offset;i++){
-      h=(FOM_mallocHook::header*)(((FOM_mallocHook::index_t*)(h+1))+h->count);
-    }
-    m_lastHdr=h;
+    out[k]=(high<<m_lowBits)|low;
   }
-  m_lastIndex=t;
-  return FOM_mallocHook::RecordIndex(m_lastHdr);
 }
 
-FOM_mallocHook::FullRecord FOM_mallocHook::IndexingReader::At(size_t t){
-  return FOM_mallocHook::FullRecord(at(t));
+size_t FOM_mallocHook::EliasFano::memoryBytes()const{
+  return sizeof(uint64_t)*(m_low.size()+m_high.size()+m_samples.size());
 }
 
-size_t FOM_mallocHook::IndexingReader::size(){
-  return (((m_records.size()-1)*m_period)+m_remainder+1);
-}
-size_t FOM_mallocHook::IndexingReader::indexedSize(){
-  return m_records.size();
+void FOM_mallocHook::EliasFano::adviseHugePages()const{
+  FOM_mallocHook::adviseHugePages(m_low.data(),m_low.size()*sizeof(uint64_t));
+  FOM_mallocHook::adviseHugePages(m_high.data(),m_high.size()*sizeof(uint64_t));
 }
 
 /*
 // Record Index
 */
-FOM_mallocHook::RecordIndex::RecordIndex(const FOM_mallocHook::header* h):m_h(0){
-  if(h){
-    m_h=h;
-  }
-}
-
-FOM_mallocHook::RecordIndex::~RecordIndex(){};
-
-const FOM_mallocHook::header* const FOM_mallocHook::RecordIndex::getHeader() const{
-  return m_h;
-}
-
 const FOM_mallocHook::index_t* const FOM_mallocHook::RecordIndex::getStacks(size_t *count) const {
   if(m_h){
     *count=m_h->count;
@@ -853,91 +2916,92 @@ uintptr_t FOM_mallocHook::RecordIndex::getLastPage()const {
   return (m_h->addr+m_h->size)|pageMask;
 }
 
-uint64_t FOM_mallocHook::RecordIndex::getTStart()const{
-  return m_h->tstart;
-}
-
-uint64_t FOM_mallocHook::RecordIndex::getTReturn()const{
-  return m_h->treturn;
-}
-
-uint64_t FOM_mallocHook::RecordIndex::getTEnd()const{
-  return m_h->tend;
+std::vector<FOM_mallocHook::index_t> FOM_mallocHook::RecordIndex::getStacks() const{
+  return stacks().toVector();
 }
 
-char FOM_mallocHook::RecordIndex::getAllocType() const{
-  return m_h->allocType; 
-}
+/*
+  FullRecord
+*/
 
-uintptr_t FOM_mallocHook::RecordIndex::getAddr() const{
-  return m_h->addr;
+FOM_mallocHook::FullRecord::FullRecord():m_h(0),m_buff(m_inline),m_capacity(InlineStacks){
 }
 
-size_t FOM_mallocHook::RecordIndex::getSize() const{
-  return m_h->size;
-
+FOM_mallocHook::FullRecord::FullRecord(const void* hd):m_h(0),m_buff(m_inline),m_capacity(InlineStacks){
+  auto h=(const FOM_mallocHook::header*)hd;
+  if(h){//make a local copy
+    assign(h,(const FOM_mallocHook::index_t*)(h+1));
+  }
 }
 
-std::vector<FOM_mallocHook::index_t> FOM_mallocHook::RecordIndex::getStacks() const{
-  if((m_h==0)||(m_h->count==0)){
-    return std::vector<FOM_mallocHook::index_t>();
+FOM_mallocHook::FullRecord::FullRecord(const RecordIndex& hd):m_h(0),m_buff(m_inline),m_capacity(InlineStacks){
+  auto h=hd.getHeader();
+  if(h){//make a local copy
+    assign(h,hd.stacks().data());
   }
-  return std::vector<FOM_mallocHook::index_t> ((FOM_mallocHook::index_t*)(m_h+1),((FOM_mallocHook::index_t*)(m_h+1))+m_h->count);
 }
 
-/*
-  FullRecord
-*/
-
-FOM_mallocHook::FullRecord::FullRecord(const void* hd):m_h(0){
-  auto h=(const FOM_mallocHook::header*)hd;
-  if(h){//make a local copy
-    m_h=(FOM_mallocHook::header*)new char[sizeof(FOM_mallocHook::header)+(h->count*sizeof(FOM_mallocHook::index_t))];
-    *m_h=*h;
-    auto dst=((FOM_mallocHook::index_t*)(m_h+1));
-    
-    auto src=((FOM_mallocHook::index_t*)(h+1));
-    // for(int i=0;i<h->count;i++){
-    //   src[i]=dst[i];
-    // }
-    ::memcpy(dst,src,sizeof(FOM_mallocHook::index_t)*h->count);
+FOM_mallocHook::FullRecord::FullRecord(const FullRecord& rhs):m_h(0),m_buff(m_inline),m_capacity(InlineStacks){
+  if(rhs.m_h){//make a local copy
+    assign(rhs.m_h,rhs.stacks().data());
   }
 }
 
-FOM_mallocHook::FullRecord::FullRecord(const RecordIndex& hd):m_h(0){
-  auto h=hd.getHeader();
-  if(h){//make a local copy
-    m_h=(FOM_mallocHook::header*)new char[sizeof(FOM_mallocHook::header)+(h->count*sizeof(FOM_mallocHook::index_t))];
-    *m_h=*h;
-    auto dst=((FOM_mallocHook::index_t*)(m_h+1));
-    size_t nStacks=0;
-    auto src=hd.getStacks(&nStacks);
-    if(nStacks){
-      ::memcpy(dst,src,sizeof(FOM_mallocHook::index_t)*nStacks);
-    }
+FOM_mallocHook::FullRecord::FullRecord(FullRecord&& rhs):m_h(0),m_buff(m_inline),m_capacity(InlineStacks){
+  *this=std::move(rhs);
+}
+
+FOM_mallocHook::FullRecord& FOM_mallocHook::FullRecord::operator=(const FullRecord& rhs){
+  if(this==&rhs)return *this;
+  if(rhs.m_h){
+    assign(rhs.m_h,rhs.stacks().data());
+  }else{
+    m_h=0;
   }
+  return *this;
 }
 
-FOM_mallocHook::FullRecord::FullRecord(const FullRecord& rhs):m_h(0){
-  if(rhs.m_h){//make a local copy
-    m_h=(FOM_mallocHook::header*)new char[sizeof(FOM_mallocHook::header)+(rhs.m_h->count*sizeof(FOM_mallocHook::index_t))];
-    // *m_h=*rhs.m_h;
-    // auto dst=((FOM_mallocHook::index_t*)(m_h+1));
-    // auto src=((FOM_mallocHook::index_t*)(rhs.m_h+1));
-    // for(int i=0;i<rhs.m_h->count;i++){
-    //   src[i]=dst[i];
-    // }
-    ::memcpy(m_h,rhs.m_h,sizeof(*m_h)+sizeof(FOM_mallocHook::index_t)*rhs.m_h->count);
+FOM_mallocHook::FullRecord& FOM_mallocHook::FullRecord::operator=(FullRecord&& rhs){
+  if(this==&rhs)return *this;
+  if(rhs.onHeap()){//take over the buffer
+    if(onHeap())delete[] m_buff;
+    m_buff=rhs.m_buff;
+    m_capacity=rhs.m_capacity;
+    m_h=(rhs.m_h?(FOM_mallocHook::header*)m_buff:0);
+    rhs.m_buff=rhs.m_inline;
+    rhs.m_capacity=InlineStacks;
+    rhs.m_h=0;
+  }else{
+    *this=(const FullRecord&)rhs;
   }
+  return *this;
 }
 
+void FOM_mallocHook::FullRecord::assign(const FOM_mallocHook::header* h,const FOM_mallocHook::index_t* st){
+  if((size_t)h->count>m_capacity){
+    if(onHeap())delete[] m_buff;
+    m_buff=new char[sizeof(FOM_mallocHook::header)+(h->count*sizeof(FOM_mallocHook::index_t))];
+    m_capacity=h->count;
+  }
+  m_h=(FOM_mallocHook::header*)m_buff;
+  *m_h=*h;
+  if(h->count){
+    ::memcpy(m_h+1,st,sizeof(FOM_mallocHook::index_t)*h->count);
+  }
+}
 
-FOM_mallocHook::FullRecord::~FullRecord(){delete[] (char*)m_h;};
+FOM_mallocHook::FullRecord::~FullRecord(){
+  if(onHeap())delete[] m_buff;
+}
 
 const FOM_mallocHook::header* const FOM_mallocHook::FullRecord::getHeader() const{
   return m_h;
 }
 
+void* FOM_mallocHook::FullRecord::getBuffer(){
+  return m_h;
+}
+
 const FOM_mallocHook::index_t* const FOM_mallocHook::FullRecord::getStacks(size_t *count) const {
   if(m_h){
     *count=m_h->count;
@@ -982,10 +3046,143 @@ size_t FOM_mallocHook::FullRecord::getSize() const{
 }
 
 std::vector<FOM_mallocHook::index_t> FOM_mallocHook::FullRecord::getStacks() const{
-  if((m_h==0)||(m_h->count==0)){
-    return std::vector<FOM_mallocHook::index_t>();
+  return stacks().toVector();
+}
+
+/*
+  RecordBatch
+*/
+
+FOM_mallocHook::RecordBatch::RecordBatch():m_curr(0),m_used(0){
+}
+
+FOM_mallocHook::RecordIndex FOM_mallocHook::RecordBatch::push_back(const RecordIndex& r){
+  auto h=r.getHeader();
+  if(!h)return RecordIndex();
+  size_t len=sizeof(FOM_mallocHook::header)+h->count*sizeof(FOM_mallocHook::index_t);
+  if(m_chunks.empty()||(m_used+len>m_chunks[m_curr].size)){
+    if(!m_chunks.empty())m_curr++;
+    if((m_curr==m_chunks.size())||(m_chunks[m_curr].size<len)){//records larger than a chunk get their own
+      Chunk c;
+      c.size=std::max((size_t)ChunkBytes,len);
+      c.buff.reset(new char[c.size]);
+      m_chunks.insert(m_chunks.begin()+m_curr,std::move(c));
+    }
+    m_used=0;
+  }
+  char* dst=m_chunks[m_curr].buff.get()+m_used;
+  ::memcpy(dst,h,len);
+  m_used+=len;
+  m_records.push_back((const FOM_mallocHook::header*)dst);
+  return RecordIndex((const FOM_mallocHook::header*)dst);
+}
+
+void FOM_mallocHook::RecordBatch::clear(){
+  m_records.clear();
+  m_curr=0;
+  m_used=0;
+}
+
+size_t FOM_mallocHook::RecordBatch::memoryBytes()const{
+  size_t b=m_records.capacity()*sizeof(const FOM_mallocHook::header*);
+  for(const auto& c:m_chunks)b+=c.size;
+  return b;
+}
+
+/*
+  BUCKET CACHE
+*/
+
+FOM_mallocHook::BucketCache::BucketCache(size_t budgetBytes):m_budget(budgetBytes),m_bytes(0),
+							     m_hits(0),m_misses(0),m_evictions(0){
+}
+
+FOM_mallocHook::BucketCache::BlockPtr FOM_mallocHook::BucketCache::find(const void* owner,size_t bucket){
+  std::lock_guard<std::mutex> lk(m_mutex);
+  auto it=m_map.find(Key{owner,bucket});
+  if(it==m_map.end()){
+    m_misses++;
+    return BlockPtr();
+  }
+  m_hits++;
+  m_lru.splice(m_lru.begin(),m_lru,it->second);
+  return it->second->second;
+}
+
+bool FOM_mallocHook::BucketCache::contains(const void* owner,size_t bucket)const{
+  std::lock_guard<std::mutex> lk(m_mutex);
+  return m_map.count(Key{owner,bucket})!=0;
+}
+
+void FOM_mallocHook::BucketCache::insert(const void* owner,size_t bucket,const BlockPtr& b){
+  std::lock_guard<std::mutex> lk(m_mutex);
+  Key k{owner,bucket};
+  auto it=m_map.find(k);
+  if(it!=m_map.end()){
+    m_bytes-=it->second->second->bytes();
+    m_lru.erase(it->second);
+    m_map.erase(it);
+  }
+  m_lru.emplace_front(k,b);
+  m_map.emplace(k,m_lru.begin());
+  m_bytes+=b->bytes();
+  evict();
+}
+
+// drops least recently used entries until the budget is met, always keeping
+// the newest one. Blocks nobody else holds are kept for reuse
+void FOM_mallocHook::BucketCache::evict(){
+  while((m_bytes>m_budget)&&(m_lru.size()>1)){
+    auto& victim=m_lru.back();
+    m_bytes-=victim.second->bytes();
+    m_map.erase(victim.first);
+    if((victim.second.use_count()==1)&&(m_spare.size()<4))m_spare.push_back(victim.second);
+    m_lru.pop_back();
+    m_evictions++;
+  }
+}
+
+void FOM_mallocHook::BucketCache::erase(const void* owner){
+  std::lock_guard<std::mutex> lk(m_mutex);
+  for(auto it=m_lru.begin();it!=m_lru.end();){
+    if(it->first.owner==owner){
+      m_bytes-=it->second->bytes();
+      m_map.erase(it->first);
+      it=m_lru.erase(it);
+    }else{
+      ++it;
+    }
   }
-  return std::vector<FOM_mallocHook::index_t> ((FOM_mallocHook::index_t*)(m_h+1),((FOM_mallocHook::index_t*)(m_h+1))+m_h->count);
+}
+
+FOM_mallocHook::BucketCache::BlockPtr FOM_mallocHook::BucketCache::acquire(){
+  std::lock_guard<std::mutex> lk(m_mutex);
+  if(m_spare.empty())return std::make_shared<Block>();
+  BlockPtr b=m_spare.back();
+  m_spare.pop_back();
+  return b;
+}
+
+void FOM_mallocHook::BucketCache::release(BlockPtr& b){
+  std::lock_guard<std::mutex> lk(m_mutex);
+  if(b && (b.use_count()==1)&&(m_spare.size()<4))m_spare.push_back(b);
+  b.reset();
+}
+
+FOM_mallocHook::BucketCache::Stats FOM_mallocHook::BucketCache::getStats()const{
+  std::lock_guard<std::mutex> lk(m_mutex);
+  Stats st;
+  st.hits=m_hits;
+  st.misses=m_misses;
+  st.evictions=m_evictions;
+  st.entries=m_lru.size();
+  st.bytes=m_bytes;
+  return st;
+}
+
+void FOM_mallocHook::BucketCache::resetStats(){
+  std::lock_guard<std::mutex> lk(m_mutex);
+  m_hits=m_misses=m_evictions=0;
 }
 
 #ifdef ZLIB_FOUND
@@ -1001,6 +3198,73 @@ FOM_mallocHook::ZlibWriter::ZlibWriter(std::string fileName,int compress,size_t
   m_bs.compressedSize=0;
   m_bs.compressionTime=0;
   m_numBuckets=0;
+  m_dictSize=0;
+  m_trainingBuckets=0;
+  m_dictId=0;
+  m_dictWritten=false;
+  m_zsInit=false;
+}
+
+void FOM_mallocHook::ZlibWriter::setDictionary(size_t dictSize,unsigned int trainingBuckets){
+  m_dictSize=std::min(dictSize,(size_t)32768);//deflate window
+  m_trainingBuckets=std::max(trainingBuckets,1u);
+  if(!m_dictSize){
+    m_samples.clear();
+    m_dict.clear();
+  }
+}
+
+// Stacks are the bulk of a bucket and repeat heavily. The dictionary is
+// made of the stack arrays that saved most bytes in the samples, with the
+// most valuable ones at the end where deflate reaches them cheapest.
+void FOM_mallocHook::ZlibWriter::trainDictionary(){
+  std::unordered_map<std::string,size_t> counts;
+  const uint8_t* p=m_samples.data();
+  const uint8_t* pEnd=p+m_samples.size();
+  while(p+sizeof(FOM_mallocHook::header)<=pEnd){
+    auto h=(const FOM_mallocHook::header*)p;
+    size_t len=sizeof(FOM_mallocHook::index_t)*h->count;
+    if(h->count>0 && (const uint8_t*)(h+1)+len<=pEnd){
+      counts[std::string((const char*)(h+1),len)]++;
+    }
+    p=(const uint8_t*)FOM_mallocHook::skipRecord(h);
+  }
+  std::vector<std::pair<size_t,const std::string*> > scored;
+  scored.reserve(counts.size());
+  for(const auto &c:counts){
+    if(c.second>1)scored.emplace_back((c.second-1)*c.first.size(),&c.first);
+  }
+  std::sort(scored.begin(),scored.end(),[](const std::pair<size_t,const std::string*>&a,
+					   const std::pair<size_t,const std::string*>&b)->bool{return a.first>b.first;});
+  std::vector<const std::string*> picked;
+  size_t total=0;
+  for(const auto &sc:scored){
+    if(total+sc.second->size()>m_dictSize)continue;
+    picked.push_back(sc.second);
+    total+=sc.second->size();
+  }
+  m_dict.clear();
+  m_dict.reserve(total);
+  for(auto it=picked.rbegin();it!=picked.rend();++it){
+    m_dict.insert(m_dict.end(),(*it)->begin(),(*it)->end());
+  }
+  std::vector<uint8_t>().swap(m_samples);
+  if(m_dict.empty()){//nothing repeats, keep plain buckets
+    m_dictSize=0;
+    return;
+  }
+  m_dictId=adler32(adler32(0,Z_NULL,0),m_dict.data(),m_dict.size());
+  if(!m_zsInit){
+    ::memset(&m_zs,0,sizeof(m_zs));
+    if(deflateInit(&m_zs,m_compLevel)!=Z_OK){
+      std::cerr<<"Initializing deflate failed, dictionary disabled"<<std::endl;
+      m_dict.clear();
+      m_dictSize=0;
+      return;
+    }
+    m_zsInit=true;
+  }
+  m_dictWritten=false;
 }
 
 
@@ -1008,6 +3272,7 @@ FOM_mallocHook::ZlibWriter::~ZlibWriter(){
   closeFile(true);
   delete[] m_buff;
   delete[] m_cBuff;
+  if(m_zsInit)deflateEnd(&m_zs);
 }
 
 void FOM_mallocHook::ZlibWriter::writeRecord(const MemRecord&r){
@@ -1028,6 +3293,7 @@ void FOM_mallocHook::ZlibWriter::writeRecord(const MemRecord&r){
   ::memcpy(m_buff+m_bucketOffset,hdr,sizeof(*hdr));
   ::memcpy(m_buff+m_bucketOffset+sizeof(*hdr),stIds,sizeof(*stIds)*nStacks);
   m_bucketOffset+=lenRecord;
+  recordWritten(hdr);
 }
 
 void FOM_mallocHook::ZlibWriter::writeRecord(const RecordIndex&r){
@@ -1051,28 +3317,58 @@ void FOM_mallocHook::ZlibWriter::writeRecord(const void *r){
   if(m_maxDepth<nStacks)m_maxDepth=nStacks;
   ::memcpy(m_buff+m_bucketOffset,hdr,lenRecord);
   m_bucketOffset+=lenRecord;
+  recordWritten(hdr);
   //std::cerr<<"Wrote record "<<hdr->tstart<<std::endl;
 }
  
+// written as an uncompressed bucket without records so that it can be used
+// in place. Buckets are self contained, the pending one is written later.
+void FOM_mallocHook::ZlibWriter::writeChunk(char type,uint64_t addr,const void* payload,size_t len){
+  auto h=makeChunkHeader(type,addr,len,m_lastTStart,m_lastTEnd);
+  size_t pad=h.count*sizeof(FOM_mallocHook::index_t)-len;
+  FOM_mallocHook::BucketStats bs;
+  bs.itemsInBucket=0;
+  bs.uncompressedSize=sizeof(h)+len+pad;
+  bs.compressedSize=bs.uncompressedSize;
+  bs.compressionTime=0;
+  WRITE(m_fileHandle,bs);
+  WRITE(m_fileHandle,h);
+  if(len && ::write(m_fileHandle,payload,len)!=(ssize_t)len){
+    char buff[2048];
+    throw std::ios_base::failure(std::string(" ZlibWriter writeChunk ")+std::string(strerror_r(errno,buff,2048)));
+  }
+  if(pad && ::write(m_fileHandle,chunkPadding,pad)!=(ssize_t)pad){
+    char buff[2048];
+    throw std::ios_base::failure(std::string(" ZlibWriter writeChunk ")+std::string(strerror_r(errno,buff,2048)));
+  }
+}
+
 bool FOM_mallocHook::ZlibWriter::closeFile(bool flush){
   if(m_fileOpened){
+    if(!flush && !m_seekable){//closing a pipe ends the stream for its reader, keep it open over forks
+      m_fileOpened=false;
+      return true;
+    }
     //std::cerr<<__PRETTY_FUNCTION__<<fsync(m_fileHandle)<<" "<<m_fileName<<" @fd= "<<m_fileHandle<<" currOffset="<<::lseek64(m_fileHandle,0,SEEK_CUR)<<" pid= "<<getpid()<<std::endl;    
     if(flush){
       if(m_nRecordsInBuffer>0){
 	compressBuffer();
       }
-      if(m_stats){
+      if(m_stats && m_seekable){
 	//std::cerr<<"Nrecords= "<<m_nRecords<<" max depth="<<m_maxDepth<<std::endl;
 	m_stats->setNumRecords(m_nRecords);
 	m_stats->setStackDepthLimit(m_maxDepth);
+	m_stats->setClosed(true);
 	m_stats->setNumBuckets(m_numBuckets);
 	m_stats->write(m_fileHandle,false);
       }
+      appendManifest();
     }
     fsync(m_fileHandle);
     //std::cerr<<__PRETTY_FUNCTION__<<fsync(m_fileHandle)<<" "<<m_fileName<<" @fd= "<<m_fileHandle<<" pid= "<<getpid()<<std::endl;
     close(m_fileHandle);
     //std::cerr<<__PRETTY_FUNCTION__<<close(m_fileHandle)<<" "<<m_fileName<<" @fd= "<<m_fileHandle<<" pid= "<<getpid()<<std::endl;
+    m_fileHandle=-1;
     delete m_stats;
     m_stats=0;
     m_fileOpened=false;
@@ -1086,44 +3382,60 @@ bool FOM_mallocHook::ZlibWriter::reopenFile(bool seekEnd){
   if(m_fileOpened){
     return false;
   }
+  if(!m_seekable && m_fileHandle>=0){//pipe kept open by closeFile()
+    m_fileOpened=true;
+    return true;
+  }
   if(m_fileName.empty())throw std::ios_base::failure("File name is empty");
-  int outFile=open(m_fileName.c_str(),O_RDONLY,(S_IRWXU^S_IXUSR)|(S_IRWXG^S_IXGRP)|(S_IROTH));
+  int outFile=open(m_fileName.c_str(),O_RDWR,(S_IRWXU^S_IXUSR)|(S_IRWXG^S_IXGRP)|(S_IROTH));
   if(outFile==-1){
     std::cerr<<"Can't open out file \""<<m_fileName<<"\""<<std::endl;
     char buff[2048];
     throw std::ios_base::failure(std::string("Openning file failed ")+std::string(strerror_r(errno,buff,2048)));
   }
   m_stats=new FOM_mallocHook::FileStats();
-  m_stats->read(outFile,false);
-  fsync(outFile);
-  close(outFile);
-  outFile=open(m_fileName.c_str(),O_WRONLY,(S_IRWXU^S_IXUSR)|(S_IRWXG^S_IXGRP)|(S_IROTH));
-  if(outFile==-1){
-    std::cerr<<"Can't open out file \""<<m_fileName<<"\""<<std::endl;
-    char buff[2048];
-    throw std::ios_base::failure(std::string("Openning file failed ")+std::string(strerror_r(errno,buff,2048)));
-  }
-  fsync(outFile);
+  m_stats->read(outFile);
   m_fileHandle=outFile;
   m_fileOpened=true;
   if(seekEnd){
     ::lseek64(outFile,0,SEEK_END);
+  }else{
+    ::lseek64(outFile,m_stats->getHeaderSize(),SEEK_SET);
   }
   return true;
 }
 
 void FOM_mallocHook::ZlibWriter::compressBuffer(){
   struct timespec t1,t2;
+  bool useDict=!m_dict.empty();
+  if(useDict && !m_dictWritten){//once per file, before the first bucket needing it
+    writeChunk(FOM_mallocHook::DictionaryChunk,m_dictId,m_dict.data(),m_dict.size());
+    m_dictWritten=true;
+  }
   clock_gettime(CLOCK_MONOTONIC,&t1);
   m_bs.itemsInBucket=m_nRecordsInBuffer;
   m_bs.uncompressedSize=m_bucketOffset;
   uLong srcLen=m_bucketOffset;
   uLongf dstLen=m_compBuffLen;
   int ret=0;
-  if((ret=compress2(m_cBuff,&dstLen,m_buff,srcLen,m_compLevel))!=Z_OK){
+  if(useDict){
+    deflateReset(&m_zs);
+    deflateSetDictionary(&m_zs,m_dict.data(),m_dict.size());
+    m_zs.next_in=m_buff;
+    m_zs.avail_in=srcLen;
+    m_zs.next_out=m_cBuff;
+    m_zs.avail_out=m_compBuffLen;
+    if((ret=deflate(&m_zs,Z_FINISH))!=Z_STREAM_END){
+      std::cerr<<"Compression Failed with "<<ret<<std::endl;
+    }
+    dstLen=m_compBuffLen-m_zs.avail_out;
+  }else if((ret=compress2(m_cBuff,&dstLen,m_buff,srcLen,m_compLevel))!=Z_OK){
     std::cerr<<"Compression Failed with "<<ret<<std::endl;
   }
   clock_gettime(CLOCK_MONOTONIC,&t2);
+  if(m_dictSize && !useDict){//still collecting training samples
+    m_samples.insert(m_samples.end(),m_buff,m_buff+m_bucketOffset);
+  }
   m_bs.compressedSize=dstLen;
   m_bs.compressionTime=(t2.tv_sec-t1.tv_sec)*1000000000l+(t2.tv_nsec-t1.tv_nsec);
   
@@ -1138,17 +3450,23 @@ void FOM_mallocHook::ZlibWriter::compressBuffer(){
   m_numBuckets++;
   m_nRecordsInBuffer=0;
   m_bucketOffset=0;
+  if(m_dictSize && m_dict.empty() && m_numBuckets>=m_trainingBuckets){
+    trainDictionary();
+  }
   // std::cerr<<"Wrote basket with "<<m_bs.itemsInBucket<<" items, "
   // 	   <<m_bs.compressedSize<<" bytes deflated from "
   // 	   <<m_bs.uncompressedSize<<" in "
   // 	   <<m_bs.compressionTime<<" ns"<<std::endl;
 }
 
-FOM_mallocHook::ZlibReader::ZlibReader(std::string fileName,uint nUncompBuckets):ReaderBase(fileName),m_fileHandle(-1),
+FOM_mallocHook::ZlibReader::ZlibReader(std::string fileName,uint nUncompBuckets,bool useIndexFile,uint access):ReaderBase(fileName,access),m_fileHandle(-1),
 										 m_fileLength(0),
 										 m_fileBegin(0),m_fileOpened(false),
 										 m_lastIndex(0),m_numRecords(0),
-										 m_numBuckets(0),m_inflateCount(0)//,
+										 m_numBuckets(0),m_scanEnd(0),m_tOffsetEnd(0),
+										 m_inflateCount(0),m_prefetchCount(0),
+										 m_readAheadDepth(0),m_readAheadBudget(256<<20),
+										 m_readAheadThreads(0),m_lastMiss(0),m_raStop(false)//,
 										 //m_uncomressedBucket(0),m_prevBucket(0)
 									      
 {
@@ -1172,67 +3490,261 @@ FOM_mallocHook::ZlibReader::ZlibReader(std::string fileName,uint nUncompBuckets)
   m_fileOpened=true;
   //size_t nrecords=0;
   char buff[2050];
-  m_fileStats=new FOM_mallocHook::FileStats();
-  //std::cout << m_fileStats << " " << m_fileHandle << std::endl;
-  m_fileStats->read(m_fileHandle,false);
-  off_t hdrOff=::lseek64(m_fileHandle,0,SEEK_CUR);
-  ::lseek64(m_fileHandle,0,SEEK_SET);
-  m_fileBegin=mmap64(0,sinp.st_size,PROT_READ,MAP_PRIVATE,inpFile,0);
+  m_fileBegin=mapTrace(inpFile,sinp.st_size,m_access);
   if(m_fileBegin==MAP_FAILED){
     throw std::ios_base::failure(std::string(strerror_r(errno,buff,2048))+"failed to mmap "+fileName);        
   }
+  m_fileStats=new FOM_mallocHook::FileStats();
+  off_t hdrOff=m_fileStats->parse(m_fileBegin,sinp.st_size);
   std::cout<<"Starting to scan the file. File should contain "<<
     m_fileStats->getNumRecords()<<" entries"<<std::endl;
-  char* fileEnd=(char*)m_fileBegin+sinp.st_size;
-  char* h=((char*)m_fileBegin+hdrOff);
-  m_bucketIndices.resize(m_fileStats->getNumBuckets());
   size_t count=0;
   m_bucketSize=m_fileStats->getBucketSize();
   //m_uncomressedBucket=new uint8_t[m_bucketSize];
   //m_prevBucket=new uint8_t[m_bucketSize];
-  uint64_t currTimeSkew=0;
   size_t nRecords=0;
   size_t nRec2=0;
-  while (h<fileEnd){
-    auto& cb=m_bucketIndices.at(count);
-    auto *br=(BucketStats*)h;
-    cb.bucketStart=h;
-    cb.rStart=nRecords;
-    nRecords+=br->itemsInBucket;
-    nRec2+=(br->itemsInBucket*br->itemsInBucket);
-    cb.rEnd=nRecords-1;
-    cb.tOffset=currTimeSkew;
-    //printf("bucket= %07lu rstart= %lu rend= %lu itemsIn= %lu cTime= %lu cSkew= %lu\n",count,cb.rStart,cb.rEnd,br->itemsInBucket,br->compressionTime,currTimeSkew);
-    currTimeSkew+=br->compressionTime;
-    count++;
-    h=((char*)(br+1))+br->compressedSize;
+  m_scanEnd=hdrOff;
+  //an unfinished file is still changing, its index would be stale right away
+  if(m_fileStats->getNumRecords()==0)useIndexFile=false;
+  FOM_mallocHook::SidecarIndex index(fileName);
+  if(useIndexFile && index.load(sinp)){
+    std::cout<<"Using bucket table from "<<index.getIndexName()<<std::endl;
+    m_bucketIndices.resize(index.numBuckets());
+    for(size_t b=0;b<index.numBuckets();b++){
+      const auto& ib=index.buckets()[b];
+      auto& cb=m_bucketIndices[b];
+      cb.bucketStart=(char*)m_fileBegin+ib.offset;
+      cb.rStart=ib.rStart;
+      cb.rEnd=ib.rEnd;
+      cb.tOffset=ib.tOffset;
+      nRec2+=(ib.rEnd-ib.rStart+1)*(ib.rEnd-ib.rStart+1);
+    }
+    for(size_t c=0;c<index.numChunks();c++){
+      auto ch=(const FOM_mallocHook::header*)((char*)m_fileBegin+index.chunks()[c]);
+      m_dictionaries.emplace_back(ch->addr,ch);
+    }
+    count=index.numBuckets();
+    nRecords=(count?m_bucketIndices.back().rEnd+1:0);
+    m_numRecords=nRecords;
+    m_scanEnd=sinp.st_size;
+    if(count){
+      auto lb=(const BucketStats*)m_bucketIndices.back().bucketStart;
+      m_tOffsetEnd=m_bucketIndices.back().tOffset+lb->compressionTime;
+    }
+  }else{
+    m_bucketIndices.reserve(m_fileStats->getNumBuckets());
+    scanBuckets();
+    count=m_bucketIndices.size();
+    nRecords=m_numRecords;
+    for(const auto& cb:m_bucketIndices)nRec2+=(cb.rEnd-cb.rStart+1)*(cb.rEnd-cb.rStart+1);
+    if(useIndexFile){
+      std::vector<FOM_mallocHook::SidecarIndex::Bucket> buckets(count);
+      for(size_t b=0;b<count;b++){
+	const auto& cb=m_bucketIndices[b];
+	buckets[b].offset=(char*)cb.bucketStart-(char*)m_fileBegin;
+	buckets[b].rStart=cb.rStart;
+	buckets[b].rEnd=cb.rEnd;
+	buckets[b].tOffset=cb.tOffset;
+      }
+      std::vector<uint64_t> dicts;
+      for(const auto& d:m_dictionaries)dicts.push_back((const char*)d.second-(const char*)m_fileBegin);
+      index.store(sinp,0,0,buckets.data(),count,dicts.data(),dicts.size());
+    }
   }
-  m_numRecords=m_bucketIndices.back().rEnd+1;
-  m_avgRecordsPerBucket=(double)m_numRecords/m_bucketIndices.size();
-  m_buffers.reserve(nUncompBuckets);
+  m_avgRecordsPerBucket=(m_bucketIndices.empty()?1.:(double)m_numRecords/m_bucketIndices.size());
+  if(m_access&AccessHugePages)FOM_mallocHook::adviseHugePages(m_bucketIndices.data(),m_bucketIndices.size()*sizeof(BucketIndex));
   std::cout<<"Counted "<<count<<" records. Created "<<m_bucketIndices.size()
 	   <<" Bucket indices points, containing  "<< m_numRecords<<" records Avg bucket size "<<m_avgRecordsPerBucket<<" +- "<<::sqrt(((double)nRec2/(nRecords))-(double)nRecords/m_bucketIndices.size())<<std::endl;
   //m_currTimeSkew=0;
   m_lastBucket=m_bucketIndices.size();
   m_currBucket=m_lastBucket+1;
-  for(size_t t=0;t<nUncompBuckets;t++){
-    m_buffers.emplace_back(m_lastBucket,new uint8_t[m_bucketSize],m_avgRecordsPerBucket+1);
+  m_cache=std::make_shared<FOM_mallocHook::BucketCache>(std::max(1u,nUncompBuckets)*
+							  (m_bucketSize+(size_t)(m_avgRecordsPerBucket+1)*sizeof(FOM_mallocHook::RecordIndex)));
+  ::memset(&m_zs,0,sizeof(m_zs));
+  if(inflateInit(&m_zs)!=Z_OK){
+    throw std::ios_base::failure("Initializing inflate failed");
+  }
+  setReadAhead(std::min(16u,std::max(2u,std::thread::hardware_concurrency())));
+}
+
+// const, so that read-ahead workers can call it with their own stream
+void FOM_mallocHook::ZlibReader::inflateBucket(z_stream* zs,uint8_t* dst,size_t* dstLen,const BucketStats* bs)const{
+  inflateReset(zs);
+  zs->next_in=(Bytef*)(bs+1);
+  zs->avail_in=bs->compressedSize;
+  zs->next_out=dst;
+  zs->avail_out=*dstLen;
+  int ret=inflate(zs,Z_FINISH);
+  if(ret==Z_NEED_DICT){
+    const FOM_mallocHook::header* dh=0;
+    for(const auto &d:m_dictionaries){
+      if(d.first==zs->adler){
+	dh=d.second;
+	break;
+      }
+    }
+    if(!dh){
+      throw std::ios_base::failure("Bucket needs a compression dictionary that is not in the file");
+    }
+    inflateSetDictionary(zs,(const Bytef*)(dh+1),dh->size);
+    ret=inflate(zs,Z_FINISH);
+  }
+  if(ret!=Z_STREAM_END){
+    char bu[200];
+    snprintf(bu,200,"Inflating bucket failed with %d",ret);
+    throw std::ios_base::failure(bu);
+  }
+  *dstLen-=zs->avail_out;
+}
+
+// inflates bucket into b and builds its record index, with the time skew
+// of the hook's own compression removed
+void FOM_mallocHook::ZlibReader::loadBucket(z_stream* zs,size_t bucket,FOM_mallocHook::BucketCache::Block& b)const{
+  const auto& bucketIndex=m_bucketIndices[bucket];
+  auto bs=(const BucketStats*)bucketIndex.bucketStart;
+  size_t buffLen=bs->uncompressedSize;
+  b.data.resize(buffLen);
+  inflateBucket(zs,b.data.data(),&buffLen,bs);
+  b.records.resize(bs->itemsInBucket);
+  auto h=(FOM_mallocHook::header*)b.data.data();
+  auto hEnd=(FOM_mallocHook::header*)(b.data.data()+buffLen);
+  uint64_t ct=bucketIndex.tOffset;
+  size_t count=0;
+  while((h<hEnd)&&(count<b.records.size())){
+    h->tstart-=ct;
+    h->treturn-=ct;
+    h->tend-=ct;
+    b.records[count]=FOM_mallocHook::RecordIndex(h);
+    h=(FOM_mallocHook::header*)(((FOM_mallocHook::index_t*)(h+1))+h->count); //Record++
+    count++;
+  }
+}
+
+void FOM_mallocHook::ZlibReader::setCache(const std::shared_ptr<FOM_mallocHook::BucketCache>& cache){
+  if(!cache||(cache==m_cache))return;
+  stopReadAhead();
+  m_cache->erase(this);
+  m_cache=cache;
+}
+
+void FOM_mallocHook::ZlibReader::setReadAhead(uint depth,size_t memoryBudget,uint nThreads){
+  stopReadAhead();
+  if(nThreads==0)nThreads=std::max(1u,std::thread::hardware_concurrency());
+  size_t maxDepth=memoryBudget/std::max((size_t)1,m_bucketSize);
+  m_readAheadDepth=std::min((size_t)depth,maxDepth);
+  m_readAheadBudget=memoryBudget;
+  m_readAheadThreads=std::min(nThreads,m_readAheadDepth);
+}
+
+void FOM_mallocHook::ZlibReader::stopReadAhead(){
+  {
+    std::lock_guard<std::mutex> lk(m_raMutex);
+    m_raStop=true;
+    m_raQueue.clear();
+  }
+  m_raWork.notify_all();
+  for(auto &w:m_workers)w.join();
+  m_workers.clear();
+  for(auto &p:m_prefetched)m_cache->release(p.second.block);
+  m_prefetched.clear();
+  m_raStop=false;
+}
+
+void FOM_mallocHook::ZlibReader::readAheadWorker()const{
+  z_stream zs;
+  ::memset(&zs,0,sizeof(zs));
+  bool zsOk=(inflateInit(&zs)==Z_OK);
+  std::unique_lock<std::mutex> lk(m_raMutex);
+  while(true){
+    m_raWork.wait(lk,[this]()->bool{return m_raStop||!m_raQueue.empty();});
+    if(m_raStop)break;
+    size_t bucket=m_raQueue.front();
+    m_raQueue.pop_front();
+    auto block=m_prefetched[bucket].block;
+    lk.unlock();
+    std::string error;
+    if(!zsOk){
+      error="Initializing inflate failed";
+    }else{
+      try{
+	loadBucket(&zs,bucket,*block);
+      }catch(const std::exception& ex){
+	error=ex.what();
+      }
+    }
+    lk.lock();
+    auto& p=m_prefetched[bucket];
+    p.error=error;
+    p.done=true;
+    m_raDone.notify_all();
+  }
+  if(zsOk)inflateEnd(&zs);
+}
+
+// queues the depth buckets from bucket on, dropping finished ones the
+// consumer has moved away from
+void FOM_mallocHook::ZlibReader::scheduleReadAhead(size_t bucket)const{
+  std::lock_guard<std::mutex> lk(m_raMutex);
+  size_t last=std::min(bucket+m_readAheadDepth,m_bucketIndices.size());
+  for(auto it=m_prefetched.begin();it!=m_prefetched.end();){
+    if(it->second.done && ((it->first<bucket)||(it->first>=last))){
+      m_cache->release(it->second.block);
+      it=m_prefetched.erase(it);
+    }else{
+      ++it;
+    }
+  }
+  bool queued=false;
+  for(size_t b=bucket;(b<last)&&(m_prefetched.size()<m_readAheadDepth);b++){
+    if(m_prefetched.count(b)||m_cache->contains(this,b))continue;
+    Prefetch p;
+    p.block=m_cache->acquire();
+    p.done=false;
+    m_prefetched.emplace(b,p);
+    m_raQueue.push_back(b);
+    queued=true;
+  }
+  if(queued){
+    while(m_workers.size()<m_readAheadThreads){
+      m_workers.emplace_back(&FOM_mallocHook::ZlibReader::readAheadWorker,this);
+    }
+    m_raWork.notify_all();
   }
 }
 
+// returns the block of bucket if it was prefetched, waiting for it if
+// necessary. Failed buckets are left to the caller, which reports the error
+// when loading them itself. Cursors consume too, so the entry is looked up
+// again after each wait, another consumer may have taken or dropped it
+FOM_mallocHook::BucketCache::BlockPtr FOM_mallocHook::ZlibReader::takePrefetched(size_t bucket)const{
+  std::unique_lock<std::mutex> lk(m_raMutex);
+  auto it=m_prefetched.find(bucket);
+  while((it!=m_prefetched.end())&&!it->second.done){
+    m_raDone.wait(lk);
+    it=m_prefetched.find(bucket);
+  }
+  if(it==m_prefetched.end())return FOM_mallocHook::BucketCache::BlockPtr();
+  Prefetch p=it->second;
+  m_prefetched.erase(it);
+  if(!p.error.empty()){
+    m_cache->release(p.block);
+    return FOM_mallocHook::BucketCache::BlockPtr();
+  }
+  return p.block;
+}
 
 FOM_mallocHook::ZlibReader::~ZlibReader(){
+  stopReadAhead();
+  m_curr.reset();
+  m_cache->erase(this);
   if(m_fileOpened){
     munmap(m_fileBegin,m_fileLength);
     close(m_fileHandle);
   }
-  //delete[] m_uncomressedBucket;
-  //delete[] m_prevBucket;
   delete m_fileStats;
-  for(auto &i:m_buffers){
-    delete[] i.bucketBuff;
-  }
-  std::cout<<"Inflated "<<m_inflateCount<<" buffers "<<std::endl;
+  inflateEnd(&m_zs);
+  std::cout<<"Inflated "<<m_inflateCount<<" buffers ("<<m_prefetchCount<<" read ahead)"<<std::endl;
 }
 
 const FOM_mallocHook::RecordIndex FOM_mallocHook::ZlibReader::at(size_t t){
@@ -1241,65 +3753,101 @@ const FOM_mallocHook::RecordIndex FOM_mallocHook::ZlibReader::at(size_t t){
     snprintf(bu,500,"Asked for an index larger than number of records! t=%ld size=%ld",t,m_numRecords);
     throw std::length_error(bu);
   }
+  size_t bucket=findBucket(t);
+  const auto& bucketIndex=m_bucketIndices.at(bucket);
+  if(bucket==m_currBucket) return m_curr->records.at(t-bucketIndex.rStart);
+  auto block=m_cache->find(this,bucket);
+  if(!block){// Need new buffer
+    if(m_readAheadDepth)block=takePrefetched(bucket);
+    if(block){
+      m_prefetchCount++;
+    }else{
+      block=m_cache->acquire();
+      loadBucket(&m_zs,bucket,*block);
+    }
+    m_inflateCount++;
+    m_cache->insert(this,bucket,block);
+    if(m_readAheadDepth && (bucket==m_lastMiss+1))scheduleReadAhead(bucket+1);
+    m_lastMiss=bucket;
+  }
+  m_curr=block;
+  m_currBucket=bucket;
+  return m_curr->records.at(t-bucketIndex.rStart);
+}
+
+size_t FOM_mallocHook::ZlibReader::findBucket(size_t t)const{
   size_t bucket=t/m_avgRecordsPerBucket;
   auto buck=std::lower_bound(m_bucketIndices.begin(),m_bucketIndices.end(),t,[](const BucketIndex&a, const size_t &b)->bool{return a.rEnd<b;});
   if((buck->rEnd>=t)&&(buck->rStart<=t))bucket=std::distance(m_bucketIndices.begin(),buck);
-  const auto& bucketIndex=m_bucketIndices.at(bucket);
-  if(bucket==m_currBucket) return m_recordsInCurrBuffer->at(t-bucketIndex.rStart);
-  auto oldB=std::lower_bound(m_buffers.begin(),m_buffers.end(),bucket,
-			     [](const BuffRec& a,const size_t b )->bool{return a.bucketIndex<b;});
-  if((oldB!=m_buffers.end()) && (oldB->bucketIndex==bucket)){
-    m_currBucket=bucket;
-    m_recordsInCurrBuffer=oldB->records;
-    return m_recordsInCurrBuffer->at(t-bucketIndex.rStart);
-  }else{// Need new buffer
-    BucketStats* bs=(BucketStats*)bucketIndex.bucketStart;
-    size_t buffLen=bs->uncompressedSize;
-    BuffRec* cb=0;
-    uint64_t tnow=std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
-    // if((m_currBucket-m_buffers.front().bucketIndex)<m_buffers.back().bucketIndex-m_currBucket){//front is closer use back
-    //   cb=&(m_buffers.back());
-    // }else{//back is closer, use front
-    //   cb=&(m_buffers.front());
-    // }
-    //use front always time sorted;
-    uint64_t tmin=tnow;
-    size_t imin=0;
-    for(size_t k=0;k<m_buffers.size();k++){//pick the LRU
-      if(m_buffers[k].lastUse<tmin){
-	tmin=m_buffers[k].lastUse;
-	imin=k;
+  return bucket;
+}
+
+// buckets are looked up and stored under the reader, so that cursors of
+// the same reader find the ones inflated by each other
+class FOM_mallocHook::ZlibReader::CursorImpl:public FOM_mallocHook::Cursor{
+public:
+  CursorImpl(const FOM_mallocHook::ZlibReader* r):m_r(r),m_cache(r->m_cache),m_currBucket(r->m_bucketIndices.size()+1),
+						   m_lastMiss(r->m_bucketIndices.size()+1){
+    ::memset(&m_zs,0,sizeof(m_zs));
+    if(inflateInit(&m_zs)!=Z_OK){
+      throw std::ios_base::failure("Initializing inflate failed");
+    }
+  };
+  ~CursorImpl(){
+    m_curr.reset();
+    inflateEnd(&m_zs);
+  };
+  const FOM_mallocHook::RecordIndex at(size_t t) override{
+    const auto& bucketIndex=seek(t);
+    return m_curr->records.at(t-bucketIndex.rStart);
+  };
+  size_t size()const override{return m_r->m_numRecords;};
+  size_t span(size_t first,size_t maxCount,const FOM_mallocHook::RecordIndex** recs) override{
+    const auto& bucketIndex=seek(first);
+    *recs=m_curr->records.data()+(first-bucketIndex.rStart);
+    return std::min(maxCount,bucketIndex.rEnd+1-first);
+  };
+private:
+  const FOM_mallocHook::ZlibReader::BucketIndex& seek(size_t t){
+    if(t>=m_r->m_numRecords){
+      char bu[500];
+      snprintf(bu,500,"Asked for an index larger than number of records! t=%ld size=%ld",t,m_r->m_numRecords);
+      throw std::length_error(bu);
+    }
+    size_t bucket=m_r->findBucket(t);
+    if(bucket!=m_currBucket){
+      auto block=m_cache->find(m_r,bucket);
+      if(!block){//as ZlibReader::at(), a second miss in a row starts reading ahead
+	if(m_r->m_readAheadDepth)block=m_r->takePrefetched(bucket);
+	if(!block){
+	  block=m_cache->acquire();
+	  m_r->loadBucket(&m_zs,bucket,*block);
+	}
+	m_cache->insert(m_r,bucket,block);
+	if(m_r->m_readAheadDepth && (bucket==m_lastMiss+1))m_r->scheduleReadAhead(bucket+1);
+	m_lastMiss=bucket;
       }
+      m_curr=block;
+      m_currBucket=bucket;
     }
-    cb=&m_buffers[imin];
-    cb->lastUse=tnow;
-    cb->bucketIndex=bucket;
-    m_currBucket=bucket;
-    uncompress(cb->bucketBuff,&buffLen,(const Bytef*)(bs+1),bs->compressedSize);
-    m_inflateCount++;
-    auto h=(FOM_mallocHook::header*)cb->bucketBuff;
-    uint64_t ct=bucketIndex.tOffset;
-    uint count=0;
-    m_recordsInCurrBuffer=cb->records;
-    m_recordsInCurrBuffer->resize(bs->itemsInBucket);
-    // if(bucket<10){
-    //   printf("Uncompressed bucket %lu time offset is=%lu\n",bucket,ct); 
-    // }
-    while((void*)h<(cb->bucketBuff+buffLen)){
-      // if(bucket<10){
-      // 	printf("record %lu, tstart= %lu tend=%lu corrected tstart= %lu tend= %lu\n",count+bucketIndex.rStart,h->tstart,h->tend,h->tstart-ct,h->tend-ct);
-      // }
-      h->tstart-=ct;
-      h->treturn-=ct;
-      h->tend-=ct;
-      m_recordsInCurrBuffer->at(count)=FOM_mallocHook::RecordIndex(h);
-      h=(FOM_mallocHook::header*)(((FOM_mallocHook::index_t*)(h+1))+h->count); //Record++
-      count++;
-    }
-    std::sort(m_buffers.begin(),m_buffers.end(),[](const BuffRec& a,const BuffRec& b)->bool{return a.bucketIndex<b.bucketIndex;});
-  }
-  return m_recordsInCurrBuffer->at(t-bucketIndex.rStart);
+    return m_r->m_bucketIndices.at(bucket);
+  };
+  const FOM_mallocHook::ZlibReader* m_r;
+  std::shared_ptr<FOM_mallocHook::BucketCache> m_cache;//the reader's when the cursor was made
+  z_stream m_zs;
+  FOM_mallocHook::BucketCache::BlockPtr m_curr;//pins the current bucket
+  size_t m_currBucket;
+  size_t m_lastMiss;
+};
+
+std::unique_ptr<FOM_mallocHook::Cursor> FOM_mallocHook::ZlibReader::newCursor()const{
+  return std::unique_ptr<FOM_mallocHook::Cursor>(new CursorImpl(this));
+}
 
+void FOM_mallocHook::ZlibReader::setAccessPattern(uint access){
+  ReaderBase::setAccessPattern(access);
+  FOM_mallocHook::adviseMapping(m_fileBegin,m_fileLength,access);
+  if(access&AccessHugePages)FOM_mallocHook::adviseHugePages(m_bucketIndices.data(),m_bucketIndices.size()*sizeof(BucketIndex));
 }
 
 FOM_mallocHook::FullRecord FOM_mallocHook::ZlibReader::At(size_t t){
@@ -1314,4 +3862,353 @@ size_t FOM_mallocHook::ZlibReader::indexedSize(){
   return m_bucketIndices.size();
 }
 
+// indexes the complete buckets after m_scanEnd, a partially written one
+// stops the walk until the next call. Returns the number of new records
+size_t FOM_mallocHook::ZlibReader::scanBuckets(){
+  const char* fileEnd=(const char*)m_fileBegin+m_fileLength;
+  const char* h=(const char*)m_fileBegin+m_scanEnd;
+  size_t n0=m_numRecords;
+  while(h+sizeof(BucketStats)<=fileEnd){
+    auto *br=(const BucketStats*)h;
+    const char* next=((const char*)(br+1))+br->compressedSize;
+    if(next>fileEnd)break;
+    if(br->itemsInBucket==0){//uncompressed chunk (symbols, maps, dictionary), not records
+      auto ch=(const FOM_mallocHook::header*)(br+1);
+      if(br->compressedSize>=sizeof(FOM_mallocHook::header) &&
+	 ch->allocType==FOM_mallocHook::DictionaryChunk && ch->treturn==FOM_mallocHook::ChunkMagic){
+	m_dictionaries.emplace_back(ch->addr,ch);
+      }
+      h=next;
+      continue;
+    }
+    BucketIndex cb;
+    cb.bucketStart=(void*)h;
+    cb.rStart=m_numRecords;
+    m_numRecords+=br->itemsInBucket;
+    cb.rEnd=m_numRecords-1;
+    cb.tOffset=m_tOffsetEnd;
+    m_tOffsetEnd+=br->compressionTime;
+    m_bucketIndices.push_back(cb);
+    h=next;
+  }
+  m_scanEnd=h-(const char*)m_fileBegin;
+  return m_numRecords-n0;
+}
+
+// bucket and dictionary pointers follow the mapping if it moves. Buckets
+// in the cache stay valid, they never change once written
+size_t FOM_mallocHook::ZlibReader::appendRecords(){
+  struct stat sinp;
+  if(fstat(m_fileHandle,&sinp)==-1){
+    char buff[2048];
+    throw std::ios_base::failure(std::string(strerror_r(errno,buff,2048)));
+  }
+  if((size_t)sinp.st_size<=m_fileLength)return 0;
+  stopReadAhead();//workers read the bucket table
+  void* m=mremap(m_fileBegin,m_fileLength,sinp.st_size,MREMAP_MAYMOVE);
+  if(m==MAP_FAILED){
+    char buff[2048];
+    throw std::ios_base::failure(std::string(strerror_r(errno,buff,2048))+"failed to grow the mapping of "+getFileName());
+  }
+  if(m!=m_fileBegin){
+    ptrdiff_t d=(char*)m-(char*)m_fileBegin;
+    for(auto& cb:m_bucketIndices)cb.bucketStart=(char*)cb.bucketStart+d;
+    for(auto& dict:m_dictionaries)dict.second=(const FOM_mallocHook::header*)((const char*)dict.second+d);
+  }
+  m_fileBegin=m;
+  m_fileLength=sinp.st_size;
+  FOM_mallocHook::adviseMapping(m_fileBegin,m_fileLength,m_access&(~AccessPopulate));
+  if(!m_curr)m_currBucket=SIZE_MAX;//the old past the end marker may be a valid bucket now
+  size_t n=scanBuckets();
+  if(!m_bucketIndices.empty())m_avgRecordsPerBucket=(double)m_numRecords/m_bucketIndices.size();
+  m_lastBucket=m_bucketIndices.size();
+  return n;
+}
+
+#endif
+
+/*
+  STREAM READER
+*/
+
+namespace{
+  // reads len bytes unless the stream ends first. Returns the bytes read
+  size_t readAll(int fd,void* dst,size_t len){
+    size_t done=0;
+    while(done<len){
+      ssize_t n=::read(fd,(char*)dst+done,len-done);
+      if(n==0)break;
+      if(n<0){
+	if(errno==EINTR)continue;
+	char buff[2048];
+	throw std::ios_base::failure(std::string("Reading stream failed ")+std::string(strerror_r(errno,buff,2048)));
+      }
+      done+=n;
+    }
+    return done;
+  }
+}
+
+size_t FOM_mallocHook::FileStats::readStream(int fd){
+  std::vector<char> buff(legacyFixedSize);
+  size_t have=readAll(fd,buff.data(),buff.size());
+  if(have==buff.size() && headerVersion(buff.data())>=30000){//its size fields are further in
+    buff.resize(sizeof(FileHdrV3));
+    have+=readAll(fd,buff.data()+have,buff.size()-have);
+  }
+  if(have<buff.size()){
+    throw std::length_error("Corrupt stream. Header is truncated");
+  }
+  size_t req=requiredSize(buff.data(),have);
+  if(req>have){
+    buff.resize(req);
+    have+=readAll(fd,buff.data()+have,req-have);
+  }
+  return parse(buff.data(),have);
+}
+
+namespace{
+  // longest record or bucket a stream may announce. Anything longer is taken
+  // for corruption instead of being allocated
+  const size_t MaxStreamBlock=sizeof(FOM_mallocHook::header)+(((size_t)1)<<26)*sizeof(FOM_mallocHook::index_t);
+}
+
+FOM_mallocHook::StreamReader::StreamReader(std::string fileName,size_t bufferSize):ReaderBase(fileName),
+										    m_fd(-1),m_ownFd(false),
+										    m_eof(false),m_compression(0),
+										    m_bufferSize(bufferSize),m_used(0),m_consumed(0),
+										    m_first(0),m_pos(0)
+#ifdef ZLIB_FOUND
+										   ,m_tOffset(0),m_zsInit(false)
+#endif
+{
+  if(fileName.empty())throw std::ios_base::failure("File name is empty");
+  if(fileName=="-"){
+    m_fd=STDIN_FILENO;
+  }else{
+    m_fd=::open(fileName.c_str(),O_RDONLY);//blocks until a FIFO has a writer
+    if(m_fd==-1){
+      std::cerr<<"Input \""<<fileName<<"\" does not exist"<<std::endl;
+      char buff[2048];
+      throw std::ios_base::failure(std::string(strerror_r(errno,buff,2048)));
+    }
+    m_ownFd=true;
+  }
+  open();
+}
+
+FOM_mallocHook::StreamReader::StreamReader(int fd,size_t bufferSize):ReaderBase(std::string("fd:")+std::to_string(fd)),
+								     m_fd(fd),m_ownFd(false),
+								     m_eof(false),m_compression(0),
+								     m_bufferSize(bufferSize),m_used(0),m_consumed(0),
+								     m_first(0),m_pos(0)
+#ifdef ZLIB_FOUND
+								    ,m_tOffset(0),m_zsInit(false)
+#endif
+{
+  if(m_fd<0)throw std::ios_base::failure("Invalid file descriptor for StreamReader");
+  open();
+}
+
+void FOM_mallocHook::StreamReader::open(){
+  if(m_bufferSize<4096)m_bufferSize=4096;
+  m_fileStats=new FOM_mallocHook::FileStats();
+  try{
+    m_fileStats->readStream(m_fd);
+  }catch(...){
+    if(m_ownFd)close(m_fd);
+    delete m_fileStats;
+    m_fileStats=0;
+    throw;
+  }
+  m_compression=m_fileStats->getCompression()/10000000;
+  if(m_compression==0){
+    m_buff.resize(m_bufferSize);
+  }
+#ifdef ZLIB_FOUND
+  else if(m_compression==_USE_ZLIB_COMPRESSION_){
+    ::memset(&m_zs,0,sizeof(m_zs));
+    if(inflateInit(&m_zs)!=Z_OK){
+      if(m_ownFd)close(m_fd);
+      throw std::ios_base::failure("Initializing zlib stream failed");
+    }
+    m_zsInit=true;
+  }
+#endif
+  else{
+    if(m_ownFd)close(m_fd);
+    throw std::ios_base::failure(std::string("Unsupported compression for streaming in ")+getFileName());
+  }
+}
+
+FOM_mallocHook::StreamReader::~StreamReader(){
+#ifdef ZLIB_FOUND
+  if(m_zsInit)inflateEnd(&m_zs);
+#endif
+  if(m_ownFd)close(m_fd);
+  delete m_fileStats;
+}
+
+bool FOM_mallocHook::StreamReader::fill(){
+  if(m_eof)return false;
+  m_first+=m_window.size();
+  m_window.clear();
+  bool more=false;
+#ifdef ZLIB_FOUND
+  if(m_compression==_USE_ZLIB_COMPRESSION_){
+    more=fillZlib();
+  }else
+#endif
+  {
+    more=fillPlain();
+  }
+  if(m_pos<m_first)m_pos=m_first;
+  return more;
+}
+
+// The bytes after m_consumed, a record that was not complete yet, are moved
+// to the front, the buffer is topped up by one read and all complete
+// records are indexed. A record larger than the buffer grows it, here where
+// m_window is empty and holds no pointers into the buffer.
+bool FOM_mallocHook::StreamReader::fillPlain(){
+  while(m_window.empty()){
+    if(m_consumed){
+      ::memmove(m_buff.data(),m_buff.data()+m_consumed,m_used-m_consumed);
+      m_used-=m_consumed;
+      m_consumed=0;
+    }
+    if(m_used>=sizeof(FOM_mallocHook::header)){
+      auto h=(const FOM_mallocHook::header*)m_buff.data();
+      size_t len=sizeof(FOM_mallocHook::header)+(uint32_t)h->count*sizeof(FOM_mallocHook::index_t);
+      if((len>m_buff.size())&&(len<=MaxStreamBlock))m_buff.resize(len);
+    }
+    ssize_t n=::read(m_fd,m_buff.data()+m_used,m_buff.size()-m_used);//whatever is there, live streams must not wait for a full buffer
+    if(n<0){
+      if(errno==EINTR)continue;
+      char buff[2048];
+      throw std::ios_base::failure(std::string("Reading stream failed ")+std::string(strerror_r(errno,buff,2048)));
+    }
+    m_used+=n;
+    size_t pos=0;
+    while(pos+sizeof(FOM_mallocHook::header)<=m_used){
+      auto h=(const FOM_mallocHook::header*)(m_buff.data()+pos);
+      size_t len=sizeof(FOM_mallocHook::header)+(uint32_t)h->count*sizeof(FOM_mallocHook::index_t);//negative counts come out too long
+      if(len>MaxStreamBlock){
+	throw std::ios_base::failure("Corrupt stream. Record with impossible stack count");
+      }
+      if(pos+len>m_used)break;
+      if(!FOM_mallocHook::isSpecialRecord(h))m_window.emplace_back(h);
+      pos+=len;
+    }
+    m_consumed=pos;
+    if(n==0){//end of stream
+      m_eof=true;
+      if(m_used>m_consumed){
+	std::cerr<<"Dropping "<<m_used-m_consumed<<" bytes of a truncated record at the end of "<<getFileName()<<std::endl;
+      }
+      return !m_window.empty();
+    }
+  }
+  return true;
+}
+
+#ifdef ZLIB_FOUND
+// One bucket per call. Uncompressed chunks between buckets are skipped,
+// dictionaries among them are kept for the buckets that need them.
+bool FOM_mallocHook::StreamReader::fillZlib(){
+  while(m_window.empty()){
+    BucketStats bs;
+    size_t n=readAll(m_fd,&bs,sizeof(bs));
+    if(n<sizeof(bs)){
+      m_eof=true;
+      if(n)std::cerr<<"Dropping a truncated bucket at the end of "<<getFileName()<<std::endl;
+      return false;
+    }
+    if((bs.uncompressedSize>MaxStreamBlock)||(bs.compressedSize>compressBound(bs.uncompressedSize))){
+      throw std::ios_base::failure("Corrupt stream. Bucket with impossible size");
+    }
+    m_cBuff.resize(bs.compressedSize);
+    if(readAll(m_fd,m_cBuff.data(),bs.compressedSize)<bs.compressedSize){
+      m_eof=true;
+      std::cerr<<"Dropping a truncated bucket at the end of "<<getFileName()<<std::endl;
+      return false;
+    }
+    if(bs.itemsInBucket==0){//symbols, maps or a dictionary
+      auto ch=(const FOM_mallocHook::header*)m_cBuff.data();
+      if(bs.compressedSize>=sizeof(*ch) && ch->allocType==FOM_mallocHook::DictionaryChunk && ch->treturn==FOM_mallocHook::ChunkMagic){
+	m_dictionaries.emplace_back(ch->addr,std::vector<char>((const char*)(ch+1),(const char*)(ch+1)+ch->size));
+      }
+      continue;
+    }
+    m_buff.resize(bs.uncompressedSize);
+    inflateReset(&m_zs);
+    m_zs.next_in=(Bytef*)m_cBuff.data();
+    m_zs.avail_in=bs.compressedSize;
+    m_zs.next_out=(Bytef*)m_buff.data();
+    m_zs.avail_out=m_buff.size();
+    int ret=inflate(&m_zs,Z_FINISH);
+    if(ret==Z_NEED_DICT){
+      const std::vector<char>* dict=0;
+      for(const auto &d:m_dictionaries){
+	if(d.first==m_zs.adler){
+	  dict=&d.second;
+	  break;
+	}
+      }
+      if(!dict){
+	throw std::ios_base::failure("Bucket needs a compression dictionary that is not in the stream");
+      }
+      inflateSetDictionary(&m_zs,(const Bytef*)dict->data(),dict->size());
+      ret=inflate(&m_zs,Z_FINISH);
+    }
+    if(ret!=Z_STREAM_END){
+      char bu[200];
+      snprintf(bu,200,"Inflating bucket failed with %d",ret);
+      throw std::ios_base::failure(bu);
+    }
+    m_used=m_buff.size()-m_zs.avail_out;
+    auto h=(FOM_mallocHook::header*)m_buff.data();
+    auto hEnd=(FOM_mallocHook::header*)(m_buff.data()+m_used);
+    m_window.reserve(bs.itemsInBucket);
+    while((h<hEnd)&&(m_window.size()<bs.itemsInBucket)){//same time correction as ZlibReader
+      h->tstart-=m_tOffset;
+      h->treturn-=m_tOffset;
+      h->tend-=m_tOffset;
+      m_window.emplace_back(h);
+      h=(FOM_mallocHook::header*)(((FOM_mallocHook::index_t*)(h+1))+h->count);
+    }
+    m_tOffset+=bs.compressionTime;
+  }
+  return true;
+}
 #endif
+
+const FOM_mallocHook::RecordIndex FOM_mallocHook::StreamReader::next(){
+  while(m_pos>=m_first+m_window.size()){
+    if(!fill())return FOM_mallocHook::RecordIndex();
+  }
+  return m_window[(m_pos++)-m_first];
+}
+
+const FOM_mallocHook::RecordIndex FOM_mallocHook::StreamReader::at(size_t t){
+  if(t<m_first){
+    throw std::out_of_range("StreamReader can not go back to a record it has passed");
+  }
+  while(t>=m_first+m_window.size()){
+    if(!fill())return FOM_mallocHook::RecordIndex();
+  }
+  m_pos=t+1;
+  return m_window[t-m_first];
+}
+
+FOM_mallocHook::FullRecord FOM_mallocHook::StreamReader::At(size_t t){
+  return FOM_mallocHook::FullRecord(at(t));
+}
+
+size_t FOM_mallocHook::StreamReader::size(){
+  return m_first+m_window.size();
+}
+
+std::unique_ptr<FOM_mallocHook::Cursor> FOM_mallocHook::StreamReader::newCursor()const{
+  throw std::logic_error("StreamReader reads forward only and has no cursors");
+}
@@ -0,0 +1,220 @@
+/*
+ *  Copyright (c) CERN 2015
+ *
+ *  Authors:
+ *      Nathalie Rauschmayr <nathalie.rauschmayr_ at _ cern _dot_ ch>
+ *      Sami Kama <sami.kama_ at _ cern _dot_ ch>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "FOMTools/SymbolTable.hpp"
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <cstring>
+#include <cstdio>
+#include <ios>
+#include <iostream>
+#include <stdexcept>
+
+FOM_mallocHook::SymbolTable::SymbolTable(const std::string& fileName){
+  const std::string suffix(".manifest");
+  if(fileName.size()>suffix.size() &&
+     fileName.compare(fileName.size()-suffix.size(),suffix.size(),suffix)==0){
+    FOM_mallocHook::SegmentedReader segs(fileName,1);
+    for(size_t s=0;s<segs.numSegments();s++){
+      addFile(segs.segmentName(s));
+    }
+  }else{
+    addFile(fileName);
+  }
+}
+
+FOM_mallocHook::SymbolTable::~SymbolTable(){
+  for(auto &m:m_maps){
+    munmap(m.begin,m.length);
+  }
+}
+
+void FOM_mallocHook::SymbolTable::addFile(const std::string& fileName){
+  int inpFile=open(fileName.c_str(),O_RDONLY);
+  if(inpFile==-1){
+    std::cerr<<"Input file \""<<fileName<<"\" does not exist"<<std::endl;
+    char buff[2048];
+    throw std::ios_base::failure(std::string(strerror_r(errno,buff,2048)));
+  }
+  struct stat sinp;
+  if(fstat(inpFile,&sinp)==-1){
+    char buff[2048];
+    close(inpFile);
+    throw std::ios_base::failure(std::string(strerror_r(errno,buff,2048)));
+  }
+  void* fileBegin=mmap64(0,sinp.st_size,PROT_READ,MAP_PRIVATE,inpFile,0);
+  close(inpFile);
+  if(fileBegin==MAP_FAILED){
+    char buff[2048];
+    throw std::ios_base::failure(std::string(strerror_r(errno,buff,2048))+"failed to mmap "+fileName);
+  }
+  m_maps.push_back(Mapping{fileBegin,(size_t)sinp.st_size});
+  FOM_mallocHook::FileStats fs;
+  size_t hdrOff=fs.parse(fileBegin,sinp.st_size);
+  const char* fileEnd=(const char*)fileBegin+sinp.st_size;
+  const char* p=(const char*)fileBegin+hdrOff;
+  int compressionMode=(fs.getCompression()/10000000);
+  if(compressionMode==0){
+    while(p+sizeof(FOM_mallocHook::header)<=fileEnd){
+      auto h=(const FOM_mallocHook::header*)p;
+      auto next=(const char*)FOM_mallocHook::skipRecord(h);
+      if(h->count<0 || next>fileEnd)break;//truncated tail
+      if(FOM_mallocHook::isSpecialRecord(h))addChunk(h,fileEnd);
+      p=next;
+    }
+  }else{
+    while(p+sizeof(FOM_mallocHook::BucketStats)<=fileEnd){
+      auto br=(const FOM_mallocHook::BucketStats*)p;
+      if(br->itemsInBucket==0){
+	addChunk((const FOM_mallocHook::header*)(br+1),fileEnd);
+      }
+      p=((const char*)(br+1))+br->compressedSize;
+    }
+  }
+}
+
+void FOM_mallocHook::SymbolTable::addChunk(const FOM_mallocHook::header* h,const char* fileEnd){
+  if((const char*)(h+1)>fileEnd || h->treturn!=FOM_mallocHook::ChunkMagic)return;
+  const char* payload=(const char*)(h+1);
+  if(h->size<sizeof(ChunkTable) || payload+h->size>fileEnd)return;
+  auto ct=(const ChunkTable*)payload;
+  if(h->allocType==FOM_mallocHook::SymbolChunk){
+    auto entries=(const SymbolEntry*)(ct+1);
+    const char* pool=(const char*)(entries+ct->nEntries);
+    if(pool+ct->poolSize>payload+h->size)return;
+    size_t first=h->addr;
+    if(m_symbols.size()<first+ct->nEntries){
+      m_symbols.resize(first+ct->nEntries,SymbolRef{0,0});
+    }
+    for(uint32_t i=0;i<ct->nEntries;i++){
+      if(entries[i].nameOffset+entries[i].nameLength<ct->poolSize){
+	m_symbols[first+i]=SymbolRef{entries+i,pool};
+      }
+    }
+  }else if(h->allocType==FOM_mallocHook::MapsChunk){
+    auto entries=(const ModuleEntry*)(ct+1);
+    const char* pool=(const char*)(entries+ct->nEntries);
+    if(pool+ct->poolSize>payload+h->size)return;
+    m_snapshots.push_back(Snapshot{entries,ct->nEntries,pool,h->tstart});
+  }
+}
+
+uint64_t FOM_mallocHook::SymbolTable::getIP(index_t i)const{
+  const auto &s=m_symbols.at(i);
+  return (s.entry?s.entry->ip:0);
+}
+
+const char* FOM_mallocHook::SymbolTable::getName(index_t i)const{
+  if(i>=m_symbols.size())return 0;
+  const auto &s=m_symbols[i];
+  return (s.entry?s.pool+s.entry->nameOffset:0);
+}
+
+const FOM_mallocHook::ModuleEntry& FOM_mallocHook::SymbolTable::getModule(size_t s,size_t m)const{
+  const auto &snap=m_snapshots.at(s);
+  if(m>=snap.nEntries)throw std::out_of_range("Module index is out of range");
+  return snap.entries[m];
+}
+
+const char* FOM_mallocHook::SymbolTable::getModuleName(size_t s,size_t m)const{
+  const auto &snap=m_snapshots.at(s);
+  if(m>=snap.nEntries)throw std::out_of_range("Module index is out of range");
+  return snap.pool+snap.entries[m].nameOffset;
+}
+
+const FOM_mallocHook::ModuleEntry* FOM_mallocHook::SymbolTable::findModule(uint64_t ip,const char** name)const{
+  for(auto s=m_snapshots.rbegin();s!=m_snapshots.rend();++s){
+    //maps are sorted by address
+    size_t lo=0,hi=s->nEntries;
+    while(lo<hi){
+      size_t mid=(lo+hi)/2;
+      if(s->entries[mid].end<=ip){
+	lo=mid+1;
+      }else{
+	hi=mid;
+      }
+    }
+    if(lo<s->nEntries && s->entries[lo].begin<=ip){
+      if(name)*name=s->pool+s->entries[lo].nameOffset;
+      return s->entries+lo;
+    }
+  }
+  return 0;
+}
+
+void FOM_mallocHook::SymbolTable::encodeSymbols(std::vector<char>& out,const uint64_t* ips,const std::string* names,size_t n){
+  size_t poolSize=0;
+  for(size_t i=0;i<n;i++)poolSize+=names[i].size()+1;
+  out.resize(sizeof(ChunkTable)+n*sizeof(SymbolEntry)+poolSize);
+  auto ct=(ChunkTable*)out.data();
+  ct->nEntries=n;
+  ct->poolSize=poolSize;
+  auto entries=(SymbolEntry*)(ct+1);
+  char* pool=(char*)(entries+n);
+  uint32_t offset=0;
+  for(size_t i=0;i<n;i++){
+    entries[i].ip=ips[i];
+    entries[i].nameOffset=offset;
+    entries[i].nameLength=names[i].size();
+    ::memcpy(pool+offset,names[i].c_str(),names[i].size()+1);
+    offset+=names[i].size()+1;
+  }
+}
+
+// parses /proc/<pid>/maps text
+void FOM_mallocHook::SymbolTable::encodeMaps(std::vector<char>& out,const char* maps,size_t len){
+  std::vector<ModuleEntry> entries;
+  std::string pool;
+  const char* l=maps;
+  const char* end=maps+len;
+  char line[4096];
+  while(l<end){
+    const char* eol=(const char*)::memchr(l,'\n',end-l);
+    if(!eol)eol=end;
+    size_t ll=std::min((size_t)(eol-l),sizeof(line)-1);
+    ::memcpy(line,l,ll);
+    line[ll]='\0';
+    l=eol+1;
+    unsigned long long b=0,e=0,off=0;
+    char perms[5]={0};
+    int nameStart=0;
+    if(sscanf(line,"%llx-%llx %4s %llx %*s %*s %n",&b,&e,perms,&off,&nameStart)<4)continue;
+    ModuleEntry m;
+    m.begin=b;
+    m.end=e;
+    m.offset=off;
+    ::memcpy(m.perms,perms,4);
+    const char* name=(nameStart>0?line+nameStart:"");
+    m.nameOffset=pool.size();
+    m.nameLength=::strlen(name);
+    pool.append(name,m.nameLength+1);
+    entries.push_back(m);
+  }
+  out.resize(sizeof(ChunkTable)+entries.size()*sizeof(ModuleEntry)+pool.size());
+  auto ct=(ChunkTable*)out.data();
+  ct->nEntries=entries.size();
+  ct->poolSize=pool.size();
+  ::memcpy(ct+1,entries.data(),entries.size()*sizeof(ModuleEntry));
+  ::memcpy(((char*)(ct+1))+entries.size()*sizeof(ModuleEntry),pool.data(),pool.size());
+}
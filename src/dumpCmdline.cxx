@@ -45,6 +45,7 @@ static double msecRes=1.0/1000000;
 void printUsage(char* name){
   std::cout<<"Usage:  "<<name<<" -i <input> -o <output> "<<std::endl;
   std::cout<<"     --input  (-i)  name of a file that is created by mallochook"<<std::endl;
+  std::cout<<"     --recover (-r) recover record count of an unfinished file from its sync markers"<<std::endl;
 }
 
 int main(int argc,char* argv[]){
@@ -52,16 +53,18 @@ int main(int argc,char* argv[]){
   //  std::string outName("");
   struct stat sinp;
   char* dataAddr=0;
+  bool recover=false;
   int c;
   while (1) {
     int option_index = 0;
     static struct option long_options[] = {
       {"help", 0, 0, 'h'},
       {"input", 1, 0, 'i'},
+      {"recover", 0, 0, 'r'},
       {0, 0, 0, 0}
     };
 
-    c = getopt_long(argc, argv, "hi:o:",
+    c = getopt_long(argc, argv, "hi:o:r",
 		    long_options, &option_index);
     if (c == -1)
       break;
@@ -74,6 +77,10 @@ int main(int argc,char* argv[]){
       inpName=std::string(optarg);
       break;
     }
+    case 'r':  {
+      recover=true;
+      break;
+    }
     default:
       printf("unknown parameter! getopt returned character code 0%o ??\n", c);
     }
@@ -104,6 +111,15 @@ int main(int argc,char* argv[]){
   struct timespec tstart,tend;
   int rc=clock_gettime(CLOCK_MONOTONIC,&tstart);
   FOM_mallocHook::ReaderBase *rdr=0;
+  if(recover){
+    try{
+      size_t n=FOM_mallocHook::recoverFile(inpName,true);
+      std::cout<<"Recovered "<<n<<" records"<<std::endl;
+    }catch(const std::exception &ex){
+      fprintf(stderr,"Caught exception %s\n",ex.what());
+      exit(EXIT_FAILURE);
+    }
+  }
   int inpFile=open(inpName.c_str(),O_RDONLY);
   auto fs=new FOM_mallocHook::FileStats();
   fs->read(inpFile,false);
@@ -0,0 +1,170 @@
+/*
+ *  Copyright (c) CERN 2015
+ *
+ *  Authors:
+ *      Nathalie Rauschmayr <nathalie.rauschmayr_ at _ cern _dot_ ch>
+ *      Sami Kama <sami.kama_ at _ cern _dot_ ch>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+// Merges the traces of several processes (e.g. mallocOutput_<pid>.fom of a
+// forking application) into one time ordered text stream. Each record is
+// tagged with the pid of its process and its frames carry ids shared by
+// all processes. The traces are read in place, nothing is copied to disk.
+
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <iostream>
+#include "FOMTools/MergedReader.hpp"
+
+#define handle_error(msg)                              \
+  do { perror(msg); exit(EXIT_FAILURE); } while (0)
+
+void printUsage(char* name){
+  std::cout<<"Usage:  "<<name<<" [-o <output>] [-s <symbols>] <trace> <trace> ..."<<std::endl;
+  std::cout<<"     --output  (-o)  output file name (default stdout). Lines are"<<std::endl;
+  std::cout<<"                     pid tstart type addr size treturn tend frames..."<<std::endl;
+  std::cout<<"     --symbols (-s)  write the merged frame table (id ip name) to this file"<<std::endl;
+  std::cout<<"     Traces are .fom files of any compression or .manifest files of segmented outputs"<<std::endl;
+}
+
+// writes all of buff or exits
+void writeAll(int fd,const char* buff,size_t len){
+  while(len){
+    ssize_t w=write(fd,buff,len);
+    if(w==-1){
+      handle_error("write failed");
+    }
+    buff+=w;
+    len-=w;
+  }
+}
+
+int main(int argc,char* argv[]){
+  std::string outName("-");
+  std::string symName;
+  std::vector<std::string> inputs;
+  int c;
+  while (1) {
+    int option_index = 0;
+    static struct option long_options[] = {
+      {"help", 0, 0, 'h'},
+      {"output", 1, 0, 'o'},
+      {"symbols", 1, 0, 's'},
+      {0, 0, 0, 0}
+    };
+    c = getopt_long(argc, argv, "ho:s:",
+		    long_options, &option_index);
+    if (c == -1)
+      break;
+    switch (c) {
+    case 'h':
+      printUsage(argv[0]);
+      exit(EXIT_SUCCESS);
+      break;
+    case 'o':  {
+      outName=std::string(optarg);
+      break;
+    }
+    case 's':  {
+      symName=std::string(optarg);
+      break;
+    }
+    default:
+      printf("unknown parameter! getopt returned character code 0%o ??\n", c);
+    }
+  }
+  while(optind<argc){
+    inputs.push_back(argv[optind]);
+    optind++;
+  }
+  if(inputs.empty()){
+    std::cerr<<"Input files are needed"<<std::endl;
+    printUsage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  int outFile=STDOUT_FILENO;
+  if(outName!="-"){
+    outFile=open(outName.c_str(),O_WRONLY|O_CREAT|O_TRUNC,(S_IRWXU^S_IXUSR)|(S_IRWXG^S_IXGRP)|S_IROTH);
+    if(outFile==-1){
+      std::cerr<<"Cant open output file \""<<outName<<std::endl;
+      handle_error("Opening output");
+    }
+  }
+  //the readers report progress on stdout, which may be the output
+  std::cout.rdbuf(std::cerr.rdbuf());
+  FOM_mallocHook::MergedReader* mr=0;
+  try{
+    mr=new FOM_mallocHook::MergedReader(inputs,FOM_mallocHook::ReaderBase::AccessSequential);
+  }catch(const std::exception &ex){
+    fprintf(stderr,"Caught exception %s\n",ex.what());
+    exit(EXIT_FAILURE);
+  }
+  for(size_t s=0;s<mr->numSources();s++){
+    fprintf(stderr,"pid %u: %s\n",mr->getSourcePid(s),mr->getSourceName(s).c_str());
+  }
+  const size_t maxBuf=1<<20;
+  const size_t maxFields=128;//pid, times, type, address and size
+  const size_t maxFrame=12;//" 4294967295"
+  std::vector<char> buff(maxBuf+(64<<10));
+  size_t buffPos=0;
+  size_t nRecords=mr->size();
+  auto cur=mr->newCursor();
+  const FOM_mallocHook::RecordIndex* recs=0;
+  for(size_t first=0;first<nRecords;){
+    size_t n=cur->span(first,nRecords-first,&recs);
+    for(size_t i=0;i<n;i++){
+      auto hdr=recs[i].getHeader();
+      size_t s=mr->getSource(first+i);
+      size_t lineMax=maxFields+maxFrame*(size_t)hdr->count+1;
+      if(buffPos+lineMax>buff.size())buff.resize(buffPos+lineMax);//deep stacks are written whole
+      char* b=buff.data();
+      buffPos+=snprintf(b+buffPos,maxFields,"%u %lu %u 0x%lx %lu %lu %lu",
+			mr->getSourcePid(s),hdr->tstart,hdr->allocType,hdr->addr,
+			hdr->size,hdr->treturn,hdr->tend);
+      for(auto f:recs[i].stacks()){
+	buffPos+=snprintf(b+buffPos,maxFrame," %u",mr->getFrame(s,f));
+      }
+      b[buffPos++]='\n';
+      if(buffPos>=maxBuf){
+	writeAll(outFile,b,buffPos);
+	buffPos=0;
+      }
+    }
+    first+=n;
+  }
+  writeAll(outFile,buff.data(),buffPos);
+  if(outFile!=STDOUT_FILENO)close(outFile);
+  if(!symName.empty()){
+    FILE* sf=fopen(symName.c_str(),"w");
+    if(!sf){
+      handle_error("Opening symbol output");
+    }
+    for(size_t f=0;f<mr->numFrames();f++){
+      const char* name=mr->getFrameName(f);
+      fprintf(sf,"%lu 0x%lx %s\n",f,mr->getFrameIP(f),name?name:"??");
+    }
+    fclose(sf);
+  }
+  fprintf(stderr,"Merged %lu records from %lu files\n",nRecords,mr->numSources());
+  delete mr;
+  return 0;
+}
@@ -43,7 +43,9 @@
 #include <execinfo.h>
 #include <errno.h>
 #endif
+#include <fcntl.h>
 #include "FOMTools/Streamers.hpp"
+#include "FOMTools/SymbolTable.hpp"
 
 static std::atomic_flag malloc_tracing_flag_sami = ATOMIC_FLAG_INIT;
 static std::atomic_flag calloc_tracing_flag_sami = ATOMIC_FLAG_INIT;
@@ -104,6 +106,46 @@ std::vector<std::string>& symNames(){
   return *symNames;
 }
 
+std::vector<uint64_t>& symIPs(){
+  static auto symIPs=new std::vector<uint64_t>();
+  return *symIPs;
+}
+
+static size_t symbolsFlushed=0;//symbols already stored in the trace
+static size_t symbolChunkSize=256;
+static uint64_t mapsHash=0;
+
+//appends new symbols and, if it changed, the module map to the trace
+void flushSymbols(FOM_mallocHook::WriterBase* w){
+  if(!w)return;
+  std::vector<char> payload;
+  size_t n=symNames().size();
+  if(n>symbolsFlushed){
+    FOM_mallocHook::SymbolTable::encodeSymbols(payload,symIPs().data()+symbolsFlushed,
+					       symNames().data()+symbolsFlushed,n-symbolsFlushed);
+    w->writeChunk(FOM_mallocHook::SymbolChunk,symbolsFlushed,payload.data(),payload.size());
+    symbolsFlushed=n;
+  }
+  int mapsFD=::open("/proc/self/maps",O_RDONLY);
+  if(mapsFD==-1)return;
+  std::string maps;
+  char buff[4096];
+  ssize_t nread=0;
+  while((nread=::read(mapsFD,buff,4096))>0){
+    maps.append(buff,nread);
+  }
+  ::close(mapsFD);
+  uint64_t hash=14695981039346656037ull;//FNV-1a
+  for(auto c:maps){
+    hash=(hash^(unsigned char)c)*1099511628211ull;
+  }
+  if(hash!=mapsHash){
+    FOM_mallocHook::SymbolTable::encodeMaps(payload,maps.data(),maps.size());
+    w->writeChunk(FOM_mallocHook::MapsChunk,0,payload.data(),payload.size());
+    mapsHash=hash;
+  }
+}
+
 const char* getOutputFileName();
 
 
@@ -129,6 +171,7 @@ void atexit_handler(){
   }
   malloc_tracing_flag_sami.test_and_set();
   calloc_tracing_flag_sami.test_and_set();
+  flushSymbols(FWriter);
   char buff[2048];
   const char* fileN=getOutputFileName();
   snprintf(buff,2048,"%s_maps",fileN);
@@ -171,6 +214,7 @@ void atexit_handler(){
   mhbuildInfo=0;
   delete &symNames();
   delete &symMap();
+  delete &symIPs();
 }
 
 void prepFork(){
@@ -197,6 +241,8 @@ void postForkChildren(){
     while(malloc_tracing_flag_sami.test_and_set(std::memory_order_acquire));//spin until get the lock
     //if(!malloc_tracing_flag_sami.test_and_set()){
     delete fwriter;
+    symbolsFlushed=0;//child trace needs all symbols again
+    mapsHash=0;
     fwriter=getWriter();
     currWriter(fwriter);
     malloc_tracing_flag_sami.clear(std::memory_order_release);
@@ -247,6 +293,7 @@ void show_backtrace (size_t size,void* addr,int depth,int allocType, uint64_t t1
 	  }
 	}
 	symNames().emplace_back(strBuf);
+	symIPs().push_back(ip);
       }
       *stackRecord=it.first->second;
       stackRecord++;
@@ -272,6 +319,9 @@ void show_backtrace (size_t size,void* addr,int depth,int allocType, uint64_t t1
   hdr->tend = t3.tv_sec*1000000000l+t3.tv_nsec;
   fwriter->writeRecord(hdr);
   counter = counter + 1;
+  if(symNames().size()-symbolsFlushed>=symbolChunkSize){
+    flushSymbols(fwriter);
+  }
 }
 
 #ifdef __DO_GNU_BACKTRACE__
@@ -420,23 +470,68 @@ FOM_mallocHook::WriterBase* getWriter(){
   }
   size_t bucketSize=65536;
   char *buck=getenv("MALLOC_INTERPOSE_BUCKET_SIZE");
-  if(com){
+  if(buck){
     char* end;
     bucketSize=std::strtoull(buck,&end,10);
   }
+  size_t syncPeriod=65536;
+  char *sync=getenv("MALLOC_INTERPOSE_SYNC_PERIOD");//records between sync markers, 0 disables
+  if(sync){
+    char* end;
+    syncPeriod=std::strtoull(sync,&end,10);
+  }
+  char *symChunk=getenv("MALLOC_INTERPOSE_SYMBOL_CHUNK");//new symbols collected before they are written
+  if(symChunk){
+    char* end;
+    symbolChunkSize=std::strtoull(symChunk,&end,10);
+    if(symbolChunkSize==0)symbolChunkSize=1;
+  }
+  size_t segmentSize=0;
+  char *segSize=getenv("MALLOC_INTERPOSE_SEGMENT_SIZE");//bytes of records per output segment
+  if(segSize){
+    char* end;
+    segmentSize=std::strtoull(segSize,&end,10);
+  }
+  uint64_t segmentTime=0;
+  char *segTime=getenv("MALLOC_INTERPOSE_SEGMENT_TIME");//seconds per output segment
+  if(segTime){
+    char* end;
+    segmentTime=std::strtoull(segTime,&end,10)*1000000000ul;
+  }
+  size_t dictSize=0;
+  char *dict=getenv("MALLOC_INTERPOSE_ZLIB_DICTIONARY");//bytes of trained dictionary, zlib only
+  if(dict){
+    char* end;
+    dictSize=std::strtoull(dict,&end,10);
+  }
   
+  char *backend=getenv("MALLOC_INTERPOSE_WRITER");//plain, mmap or uring, for uncompressed output
+  bool useMmap=(backend && (strcmp(backend,"mmap")==0));
+  bool useUring=(backend && (strcmp(backend,"uring")==0));
   FOM_mallocHook::WriterBase *w=0;
   int compressionMode=(compress/10000000); //higher 8 bits for compression mode
   switch(compressionMode){
   case(0):
     {
-      w=new FOM_mallocHook::PlainWriter(fileN,compress,bucketSize);
+      if(useMmap){
+	w=new FOM_mallocHook::MmapWriter(fileN,compress,bucketSize);
+      }
+#ifdef IO_URING_FOUND
+      else if(useUring){
+	w=new FOM_mallocHook::UringWriter(fileN,compress,bucketSize);
+      }
+#endif
+      else{
+	w=new FOM_mallocHook::PlainWriter(fileN,compress,bucketSize);
+      }
       break;
     }
 #ifdef ZLIB_FOUND
   case(_USE_ZLIB_COMPRESSION_):
     {
-      w=new FOM_mallocHook::ZlibWriter(fileN,compress,bucketSize);
+      auto zw=new FOM_mallocHook::ZlibWriter(fileN,compress,bucketSize);
+      if(dictSize)zw->setDictionary(dictSize);
+      w=zw;
       break;
     }
 #endif
@@ -461,6 +556,10 @@ FOM_mallocHook::WriterBase* getWriter(){
      break;
    }
   }
+  w->setSyncPeriod(syncPeriod);
+  if(segmentSize||segmentTime){
+    w->setSegmentation(segmentSize,segmentTime);
+  }
   return w;
 }
 
@@ -0,0 +1,85 @@
+/*
+ *  Copyright (c) CERN 2015
+ *
+ *  Authors:
+ *      Nathalie Rauschmayr <nathalie.rauschmayr_ at _ cern _dot_ ch>
+ *      Sami Kama <sami.kama_ at _ cern _dot_ ch>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#ifndef __TRACE_GENERATOR_H
+#define __TRACE_GENERATOR_H
+#include <cstdint>
+#include <vector>
+#include <random>
+#include "FOMTools/Streamers.hpp"
+
+//
+// TraceGenerator. Synthetic records looking like hook output for the
+// tests and benchmarks, the same sequence for every run. Records are 1 us
+// apart at addresses spread over 256 MB. With nPaths>0 stacks are drawn
+// from that many call paths of 5 to 30 frames, so that they repeat as in
+// real traces, otherwise each record gets its own stack of 0 to 24 frames.
+//
+class TraceGenerator{
+public:
+  TraceGenerator(size_t nPaths=0):m_typeDist(0,3),m_depthDist(0,24),m_pathDist(0,nPaths?nPaths-1:0),
+				  m_addrDist(0,1ul<<24),m_t(1000000000ul),m_nRecords(0){
+    m_eng.seed(1234);
+    std::uniform_int_distribution<int> pathDepth(5,30);
+    std::uniform_int_distribution<FOM_mallocHook::index_t> frame(0,999);
+    m_paths.resize(nPaths);
+    for(auto &p:m_paths){
+      p.resize(pathDepth(m_eng));
+      for(auto &i:p)i=frame(m_eng);
+    }
+  };
+  // the next record, valid until the following call
+  const FOM_mallocHook::header* next(){
+    auto h=(FOM_mallocHook::header*)m_buff;
+    auto st=(FOM_mallocHook::index_t*)(h+1);
+    h->tstart=m_t;
+    h->treturn=m_t+40;
+    h->tend=m_t+400;
+    h->allocType=m_typeDist(m_eng);
+    h->addr=0x7f0000000000ul+(m_addrDist(m_eng)<<4);
+    h->size=(h->allocType==0?0:(m_addrDist(m_eng)&0xffff));
+    if(m_paths.empty()){
+      h->count=m_depthDist(m_eng);
+      for(int i=0;i<h->count;i++)st[i]=m_nRecords+i;
+    }else{
+      const auto &p=m_paths[m_pathDist(m_eng)];
+      h->count=p.size();
+      for(int i=0;i<h->count;i++)st[i]=p[i];
+    }
+    m_t+=1000;
+    m_nRecords++;
+    return h;
+  };
+  void write(FOM_mallocHook::WriterBase& w,size_t nRecords){
+    for(size_t r=0;r<nRecords;r++)w.writeRecord((const void*)next());
+  };
+private:
+  std::default_random_engine m_eng;
+  std::uniform_int_distribution<int> m_typeDist;
+  std::uniform_int_distribution<int> m_depthDist;
+  std::uniform_int_distribution<size_t> m_pathDist;
+  std::uniform_int_distribution<uint64_t> m_addrDist;
+  std::vector<std::vector<FOM_mallocHook::index_t> > m_paths;
+  uint64_t m_t;
+  size_t m_nRecords;
+  char m_buff[sizeof(FOM_mallocHook::header)+32*sizeof(FOM_mallocHook::index_t)];
+};
+#endif
@@ -0,0 +1,189 @@
+/*
+ *  Copyright (c) CERN 2015
+ *
+ *  Authors:
+ *      Nathalie Rauschmayr <nathalie.rauschmayr_ at _ cern _dot_ ch>
+ *      Sami Kama <sami.kama_ at _ cern _dot_ ch>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+// Index construction benchmark. Writes a synthetic uncompressed trace (or
+// uses an existing one) and times building the record index with an
+// increasing number of threads against the single threaded walk, then
+// the compressed (Elias-Fano) index against the plain offset vector.
+
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <iostream>
+#include "FOMTools/Streamers.hpp"
+#include "TraceGenerator.hpp"
+
+void printUsage(char* name){
+  std::cout<<"Usage:  "<<name<<" -n <records> -d <directory> "<<std::endl;
+  std::cout<<"     --records   (-n)  number of records to write (default 1000000000)"<<std::endl;
+  std::cout<<"     --directory (-d)  directory for the output file (default /tmp)"<<std::endl;
+  std::cout<<"     --file      (-f)  index an existing uncompressed trace instead"<<std::endl;
+  std::cout<<"     --sync      (-s)  records between sync markers, 0 disables (default 65536)"<<std::endl;
+  std::cout<<"     --threads   (-t)  maximum number of threads (default all cores)"<<std::endl;
+  std::cout<<"     --keep      (-k)  keep the generated file"<<std::endl;
+}
+
+void writeTrace(const std::string& fileName,size_t nRecords,size_t syncPeriod){
+  FOM_mallocHook::MmapWriter w(fileName,0,0);
+  w.setSyncPeriod(syncPeriod);
+  TraceGenerator g;
+  g.write(w,nRecords);
+}
+
+int main(int argc,char* argv[]){
+  size_t nRecords=1000000000ul;
+  size_t syncPeriod=65536;
+  unsigned int maxThreads=std::thread::hardware_concurrency();
+  std::string dir("/tmp");
+  std::string fileName;
+  bool keep=false;
+  int c;
+  while (1) {
+    int option_index = 0;
+    static struct option long_options[] = {
+      {"help", 0, 0, 'h'},
+      {"records", 1, 0, 'n'},
+      {"directory", 1, 0, 'd'},
+      {"file", 1, 0, 'f'},
+      {"sync", 1, 0, 's'},
+      {"threads", 1, 0, 't'},
+      {"keep", 0, 0, 'k'},
+      {0, 0, 0, 0}
+    };
+    c = getopt_long(argc, argv, "hn:d:f:s:t:k",
+		    long_options, &option_index);
+    if (c == -1)
+      break;
+    switch (c) {
+    case 'h':
+      printUsage(argv[0]);
+      exit(EXIT_SUCCESS);
+      break;
+    case 'n':  {
+      nRecords=std::strtoull(optarg,0,10);
+      break;
+    }
+    case 'd':  {
+      dir=std::string(optarg);
+      break;
+    }
+    case 'f':  {
+      fileName=std::string(optarg);
+      keep=true;
+      break;
+    }
+    case 's':  {
+      syncPeriod=std::strtoull(optarg,0,10);
+      break;
+    }
+    case 't':  {
+      maxThreads=std::strtoul(optarg,0,10);
+      break;
+    }
+    case 'k':  {
+      keep=true;
+      break;
+    }
+    default:
+      printf("unknown parameter! getopt returned character code 0%o ??\n", c);
+    }
+  }
+  if(maxThreads<1)maxThreads=1;
+  if(fileName.empty()){
+    fileName=dir+"/benchIndex.fom";
+    printf("Writing %lu records to %s\n",nRecords,fileName.c_str());
+    auto t0=std::chrono::steady_clock::now();
+    writeTrace(fileName,nRecords,syncPeriod);
+    printf("Written in %.1f s\n",std::chrono::duration<double>(std::chrono::steady_clock::now()-t0).count());
+  }
+  int fd=open(fileName.c_str(),O_RDONLY);
+  if(fd==-1){
+    perror("open");
+    return 1;
+  }
+  struct stat sinp;
+  fstat(fd,&sinp);
+  void* m=mmap64(0,sinp.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+  if(m==MAP_FAILED){
+    perror("mmap");
+    return 1;
+  }
+  FOM_mallocHook::FileStats fs;
+  size_t hdrOff=fs.parse(m,sinp.st_size);
+  printf("%.1f GB trace\n",sinp.st_size/1073741824.);
+  std::vector<uint64_t> reference;
+  double tRef=0;
+  std::vector<unsigned int> threadCounts;
+  for(unsigned int nt=1;nt<maxThreads;nt*=2)threadCounts.push_back(nt);
+  threadCounts.push_back(maxThreads);
+  for(auto nt:threadCounts){
+    std::vector<uint64_t> offsets;
+    auto t0=std::chrono::steady_clock::now();
+    size_t n=FOM_mallocHook::indexRecords(m,hdrOff,sinp.st_size,1,offsets,nt);
+    double dt=std::chrono::duration<double>(std::chrono::steady_clock::now()-t0).count();
+    if(nt==1){
+      tRef=dt;
+      reference.swap(offsets);
+    }else if(offsets!=reference){
+      printf("Index built with %u threads differs from the sequential one!\n",nt);
+      return 1;
+    }
+    printf("%3u threads %8.3f s %12.0f records/s speedup %5.2f (%lu records)\n",nt,dt,n/dt,tRef/dt,n);
+  }
+  {
+    FOM_mallocHook::EliasFano ef;
+    auto t0=std::chrono::steady_clock::now();
+    size_t n=FOM_mallocHook::indexRecords(m,hdrOff,sinp.st_size,ef,maxThreads);
+    double dt=std::chrono::duration<double>(std::chrono::steady_clock::now()-t0).count();
+    for(size_t i=0;i<n;i++){
+      if(ef.at(i)!=reference[i]){
+	printf("Compressed index differs from the sequential one at %lu!\n",i);
+	return 1;
+      }
+    }
+    std::default_random_engine eng;
+    std::uniform_int_distribution<size_t> idxDist(0,n?n-1:0);
+    const size_t nLookups=10000000;
+    uint64_t sum=0;
+    t0=std::chrono::steady_clock::now();
+    for(size_t i=0;i<nLookups;i++)sum+=ef.at(idxDist(eng));
+    double dtEF=std::chrono::duration<double>(std::chrono::steady_clock::now()-t0).count();
+    t0=std::chrono::steady_clock::now();
+    for(size_t i=0;i<nLookups;i++)sum-=reference[idxDist(eng)];
+    double dtVec=std::chrono::duration<double>(std::chrono::steady_clock::now()-t0).count();
+    printf("Elias-Fano %3u threads %8.3f s %6.2f bytes/record, random access %.1f ns (vector %.1f ns) %lu\n",
+	   maxThreads,dt,(double)ef.memoryBytes()/n,dtEF*1e9/nLookups,dtVec*1e9/nLookups,sum);
+  }
+  munmap(m,sinp.st_size);
+  close(fd);
+  if(!keep)unlink(fileName.c_str());
+  return 0;
+}
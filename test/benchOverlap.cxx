@@ -0,0 +1,204 @@
+/*
+ *  Copyright (c) CERN 2015
+ *
+ *  Authors:
+ *      Nathalie Rauschmayr <nathalie.rauschmayr_ at _ cern _dot_ ch>
+ *      Sami Kama <sami.kama_ at _ cern _dot_ ch>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+// Overlap classification benchmark. Classifies random allocations, kept
+// as columns, against random regions in every ALLOCTIME mode, once with
+// the nested-if loops RegionFinder used to run per record and once with
+// a column kernel over overlapOf(), and reports records/s for both. Both
+// must classify every allocation the same way.
+
+#include <getopt.h>
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <iostream>
+#include "FOMTools/OverlapKernel.hpp"
+
+typedef FOM_mallocHook::RegionFinder RF;
+typedef FOM_mallocHook::MemRecord MR;
+
+void printUsage(char* name){
+  std::cout<<"Usage:  "<<name<<" -n <records> -r <regions> "<<std::endl;
+  std::cout<<"     --records   (-n)  number of allocations (default 10000000)"<<std::endl;
+  std::cout<<"     --regions   (-r)  number of regions per mode (default 20)"<<std::endl;
+}
+
+// the loops of RegionFinder before the kernel: time test, then nested ifs
+size_t classifyLoop(RF::ALLOCTIME mode,const RegionInfo& ri,const uintptr_t* first,const uintptr_t* last,
+		    const uint64_t* tStart,const uint64_t* tFree,size_t n,uint8_t* out){
+  size_t count=0;
+  for(size_t i=0;i<n;i++){
+    out[i]=MR::Undefined;
+    if(mode==RF::AFTER && tStart[i]<ri.alloc_time)continue;
+    if(mode==RF::BEFORE && tStart[i]>ri.alloc_time)continue;
+    if(mode==RF::LIVE && !(tStart[i]<=ri.alloc_time && ri.alloc_time<tFree[i]))continue;
+    uintptr_t ms=first[i];
+    uintptr_t me=last[i];
+    if(ri.pBegin<me){
+      if(ri.pBegin>=ms){
+	if(ri.pEnd<=me){
+	  out[i]=MR::Superset;
+	}else{
+	  out[i]=MR::Underflow;
+	}
+      }else{
+	if(ri.pEnd>=me){
+	  out[i]=MR::Subset;
+	}else if(ri.pEnd>=ms){
+	  out[i]=MR::Overflow;
+	}
+      }
+    }
+    count+=(out[i]!=MR::Undefined);
+  }
+  return count;
+}
+
+// The kernel: out[i] is the overlap type of allocation i, Undefined when
+// it does not overlap or its time does not fit the mode. ANYTIME has no
+// branches, so it vectorizes with -ftree-vectorize. The other modes test
+// the time first with a branch, which is well predicted for records in
+// time order and skips the page work.
+template<int Mode> size_t classifyOverlaps(const RegionInfo& ri,const uintptr_t* first,const uintptr_t* last,
+					   const uint64_t* tStart,const uint64_t* tFree,size_t n,uint8_t* out){
+  const uint64_t rs=FOM_mallocHook::regionPage(ri.pBegin);
+  const uint64_t re=FOM_mallocHook::regionPage(ri.pEnd);
+  const uint64_t t=ri.alloc_time;
+  size_t count=0;
+  if(Mode==RF::ANYTIME){
+    for(size_t i=0;i<n;i++){
+      const uint8_t o=FOM_mallocHook::overlapOf(rs,re,first[i],last[i]);
+      out[i]=o;
+      count+=(o!=0);
+    }
+    return count;
+  }
+  for(size_t i=0;i<n;i++){
+    out[i]=MR::Undefined;
+    if(!FOM_mallocHook::inTime<Mode>(tStart[i],(Mode==RF::LIVE)?tFree[i]:0,t))continue;
+    out[i]=FOM_mallocHook::overlapOf(rs,re,first[i],last[i]);
+    count+=(out[i]!=0);
+  }
+  return count;
+}
+
+size_t classifyOverlaps(RF::ALLOCTIME mode,const RegionInfo& ri,const uintptr_t* first,const uintptr_t* last,
+			const uint64_t* tStart,const uint64_t* tFree,size_t n,uint8_t* out){
+  switch(mode){
+  case RF::BEFORE:return classifyOverlaps<RF::BEFORE>(ri,first,last,tStart,tFree,n,out);
+  case RF::AFTER:return classifyOverlaps<RF::AFTER>(ri,first,last,tStart,tFree,n,out);
+  case RF::LIVE:return classifyOverlaps<RF::LIVE>(ri,first,last,tStart,tFree,n,out);
+  default:return classifyOverlaps<RF::ANYTIME>(ri,first,last,tStart,tFree,n,out);
+  }
+}
+
+typedef std::chrono::steady_clock Clock;
+
+int main(int argc,char* argv[]){
+  size_t nRecords=10000000;
+  size_t nRegions=20;
+  int c;
+  while (1) {
+    int option_index = 0;
+    static struct option long_options[] = {
+      {"help", 0, 0, 'h'},
+      {"records", 1, 0, 'n'},
+      {"regions", 1, 0, 'r'},
+      {0, 0, 0, 0}
+    };
+    c = getopt_long(argc, argv, "hn:r:",
+		    long_options, &option_index);
+    if (c == -1)
+      break;
+    switch (c) {
+    case 'h':
+      printUsage(argv[0]);
+      exit(EXIT_SUCCESS);
+      break;
+    case 'n':  {
+      nRecords=std::strtoull(optarg,0,10);
+      break;
+    }
+    case 'r':  {
+      nRegions=std::strtoull(optarg,0,10);
+      break;
+    }
+    default:
+      printf("unknown parameter! getopt returned character code 0%o ??\n", c);
+    }
+  }
+  if(nRecords==0 || nRegions==0){
+    printUsage(argv[0]);
+    return 1;
+  }
+  std::default_random_engine eng;
+  eng.seed(1234);
+  std::uniform_int_distribution<uint64_t> addrDist(0,1ul<<24);
+  std::uniform_int_distribution<uint64_t> sizeDist(0,1ul<<16);
+  std::uniform_int_distribution<uint64_t> lifeDist(0,1ul<<24);
+  const uintptr_t pageMask=4095;
+  std::vector<uintptr_t> first(nRecords),last(nRecords);
+  std::vector<uint64_t> tStart(nRecords),tFree(nRecords);
+  uint64_t t=1000000000ul;
+  for(size_t i=0;i<nRecords;i++){
+    uintptr_t addr=0x7f0000000000ul+(addrDist(eng)<<4);
+    first[i]=addr&(~pageMask);
+    last[i]=(addr+sizeDist(eng))|pageMask;
+    tStart[i]=t;
+    tFree[i]=(i%16==0)?UINT64_MAX:t+lifeDist(eng);//some never freed
+    t+=1000;
+  }
+  std::vector<RegionInfo> regions(nRegions);
+  std::uniform_int_distribution<size_t> recDist(0,nRecords-1);
+  for(auto& ri:regions){
+    ri.pBegin=(0x7f0000000000ul+(addrDist(eng)<<4))&(~pageMask);
+    ri.pEnd=ri.pBegin+(sizeDist(eng)<<4);
+    ri.alloc_time=tStart[recDist(eng)];
+  }
+  std::vector<uint8_t> ref(nRecords),out(nRecords);
+  const RF::ALLOCTIME modes[]={RF::ANYTIME,RF::AFTER,RF::BEFORE,RF::LIVE};
+  const char* names[]={"ANYTIME","AFTER","BEFORE","LIVE"};
+  bool ok=true;
+  for(int m=0;m<4;m++){
+    double dtLoop=0,dtKernel=0;
+    size_t hits=0;
+    for(const auto& ri:regions){
+      auto t0=Clock::now();
+      size_t nRef=classifyLoop(modes[m],ri,first.data(),last.data(),tStart.data(),tFree.data(),nRecords,ref.data());
+      auto t1=Clock::now();
+      size_t nOut=classifyOverlaps(modes[m],ri,first.data(),last.data(),tStart.data(),tFree.data(),nRecords,out.data());
+      auto t2=Clock::now();
+      dtLoop+=std::chrono::duration<double>(t1-t0).count();
+      dtKernel+=std::chrono::duration<double>(t2-t1).count();
+      hits+=nRef;
+      if(nRef!=nOut || ref!=out){
+	printf("%s: kernel and loops classify differently!\n",names[m]);
+	ok=false;
+      }
+    }
+    double n=(double)nRecords*nRegions;
+    printf("%-8s loops %8.3f s %12.0f records/s   kernel %8.3f s %12.0f records/s speedup %5.2f (%lu overlaps)\n",
+	   names[m],dtLoop,n/dtLoop,dtKernel,n/dtKernel,dtLoop/dtKernel,hits);
+  }
+  return ok?0:1;
+}
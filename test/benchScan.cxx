@@ -0,0 +1,269 @@
+/*
+ *  Copyright (c) CERN 2015
+ *
+ *  Authors:
+ *      Nathalie Rauschmayr <nathalie.rauschmayr_ at _ cern _dot_ ch>
+ *      Sami Kama <sami.kama_ at _ cern _dot_ ch>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+// Full scan benchmark. Reads every record of a trace with each reader,
+// once through the virtual at() of the reader, once through a cursor's
+// at(), then with forEach() and the record iterator, and reports
+// records/s for each. Last, every record is copied out with At(). All of
+// them must see the same records. For uncompressed traces the page faults
+// of a full scan and of random queries are then counted, starting from a
+// cold page cache, for each reader access pattern.
+
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <iostream>
+#include "FOMTools/Streamers.hpp"
+#include "TraceGenerator.hpp"
+
+void printUsage(char* name){
+  std::cout<<"Usage:  "<<name<<" -n <records> -d <directory> "<<std::endl;
+  std::cout<<"     --records   (-n)  number of records to write (default 20000000)"<<std::endl;
+  std::cout<<"     --directory (-d)  directory for the generated files (default /tmp)"<<std::endl;
+  std::cout<<"     --file      (-f)  scan an existing trace instead"<<std::endl;
+  std::cout<<"     --keep      (-k)  keep the generated files"<<std::endl;
+  std::cout<<"     --queries   (-q)  random queries per access pattern (default 1000000)"<<std::endl;
+}
+
+void writeTrace(FOM_mallocHook::WriterBase* w,size_t nRecords){
+  TraceGenerator g;
+  g.write(*w,nRecords);
+  delete w;
+}
+
+// what every scan computes, enough to keep the loads alive
+struct Sum{
+  uint64_t s;
+  Sum():s(0){};
+  void add(const FOM_mallocHook::RecordIndex& r){s+=r.getTStart()^(r.getAddr()+r.getSize());};
+};
+
+typedef std::chrono::steady_clock Clock;
+
+// drops the trace from the page cache so that every run starts cold
+void evict(const std::string& f){
+  int fd=open(f.c_str(),O_RDONLY);
+  if(fd==-1)return;
+  fdatasync(fd);//dirty pages are not dropped
+  posix_fadvise(fd,0,0,POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+void faults(const std::string& f,size_t nQueries){
+  typedef FOM_mallocHook::ReaderBase RB;
+  const unsigned int patterns[]={RB::AccessNormal,RB::AccessSequential,RB::AccessRandom,
+				 RB::AccessSequential|RB::AccessPopulate,RB::AccessRandom|RB::AccessHugePages};
+  const char* names[]={"normal","sequential","random","sequential+populate","random+hugepages"};
+  bool hadIndex=(access((f+".fomidx").c_str(),F_OK)==0);
+  {//write the sidecar index, opening must not touch the trace
+    FOM_mallocHook::Reader r(f,true);
+  }
+  for(int w=0;w<2;w++){
+    for(int p=0;p<5;p++){
+      evict(f);
+      struct rusage r0,r1;
+      getrusage(RUSAGE_SELF,&r0);
+      auto t0=Clock::now();
+      Sum s;
+      {
+	FOM_mallocHook::Reader r(f,true,patterns[p]);
+	if(w==0){
+	  r.forEach([&s](const FOM_mallocHook::RecordIndex& ri){s.add(ri);});
+	}else{
+	  std::default_random_engine eng;
+	  std::uniform_int_distribution<size_t> idxDist(0,r.size()-1);
+	  for(size_t i=0;i<nQueries;i++)s.add(r.at(idxDist(eng)));
+	}
+      }
+      double dt=std::chrono::duration<double>(Clock::now()-t0).count();
+      getrusage(RUSAGE_SELF,&r1);
+      printf("%-7s %-20s %8.3f s %10ld minor %8ld major faults (%lu)\n",(w==0?"scan":"queries"),names[p],dt,
+	     r1.ru_minflt-r0.ru_minflt,r1.ru_majflt-r0.ru_majflt,s.s&0xff);
+    }
+  }
+  if(!hadIndex)unlink((f+".fomidx").c_str());
+}
+
+bool scan(FOM_mallocHook::ReaderBase* r,const char* name){
+  size_t n=r->size();
+  double dt[5];
+  uint64_t sums[5];
+  {
+    Sum s;
+    auto t0=Clock::now();
+    for(size_t i=0;i<n;i++)s.add(r->at(i));
+    dt[0]=std::chrono::duration<double>(Clock::now()-t0).count();
+    sums[0]=s.s;
+  }
+  {
+    Sum s;
+    auto c=r->newCursor();
+    auto t0=Clock::now();
+    for(size_t i=0;i<n;i++)s.add(c->at(i));
+    dt[1]=std::chrono::duration<double>(Clock::now()-t0).count();
+    sums[1]=s.s;
+  }
+  {
+    Sum s;
+    auto t0=Clock::now();
+    r->forEach([&s](const FOM_mallocHook::RecordIndex& ri){s.add(ri);});
+    dt[2]=std::chrono::duration<double>(Clock::now()-t0).count();
+    sums[2]=s.s;
+  }
+  {
+    Sum s;
+    auto t0=Clock::now();
+    for(const auto& ri:r->records())s.add(ri);
+    dt[3]=std::chrono::duration<double>(Clock::now()-t0).count();
+    sums[3]=s.s;
+  }
+  {
+    Sum s;
+    auto c=r->newCursor();
+    FOM_mallocHook::FullRecord fr;
+    auto t0=Clock::now();
+    for(size_t i=0;i<n;i++){
+      fr=c->At(i);
+      s.add(FOM_mallocHook::RecordIndex(fr.getHeader()));
+    }
+    dt[4]=std::chrono::duration<double>(Clock::now()-t0).count();
+    sums[4]=s.s;
+  }
+  const char* modes[5]={"at()","cursor at()","forEach()","iterator","At() copy"};
+  bool ok=true;
+  for(int m=0;m<5;m++){
+    printf("%-16s %-12s %8.3f s %12.0f records/s speedup %5.2f\n",name,modes[m],dt[m],n/dt[m],dt[0]/dt[m]);
+    if(sums[m]!=sums[0]){
+      printf("%s %s saw different records!\n",name,modes[m]);
+      ok=false;
+    }
+  }
+  return ok;
+}
+
+int main(int argc,char* argv[]){
+  size_t nRecords=20000000;
+  std::string dir("/tmp");
+  std::string fileName;
+  bool keep=false;
+  size_t nQueries=1000000;
+  int c;
+  while (1) {
+    int option_index = 0;
+    static struct option long_options[] = {
+      {"help", 0, 0, 'h'},
+      {"records", 1, 0, 'n'},
+      {"directory", 1, 0, 'd'},
+      {"file", 1, 0, 'f'},
+      {"keep", 0, 0, 'k'},
+      {"queries", 1, 0, 'q'},
+      {0, 0, 0, 0}
+    };
+    c = getopt_long(argc, argv, "hn:d:f:kq:",
+		    long_options, &option_index);
+    if (c == -1)
+      break;
+    switch (c) {
+    case 'h':
+      printUsage(argv[0]);
+      exit(EXIT_SUCCESS);
+      break;
+    case 'n':  {
+      nRecords=std::strtoull(optarg,0,10);
+      break;
+    }
+    case 'd':  {
+      dir=std::string(optarg);
+      break;
+    }
+    case 'f':  {
+      fileName=std::string(optarg);
+      keep=true;
+      break;
+    }
+    case 'k':  {
+      keep=true;
+      break;
+    }
+    case 'q':  {
+      nQueries=std::strtoull(optarg,0,10);
+      break;
+    }
+    default:
+      printf("unknown parameter! getopt returned character code 0%o ??\n", c);
+    }
+  }
+  std::vector<std::string> files;
+  if(fileName.empty()){
+    files.push_back(dir+"/benchScan.fom");
+    writeTrace(new FOM_mallocHook::MmapWriter(files.back(),0,0),nRecords);
+#ifdef ZLIB_FOUND
+    files.push_back(dir+"/benchScan_zlib.fom");
+    writeTrace(new FOM_mallocHook::ZlibWriter(files.back(),(_USE_ZLIB_COMPRESSION_*10000000)+1,65536),nRecords);
+#endif
+  }else{
+    files.push_back(fileName);
+  }
+  bool ok=true;
+  for(const auto& f:files){
+    FOM_mallocHook::FileStats fs;
+    {
+      int fd=open(f.c_str(),O_RDONLY);
+      if(fd==-1){
+	perror("open");
+	return 1;
+      }
+      fs.read(fd,false);
+      close(fd);
+    }
+    if(fs.getCompression()==0){
+      {
+	FOM_mallocHook::Reader r(f,false);
+	ok&=scan(&r,"Reader");
+      }
+      {
+	FOM_mallocHook::CompactReader r(f);
+	ok&=scan(&r,"CompactReader");
+      }
+      {
+	FOM_mallocHook::IndexingReader r(f);
+	ok&=scan(&r,"IndexingReader");
+      }
+      faults(f,nQueries);
+    }
+#ifdef ZLIB_FOUND
+    else if((fs.getCompression()/10000000)==_USE_ZLIB_COMPRESSION_){
+      FOM_mallocHook::ZlibReader r(f,3,false);
+      ok&=scan(&r,"ZlibReader");
+    }
+#endif
+    if(!keep)unlink(f.c_str());
+  }
+  return ok?0:1;
+}
@@ -0,0 +1,168 @@
+/*
+ *  Copyright (c) CERN 2015
+ *
+ *  Authors:
+ *      Nathalie Rauschmayr <nathalie.rauschmayr_ at _ cern _dot_ ch>
+ *      Sami Kama <sami.kama_ at _ cern _dot_ ch>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+// Writer throughput comparison. Writes the same synthetic record stream
+// with every available writer and reports records/s and MB/s.
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <getopt.h>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <iostream>
+#include "FOMTools/Streamers.hpp"
+#include "TraceGenerator.hpp"
+
+void printUsage(char* name){
+  std::cout<<"Usage:  "<<name<<" -n <records> -d <directory> [-b <bucket size>] [-D <dictionary size>]"<<std::endl;
+  std::cout<<"     --records   (-n)  number of records to write (default 10000000)"<<std::endl;
+  std::cout<<"     --directory (-d)  directory for the output files (default /tmp)"<<std::endl;
+  std::cout<<"     --keep      (-k)  keep output files"<<std::endl;
+  std::cout<<"     --bucket    (-b)  bucket size for zlib writers (default 65536)"<<std::endl;
+  std::cout<<"     --dictionary (-D) dictionary size for the ZlibDict row (default 32768)"<<std::endl;
+}
+
+// builds a stream of records looking like hook output. Stacks are drawn from
+// a small set of call paths so that they repeat like in real traces
+std::vector<char> makeRecords(size_t nRecords,size_t *totBytes){
+  TraceGenerator g(1000);
+  std::vector<char> buff;
+  buff.reserve(nRecords*(sizeof(FOM_mallocHook::header)+20*sizeof(FOM_mallocHook::index_t)));
+  for(size_t r=0;r<nRecords;r++){
+    auto h=g.next();
+    buff.insert(buff.end(),(const char*)h,(const char*)FOM_mallocHook::skipRecord(h));
+  }
+  *totBytes=buff.size();
+  return buff;
+}
+
+double runWriter(FOM_mallocHook::WriterBase *w,const std::vector<char> &recs){
+  auto tstart=std::chrono::steady_clock::now();
+  const char* r=recs.data();
+  const char* rEnd=r+recs.size();
+  while(r<rEnd){
+    auto h=(const FOM_mallocHook::header*)r;
+    w->writeRecord((const void*)h);
+    r=(const char*)FOM_mallocHook::skipRecord(h);
+  }
+  delete w;//includes flushing and closing the file
+  auto tend=std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(tend-tstart).count();
+}
+
+int main(int argc,char* argv[]){
+  size_t nRecords=10000000;
+  std::string dir("/tmp");
+  bool keep=false;
+  size_t bucketSize=65536;
+  size_t dictSize=32768;
+  int c;
+  while (1) {
+    int option_index = 0;
+    static struct option long_options[] = {
+      {"help", 0, 0, 'h'},
+      {"records", 1, 0, 'n'},
+      {"directory", 1, 0, 'd'},
+      {"keep", 0, 0, 'k'},
+      {"bucket", 1, 0, 'b'},
+      {"dictionary", 1, 0, 'D'},
+      {0, 0, 0, 0}
+    };
+    c = getopt_long(argc, argv, "hn:d:kb:D:",
+		    long_options, &option_index);
+    if (c == -1)
+      break;
+    switch (c) {
+    case 'h':
+      printUsage(argv[0]);
+      exit(EXIT_SUCCESS);
+      break;
+    case 'n':  {
+      nRecords=std::strtoull(optarg,0,10);
+      break;
+    }
+    case 'd':  {
+      dir=std::string(optarg);
+      break;
+    }
+    case 'k':  {
+      keep=true;
+      break;
+    }
+    case 'b':  {
+      bucketSize=std::strtoull(optarg,0,10);
+      break;
+    }
+    case 'D':  {
+      dictSize=std::strtoull(optarg,0,10);
+      break;
+    }
+    default:
+      printf("unknown parameter! getopt returned character code 0%o ??\n", c);
+    }
+  }
+  size_t totBytes=0;
+  auto recs=makeRecords(nRecords,&totBytes);
+  printf("Writing %lu records, %.1f MB of uncompressed record data\n",nRecords,totBytes/1048576.);
+  std::vector<std::string> names;
+  names.push_back("PlainWriter");
+  names.push_back("MmapWriter");
+#ifdef IO_URING_FOUND
+  names.push_back("UringWriter");
+#endif
+#ifdef ZLIB_FOUND
+  names.push_back("ZlibWriter");
+  names.push_back("ZlibDict");
+#endif
+  for(auto &n:names){
+    std::string fileName=dir+"/benchWriters_"+n+".fom";
+    FOM_mallocHook::WriterBase *w=0;
+    if(n=="PlainWriter"){
+      w=new FOM_mallocHook::PlainWriter(fileName,0,0);
+    }else if(n=="MmapWriter"){
+      w=new FOM_mallocHook::MmapWriter(fileName,0,0);
+    }
+#ifdef IO_URING_FOUND
+    else if(n=="UringWriter"){
+      w=new FOM_mallocHook::UringWriter(fileName,0,0);
+    }
+#endif
+#ifdef ZLIB_FOUND
+    else if(n=="ZlibWriter"){
+      w=new FOM_mallocHook::ZlibWriter(fileName,(_USE_ZLIB_COMPRESSION_*10000000)+1,bucketSize);
+    }else if(n=="ZlibDict"){
+      auto zw=new FOM_mallocHook::ZlibWriter(fileName,(_USE_ZLIB_COMPRESSION_*10000000)+1,bucketSize);
+      zw->setDictionary(dictSize);
+      w=zw;
+    }
+#endif
+    double dt=runWriter(w,recs);
+    struct stat st;
+    double fileMB=(stat(fileName.c_str(),&st)==0?st.st_size/1048576.:0.);
+    printf("%-12s %8.3f s %12.0f records/s %9.1f MB/s %9.1f MB on disk\n",n.c_str(),dt,nRecords/dt,totBytes/1048576./dt,fileMB);
+    if(!keep)unlink(fileName.c_str());
+  }
+  return 0;
+}
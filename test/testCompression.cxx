@@ -47,12 +47,16 @@ void printUsage(char* name){
   std::cout<<"Usage:  "<<name<<" -i <input> -o <output> "<<std::endl;
   std::cout<<"     --input  (-i)  name of a file that is created by mallochook"<<std::endl;
   std::cout<<"     --output (-o)  output file name"<<std::endl;
+  std::cout<<"     --readahead (-r)  buckets inflated ahead when uncompressing, 0 disables"<<std::endl;
+  std::cout<<"     --memory    (-m)  read-ahead memory budget in MB (default 256)"<<std::endl;
 }
 
 int main(int argc,char* argv[]){
   std::string inpName("");
   std::string outName("");
   struct stat sinp;
+  int readAhead=-1;
+  size_t readAheadMB=256;
   int c;
   while (1) {
     int option_index = 0;
@@ -60,9 +64,11 @@ int main(int argc,char* argv[]){
       {"help", 0, 0, 'h'},
       {"input", 1, 0, 'i'},
       {"output", 1, 0, 'o'},
+      {"readahead", 1, 0, 'r'},
+      {"memory", 1, 0, 'm'},
       {0, 0, 0, 0}
     };
-    c = getopt_long(argc, argv, "hi:o:",
+    c = getopt_long(argc, argv, "hi:o:r:m:",
 		    long_options, &option_index);
     if (c == -1)
       break;
@@ -79,6 +85,14 @@ int main(int argc,char* argv[]){
       outName=std::string(optarg);
       break;
     }
+    case 'r':  {
+      readAhead=std::strtol(optarg,0,10);
+      break;
+    }
+    case 'm':  {
+      readAheadMB=std::strtoull(optarg,0,10);
+      break;
+    }
     default:
       printf("unknown parameter! getopt returned character code 0%o ??\n", c);
     }
@@ -135,7 +149,9 @@ int main(int argc,char* argv[]){
   bool compressed=(fs->getCompression()>0);
   if(compressed){
     int rc=clock_gettime(CLOCK_MONOTONIC,&tstart);
-    reader=new FOM_mallocHook::ZlibReader(inpName);
+    auto zr=new FOM_mallocHook::ZlibReader(inpName);
+    if(readAhead>=0)zr->setReadAhead(readAhead,readAheadMB<<20);
+    reader=zr;
     reader->getFileStats()->print();
     rc=clock_gettime(CLOCK_MONOTONIC,&tend);
     long ds=(tend.tv_sec-tstart.tv_sec);
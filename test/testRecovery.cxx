@@ -0,0 +1,116 @@
+/*
+ *  Copyright (c) CERN 2015
+ *
+ *  Authors:
+ *      Nathalie Rauschmayr <nathalie.rauschmayr_ at _ cern _dot_ ch>
+ *      Sami Kama <sami.kama_ at _ cern _dot_ ch>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+// Recovery of unfinished plain traces. Writes records around symbol and
+// maps chunks longer than any plausible stack, leaves the file without a
+// final header and with a partial record at its end, and checks that
+// recoverFile() finds every record instead of stopping at a chunk.
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <iostream>
+#include "FOMTools/Streamers.hpp"
+#include "TraceGenerator.hpp"
+
+void printUsage(char* name){
+  std::cout<<"Usage:  "<<name<<" [-d <directory>] [-s <sync period>]"<<std::endl;
+  std::cout<<"     --directory (-d)  directory for the test file (default /tmp)"<<std::endl;
+  std::cout<<"     --sync      (-s)  records between sync markers, 0 disables them (default 0)"<<std::endl;
+}
+
+int main(int argc,char* argv[]){
+  std::string dir("/tmp");
+  size_t syncPeriod=0;
+  int c;
+  while (1) {
+    int option_index = 0;
+    static struct option long_options[] = {
+      {"help", 0, 0, 'h'},
+      {"directory", 1, 0, 'd'},
+      {"sync", 1, 0, 's'},
+      {0, 0, 0, 0}
+    };
+    c = getopt_long(argc, argv, "hd:s:",
+		    long_options, &option_index);
+    if (c == -1)
+      break;
+    switch (c) {
+    case 'h':
+      printUsage(argv[0]);
+      exit(EXIT_SUCCESS);
+      break;
+    case 'd':  {
+      dir=std::string(optarg);
+      break;
+    }
+    case 's':  {
+      syncPeriod=std::strtoull(optarg,0,10);
+      break;
+    }
+    default:
+      printf("unknown parameter! getopt returned character code 0%o ??\n", c);
+    }
+  }
+  char pidStr[20];
+  snprintf(pidStr,20,"%u",getpid());
+  std::string fileName=dir+"/testRecovery_"+pidStr+".fom";
+  const size_t nRecords=3000;
+  std::vector<char> symbols(200000,'s');//50000 words, far more than any stack
+  std::vector<char> maps(40001,'m');
+  {
+    FOM_mallocHook::PlainWriter w(fileName,0,0);
+    w.setSyncPeriod(syncPeriod);
+    TraceGenerator g;
+    g.write(w,nRecords/3);
+    w.writeChunk(FOM_mallocHook::SymbolChunk,0,symbols.data(),symbols.size());
+    g.write(w,nRecords/3);
+    w.writeChunk(FOM_mallocHook::MapsChunk,0,maps.data(),maps.size());
+    g.write(w,nRecords/3);
+    w.closeFile(false);//as a killed process leaves it, without the final header
+  }
+  int fd=open(fileName.c_str(),O_WRONLY|O_APPEND);
+  if(fd==-1 || ::write(fd,"partial",7)!=7){
+    perror("appending partial record");
+    unlink(fileName.c_str());
+    return 1;
+  }
+  close(fd);
+  size_t found=FOM_mallocHook::recoverFile(fileName,true);
+  size_t read=0;
+  {
+    FOM_mallocHook::Reader r(fileName);
+    read=r.size();
+  }
+  unlink(fileName.c_str());
+  unlink((fileName+".fomidx").c_str());
+  printf("Wrote %lu records, recovered %lu, read back %lu\n",nRecords,found,read);
+  if(found!=nRecords || read!=nRecords){
+    printf("Recovery lost records!\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ *  Copyright (c) CERN 2015
+ *
+ *  Authors:
+ *      Nathalie Rauschmayr <nathalie.rauschmayr_ at _ cern _dot_ ch>
+ *      Sami Kama <sami.kama_ at _ cern _dot_ ch>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+// Region queries over a MergedReader. Writes two traces, searches the
+// first one alone, which keeps its region index next to it, then both
+// through a MergedReader and compares the records found with a scan of
+// the merged records. The merged search must leave the index of the
+// first trace alone, which is searched again last.
+
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <iostream>
+#include "FOMTools/Streamers.hpp"
+#include "FOMTools/MergedReader.hpp"
+#include "FOMTools/RegionFinder.hpp"
+#include "TraceGenerator.hpp"
+
+void printUsage(char* name){
+  std::cout<<"Usage:  "<<name<<" [-d <directory>]"<<std::endl;
+  std::cout<<"     --directory (-d)  directory for the test files (default /tmp)"<<std::endl;
+}
+
+namespace{
+  typedef std::vector<std::vector<FOM_mallocHook::MemRecord> > Sets;
+  // records of r overlapping each region, in file order
+  Sets scan(FOM_mallocHook::ReaderBase& r,const std::vector<RegionInfo>& regions){
+    Sets s(regions.size());
+    r.forEach([&](const FOM_mallocHook::RecordIndex& ri){
+	for(size_t k=0;k<regions.size();k++){
+	  if(ri.getFirstPage()<=regions[k].pEnd && regions[k].pBegin<ri.getLastPage())s[k].emplace_back(ri);
+	}
+      });
+    return s;
+  }
+  size_t differences(const Sets& a,const Sets& b){
+    size_t n=0;
+    for(size_t k=0;k<a.size();k++){
+      if(a[k].size()!=b[k].size()){
+	n++;
+	continue;
+      }
+      for(size_t i=0;i<a[k].size();i++){
+	if(a[k][i].getTStart()!=b[k][i].getTStart() || a[k][i].getAddr()!=b[k][i].getAddr()){
+	  n++;
+	  break;
+	}
+      }
+    }
+    return n;
+  }
+  bool sameFile(const struct stat& a,const struct stat& b){
+    return a.st_ino==b.st_ino && a.st_size==b.st_size &&
+      a.st_mtim.tv_sec==b.st_mtim.tv_sec && a.st_mtim.tv_nsec==b.st_mtim.tv_nsec;
+  }
+}
+
+int main(int argc,char* argv[]){
+  std::string dir("/tmp");
+  int c;
+  while (1) {
+    int option_index = 0;
+    static struct option long_options[] = {
+      {"help", 0, 0, 'h'},
+      {"directory", 1, 0, 'd'},
+      {0, 0, 0, 0}
+    };
+    c = getopt_long(argc, argv, "hd:",
+		    long_options, &option_index);
+    if (c == -1)
+      break;
+    switch (c) {
+    case 'h':
+      printUsage(argv[0]);
+      exit(EXIT_SUCCESS);
+      break;
+    case 'd':  {
+      dir=std::string(optarg);
+      break;
+    }
+    default:
+      printf("unknown parameter! getopt returned character code 0%o ??\n", c);
+    }
+  }
+  char pidStr[20];
+  snprintf(pidStr,20,"%u",getpid());
+  const std::vector<std::string> names={dir+"/testRegionFinderA_"+pidStr+".fom",
+					dir+"/testRegionFinderB_"+pidStr+".fom"};
+  const size_t nRecords=20000;//per trace
+  {
+    TraceGenerator g;
+    for(const auto& n:names){
+      FOM_mallocHook::PlainWriter w(n,0,0);
+      g.write(w,nRecords);
+    }
+  }
+  const std::string indexA=names[0]+".fomrgn";
+  size_t wrongA=0,wrongMerged=0,wrongAgain=0,nFound=0;
+  bool indexKept=false;
+  int rc=0;
+  try{
+    FOM_mallocHook::Reader a(names[0]);
+    FOM_mallocHook::MergedReader m(names);
+    std::vector<RegionInfo> regions;
+    m.forEach([&](const FOM_mallocHook::RecordIndex& ri){
+	if(regions.size()<200 && ri.getFirstPage()<ri.getLastPage()){
+	  RegionInfo r;
+	  r.pBegin=ri.getFirstPage();
+	  r.pEnd=ri.getLastPage();
+	  regions.push_back(r);
+	}
+      },nRecords-100,nRecords+100);
+    Sets fromA,expectA=scan(a,regions),expectMerged=scan(m,regions);
+    {
+      FOM_mallocHook::RegionFinder f(&a);
+      fromA=f.getAllocationSets(regions);
+      wrongA=differences(fromA,expectA);
+    }
+    struct stat before,after;
+    if(stat(indexA.c_str(),&before)==-1){
+      std::cerr<<"No region index written for "<<names[0]<<std::endl;
+      rc=1;
+    }
+    {
+      FOM_mallocHook::RegionFinder f(&m);
+      auto found=f.getAllocationSets(regions);
+      wrongMerged=differences(found,expectMerged);
+      for(const auto& s:found)nFound+=s.size();
+      for(size_t k=0;k<regions.size();k++){
+	if(differences(Sets(1,f.getAllocations(regions[k])),Sets(1,expectMerged[k])))wrongMerged++;
+      }
+    }
+    indexKept=(stat(indexA.c_str(),&after)==0 && sameFile(before,after));
+    {
+      FOM_mallocHook::RegionFinder f(&a);
+      wrongAgain=differences(f.getAllocationSets(regions),expectA);
+    }
+  }catch(const std::exception& ex){
+    std::cerr<<"Searching "<<names[0]<<" and "<<names[1]<<" failed: "<<ex.what()<<std::endl;
+    rc=1;
+  }
+  for(const auto& n:names){
+    unlink(n.c_str());
+    unlink((n+".fomidx").c_str());
+    unlink((n+".fomrgn").c_str());
+  }
+  if(rc)return rc;
+  printf("Merged search found %lu records, %lu regions differ alone, %lu merged, %lu alone again\n",
+	 nFound,wrongA,wrongMerged,wrongAgain);
+  if(!indexKept)printf("The merged search replaced the region index of %s\n",names[0].c_str());
+  if(wrongA || wrongMerged || wrongAgain || nFound==0 || !indexKept){
+    printf("Region queries over the merged traces are wrong!\n");
+    return 1;
+  }
+  return 0;
+}
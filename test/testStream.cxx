@@ -0,0 +1,111 @@
+/*
+ *  Copyright (c) CERN 2015
+ *
+ *  Authors:
+ *      Nathalie Rauschmayr <nathalie.rauschmayr_ at _ cern _dot_ ch>
+ *      Sami Kama <sami.kama_ at _ cern _dot_ ch>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+// Streaming reads across records longer than the read buffer. Writes
+// ordinary records, a symbol chunk several times the buffer size and more
+// records, then reads the trace back with StreamReader and compares every
+// record with the generated sequence.
+
+#include <unistd.h>
+#include <getopt.h>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <iostream>
+#include "FOMTools/Streamers.hpp"
+#include "TraceGenerator.hpp"
+
+void printUsage(char* name){
+  std::cout<<"Usage:  "<<name<<" [-d <directory>] [-b <buffer size>]"<<std::endl;
+  std::cout<<"     --directory (-d)  directory for the test file (default /tmp)"<<std::endl;
+  std::cout<<"     --buffer    (-b)  StreamReader buffer size in bytes (default 1048576)"<<std::endl;
+}
+
+int main(int argc,char* argv[]){
+  std::string dir("/tmp");
+  size_t bufferSize=1<<20;
+  int c;
+  while (1) {
+    int option_index = 0;
+    static struct option long_options[] = {
+      {"help", 0, 0, 'h'},
+      {"directory", 1, 0, 'd'},
+      {"buffer", 1, 0, 'b'},
+      {0, 0, 0, 0}
+    };
+    c = getopt_long(argc, argv, "hd:b:",
+		    long_options, &option_index);
+    if (c == -1)
+      break;
+    switch (c) {
+    case 'h':
+      printUsage(argv[0]);
+      exit(EXIT_SUCCESS);
+      break;
+    case 'd':  {
+      dir=std::string(optarg);
+      break;
+    }
+    case 'b':  {
+      bufferSize=std::strtoull(optarg,0,10);
+      break;
+    }
+    default:
+      printf("unknown parameter! getopt returned character code 0%o ??\n", c);
+    }
+  }
+  char pidStr[20];
+  snprintf(pidStr,20,"%u",getpid());
+  std::string fileName=dir+"/testStream_"+pidStr+".fom";
+  const size_t nRecords=60000;//several buffers before and after the chunk
+  std::vector<char> symbols(3*std::max(bufferSize,(size_t)4096)+4,'s');
+  {
+    FOM_mallocHook::PlainWriter w(fileName,0,0);
+    TraceGenerator g;
+    g.write(w,nRecords/2);
+    w.writeChunk(FOM_mallocHook::SymbolChunk,0,symbols.data(),symbols.size());
+    g.write(w,nRecords/2);
+  }
+  size_t read=0,wrong=0;
+  try{
+    FOM_mallocHook::StreamReader r(fileName,bufferSize);
+    TraceGenerator g;
+    r.forEach([&](const FOM_mallocHook::RecordIndex& ri){
+	auto h=g.next();
+	size_t len=sizeof(*h)+h->count*sizeof(FOM_mallocHook::index_t);
+	if(::memcmp(ri.getHeader(),h,len))wrong++;
+	read++;
+      });
+  }catch(const std::exception& ex){
+    std::cerr<<"Reading "<<fileName<<" failed: "<<ex.what()<<std::endl;
+    unlink(fileName.c_str());
+    return 1;
+  }
+  unlink(fileName.c_str());
+  printf("Wrote %lu records, streamed %lu, %lu differ\n",nRecords,read,wrong);
+  if(read!=nRecords || wrong){
+    printf("Streaming lost or damaged records!\n");
+    return 1;
+  }
+  return 0;
+}